@@ -1,7 +1,12 @@
+#include "utest.h"
+#include "util.h"
+
 #include <assert.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
 #include <sys/wait.h>
 #include <unistd.h>
 #include <sched.h>
@@ -60,3 +65,80 @@ int test_fork_sigchld_ignored(void) {
   assert(wait(NULL) == -1);
   return 0;
 }
+
+int test_fork_cow(void) {
+  size_t pgsz = getpagesize();
+  char *map =
+    mmap(NULL, 2 * pgsz, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, 0);
+  assert(map != (char *)MAP_FAILED);
+
+  strcpy(map, "parent");
+  strcpy(map + pgsz, "parent");
+
+  pid_t pid = fork();
+  assert(pid >= 0);
+
+  if (pid == 0) {
+    /* child: sees parent's data, but its writes stay private */
+    assert(strcmp(map, "parent") == 0);
+    strcpy(map, "child");
+    assert(strcmp(map, "child") == 0);
+    assert(strcmp(map + pgsz, "parent") == 0);
+    exit(0);
+  }
+
+  /* parent: write to the other page while the child may still run */
+  strcpy(map + pgsz, "parent2");
+  wait_for_child_exit(pid, 0);
+  assert(strcmp(map, "parent") == 0);
+  assert(strcmp(map + pgsz, "parent2") == 0);
+
+  /* the page is not shared anymore, so it can be written in place */
+  strcpy(map, "parent3");
+  assert(strcmp(map, "parent3") == 0);
+  assert(munmap(map, 2 * pgsz) == 0);
+  return 0;
+}
+
+#define FORK_COW_ROUNDS 10
+
+/* Fork a process having `npages` resident pages a few times. Each child must
+ * see parent's contents and overwrite every page, which must not be visible to
+ * the parent. */
+static void fork_cow_pages(size_t npages) {
+  size_t pgsz = getpagesize();
+  size_t len = npages * pgsz;
+  char *map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE,
+                   -1, 0);
+  assert(map != (char *)MAP_FAILED);
+
+  /* make all pages resident */
+  for (size_t i = 0; i < npages; i++)
+    map[i * pgsz] = i;
+
+  for (int i = 0; i < FORK_COW_ROUNDS; i++) {
+    pid_t pid = fork();
+    assert(pid >= 0);
+    if (pid == 0) {
+      for (size_t j = 0; j < npages; j++) {
+        if (map[j * pgsz] != (char)j)
+          exit(1);
+        map[j * pgsz] = j + 1;
+      }
+      exit(0);
+    }
+    wait_for_child_exit(pid, 0);
+  }
+
+  for (size_t i = 0; i < npages; i++)
+    assert(map[i * pgsz] == (char)i);
+
+  assert(munmap(map, len) == 0);
+}
+
+int test_fork_cow_pages(void) {
+  fork_cow_pages(1);
+  fork_cow_pages(64);
+  fork_cow_pages(512);
+  return 0;
+}
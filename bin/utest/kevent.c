@@ -0,0 +1,103 @@
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/event.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#include "utest.h"
+#include "util.h"
+
+int test_kevent_pipe(void) {
+  int kq, fds[2];
+  struct kevent kev, ev[2];
+  struct timespec zero = {0, 0};
+  char c;
+
+  assert((kq = kqueue()) >= 0);
+  assert(pipe2(fds, 0) == 0);
+
+  EV_SET(&kev, fds[0], EVFILT_READ, EV_ADD, 0, 0, &fds[0]);
+  assert(kevent(kq, &kev, 1, NULL, 0, NULL) == 0);
+  EV_SET(&kev, fds[1], EVFILT_WRITE, EV_ADD | EV_ONESHOT, 0, 0, &fds[1]);
+  assert(kevent(kq, &kev, 1, NULL, 0, NULL) == 0);
+
+  /* Only the write end is ready and it's reported once. */
+  assert(kevent(kq, NULL, 0, ev, 2, &zero) == 1);
+  assert(ev[0].ident == (uintptr_t)fds[1]);
+  assert(ev[0].filter == EVFILT_WRITE);
+  assert(ev[0].udata == &fds[1]);
+  assert(kevent(kq, NULL, 0, ev, 2, &zero) == 0);
+
+  /* Data in the pipe makes the read end ready until it's consumed. */
+  assert(write(fds[1], "ab", 2) == 2);
+  for (int i = 0; i < 2; i++) {
+    assert(kevent(kq, NULL, 0, ev, 2, NULL) == 1);
+    assert(ev[0].ident == (uintptr_t)fds[0]);
+    assert(ev[0].filter == EVFILT_READ);
+    assert(ev[0].data == 2 - i);
+    assert(read(fds[0], &c, 1) == 1);
+  }
+  assert(kevent(kq, NULL, 0, ev, 2, &zero) == 0);
+
+  /* Closing the write end reports EOF. */
+  close(fds[1]);
+  assert(kevent(kq, NULL, 0, ev, 2, &zero) == 1);
+  assert(ev[0].flags & EV_EOF);
+
+  /* Closing a descriptor removes its events. */
+  close(fds[0]);
+  EV_SET(&kev, fds[0], EVFILT_READ, EV_DELETE, 0, 0, NULL);
+  assert(kevent(kq, &kev, 1, NULL, 0, NULL) == -1);
+  assert(errno == EBADF);
+
+  /* Errors are reported in the event list. */
+  EV_SET(&kev, fds[0], EVFILT_READ, EV_ADD, 0, 0, NULL);
+  assert(kevent(kq, &kev, 1, ev, 1, NULL) == 1);
+  assert(ev[0].flags & EV_ERROR);
+  assert(ev[0].data == EBADF);
+
+  close(kq);
+  return 0;
+}
+
+int test_kevent_timer(void) {
+  int kq;
+  struct kevent kev, ev;
+  struct timeval start, end, diff;
+
+  assert((kq = kqueue()) >= 0);
+
+  EV_SET(&kev, 1, EVFILT_TIMER, EV_ADD, 0, 10, NULL);
+  assert(kevent(kq, &kev, 1, NULL, 0, NULL) == 0);
+
+  gettimeofday(&start, NULL);
+  for (int i = 0; i < 5; i++) {
+    assert(kevent(kq, NULL, 0, &ev, 1, NULL) == 1);
+    assert(ev.ident == 1 && ev.filter == EVFILT_TIMER);
+    assert(ev.data >= 1);
+  }
+  gettimeofday(&end, NULL);
+  timersub(&end, &start, &diff);
+  assert(diff.tv_sec > 0 || diff.tv_usec >= 40000);
+
+  /* Waiting for events honours the timeout. */
+  EV_SET(&kev, 1, EVFILT_TIMER, EV_DELETE, 0, 0, NULL);
+  assert(kevent(kq, &kev, 1, NULL, 0, NULL) == 0);
+  struct timespec ts = {0, 20000000};
+  assert(kevent(kq, NULL, 0, &ev, 1, &ts) == 0);
+
+  /* Kqueue is not inherited by the child. */
+  pid_t pid = fork();
+  if (pid == 0) {
+    assert(kevent(kq, NULL, 0, &ev, 1, &ts) == -1);
+    assert(errno == EBADF);
+    exit(0);
+  }
+  wait_for_child_exit(pid, 0);
+
+  close(kq);
+  return 0;
+}
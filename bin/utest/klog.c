@@ -0,0 +1,27 @@
+#include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "utest.h"
+
+int test_klog_dev(void) {
+  char buf[7];
+  ssize_t n;
+  int lines = 0;
+
+  int fd = open("/dev/klog", O_RDONLY);
+  assert(fd >= 0);
+
+  /* Read the log in small chunks, so that lines get split between reads.
+   * Opening the device has been logged, so the log isn't empty. Every read
+   * is logged as well, hence we may never reach the end of the log. */
+  while (lines < 16 && (n = read(fd, buf, sizeof(buf))) > 0) {
+    for (ssize_t i = 0; i < n; i++)
+      if (buf[i] == '\n')
+        lines++;
+  }
+  assert(lines > 0);
+
+  close(fd);
+  return 0;
+}
@@ -0,0 +1,58 @@
+#include <assert.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "utest.h"
+
+static void spin(int ms) {
+  struct timeval start, now, diff;
+
+  gettimeofday(&start, NULL);
+  do {
+    (void)getpid();
+    gettimeofday(&now, NULL);
+    timersub(&now, &start, &diff);
+  } while (diff.tv_sec * 1000 + diff.tv_usec / 1000 < ms);
+}
+
+int test_kprof(void) {
+  static char buf[65536];
+  size_t len = 0;
+  ssize_t n;
+
+  int fd = open("/dev/kprof", O_RDWR);
+  assert(fd >= 0);
+
+  /* Drop samples collected so far. */
+  while (read(fd, buf, sizeof(buf)) > 0)
+    continue;
+
+  assert(write(fd, "1", 1) == 1);
+  spin(100);
+  assert(write(fd, "0", 1) == 1);
+
+  while ((n = read(fd, buf + len, sizeof(buf) - len - 1)) > 0)
+    len += n;
+  assert(n == 0);
+  buf[len] = '\0';
+
+  /* Each line is a call stack followed by number of samples. */
+  unsigned samples = 0;
+  for (char *line = buf; *line; line = strchr(line, '\n') + 1) {
+    char *end = strchr(line, '\n');
+    assert(end != NULL);
+    char *count = strrchr(line, ' ');
+    assert(count != NULL && count < end);
+    samples += strtoul(count + 1, NULL, 10);
+  }
+  assert(samples > 0);
+
+  /* Unknown command. */
+  assert(write(fd, "x", 1) == -1);
+
+  close(fd);
+  return 0;
+}
@@ -22,6 +22,8 @@ int main(int argc, char **argv) {
   CHECKRUN_TEST(munmap_sigsegv);
   CHECKRUN_TEST(mmap_prot_none);
   CHECKRUN_TEST(mmap_prot_read);
+  CHECKRUN_TEST(mmap_file);
+  CHECKRUN_TEST(mmap_vnode);
   CHECKRUN_TEST(sbrk);
   CHECKRUN_TEST(sbrk_sigsegv);
   CHECKRUN_TEST(misbehave);
@@ -51,6 +53,8 @@ int main(int argc, char **argv) {
   CHECKRUN_TEST(fork_wait);
   CHECKRUN_TEST(fork_signal);
   CHECKRUN_TEST(fork_sigchld_ignored);
+  CHECKRUN_TEST(fork_cow);
+  CHECKRUN_TEST(fork_cow_pages);
   CHECKRUN_TEST(lseek_basic);
   CHECKRUN_TEST(lseek_errors);
   CHECKRUN_TEST(access_basic);
@@ -85,6 +89,7 @@ int main(int argc, char **argv) {
   CHECKRUN_TEST(vfs_symlink);
   CHECKRUN_TEST(vfs_link);
   CHECKRUN_TEST(vfs_chmod);
+  CHECKRUN_TEST(vfs_bigdir);
   CHECKRUN_TEST(wait_basic);
   CHECKRUN_TEST(wait_nohang);
 
@@ -125,9 +130,16 @@ int main(int argc, char **argv) {
   CHECKRUN_TEST(tty_signals);
 
   CHECKRUN_TEST(procstat);
+  CHECKRUN_TEST(physmem_stats);
+  CHECKRUN_TEST(klog_dev);
+  CHECKRUN_TEST(kprof);
 
   CHECKRUN_TEST(pipe_parent_signaled);
   CHECKRUN_TEST(pipe_child_signaled);
+  CHECKRUN_TEST(pipe_transfer);
+
+  CHECKRUN_TEST(kevent_pipe);
+  CHECKRUN_TEST(kevent_timer);
 
   printf("No user test \"%s\" available.\n", test_name);
   return 1;
@@ -2,6 +2,7 @@
 #include "util.h"
 
 #include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
@@ -211,3 +212,119 @@ int test_mmap_prot_read(void) {
 
   return 0;
 }
+
+#define TESTFILE "/tmp/mmap_file"
+
+static ssize_t read_at(int fd, void *buf, size_t len, off_t off) {
+  assert(lseek(fd, off, SEEK_SET) == off);
+  return read(fd, buf, len);
+}
+
+static ssize_t write_at(int fd, const void *buf, size_t len, off_t off) {
+  assert(lseek(fd, off, SEEK_SET) == off);
+  return write(fd, buf, len);
+}
+
+int test_mmap_file(void) {
+  size_t pgsz = getpagesize();
+  size_t size = pgsz * 2 + 100;
+  char buf[16];
+  int fd;
+
+  assert((fd = open(TESTFILE, O_RDWR | O_CREAT | O_TRUNC, 0644)) >= 0);
+  assert(ftruncate(fd, size) == 0);
+  assert(write_at(fd, "hello", 5, pgsz) == 5);
+
+  char *shared = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  assert(shared != MAP_FAILED);
+  char *private = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  assert(private != MAP_FAILED);
+
+  /* Both mappings see contents of the file. */
+  assert(shared[0] == 0 && memcmp(shared + pgsz, "hello", 5) == 0);
+  assert(private[0] == 0 && memcmp(private + pgsz, "hello", 5) == 0);
+
+  /* Writes through shared mapping are visible to read(2)... */
+  memcpy(shared + pgsz * 2, "world", 5);
+  assert(read_at(fd, buf, 5, pgsz * 2) == 5);
+  assert(memcmp(buf, "world", 5) == 0);
+
+  /* ... and results of write(2) are visible through the mapping. */
+  assert(write_at(fd, "abc", 3, 10) == 3);
+  assert(memcmp(shared + 10, "abc", 3) == 0);
+
+  /* Writes to private mapping do not reach the file. */
+  memcpy(private + pgsz, "HELLO", 5);
+  assert(read_at(fd, buf, 5, pgsz) == 5);
+  assert(memcmp(buf, "hello", 5) == 0);
+  assert(memcmp(shared + pgsz, "hello", 5) == 0);
+
+  /* Data past the end of file is discarded when the file grows. */
+  shared[size] = 'x';
+  assert(ftruncate(fd, size + 1) == 0);
+  assert(read_at(fd, buf, 1, size) == 1 && buf[0] == 0);
+
+  assert(munmap(private, size) == 0);
+  assert(munmap(shared, size) == 0);
+
+  /* Offset must be page aligned and the file opened for reading. */
+  assert(mmap(NULL, pgsz, PROT_READ, MAP_SHARED, fd, 1) == MAP_FAILED);
+  assert(errno == EINVAL);
+  close(fd);
+  assert((fd = open(TESTFILE, O_WRONLY, 0)) >= 0);
+  assert(mmap(NULL, pgsz, PROT_READ, MAP_SHARED, fd, 0) == MAP_FAILED);
+  assert(errno == EACCES);
+  close(fd);
+
+  /* Contents of the mapping outlive the file. */
+  assert((fd = open(TESTFILE, O_RDONLY, 0)) >= 0);
+  shared = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  assert(shared != MAP_FAILED);
+  close(fd);
+  assert(unlink(TESTFILE) == 0);
+  assert(memcmp(shared + pgsz * 2, "world", 5) == 0);
+  assert(munmap(shared, size) == 0);
+
+  return 0;
+}
+
+#define TESTPROG "/bin/utest"
+
+int test_mmap_vnode(void) {
+  size_t pgsz = getpagesize();
+  size_t size = pgsz * 4;
+  char *buf = malloc(size);
+  int fd;
+
+  assert((fd = open(TESTPROG, O_RDONLY, 0)) >= 0);
+  assert(read(fd, buf, size) == (ssize_t)size);
+
+  char *first = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  assert(first != MAP_FAILED);
+  char *second = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  assert(second != MAP_FAILED);
+
+  /* Both mappings read in contents of the file. */
+  assert(memcmp(first, buf, size) == 0);
+  assert(memcmp(second, buf, size) == 0);
+
+  /* Writes to private mapping are not visible in other ones. */
+  memset(second + pgsz, 0, pgsz);
+  assert(memcmp(first + pgsz, buf + pgsz, pgsz) == 0);
+
+  /* Mapping outlives the file descriptor. */
+  close(fd);
+  assert(memcmp(first + pgsz * 2, buf + pgsz * 2, pgsz * 2) == 0);
+
+  assert(munmap(first, size) == 0);
+  assert(munmap(second, size) == 0);
+  free(buf);
+
+  /* Shared writable mapping requires the file to be opened for writing. */
+  assert((fd = open(TESTPROG, O_RDONLY, 0)) >= 0);
+  assert(mmap(NULL, size, PROT_WRITE, MAP_SHARED, fd, 0) == MAP_FAILED);
+  assert(errno == EACCES);
+  close(fd);
+
+  return 0;
+}
@@ -3,10 +3,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <stdint.h>
 
 #include <signal.h>
 #include <string.h>
 
+#include <sys/param.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 
@@ -104,3 +106,58 @@ int test_pipe_child_signaled(void) {
 
   return 0;
 }
+
+#define PIPE_TRANSFER_BYTES (1024 * 1024)
+
+static uint8_t pipe_pattern(size_t i) {
+  return i % 251;
+}
+
+/* Send `PIPE_TRANSFER_BYTES` through a pipe in `chunk` sized writes to a
+ * child that reads them in `chunk` sized reads and verifies the contents. */
+static void pipe_transfer(size_t chunk) {
+  int fds[2];
+  uint8_t *buf = malloc(chunk);
+  assert(buf != NULL);
+  assert(pipe2(fds, 0) == 0);
+
+  pid_t pid = fork();
+  assert(pid >= 0);
+
+  if (pid == 0) {
+    close(fds[1]);
+    size_t total = 0;
+    ssize_t n;
+    while ((n = read(fds[0], buf, chunk)) > 0) {
+      for (ssize_t i = 0; i < n; i++)
+        assert(buf[i] == pipe_pattern(total + i));
+      total += n;
+    }
+    assert(n == 0);
+    assert(total == PIPE_TRANSFER_BYTES);
+    exit(0);
+  }
+
+  close(fds[0]);
+  for (size_t total = 0; total < PIPE_TRANSFER_BYTES;) {
+    size_t len = MIN(chunk, PIPE_TRANSFER_BYTES - total);
+    for (size_t i = 0; i < len; i++)
+      buf[i] = pipe_pattern(total + i);
+    assert(write(fds[1], buf, len) == (ssize_t)len);
+    total += len;
+  }
+  close(fds[1]);
+  wait_for_child_exit(pid, 0);
+
+  free(buf);
+}
+
+int test_pipe_transfer(void) {
+  /* Buffered transfers, the latter ones grow pipe buffer. */
+  pipe_transfer(512);
+  pipe_transfer(4096);
+  /* Direct transfers from writer's pages, including unaligned ones. */
+  pipe_transfer(65536);
+  pipe_transfer(65536 + 100);
+  return 0;
+}
@@ -1,5 +1,8 @@
 #include <stdio.h>
+#include <string.h>
+#include <unistd.h>
 #include <assert.h>
+#include <sys/mman.h>
 
 int test_procstat(void) {
   int euid, pid, ppid, pgrp, session, got;
@@ -23,3 +26,44 @@ int test_procstat(void) {
   }
   return 0;
 }
+
+/* Returns number of zeroed pages handed out by physical memory allocator. */
+static unsigned long physmem_zero_allocs(void) {
+  unsigned long value, total = 0;
+  char name[32];
+  int got, lines = 0;
+
+  FILE *pstat = fopen("/dev/physmem", "r");
+  assert(pstat != NULL);
+
+  while ((got = fscanf(pstat, "%31s %lu\n", name, &value)) != EOF) {
+    assert(got == 2);
+    if (!strcmp(name, "zero_hits") || !strcmp(name, "zero_misses"))
+      total += value;
+    lines++;
+  }
+
+  fclose(pstat);
+  assert(lines > 0);
+  return total;
+}
+
+#define NPAGES 16
+
+int test_physmem_stats(void) {
+  size_t pgsz = getpagesize();
+  unsigned long before = physmem_zero_allocs();
+
+  /* Each page fault in anonymous memory consumes a zeroed page. */
+  char *p = mmap(NULL, NPAGES * pgsz, PROT_READ | PROT_WRITE,
+                 MAP_ANON | MAP_PRIVATE, -1, 0);
+  assert(p != MAP_FAILED);
+  for (int i = 0; i < NPAGES; i++) {
+    assert(p[i * pgsz] == 0);
+    p[i * pgsz] = 1;
+  }
+  munmap(p, NPAGES * pgsz);
+
+  assert(physmem_zero_allocs() >= before + NPAGES);
+  return 0;
+}
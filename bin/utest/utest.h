@@ -12,6 +12,8 @@ int test_munmap(void);
 int test_munmap_sigsegv(void);
 int test_mmap_prot_none(void);
 int test_mmap_prot_read(void);
+int test_mmap_file(void);
+int test_mmap_vnode(void);
 int test_sbrk(void);
 int test_sbrk_sigsegv(void);
 int test_misbehave(void);
@@ -44,6 +46,8 @@ int test_signal_handler_mask(void);
 int test_fork_wait(void);
 int test_fork_signal(void);
 int test_fork_sigchld_ignored(void);
+int test_fork_cow(void);
+int test_fork_cow_pages(void);
 
 int test_lseek_basic(void);
 int test_lseek_errors(void);
@@ -87,6 +91,7 @@ int test_vfs_trunc(void);
 int test_vfs_symlink(void);
 int test_vfs_link(void);
 int test_vfs_chmod(void);
+int test_vfs_bigdir(void);
 
 int test_wait_basic(void);
 int test_wait_nohang(void);
@@ -119,8 +124,15 @@ int test_tty_echo(void);
 int test_tty_signals(void);
 
 int test_procstat(void);
+int test_physmem_stats(void);
+int test_klog_dev(void);
+int test_kprof(void);
 
 int test_pipe_parent_signaled(void);
 int test_pipe_child_signaled(void);
+int test_pipe_transfer(void);
+
+int test_kevent_pipe(void);
+int test_kevent_timer(void);
 
 #endif /* __UTEST_H__ */
@@ -1,6 +1,7 @@
 #include "utest.h"
 
 #include <sys/stat.h>
+#include <dirent.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
@@ -396,3 +397,50 @@ int test_vfs_chmod(void) {
 
   return 0;
 }
+
+#define BIGDIR_NFILES 2000
+
+int test_vfs_bigdir(void) {
+  char path[64];
+  int fd;
+
+  assert_ok(mkdir(TESTDIR "/bigdir", 0));
+
+  for (int i = 0; i < BIGDIR_NFILES; i++) {
+    snprintf(path, sizeof(path), TESTDIR "/bigdir/file%d", i);
+    assert((fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0)) >= 0);
+    assert_ok(close(fd));
+  }
+
+  /* Every entry can be found and removal of one does not affect others. */
+  for (int i = 0; i < BIGDIR_NFILES; i += 2) {
+    snprintf(path, sizeof(path), TESTDIR "/bigdir/file%d", i);
+    assert_fail(open(path, O_RDWR | O_CREAT | O_EXCL, 0), EEXIST);
+    assert_ok(unlink(path));
+    assert_fail(access(path, 0), ENOENT);
+  }
+  assert_fail(rmdir(TESTDIR "/bigdir"), ENOTEMPTY);
+
+  /* Remaining entries are listed in order of creation. */
+  DIR *dir = opendir(TESTDIR "/bigdir");
+  struct dirent *de;
+  int n = 1;
+  assert(dir != NULL);
+  while ((de = readdir(dir))) {
+    if (de->d_name[0] == '.')
+      continue;
+    snprintf(path, sizeof(path), "file%d", n);
+    assert(strcmp(de->d_name, path) == 0);
+    n += 2;
+  }
+  assert(n == BIGDIR_NFILES + 1);
+  closedir(dir);
+
+  for (int i = 1; i < BIGDIR_NFILES; i += 2) {
+    snprintf(path, sizeof(path), TESTDIR "/bigdir/file%d", i);
+    assert_ok(unlink(path));
+  }
+  assert_ok(rmdir(TESTDIR "/bigdir"));
+
+  return 0;
+}
@@ -18,6 +18,9 @@ ELFARCH := aarch64
 # because we share bcopy (memcpy) implementation with user-space.
 CPPFLAGS += -DSTRICT_ALIGNMENT=1
 
+# Frame records are needed to walk call stacks (see ctx_unwind).
+CFLAGS += -fno-omit-frame-pointer
+
 ifeq ($(KERNEL), 1)
 	CFLAGS += -mcpu=cortex-a53+nofp -march=armv8-a+nofp -mgeneral-regs-only
 	ifeq ($(KASAN), 1)
@@ -29,7 +29,6 @@ typedef struct pmap pmap_t;
 
 #define DMAP_L1_SIZE roundup(DMAP_L1_ENTRIES * sizeof(pde_t), PAGESIZE)
 #define DMAP_L2_SIZE roundup(DMAP_L2_ENTRIES * sizeof(pde_t), PAGESIZE)
-#define DMAP_L3_SIZE roundup(DMAP_L3_ENTRIES * sizeof(pte_t), PAGESIZE)
 
 #define PA_MASK 0xfffffffff000
 #define PTE_FRAME_ADDR(pte) ((pte)&PA_MASK)
@@ -45,12 +45,14 @@ typedef uint64_t pde_t;
 #define ATTR_MASK_H UINT64_C(0xfff0000000000000)
 #define ATTR_MASK_L UINT64_C(0x0000000000000fff)
 #define ATTR_MASK (ATTR_MASK_H | ATTR_MASK_L)
+#define ATTR_DESCR_MASK 3
 /* Bits 58:55 are reserved for software */
 #define ATTR_SW_SHIFT 55
 #define ATTR_SW_READ (1UL << ATTR_SW_SHIFT)
 #define ATTR_SW_WRITE (2UL << ATTR_SW_SHIFT)
 #define ATTR_SW_NOEXEC (4UL << ATTR_SW_SHIFT)
 #define ATTR_SW_FLAGS (ATTR_SW_READ | ATTR_SW_WRITE | ATTR_SW_NOEXEC)
+#define ATTR_SW_WIRED (8UL << ATTR_SW_SHIFT) /* entered by pmap_kenter */
 #define ATTR_UXN (1UL << 54)
 #define ATTR_PXN (1UL << 53)
 #define ATTR_XN (ATTR_PXN | ATTR_UXN)
@@ -9,5 +9,6 @@
 
 void tlb_invalidate(vaddr_t va, asid_t asid);
 void tlb_invalidate_asid(asid_t asid);
+void tlb_invalidate_all(void);
 
 #endif /* !_AARCH64_TLB_H_ */
@@ -43,7 +43,8 @@ static inline uart_methods_t *uart_methods(device_t *dev) {
 
 typedef struct uart_state {
   spin_t u_lock;
-  ringbuf_t u_rx_buf; /* Software receiver queue. */
+  /* Software receiver queue. Filled by uart_intr, drained by tty thread. */
+  spsc_ringbuf_t u_rx_buf;
   ringbuf_t u_tx_buf; /* Software transmitter queue. */
   tty_thread_t u_ttd;
   void *u_state; /* Private state - mostly memory and irq resources. */
@@ -6,6 +6,7 @@
 #endif
 
 #include <stdint.h>
+#include <sys/types.h>
 #include <mips/m32c0.h>
 
 typedef uint32_t tlbhi_t;
@@ -88,6 +89,13 @@ void tlb_invalidate(tlbhi_t hi);
 /* Invalidate all TLB entries with given ASID (save wired). */
 void tlb_invalidate_asid(tlbhi_t asid);
 
+/* Invalidate all TLB entries that are not global (save wired). */
+void tlb_invalidate_user(void);
+
+/* Invalidate all TLB entries (save wired) that map addresses within
+ * [start, end) range and either are global or have given ASID. */
+void tlb_invalidate_range(tlbhi_t asid, vaddr_t start, vaddr_t end);
+
 /* Writes the TLB entry specified by @i or random entry if TLBI_RANDOM. */
 void tlb_write(unsigned i, tlbentry_t *e);
 
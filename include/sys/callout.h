@@ -13,7 +13,8 @@ typedef struct callout {
   timeout_t c_func; /* function to call */
   void *c_arg;      /* function argument */
   uint32_t c_flags;
-  unsigned c_index; /* index of bucket this callout is assigned to */
+  unsigned c_index; /* index of wheel slot this callout is assigned to */
+  unsigned c_cpu;   /* CPU whose wheel holds this callout */
 } callout_t;
 
 /* callout has been delegated to callout thread and will be executed soon */
@@ -69,6 +70,13 @@ bool callout_stop(callout_t *handle);
  */
 void callout_process(systime_t now);
 
+/*
+ * Return the first tick before `limit` at which callouts of current CPU need
+ * to be processed, or `limit` if there's no such tick. Used to decide how long
+ * the clock may stay silent while the CPU is idle.
+ */
+systime_t callout_next(systime_t limit);
+
 /*
  * Wait until a callout ends its execution or return immediately if the
  * callout has already been executed or stopped.
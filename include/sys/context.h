@@ -25,6 +25,21 @@ void ctx_set_retval(ctx_t *ctx, long value);
 /*! \brief Gets program counter from context. */
 register_t ctx_get_pc(ctx_t *ctx);
 
+/*! \brief Reads a word of memory for the stack unwinder.
+ *
+ * \returns false if the word cannot be read, which stops unwinding. */
+typedef bool (*unwind_read_t)(vaddr_t addr, register_t *valp);
+
+/*! \brief Walks the call stack starting from the saved context.
+ *
+ * Stores the program counter and up to `n - 1` return addresses into `pcs`,
+ * innermost first. Works both for kernel and user contexts, as memory is
+ * accessed only through `read` function.
+ *
+ * \returns number of stored addresses. */
+unsigned ctx_unwind(ctx_t *ctx, unwind_read_t read, uintptr_t *pcs,
+                    unsigned n);
+
 /*! \brief Copy user exception ctx. */
 void mcontext_copy(mcontext_t *to, mcontext_t *from);
 
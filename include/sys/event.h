@@ -15,12 +15,15 @@
  *    this does not apply to issuing events. In other words, any thread can
  *    report an event to the kqueue.
  *  - The queue is not inherited by a child created with fork.
+ *  - Events registered for a file descriptor are removed when the descriptor
+ *    gets closed.
  */
 
 /* Filter types */
 #define EVFILT_READ 0U
 #define EVFILT_WRITE 1U
-#define EVFILT_SYSCOUNT 2U /* number of filters */
+#define EVFILT_TIMER 2U    /* `data` is the period in milliseconds */
+#define EVFILT_SYSCOUNT 3U /* number of filters */
 
 struct kevent {
   uintptr_t ident; /* identifier for this event */
@@ -45,8 +48,13 @@ struct kevent {
 #define EV_ADD 0x0001U    /* add event to kq */
 #define EV_DELETE 0x0002U /* delete event from kq */
 
+/* flags */
+#define EV_ONESHOT 0x0010U /* only report one occurrence */
+#define EV_CLEAR 0x0020U   /* clear event state after reporting */
+
 /* returned values */
 #define EV_ERROR 0x4000U /* error, data contains errno */
+#define EV_EOF 0x8000U   /* EOF detected */
 
 #ifdef _KERNEL
 
@@ -57,6 +65,7 @@ typedef struct knote knote_t;
 typedef struct kevent kevent_t;
 typedef struct kqueue kqueue_t;
 typedef struct mtx mtx_t;
+typedef struct file file_t;
 
 typedef int filt_attach_t(knote_t *kn);
 typedef void filt_detach_t(knote_t *kn);
@@ -71,10 +80,11 @@ typedef struct filterops {
   filt_event_t *filt_event;
 } filterops_t;
 
-typedef SLIST_HEAD(, knote) knlist_t;
+typedef LIST_HEAD(, knote) knlist_t;
 
 /* Status of knote. */
 #define KN_QUEUED 0x01U /* event is on queue */
+#define KN_MARKER 0x02U /* ignore this knote while scanning pending events */
 
 /*
  * Field locking:
@@ -87,8 +97,9 @@ typedef SLIST_HEAD(, knote) knlist_t;
 typedef struct knote {
   SLIST_ENTRY(knote) kn_hashlink; /* (q) for hashmap in kqueue */
   TAILQ_ENTRY(knote) kn_penlink;  /* (q) for list of pending events in kqueue */
-  SLIST_ENTRY(knote) kn_objlink;  /* (o) for list of knotes in the object*/
+  LIST_ENTRY(knote) kn_objlink;   /* (o) for list of knotes in the object*/
   kqueue_t *kn_kq;                /* (!) which queue we are on */
+  file_t *kn_file;                /* (!) referenced file or NULL for timers */
   void *kn_obj;                   /* (!) monitored object */
   uint32_t kn_status;             /* (q) flags above */
 
@@ -103,6 +114,28 @@ typedef struct knote {
   mtx_t *kn_objlock;       /* Lock protecting the object */
 } knote_t;
 
+#define kn_id kn_kevent.ident
+#define kn_filter kn_kevent.filter
+#define kn_flags kn_kevent.flags
+#define kn_fflags kn_kevent.fflags
+#define kn_data kn_kevent.data
+
+static inline void knlist_init(knlist_t *knlist) {
+  LIST_INIT(knlist);
+}
+
+static inline bool knlist_empty(knlist_t *knlist) {
+  return LIST_EMPTY(knlist);
+}
+
+/*
+ * Insert a knote into (or remove it from) the list of knotes monitoring an
+ * object. Both acquire `kn_objlock`, so they're meant to be used as
+ * `filt_attach` and `filt_detach` implementations.
+ */
+void knlist_add(knlist_t *knlist, knote_t *kn);
+void knlist_remove(knlist_t *knlist, knote_t *kn);
+
 /*
  * Walk down a list of knotes, activating them if their event has
  * triggered.  The caller's object lock (e.g. device driver lock)
@@ -110,6 +143,12 @@ typedef struct knote {
  */
 void knote(knlist_t *knlist, long hint);
 
+/*
+ * Remove all knotes registered on `kqf` kqueue file that refer to file
+ * descriptor `fd`. Called when a descriptor is being closed.
+ */
+void kqueue_fdclose(file_t *kqf, int fd);
+
 int do_kqueue1(proc_t *p, int flags, int *fd);
 int do_kevent(proc_t *p, int kq, kevent_t *changelist, size_t nchanges,
               kevent_t *eventlist, size_t nevents, timespec_t *timeout,
@@ -0,0 +1,16 @@
+#ifndef _SYS_KPROF_H_
+#define _SYS_KPROF_H_
+
+typedef struct mcontext mcontext_t;
+
+/*! \brief Records call stack of the running thread if profiling is enabled.
+ *
+ * Called on every clock tick with interrupts disabled. */
+void kprof_tick(void);
+
+/*! \brief Completes samples of current thread with its user-space call stack.
+ *
+ * Called just before returning to user space if TDF_NEEDPROF is set. */
+void kprof_user_leave(mcontext_t *ctx);
+
+#endif /* !_SYS_KPROF_H_ */
@@ -40,6 +40,10 @@ int toascii(int);
 int snprintf(char *buf, size_t size, const char *fmt, ...)
   __attribute__((format(printf, 3, 4)));
 int vsnprintf(char *buf, size_t size, const char *fmt, va_list ap);
+/* Appends formatted text to `buf` that already holds `n` characters.
+ * Output is truncated, so the result never exceeds `size - 1`. */
+size_t snprintf_append(char *buf, size_t size, size_t n, const char *fmt, ...)
+  __attribute__((format(printf, 4, 5)));
 int sscanf(const char *str, const char *fmt, ...)
   __attribute__((format(scanf, 2, 3)));
 int vsscanf(const char *str, char const *fmt, va_list ap);
@@ -5,17 +5,18 @@
 #include <sys/linker_set.h>
 #include <sys/kmem_flags.h>
 #include <machine/vm_param.h>
+#include <stdatomic.h>
 
 /*
  * General purpose kernel memory allocator.
  */
 
 typedef struct kmalloc_pool {
-  const char *desc; /* Printable type name. */
-  size_t nrequests; /* Number of allocation requests. */
-  size_t active;    /* Numer of active blocks. */
-  size_t used;      /* Bytes currently used. */
-  size_t maxused;   /* Peak usage of memory. */
+  const char *desc;        /* Printable type name. */
+  atomic_size_t nrequests; /* Number of allocation requests. */
+  atomic_size_t active;    /* Numer of active blocks. */
+  atomic_size_t used;      /* Bytes currently used. */
+  size_t maxused;          /* Peak usage of memory. */
 } kmalloc_pool_t;
 
 /* Defines a local pool of memory for use by a subsystem. */
@@ -30,6 +31,11 @@ typedef struct kmalloc_pool {
 /*! \brief Called during kernel initialization. */
 void init_kmalloc(void);
 
+/*! \brief Called during kernel initialization, when pools and kmem are ready.
+ *
+ * From now on small blocks are allocated from size class pools. */
+void init_kmalloc_classes(void);
+
 void *kmalloc(kmalloc_pool_t *mp, size_t size,
               kmem_flags_t flags) __warn_unused;
 void kfree(kmalloc_pool_t *mp, void *addr);
@@ -8,6 +8,9 @@
 typedef struct thread thread_t;
 typedef struct pmap pmap_t;
 typedef struct vm_map vm_map_t;
+typedef struct runq runq_t;
+
+#define MAXCPU 1 /* Maximum number of supported processors. */
 
 /*! \brief Private per-cpu structure. */
 typedef struct pcpu {
@@ -16,12 +19,16 @@ typedef struct pcpu {
   thread_t *idle_thread; /*!< idle thread executed on this CPU */
   pmap_t *curpmap;       /*!< current page table */
   vm_map_t *uspace;      /*!< user space virtual memory map */
+  runq_t *runq;          /*!< run queue of this CPU */
+  unsigned cpuid;        /*!< index of this CPU in _pcpu_data */
 
   /* Machine-dependent part */
   PCPU_MD_FIELDS;
 } pcpu_t;
 
-extern pcpu_t _pcpu_data[1];
+extern pcpu_t _pcpu_data[MAXCPU];
+
+#define CPU_FOREACH(i) for ((i) = 0; (i) < MAXCPU; (i)++)
 
 /* Read pcpu.h from FreeBSD for API reference */
 #define PCPU_GET(member) (_pcpu_data->member)
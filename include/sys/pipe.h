@@ -5,8 +5,14 @@
 
 #include <machine/vm_param.h>
 
-/* size of pipe buffer */
+/* initial size of pipe buffer */
 #define PIPE_SIZE PAGESIZE
+/* pipe buffer can grow up to this size */
+#define PIPE_MAX_SIZE (16 * PAGESIZE)
+/* writes at least this large are transferred directly to the reader */
+#define PIPE_DIRECT_MIN (2 * PAGESIZE)
+/* maximum number of pages loaned to the pipe by a writer at once */
+#define PIPE_DIRECT_PAGES 16
 
 typedef struct proc proc_t;
 
@@ -52,6 +52,10 @@ void pmap_page_remove(vm_page_t *pg);
 void pmap_zero_page(vm_page_t *pg);
 void pmap_copy_page(vm_page_t *src, vm_page_t *dst);
 
+/*! \brief Returns kernel virtual address through which contents of the page
+ * can be accessed directly. */
+void *pmap_page_kva(vm_page_t *pg);
+
 bool pmap_clear_modified(vm_page_t *pg);
 bool pmap_clear_referenced(vm_page_t *pg);
 bool pmap_is_modified(vm_page_t *pg);
@@ -8,8 +8,14 @@
 /*! \file pool.h
  *
  * Pooled allocator manages fixed-size object. Implementation is based on idea
- * of the slab allocator, however object caching facility is not available
- * (though the actual implementation is capable of supporting it).
+ * of the slab allocator including object caching facility: if the pool has
+ * a constructor, all objects of a new slab get constructed at once. Objects
+ * must be returned to the pool in their constructed state, so that they can
+ * be reused without initializing them again. Destructor is called on all
+ * objects of a slab just before its memory is given back to kmem.
+ *
+ * Allocation and deallocation requests are first served by per-CPU magazines,
+ * which don't need to take the pool lock, then by the slab layer.
  *
  * Pooled allocator idea is loosely based on NetBSD's pool(9).
  */
@@ -19,11 +25,23 @@ typedef struct pool pool_t;
 /*! \brief Called during kernel initialization. */
 void init_pool(void);
 
+/*! \brief Pool flags. */
+typedef enum {
+  PF_NOCACHE = 1, /* don't put per-CPU magazine layer in front of slabs */
+} pool_flags_t;
+
+/*! \brief Object constructor and destructor. */
+typedef void (*pool_ctor_t)(void *obj);
+typedef void (*pool_dtor_t)(void *obj);
+
 /*! \brief Pool constructor parameters. */
 typedef struct pool_init {
   const char *desc;
   size_t size;
   size_t alignment;
+  pool_flags_t flags;
+  pool_ctor_t ctor; /* optional, brings object into constructed state */
+  pool_dtor_t dtor; /* optional, releases resources acquired by ctor */
 } pool_init_t;
 
 /*! \brief Creates a pool of objects of given size. */
@@ -40,6 +58,12 @@ pool_t *_pool_create(pool_init_t *args);
  */
 void pool_add_page(pool_t *pool, void *page, size_t size);
 
+/*! \brief Returns memory cached by all pools to the kernel.
+ *
+ * Objects held by magazine layer are given back to slabs, then empty slabs
+ * are released. Called when the system runs low on memory. */
+void pool_reclaim(void);
+
 /*! \brief Frees all memory associated with the pool
  *
  * \warning Do not call this function on pool with live objects! */
@@ -47,7 +71,8 @@ void pool_destroy(pool_t *pool);
 
 /*! \brief Allocate an object from the pool.
  *
- * \note The pool may grow in page size units. */
+ * \note The pool may grow in page size units.
+ * \note M_ZERO flag cannot be used with pools that have a constructor. */
 void *pool_alloc(pool_t *pool, kmem_flags_t flags) __warn_unused;
 
 /*! \brief Release an object that belongs to the pool. */
@@ -3,6 +3,7 @@
 
 #include <sys/cdefs.h>
 #include <stdbool.h>
+#include <stdatomic.h>
 
 typedef struct uio uio_t;
 
@@ -35,4 +36,29 @@ int ringbuf_read(ringbuf_t *buf, uio_t *uio);
 int ringbuf_write(ringbuf_t *buf, uio_t *uio);
 void ringbuf_reset(ringbuf_t *buf);
 
+/*! \brief Ring buffer with a single producer and a single consumer.
+ *
+ * Producer and consumer may run concurrently (e.g. interrupt filter and
+ * a thread) without any external lock. Size must be a power of two. */
+typedef struct spsc_ringbuf {
+  atomic_size_t head; /*!< total number of bytes produced */
+  atomic_size_t tail; /*!< total number of bytes consumed */
+  size_t size;        /*!< total size of the buffer */
+  uint8_t *data;      /*!< buffer that stores data */
+} spsc_ringbuf_t;
+
+void spsc_ringbuf_init(spsc_ringbuf_t *rb, void *buf, size_t size);
+/* Producer side. */
+bool spsc_ringbuf_putb(spsc_ringbuf_t *rb, uint8_t byte);
+bool spsc_ringbuf_putnb(spsc_ringbuf_t *rb, const uint8_t *data, size_t n);
+/* Consumer side. */
+bool spsc_ringbuf_getb(spsc_ringbuf_t *rb, uint8_t *byte_p);
+bool spsc_ringbuf_getnb(spsc_ringbuf_t *rb, uint8_t *data, size_t n);
+/*! \brief Number of bytes stored, may be stale if the other side is active. */
+size_t spsc_ringbuf_count(spsc_ringbuf_t *rb);
+
+static inline bool spsc_ringbuf_empty(spsc_ringbuf_t *rb) {
+  return spsc_ringbuf_count(rb) == 0;
+}
+
 #endif /* !_SYS_RINGBUF_H_ */
@@ -5,16 +5,21 @@
 
 #include <sys/cdefs.h>
 #include <sys/queue.h>
+#include <stdint.h>
 
 typedef struct thread thread_t;
 
 /* TODO How to prevent tests from using following values? */
 #define RQ_NQS 64 /* Number of run queues. */
 #define RQ_PPQ 4  /* Priorities per queue. */
+#define RQ_BPW 32 /* Bits in a status word. */
+#define RQ_NSW (RQ_NQS / RQ_BPW) /* Number of status words. */
 
 TAILQ_HEAD(rq_head, thread);
 
-typedef struct {
+typedef struct runq {
+  unsigned rq_count;           /* Number of threads on the run queue. */
+  uint32_t rq_status[RQ_NSW]; /* Bit is set iff corresponding queue is used. */
   struct rq_head rq_queues[RQ_NQS];
 } runq_t;
 
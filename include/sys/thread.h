@@ -21,6 +21,7 @@
 struct turnstile;
 typedef struct turnstile turnstile_t;
 typedef struct sleepq sleepq_t;
+typedef struct runq runq_t;
 typedef struct vm_page vm_page_t;
 typedef struct vm_map vm_map_t;
 typedef struct fdtab fdtab_t;
@@ -68,6 +69,8 @@ typedef enum {
 /* TDF_SLP* flags are used internally by sleep queue */
 #define TDF_SLPINTR 0x00000040  /* sleep is interruptible */
 #define TDF_SLPTIMED 0x00000080 /* sleep with timeout */
+#define TDF_NEEDPROF 0x00000100 /* profiler waits for user-space backtrace */
+#define TDF_IDLE 0x00000200     /* runs when CPU would be idle, never boosted */
 
 typedef enum {
   TDP_OLDSIGMASK = 0x01,  /* Pass td_oldsigmask as return mask to send_sig(). */
@@ -132,6 +135,9 @@ typedef struct thread {
   prio_t td_base_prio; /*!< ($) base priority */
   prio_t td_prio;      /*!< ($) active priority */
   int td_slice;        /*!< ($) time slice length in system ticks */
+  runq_t *td_runqueue; /*!< ($) run queue the thread is placed on */
+  uint32_t td_slphist; /*!< ($) recent sleep time [us] for interactivity */
+  uint32_t td_runhist; /*!< ($) recent run time [us] for interactivity */
   /* thread statistics */
   bintime_t td_rtime;        /*!< (*) time spent running */
   bintime_t td_last_rtime;   /*!< (*) time of last switch to running state */
@@ -205,6 +205,12 @@ bintime_t bintime(void);
  * and is maintained by system clock. */
 systime_t getsystime(void);
 
+/* Stop periodic clock interrupts until the next callout is due.
+ * Called by idle thread. */
+void clock_idle(void);
+/* Resume periodic clock interrupts if they have been stopped. */
+void clock_resume(void);
+
 timespec_t nanotime(void);
 
 systime_t ts2hz(const timespec_t *ts);
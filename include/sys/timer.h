@@ -22,6 +22,11 @@ typedef TAILQ_HEAD(timer_head, timer) timer_list_t;
 typedef int (*tm_start_t)(timer_t *tm, unsigned flags, const bintime_t start,
                           const bintime_t period);
 typedef int (*tm_stop_t)(timer_t *tm);
+/*! \brief Type of function that reprograms next event of a periodic timer.
+ *
+ * Next event is triggered at absolute time `when` (as in `binuptime`), then
+ * the timer continues with the period it was started with. */
+typedef int (*tm_program_t)(timer_t *tm, const bintime_t when);
 
 /*! \brief Type of function for fetching current time.
  *
@@ -49,6 +54,7 @@ typedef struct timer {
   bintime_t tm_max_period;    /*!< same as above */
   tm_start_t tm_start;        /*!< makes timer operational */
   tm_stop_t tm_stop;          /*!< ceases timer from generating new events */
+  tm_program_t tm_program;    /*!< moves next event (optional) */
   tm_event_cb_t tm_event_cb;  /*!< callback called when timer triggers */
   tm_gettime_t tm_gettime;    /*!< fetches current time from the timer */
   void *tm_arg;               /*!< an argument for callback */
@@ -78,6 +84,10 @@ int tm_start(timer_t *tm, unsigned flags, const bintime_t start,
              const bintime_t period);
 /*! \brief Stops timer from triggering a callback. */
 int tm_stop(timer_t *tm);
+/*! \brief Moves next event of a periodic timer to absolute time `when`.
+ *
+ * \returns ENOTSUP if the timer can't do that */
+int tm_program(timer_t *tm, const bintime_t when);
 /*! \brief Used by interrupt filter routine to trigger a callback. */
 void tm_trigger(timer_t *tm);
 
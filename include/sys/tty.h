@@ -8,6 +8,7 @@
 #include <sys/mutex.h>
 #include <sys/proc.h>
 #include <sys/devfs.h>
+#include <sys/event.h>
 
 #define TTY_QUEUE_SIZE 0x400
 #define TTY_OUT_LOW_WATER (TTY_QUEUE_SIZE / 4)
@@ -70,6 +71,7 @@ typedef struct tty {
   size_t t_column;           /* Cursor's column position */
   size_t t_rocol, t_rocount; /* See explanation below */
   condvar_t t_serialize_cv;  /* CV used to serialize write() calls */
+  knlist_t t_knlist;         /* Knotes monitoring the slave device */
   ttyops_t t_ops;            /* Serial device operations */
   struct termios t_termios;
   struct winsize t_winsize; /* Terminal window size */
@@ -134,6 +134,26 @@ int vfs_maybe_descend(vnode_t **vp);
 /* Finds name of v-node in given directory. */
 int vfs_name_in_dir(vnode_t *dv, vnode_t *v, char *buf, size_t *lastp);
 
+/* Looks up a name in the name cache. Returns true on a cache hit, in which
+ * case `*vp` is set to referenced vnode or NULL if the entry is negative. */
+bool vfs_cache_lookup(vnode_t *dvp, componentname_t *cn, vnode_t **vp);
+
+/* Returns current generation of the name cache. It must be obtained before
+ * calling VOP_LOOKUP and then passed to `vfs_cache_enter`. */
+unsigned vfs_cache_generation(void);
+
+/* Enters a result of VOP_LOOKUP into the name cache. Pass NULL as `vp` to
+ * create a negative entry. */
+void vfs_cache_enter(vnode_t *dvp, componentname_t *cn, vnode_t *vp,
+                     unsigned gen);
+
+/* Removes the entry for a name in a directory. Must be called whenever
+ * the name is added to or removed from the directory. */
+void vfs_cache_purge_name(vnode_t *dvp, componentname_t *cn);
+
+/* Removes all entries that refer to a vnode. */
+void vfs_cache_purge(vnode_t *v);
+
 #endif /* !_KERNEL */
 
 #endif /* !_SYS_VFS_H_ */
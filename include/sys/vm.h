@@ -3,6 +3,7 @@
 
 #include <sys/types.h>
 #include <sys/queue.h>
+#include <sys/tree.h>
 #include <machine/vm_param.h>
 
 #ifdef _KERNEL
@@ -20,6 +21,7 @@ typedef enum {
   PG_MANAGED = 0x02,    /* a page is on a freeq */
   PG_REFERENCED = 0x04, /* page has been accessed since last check */
   PG_MODIFIED = 0x08,   /* page has been modified since last check */
+  PG_RELEASED = 0x10,   /* page has been freed while held */
 } __packed pg_flags_t;
 
 typedef enum {
@@ -42,6 +44,7 @@ typedef enum {
 
 typedef struct vm_page vm_page_t;
 typedef TAILQ_HEAD(vm_pagelist, vm_page) vm_pagelist_t;
+typedef RB_HEAD(vm_pagetree, vm_page) vm_pagetree_t;
 
 typedef struct pv_entry pv_entry_t;
 typedef struct vm_object vm_object_t;
@@ -49,15 +52,15 @@ typedef struct slab slab_t;
 typedef uintptr_t vm_offset_t;
 
 /* Field marking and corresponding locks:
- * (@) pv_list_lock (in pmap.c)
+ * (@) pv lock selected by physical address of the page (in pmap.c)
  * (P) physmem_lock (in vm_physmem.c)
  * (O) vm_object::vo_lock */
 
 struct vm_page {
   union {
-    TAILQ_ENTRY(vm_page) freeq;    /* (P) list of free pages for buddy system */
+    TAILQ_ENTRY(vm_page) freeq;    /* (P) free pages of buddy system or cache */
     TAILQ_ENTRY(vm_page) pageq;    /* used to group allocated pages */
-    TAILQ_ENTRY(vm_page) objpages; /* (O) list of pages in vm_object */
+    RB_ENTRY(vm_page) objpages;    /* (O) tree of pages in vm_object */
     slab_t *slab; /* active when page is used by pool allocator */
   };
   TAILQ_HEAD(, pv_entry) pv_list; /* (@) where this page is mapped? */
@@ -65,10 +68,12 @@ struct vm_page {
   vm_offset_t offset;             /* (O) offset to page in vm_object */
   paddr_t paddr;                  /* (P) physical address of page */
   pg_flags_t flags;               /* (P) page flags (used by physmem as well) */
+  uint16_t holdcnt;               /* (P) page is not freed while held */
   uint32_t size;                  /* (P) size of page in PAGESIZE units */
 };
 
-int do_mmap(vaddr_t *addr_p, size_t length, int u_prot, int u_flags);
+int do_mmap(vaddr_t *addr_p, size_t length, int u_prot, int u_flags, int fd,
+            off_t pos);
 int do_munmap(vaddr_t addr, size_t length);
 
 #endif /* !_KERNEL */
@@ -76,10 +76,13 @@ vm_map_entry_t *vm_map_entry_next(vm_map_entry_t *ent);
  */
 int vm_map_findspace(vm_map_t *map, vaddr_t /*inout*/ *start_p, size_t length);
 
-/*! \brief Allocates entry and associate anonymous memory object with it. */
-int vm_map_alloc_entry(vm_map_t *map, vaddr_t addr, size_t length,
-                       vm_prot_t prot, vm_flags_t flags,
-                       vm_map_entry_t **ent_p);
+/*! \brief Allocates entry that maps \a obj starting from \a offset.
+ *
+ * If \a obj is NULL then anonymous memory object is created. Otherwise the
+ * entry acquires its own reference to \a obj. */
+int vm_map_alloc_entry(vm_map_t *map, vm_object_t *obj, vm_offset_t offset,
+                       vaddr_t addr, size_t length, vm_prot_t prot,
+                       vm_flags_t flags, vm_map_entry_t **ent_p);
 
 /* Tries to resize an entry, by moving its end if there
    are no other mappings in the way. On success, returns 0. */
@@ -6,6 +6,8 @@
 #include <sys/mutex.h>
 #include <sys/refcnt.h>
 
+typedef struct vnode vnode_t;
+
 /*! \brief Virtual memory object
  *
  * Field marking and corresponding locks:
@@ -15,10 +17,14 @@
 
 typedef struct vm_object {
   mtx_t vo_lock;
-  vm_pagelist_t vo_pages; /* (@) List of pages */
+  mtx_t vo_pagein_lock;   /* Serializes page-ins done by the pager */
+  vm_pagetree_t vo_pages; /* (@) Pages sorted by offset */
   size_t vo_npages;       /* (@) Number of pages */
   vm_pager_t *vo_pager;   /* Pager type and page fault function for object */
   refcnt_t vo_refs;       /* (a) How many objects refer to this object? */
+  vm_object_t *vo_backing;    /* (@) Object shadowed by this one (or NULL) */
+  vm_offset_t vo_backing_end; /* (@) Backing pages at or above are hidden */
+  vnode_t *vo_vnode;          /* (@) File cached by VM_VNODE object */
 } vm_object_t;
 
 vm_object_t *vm_object_alloc(vm_pgr_type_t type);
@@ -27,7 +33,22 @@ void vm_object_drop(vm_object_t *obj);
 void vm_object_add_page(vm_object_t *obj, vm_offset_t off, vm_page_t *pg);
 void vm_object_remove_pages(vm_object_t *obj, vm_offset_t off, size_t len);
 vm_page_t *vm_object_find_page(vm_object_t *obj, vm_offset_t off);
-vm_object_t *vm_object_clone(vm_object_t *obj);
+
+/*! \brief Create anonymous object that shadows \a obj.
+ *
+ * Pages of \a obj below \a end are visible through the new object until it
+ * gets private copies of them. The new object holds a reference to \a obj. */
+vm_object_t *vm_object_shadow(vm_object_t *obj, vm_offset_t end);
+
+/*! \brief Look up page at \a off in the chain of objects backing \a obj.
+ *
+ * Pages that are resident in \a obj itself are not considered. Pages of files
+ * are read in if they're not resident yet. */
+vm_page_t *vm_object_find_backing_page(vm_object_t *obj, vm_offset_t off);
+
+/*! \brief Merge backing objects that are referenced only by \a obj. */
+void vm_object_collapse(vm_object_t *obj);
+
 void vm_object_dump(vm_object_t *obj);
 
 #endif /* !_SYS_VM_OBJECT_H_ */
@@ -6,6 +6,7 @@
 typedef enum {
   VM_DUMMY,
   VM_ANONYMOUS,
+  VM_VNODE,
 } vm_pgr_type_t;
 
 typedef vm_page_t *vm_pgr_fault_t(vm_object_t *obj, off_t offset);
@@ -17,4 +18,16 @@ typedef struct vm_pager {
 
 extern vm_pager_t pagers[];
 
+typedef struct vnode vnode_t;
+
+/*! \brief Returns object that caches pages of file \a v with reference held.
+ *
+ * The object is created on first use and lives as long as the vnode does.
+ * While the object is referenced it keeps the vnode alive.
+ * Must be called with the vnode locked. */
+vm_object_t *vnode_pager_object(vnode_t *v);
+
+/*! \brief Frees pages cached for \a v. Called when the vnode is reclaimed. */
+void vnode_pager_release(vnode_t *v);
+
 #endif /* !_SYS_VM_PAGER_H_ */
@@ -16,6 +16,13 @@ void _vm_physseg_plug(paddr_t start, paddr_t end, bool used);
 /* Allocates contiguous big page that consists of n machine pages. */
 vm_page_t *vm_page_alloc(size_t n);
 
+/* Allocates single page filled with zeros. Pages are taken from the pool
+ * zeroed in background, unless the pool is empty. */
+vm_page_t *vm_page_alloc_zero(void);
+
+/* Starts the thread that fills the pool of zeroed pages. */
+void init_vm_pagezero(void);
+
 /* Allocates `n` pages in various sizes and puts them on `pglist`. Always
  * initializes `pglist`. Returns ENOMEM if the request cannot be satisfied. */
 int vm_pagelist_alloc(size_t n, vm_pagelist_t *pglist);
@@ -26,7 +33,14 @@ void vm_pagelist_free(vm_pagelist_t *pglist);
 /* Returns vm_page associated with frame of given address. */
 vm_page_t *vm_page_find(paddr_t pa);
 
-/* Returns vm_page to physical memory manager. */
+/* Returns vm_page to physical memory manager. If the page is held, then it's
+ * returned when the last hold is released. */
 void vm_page_free(vm_page_t *page);
 
+/* Prevents the page from being returned to physical memory manager until
+ * `vm_page_unhold` is called. The caller must make sure the page is not being
+ * freed concurrently, e.g. by looking it up in a mapping that can't change. */
+void vm_page_hold(vm_page_t *page);
+void vm_page_unhold(vm_page_t *page);
+
 #endif /* !_SYS_VM_PHYSMEM_H_ */
@@ -28,7 +28,13 @@ int vmem_add(vmem_t *vm, vmem_addr_t addr, vmem_size_t size);
 int vmem_alloc(vmem_t *vm, vmem_size_t size, vmem_addr_t *addrp,
                kmem_flags_t flags);
 
-/*! \brief Free segment previously allocated by vmem_alloc(). */
+/*! \brief Allocate an address segment that starts at a multiple of `alignment`.
+ * Alignment must be a power of 2, or 0 if only the quantum matters. */
+int vmem_xalloc(vmem_t *vm, vmem_size_t size, vmem_size_t alignment,
+                vmem_addr_t *addrp, kmem_flags_t flags);
+
+/*! \brief Free segment previously allocated by vmem_alloc() or vmem_xalloc().
+ */
 void vmem_free(vmem_t *vm, vmem_addr_t addr, vmem_size_t size);
 
 /*! \brief Destroy existing vmem arena. */
@@ -19,6 +19,8 @@ typedef struct dirent dirent_t;
 typedef struct stat stat_t;
 typedef struct componentname componentname_t;
 typedef struct cred cred_t;
+typedef struct namecache namecache_t;
+typedef struct vm_object vm_object_t;
 
 /* Indicates that given field of vattr structure does not hold a value.
  * vnodeops should not modify attributes set to VNOVAL. */
@@ -57,6 +59,7 @@ typedef int vnode_readlink_t(vnode_t *v, uio_t *uio);
 typedef int vnode_symlink_t(vnode_t *dv, componentname_t *cn, vattr_t *va,
                             char *target, vnode_t **vp);
 typedef int vnode_link_t(vnode_t *dv, vnode_t *v, componentname_t *cn);
+typedef int vnode_mmap_t(vnode_t *v, vm_object_t **objp);
 
 typedef struct vnodeops {
   vnode_lookup_t *v_lookup;
@@ -78,6 +81,7 @@ typedef struct vnodeops {
   vnode_readlink_t *v_readlink;
   vnode_symlink_t *v_symlink;
   vnode_link_t *v_link;
+  vnode_mmap_t *v_mmap;
 } vnodeops_t;
 
 /* Fill missing entries with default vnode operation. */
@@ -105,6 +109,11 @@ typedef struct vnode {
 
   refcnt_t v_usecnt;
   vnlock_t v_lock;
+
+  LIST_HEAD(, namecache) v_nclist; /* Name cache entries pointing to us */
+  LIST_HEAD(, namecache) v_ncdir;  /* Name cache entries in this directory */
+
+  vm_object_t *v_object; /* Pages of the file cached by vnode pager */
 } vnode_t;
 
 static inline bool is_mountpoint(vnode_t *v) {
@@ -210,6 +219,11 @@ static inline int VOP_LINK(vnode_t *dv, vnode_t *v, componentname_t *cn) {
   return VOP_CALL(link, dv, v, cn);
 }
 
+/* Memory object with file contents is returned with reference held. */
+static inline int VOP_MMAP(vnode_t *v, vm_object_t **objp) {
+  return VOP_CALL(mmap, v, objp);
+}
+
 #undef VOP_CALL
 
 /* Allocates and initializes a new vnode */
@@ -239,6 +253,8 @@ int vnode_seek_generic(vnode_t *v, off_t oldoff, off_t newoff);
 int vnode_access_generic(vnode_t *v, accmode_t mode, cred_t *cred);
 /* When successful increments reference counter for given vnode.*/
 int vnode_open_generic(vnode_t *v, int mode, file_t *fp);
+/* Regular files are mapped through the vnode pager. */
+int vnode_mmap_generic(vnode_t *v, vm_object_t **objp);
 
 /* Default fileops implementations for files with v-nodes. */
 int default_vnread(file_t *f, uio_t *uio);
@@ -172,16 +172,15 @@ __boot_text static paddr_t build_page_table(void) {
   for (; pa < ebss; pa += PAGESIZE, va += PAGESIZE)
     l3[L3_INDEX(va)] = pa | ATTR_AP_RW | ATTR_XN | pte_default;
 
-  /* direct map construction */
+  /* direct map construction (with 2MiB blocks) */
   volatile pde_t *l1d = bootmem_alloc(DMAP_L1_SIZE);
   volatile pde_t *l2d = bootmem_alloc(DMAP_L2_SIZE);
-  volatile pde_t *l3d = bootmem_alloc(DMAP_L3_SIZE);
 
-  for (intptr_t i = 0; i < DMAP_L3_ENTRIES; i++)
-    l3d[i] = (i * PAGESIZE) | ATTR_AP_RW | ATTR_XN | pte_default;
+  const pde_t block_default =
+    L2_BLOCK | ATTR_AF | ATTR_SH_IS | ATTR_IDX(ATTR_NORMAL_MEM_WB);
 
   for (intptr_t i = 0; i < DMAP_L2_ENTRIES; i++)
-    l2d[i] = (pde_t)&l3d[i * PT_ENTRIES] | L2_TABLE;
+    l2d[i] = (i * L2_SIZE) | ATTR_AP_RW | ATTR_XN | block_default;
 
   for (intptr_t i = 0; i < DMAP_L1_ENTRIES; i++)
     l1d[i] = (pde_t)&l2d[i * PT_ENTRIES] | L1_TABLE;
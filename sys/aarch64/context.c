@@ -30,6 +30,36 @@ register_t ctx_get_pc(ctx_t *ctx) {
   return _REG(ctx, PC);
 }
 
+/*
+ * Code is compiled with frame pointers, so each stack frame begins with
+ * a frame record that holds the previous value of frame pointer and the return
+ * address. If the context was saved before the current function set up its
+ * frame record, its caller will be missing from the backtrace.
+ */
+unsigned ctx_unwind(ctx_t *ctx, unwind_read_t read, uintptr_t *pcs,
+                    unsigned n) {
+  register_t fp = _REG(ctx, FP);
+  unsigned i = 0;
+
+  if (n == 0)
+    return 0;
+
+  pcs[i++] = _REG(ctx, PC);
+
+  while (i < n && fp != 0) {
+    register_t next, lr;
+    if (!read(fp, &next) || !read(fp + sizeof(register_t), &lr) || lr == 0)
+      break;
+    pcs[i++] = lr;
+    /* Stack grows down, so frame records of callers have higher addresses. */
+    if (next <= fp)
+      break;
+    fp = next;
+  }
+
+  return i;
+}
+
 void mcontext_copy(mcontext_t *to, mcontext_t *from) {
   memcpy(to, from, sizeof(mcontext_t));
 }
@@ -1,5 +1,6 @@
 #define KL_LOG KL_PMAP
 #include <sys/klog.h>
+#include <sys/hash.h>
 #include <sys/mimiker.h>
 #include <sys/libkern.h>
 #include <sys/pool.h>
@@ -12,21 +13,21 @@
 #include <sys/mutex.h>
 #include <sys/sched.h>
 #include <sys/vm_physmem.h>
-#include <bitstring.h>
 #include <sys/errno.h>
+#include <sys/interrupt.h>
 #include <sys/kasan.h>
 
 typedef struct pmap {
-  mtx_t mtx;                      /* protects all fields in this structure */
-  asid_t asid;                    /* address space identifier */
-  paddr_t pde;                    /* directory page table physical address */
-  vm_pagelist_t pte_pages;        /* pages we allocate in page table */
-  TAILQ_HEAD(, pv_entry) pv_list; /* all pages mapped by this physical map */
+  mtx_t mtx;               /* protects all fields in this structure */
+  asid_t asid;             /* address space identifier */
+  uint32_t asid_gen;       /* generation `asid` is valid in */
+  paddr_t pde;             /* directory page table physical address */
+  vm_pagelist_t pte_pages; /* pages we allocate in page table */
 } pmap_t;
 
 typedef struct pv_entry {
-  TAILQ_ENTRY(pv_entry) pmap_link; /* link on pmap::pv_list */
   TAILQ_ENTRY(pv_entry) page_link; /* link on vm_page::pv_list */
+  LIST_ENTRY(pv_entry) hash_link;  /* link on pv hash bucket */
   pmap_t *pmap;                    /* page is mapped in this pmap */
   vaddr_t va;                      /* under this address */
 } pv_entry_t;
@@ -78,13 +79,34 @@ static const pte_t vm_prot_map[] = {
 
 static pmap_t kernel_pmap;
 paddr_t _kernel_pmap_pde;
-static bitstr_t asid_used[bitstr_size(MAX_ASID)] = {0};
 static SPIN_DEFINE(asid_lock, 0);
+static uint32_t asid_gen = 1;  /* current ASID generation */
+static unsigned asid_next = 1; /* next ASID to hand out in this generation */
 
-/* this lock is used to protect the vm_page::pv_list field */
-/* the order of acquiring locks is as follows: firstly pv_list_lock and then
- * pmap_t::mtx */
-static MTX_DEFINE(pv_list_lock, 0);
+/*
+ * Physical-to-virtual entries of a page are kept on vm_page::pv_list. To find
+ * an entry for given pmap and virtual address without walking the list of
+ * a page that is mapped in many address spaces, entries are also put into
+ * a hash table.
+ *
+ * There's no single lock for all pv entries. A page is assigned one of
+ * PV_LOCKS locks based on its physical address. The lock protects pv list of
+ * the page, a part of the hash table and page table entries that map the page.
+ * Thus flags of all mappings of a page can be changed without taking locks of
+ * pmaps involved. Creating or destroying a mapping requires holding both
+ * pmap_t::mtx and the pv lock of the page, in that order.
+ */
+#define PV_LOCKS 64    /* number of pv locks, must be a power of two */
+#define PV_HASHSIZE 64 /* hash buckets per lock, must be a power of two */
+
+typedef LIST_HEAD(, pv_entry) pv_hashhead_t;
+
+typedef struct pv_table {
+  mtx_t lock;
+  pv_hashhead_t hash[PV_HASHSIZE];
+} pv_table_t;
+
+static pv_table_t pv_table[PV_LOCKS];
 
 #define PAGE_OFFSET(x) ((x) & (PAGESIZE - 1))
 #define PG_DMAP_ADDR(pg) ((void *)((intptr_t)(pg)->paddr + DMAP_BASE))
@@ -101,11 +123,11 @@ static bool kern_addr_p(vaddr_t addr) {
 }
 
 inline vaddr_t pmap_start(pmap_t *pmap) {
-  return pmap->asid ? PMAP_USER_BEGIN : PMAP_KERNEL_BEGIN;
+  return pmap != pmap_kernel() ? PMAP_USER_BEGIN : PMAP_KERNEL_BEGIN;
 }
 
 inline vaddr_t pmap_end(pmap_t *pmap) {
-  return pmap->asid ? PMAP_USER_END : PMAP_KERNEL_END;
+  return pmap != pmap_kernel() ? PMAP_USER_END : PMAP_KERNEL_END;
 }
 
 inline bool pmap_address_p(pmap_t *pmap, vaddr_t va) {
@@ -134,57 +156,80 @@ pmap_t *pmap_lookup(vaddr_t addr) {
 
 /*
  * Address space identifiers management.
+ *
+ * ASID 0 belongs to the kernel, the rest is handed out to user pmaps in order
+ * of activation. When all ASIDs are used up, we start a new generation and
+ * flush the whole TLB, so every user pmap will get a fresh ASID next time
+ * it's activated. Thus ASIDs are never released, and a pmap from an older
+ * generation has no TLB entries tagged with its (stale) ASID.
  */
 
-static asid_t alloc_asid(void) {
-  int free = 0;
-  WITH_SPIN_LOCK (&asid_lock) {
-    bit_ffc(asid_used, MAX_ASID, &free);
-    if (free < 0)
-      panic("Out of asids!");
-    bit_set(asid_used, free);
+static void pmap_asid_check(pmap_t *pmap) {
+  SCOPED_SPIN_LOCK(&asid_lock);
+
+  if (pmap->asid_gen == asid_gen)
+    return;
+
+  if (asid_next > MAX_ASID) {
+    /* Generation number 0 marks pmaps that have never been activated. */
+    if (++asid_gen == 0)
+      asid_gen = 1;
+    asid_next = 1;
+    tlb_invalidate_all();
+    klog("ASID generation %u started", asid_gen);
   }
-  klog("alloc_asid() = %d", free);
-  return free;
-}
 
-static void free_asid(asid_t asid) {
-  klog("free_asid(%d)", asid);
-  SCOPED_SPIN_LOCK(&asid_lock);
-  bit_clear(asid_used, (unsigned)asid);
-  tlb_invalidate_asid(asid);
+  pmap->asid = asid_next++;
+  pmap->asid_gen = asid_gen;
+  klog("pmap %p got ASID %d", pmap, pmap->asid);
 }
 
 /*
  * Physical-to-virtual entries are managed for all pageable mappings.
  */
 
+static inline pv_table_t *pv_table_of(paddr_t pa) {
+  return &pv_table[(pa / PAGESIZE) & (PV_LOCKS - 1)];
+}
+
+static pv_hashhead_t *pv_hashhead(pv_table_t *pt, pmap_t *pmap, vaddr_t va) {
+  uint32_t hash = hash32_buf(&pmap, sizeof(pmap), HASH32_BUF_INIT);
+  hash = hash32_buf(&va, sizeof(va), hash);
+  return &pt->hash[hash & (PV_HASHSIZE - 1)];
+}
+
 static void pv_add(pmap_t *pmap, vaddr_t va, vm_page_t *pg) {
-  assert(mtx_owned(&pv_list_lock));
+  pv_table_t *pt = pv_table_of(pg->paddr);
+  assert(mtx_owned(&pt->lock));
   pv_entry_t *pv = pool_alloc(P_PV, M_ZERO);
   pv->pmap = pmap;
   pv->va = va;
   TAILQ_INSERT_TAIL(&pg->pv_list, pv, page_link);
-  TAILQ_INSERT_TAIL(&pmap->pv_list, pv, pmap_link);
+  LIST_INSERT_HEAD(pv_hashhead(pt, pmap, va), pv, hash_link);
 }
 
 static pv_entry_t *pv_find(pmap_t *pmap, vaddr_t va, vm_page_t *pg) {
-  assert(mtx_owned(&pv_list_lock));
+  pv_table_t *pt = pv_table_of(pg->paddr);
+  assert(mtx_owned(&pt->lock));
   pv_entry_t *pv;
-  TAILQ_FOREACH (pv, &pg->pv_list, page_link) {
+  LIST_FOREACH (pv, pv_hashhead(pt, pmap, va), hash_link) {
     if (pv->pmap == pmap && pv->va == va)
       return pv;
   }
   return NULL;
 }
 
+static void pv_free(pv_entry_t *pv, vm_page_t *pg) {
+  assert(mtx_owned(&pv_table_of(pg->paddr)->lock));
+  TAILQ_REMOVE(&pg->pv_list, pv, page_link);
+  LIST_REMOVE(pv, hash_link);
+  pool_free(P_PV, pv);
+}
+
 static void pv_remove(pmap_t *pmap, vaddr_t va, vm_page_t *pg) {
-  assert(mtx_owned(&pv_list_lock));
   pv_entry_t *pv = pv_find(pmap, va, pg);
   assert(pv != NULL);
-  TAILQ_REMOVE(&pg->pv_list, pv, page_link);
-  TAILQ_REMOVE(&pmap->pv_list, pv, pmap_link);
-  pool_free(P_PV, pv);
+  pv_free(pv, pg);
 }
 
 /*
@@ -192,34 +237,71 @@ static void pv_remove(pmap_t *pmap, vaddr_t va, vm_page_t *pg) {
  */
 
 static vm_page_t *pmap_pagealloc(void) {
-  vm_page_t *pg = vm_page_alloc(1);
-  pmap_zero_page(pg);
-  return pg;
+  return vm_page_alloc_zero();
 }
 
-static pte_t *pmap_lookup_pte(pmap_t *pmap, vaddr_t va) {
+static bool pde_block_p(pde_t pde) {
+  return (pde & ATTR_DESCR_MASK) == L2_BLOCK;
+}
+
+/*
+ * Return pointer to entry of va in level 2 of page table or NULL if there's
+ * no such entry. In the latter case `*nextp` is set to the end of address
+ * range that would be described by the missing table.
+ */
+static pde_t *pmap_walk_l2(pmap_t *pmap, vaddr_t va, vaddr_t *nextp) {
   pde_t *pdep;
   paddr_t pa = pmap->pde;
 
   /* Level 0 */
   pdep = (pde_t *)PHYS_TO_DMAP(pa) + L0_INDEX(va);
-  if (!(pa = PTE_FRAME_ADDR(*pdep)))
+  if (!(pa = PTE_FRAME_ADDR(*pdep))) {
+    *nextp = rounddown(va, L0_SIZE) + L0_SIZE;
     return NULL;
+  }
 
   /* Level 1 */
   pdep = (pde_t *)PHYS_TO_DMAP(pa) + L1_INDEX(va);
-  if (!(pa = PTE_FRAME_ADDR(*pdep)))
+  if (!(pa = PTE_FRAME_ADDR(*pdep))) {
+    *nextp = rounddown(va, L1_SIZE) + L1_SIZE;
     return NULL;
+  }
 
   /* Level 2 */
-  pdep = (pde_t *)PHYS_TO_DMAP(pa) + L2_INDEX(va);
-  if (!(pa = PTE_FRAME_ADDR(*pdep)))
+  return (pde_t *)PHYS_TO_DMAP(pa) + L2_INDEX(va);
+}
+
+/*
+ * Return pointer to entry of va in level 3 of page table or NULL if there's
+ * no such entry. In the latter case `*nextp` is set to the end of address
+ * range that would be described by the missing table. The same happens for
+ * 2MiB block mappings, which have no level 3 table at all.
+ */
+static pte_t *pmap_walk(pmap_t *pmap, vaddr_t va, vaddr_t *nextp) {
+  pde_t *pdep = pmap_walk_l2(pmap, va, nextp);
+  if (pdep == NULL)
     return NULL;
 
+  paddr_t pa = PTE_FRAME_ADDR(*pdep);
+  if (pa == 0 || pde_block_p(*pdep)) {
+    *nextp = rounddown(va, L2_SIZE) + L2_SIZE;
+    return NULL;
+  }
+
   /* Level 3 */
   return (pde_t *)PHYS_TO_DMAP(pa) + L3_INDEX(va);
 }
 
+static pde_t *pmap_lookup_l2(pmap_t *pmap, vaddr_t va) {
+  vaddr_t next;
+  return pmap_walk_l2(pmap, va, &next);
+}
+
+static pte_t *pmap_lookup_pte(pmap_t *pmap, vaddr_t va) {
+  vaddr_t next;
+  return pmap_walk(pmap, va, &next);
+}
+
 static paddr_t pmap_alloc_pde(pmap_t *pmap, vaddr_t vaddr) {
   vm_page_t *pg = pmap_pagealloc();
 
@@ -230,6 +312,44 @@ static paddr_t pmap_alloc_pde(pmap_t *pmap, vaddr_t vaddr) {
   return pg->paddr;
 }
 
+static bool pmap_table_empty_p(paddr_t pa) {
+  pde_t *table = (pde_t *)PHYS_TO_DMAP(pa);
+  for (int i = 0; i < PAGESIZE / (int)sizeof(pde_t); i++)
+    if (PTE_FRAME_ADDR(table[i]) != 0)
+      return false;
+  return true;
+}
+
+/*
+ * Free page tables (levels 1, 2, 3) on the path to va, that have no entries
+ * describing any pages or other tables.
+ */
+static void pmap_remove_pde(pmap_t *pmap, vaddr_t va) {
+  pde_t *pdep[3];
+  paddr_t pa = pmap->pde;
+
+  pdep[0] = (pde_t *)PHYS_TO_DMAP(pa) + L0_INDEX(va);
+  pa = PTE_FRAME_ADDR(*pdep[0]);
+  pdep[1] = (pde_t *)PHYS_TO_DMAP(pa) + L1_INDEX(va);
+  pa = PTE_FRAME_ADDR(*pdep[1]);
+  pdep[2] = (pde_t *)PHYS_TO_DMAP(pa) + L2_INDEX(va);
+
+  for (int lvl = 2; lvl >= 0; lvl--) {
+    pa = PTE_FRAME_ADDR(*pdep[lvl]);
+    if (!pmap_table_empty_p(pa))
+      return;
+
+    *pdep[lvl] = 0;
+    /* Purge cached copies of the table entry from walk cache. */
+    tlb_invalidate(va, pmap->asid);
+
+    vm_page_t *pg = vm_page_find(pa);
+    TAILQ_REMOVE(&pmap->pte_pages, pg, pageq);
+    vm_page_free(pg);
+    klog("Page table for 0x%016lx freed at level %d", va, lvl + 1);
+  }
+}
+
 static pte_t make_pte(paddr_t pa, pte_t prot, unsigned flags) {
   pte_t pte = pa | prot;
   unsigned cacheflags = flags & PMAP_CACHE_MASK;
@@ -247,6 +367,92 @@ static void pmap_write_pte(pmap_t *pmap, pte_t *ptep, pte_t pte, vaddr_t va) {
   tlb_invalidate(va, pmap->asid);
 }
 
+/*
+ * 2MiB block mappings.
+ *
+ * Kernel pmap maps the direct map with blocks right from the start. Level 3
+ * tables filled by pmap_kenter with physically contiguous and suitably
+ * aligned pages are promoted to blocks, which saves TLB entries. Whenever
+ * a single page of a block has to be changed, the block is demoted back to
+ * a level 3 table. Blocks never describe managed (pageable) pages, so pv
+ * entries and referenced & modified bits are not concerned.
+ *
+ * Level 2 entries are changed with break-before-make sequence, i.e. the entry
+ * is invalidated and purged from TLB before the new one is written, as
+ * required by the architecture. The range being remapped may contain the
+ * stack of current thread, so the sequence must not touch memory other than
+ * the entry itself and is performed with interrupts disabled.
+ */
+static void pmap_replace_pde(pde_t *pdep, pde_t pde, vaddr_t va) {
+  uint64_t page = rounddown(va, L2_SIZE) >> PAGE_SHIFT;
+  uint64_t n = PT_ENTRIES;
+
+  SCOPED_INTR_DISABLED();
+
+  __asm__ volatile("str xzr, [%[pdep]]\n\t"
+                   "dsb ishst\n"
+                   "1:\n\t"
+                   "tlbi vaae1is, %[page]\n\t"
+                   "add %[page], %[page], #1\n\t"
+                   "subs %[n], %[n], #1\n\t"
+                   "b.ne 1b\n\t"
+                   "dsb ish\n\t"
+                   "str %[pde], [%[pdep]]\n\t"
+                   "dsb ishst\n\t"
+                   "isb"
+                   : [page] "+r"(page), [n] "+r"(n)
+                   : [pdep] "r"(pdep), [pde] "r"(pde)
+                   : "cc", "memory");
+}
+
+static void pmap_demote(pmap_t *pmap, pde_t *pdep, vaddr_t va) {
+  pde_t block = *pdep & ~ATTR_DESCR_MASK;
+  paddr_t pa = pmap_alloc_pde(pmap, va);
+  pte_t *l3 = (pte_t *)PHYS_TO_DMAP(pa);
+
+  for (int i = 0; i < PT_ENTRIES; i++)
+    l3[i] = (block + i * PAGESIZE) | L3_PAGE;
+
+  pmap_replace_pde(pdep, pa | L2_TABLE, va);
+  klog("Block at 0x%016lx demoted", rounddown(va, L2_SIZE));
+}
+
+/*
+ * Replace level 3 table containing va with a block if the table maps
+ * 2MiB-aligned physically contiguous range with same attributes.
+ */
+static void pmap_promote(pmap_t *pmap, vaddr_t va) {
+  pde_t *pdep = pmap_lookup_l2(pmap, va);
+  paddr_t l3pa = PTE_FRAME_ADDR(*pdep);
+  pte_t *l3 = (pte_t *)PHYS_TO_DMAP(l3pa);
+  pte_t first = l3[0];
+
+  /* Cheap checks first, as we're called for every entered page. */
+  if ((first & ATTR_DESCR_MASK) != L3_PAGE || !(first & ATTR_SW_WIRED))
+    return;
+  if (!is_aligned(PTE_FRAME_ADDR(first), L2_SIZE))
+    return;
+  if (l3[PT_ENTRIES - 1] != first + (PT_ENTRIES - 1) * PAGESIZE)
+    return;
+
+  for (int i = 1; i < PT_ENTRIES - 1; i++)
+    if (l3[i] != first + i * PAGESIZE)
+      return;
+
+  pmap_replace_pde(pdep, (first & ~ATTR_DESCR_MASK) | L2_BLOCK, va);
+  klog("Page table for 0x%016lx promoted to block", rounddown(va, L2_SIZE));
+
+  /* Tables built during boot are not in pte_pages and are left alone. */
+  vm_page_t *pg;
+  TAILQ_FOREACH (pg, &pmap->pte_pages, pageq) {
+    if (pg->paddr == l3pa) {
+      TAILQ_REMOVE(&pmap->pte_pages, pg, pageq);
+      vm_page_free(pg);
+      break;
+    }
+  }
+}
+
 /*
  * Return pointer to entry of va in level 3 of page table. Allocate space if
  * needed.
@@ -272,6 +478,8 @@ static pte_t *pmap_ensure_pte(pmap_t *pmap, vaddr_t va) {
 
   /* Level 2 */
   pdep = (pde_t *)PHYS_TO_DMAP(pa) + L2_INDEX(va);
+  if (pde_block_p(*pdep))
+    pmap_demote(pmap, pdep, va);
   if (!(pa = PTE_FRAME_ADDR(*pdep))) {
     pa = pmap_alloc_pde(pmap, va);
     *pdep = pa | L2_TABLE;
@@ -284,6 +492,9 @@ static pte_t *pmap_ensure_pte(pmap_t *pmap, vaddr_t va) {
 void pmap_activate(pmap_t *umap) {
   SCOPED_NO_PREEMPTION();
 
+  if (umap)
+    pmap_asid_check(umap);
+
   PCPU_SET(curpmap, umap);
 
   uint64_t tcr = READ_SPECIALREG(TCR_EL1);
@@ -310,11 +521,12 @@ void pmap_kenter(vaddr_t va, paddr_t pa, vm_prot_t prot, unsigned flags) {
 
   klog("Enter unmanaged mapping from %p to %p", va, pa);
 
-  pte_t pte = make_pte(pa, vm_prot_map[prot], flags);
+  pte_t pte = make_pte(pa, vm_prot_map[prot] | ATTR_SW_WIRED, flags);
 
   WITH_MTX_LOCK (&pmap->mtx) {
     pte_t *ptep = pmap_ensure_pte(pmap, va);
     pmap_write_pte(pmap, ptep, pte, va);
+    pmap_promote(pmap, va);
   }
 }
 
@@ -329,9 +541,21 @@ void pmap_kremove(vaddr_t va, size_t size) {
 
   WITH_MTX_LOCK (&pmap->mtx) {
     for (size_t off = 0; off < size; off += PAGESIZE) {
-      pte_t *ptep = pmap_lookup_pte(pmap, va + off);
-      assert(ptep != NULL);
-      pmap_write_pte(pmap, ptep, 0, va + off);
+      vaddr_t cur = va + off;
+      pde_t *pdep = pmap_lookup_l2(pmap, cur);
+      assert(pdep != NULL);
+      /* Whole block is removed at once, otherwise it's demoted. */
+      if (pde_block_p(*pdep) && is_aligned(cur, L2_SIZE) &&
+          size - off >= L2_SIZE) {
+        pmap_replace_pde(pdep, 0, cur);
+        off += L2_SIZE - PAGESIZE;
+      } else {
+        if (pde_block_p(*pdep))
+          pmap_demote(pmap, pdep, cur);
+        pte_t *ptep = pmap_lookup_pte(pmap, cur);
+        assert(ptep != NULL);
+        pmap_write_pte(pmap, ptep, 0, cur);
+      }
     }
   }
 }
@@ -348,6 +572,12 @@ static bool pmap_extract_nolock(pmap_t *pmap, vaddr_t va, paddr_t *pap) {
   if (!pmap_address_p(pmap, va))
     return false;
 
+  pde_t *pdep = pmap_lookup_l2(pmap, va);
+  if (pdep != NULL && pde_block_p(*pdep)) {
+    *pap = (*pdep & L2_BLOCK_MASK) | (va & L2_OFFSET);
+    return true;
+  }
+
   pte_t *ptep = pmap_lookup_pte(pmap, va);
   if (ptep == NULL)
     return false;
@@ -358,6 +588,25 @@ static bool pmap_extract_nolock(pmap_t *pmap, vaddr_t va, paddr_t *pap) {
   return true;
 }
 
+/*
+ * Remove mapping of page frame pa under va. The mapping could have been
+ * removed by pmap_page_remove in the meantime, so it's checked again with
+ * pv lock held. Returns true if the mapping has been removed.
+ */
+static bool pmap_remove_mapping(pmap_t *pmap, vaddr_t va, paddr_t pa) {
+  assert(mtx_owned(&pmap->mtx));
+
+  SCOPED_MTX_LOCK(&pv_table_of(pa)->lock);
+
+  pte_t *ptep = pmap_lookup_pte(pmap, va);
+  if (ptep == NULL || PTE_FRAME_ADDR(*ptep) != pa)
+    return false;
+
+  pv_remove(pmap, va, vm_page_find(pa));
+  pmap_write_pte(pmap, ptep, 0, va);
+  return true;
+}
+
 void pmap_enter(pmap_t *pmap, vaddr_t va, vm_page_t *pg, vm_prot_t prot,
                 unsigned flags) {
   paddr_t pa = pg->paddr;
@@ -369,20 +618,31 @@ void pmap_enter(pmap_t *pmap, vaddr_t va, vm_page_t *pg, vm_prot_t prot,
 
   bool kern_mapping = (pmap == pmap_kernel());
 
-  /* Mark user pages as non-referenced & non-modified. */
+  /* Mark user pages as non-referenced & non-modified, unless the caller told
+   * us which kind of access is going to happen right after the mapping. */
   pte_t mask = kern_mapping ? 0UL : (ATTR_AF);
+  pg_flags_t pgflags = kern_mapping ? (PG_MODIFIED | PG_REFERENCED) : 0;
+  if (flags & PMAP_PROT_MASK) {
+    mask = 0UL;
+    pgflags |= PG_REFERENCED;
+  }
+  if (flags & VM_PROT_WRITE)
+    pgflags |= PG_MODIFIED;
   pte_t pte = make_pte(pa, vm_prot_map[prot] & ~mask, flags);
 
-  WITH_MTX_LOCK (&pv_list_lock) {
-    WITH_MTX_LOCK (&pmap->mtx) {
+  WITH_MTX_LOCK (&pmap->mtx) {
+    paddr_t old_pa;
+    /* Replacing mapping of another page (i.e. after copy-on-write)? */
+    if (pmap_extract_nolock(pmap, va, &old_pa) && old_pa != pa)
+      pmap_remove_mapping(pmap, va, old_pa);
+    /* Don't allocate page tables with pv lock held. */
+    pte_t *ptep = pmap_ensure_pte(pmap, va);
+    WITH_MTX_LOCK (&pv_table_of(pa)->lock) {
       pv_entry_t *pv = pv_find(pmap, va, pg);
       if (pv == NULL)
         pv_add(pmap, va, pg);
-      if (kern_mapping)
-        pg->flags |= PG_MODIFIED | PG_REFERENCED;
-      else
-        pg->flags &= ~(PG_MODIFIED | PG_REFERENCED);
-      pte_t *ptep = pmap_ensure_pte(pmap, va);
+      pg->flags &= ~(PG_MODIFIED | PG_REFERENCED);
+      pg->flags |= pgflags;
       pmap_write_pte(pmap, ptep, pte, va);
     }
   }
@@ -394,19 +654,27 @@ void pmap_remove(pmap_t *pmap, vaddr_t start, vaddr_t end) {
 
   klog("Remove page mapping for address range %p-%p", start, end);
 
-  WITH_MTX_LOCK (&pv_list_lock) {
-    WITH_MTX_LOCK (&pmap->mtx) {
-      for (vaddr_t va = start; va < end; va += PAGESIZE) {
-        pte_t *ptep = pmap_lookup_pte(pmap, va);
-        if (ptep == NULL)
-          continue;
-        paddr_t pa = PTE_FRAME_ADDR(*ptep);
-        if (pa == 0)
-          continue;
-        vm_page_t *pg = vm_page_find(pa);
-        pv_remove(pmap, va, pg);
-        pmap_write_pte(pmap, ptep, 0, va);
+  /* Page tables of kernel pmap are shared by all address spaces. */
+  bool reclaim = (pmap != pmap_kernel());
+
+  WITH_MTX_LOCK (&pmap->mtx) {
+    for (vaddr_t va = start; va < end; va += PAGESIZE) {
+      vaddr_t next;
+      pte_t *ptep = pmap_walk(pmap, va, &next);
+      /* Skip over address ranges without page table. */
+      if (ptep == NULL) {
+        if (next >= end)
+          break;
+        va = next - PAGESIZE;
+        continue;
       }
+      paddr_t pa = PTE_FRAME_ADDR(*ptep);
+      if (pa != 0)
+        pmap_remove_mapping(pmap, va, pa);
+      /* Done with the part of the range covered by this page table? */
+      if (reclaim &&
+          (va + PAGESIZE == end || is_aligned(va + PAGESIZE, L2_SIZE)))
+        pmap_remove_pde(pmap, va);
     }
   }
 }
@@ -420,11 +688,26 @@ void pmap_protect(pmap_t *pmap, vaddr_t start, vaddr_t end, vm_prot_t prot) {
 
   WITH_MTX_LOCK (&pmap->mtx) {
     for (vaddr_t va = start; va < end; va += PAGESIZE) {
-      pte_t *ptep = pmap_lookup_pte(pmap, va);
-      if (ptep == NULL)
+      vaddr_t next;
+      pte_t *ptep = pmap_walk(pmap, va, &next);
+      /* Skip over address ranges without page table. */
+      if (ptep == NULL) {
+        if (next >= end)
+          break;
+        va = next - PAGESIZE;
         continue;
-      pte_t pte = vm_prot_map[prot] | (*ptep & (~ATTR_AP_MASK & ~ATTR_XN));
-      pmap_write_pte(pmap, ptep, pte, va);
+      }
+      paddr_t pa = PTE_FRAME_ADDR(*ptep);
+      if (pa == 0)
+        continue;
+      WITH_MTX_LOCK (&pv_table_of(pa)->lock) {
+        /* Check if the page hasn't been unmapped in the meantime. */
+        if (PTE_FRAME_ADDR(*ptep) == pa) {
+          pte_t pte =
+            vm_prot_map[prot] | (*ptep & (~ATTR_AP_MASK & ~ATTR_XN));
+          pmap_write_pte(pmap, ptep, pte, va);
+        }
+      }
     }
   }
 }
@@ -435,20 +718,16 @@ bool pmap_extract(pmap_t *pmap, vaddr_t va, paddr_t *pap) {
 }
 
 void pmap_page_remove(vm_page_t *pg) {
-  SCOPED_MTX_LOCK(&pv_list_lock);
+  SCOPED_MTX_LOCK(&pv_table_of(pg->paddr)->lock);
 
-  while (!TAILQ_EMPTY(&pg->pv_list)) {
-    pv_entry_t *pv = TAILQ_FIRST(&pg->pv_list);
+  pv_entry_t *pv;
+  while ((pv = TAILQ_FIRST(&pg->pv_list))) {
     pmap_t *pmap = pv->pmap;
     vaddr_t va = pv->va;
-    WITH_MTX_LOCK (&pmap->mtx) {
-      TAILQ_REMOVE(&pg->pv_list, pv, page_link);
-      TAILQ_REMOVE(&pmap->pv_list, pv, pmap_link);
-      pte_t *ptep = pmap_lookup_pte(pmap, va);
-      assert(ptep != NULL);
-      pmap_write_pte(pmap, ptep, 0, va);
-    }
-    pool_free(P_PV, pv);
+    pv_free(pv, pg);
+    pte_t *ptep = pmap_lookup_pte(pmap, va);
+    assert(ptep != NULL);
+    pmap_write_pte(pmap, ptep, 0, va);
   }
 }
 
@@ -460,21 +739,26 @@ void pmap_copy_page(vm_page_t *src, vm_page_t *dst) {
   memcpy(PG_DMAP_ADDR(dst), PG_DMAP_ADDR(src), PAGESIZE);
 }
 
+void *pmap_page_kva(vm_page_t *pg) {
+  return PG_DMAP_ADDR(pg);
+}
+
 static void pmap_modify_flags(vm_page_t *pg, pte_t set, pte_t clr) {
-  SCOPED_MTX_LOCK(&pv_list_lock);
+  SCOPED_MTX_LOCK(&pv_table_of(pg->paddr)->lock);
   pv_entry_t *pv;
   TAILQ_FOREACH (pv, &pg->pv_list, page_link) {
     pmap_t *pmap = pv->pmap;
     vaddr_t va = pv->va;
-    WITH_MTX_LOCK (&pmap->mtx) {
-      pte_t *ptep = pmap_lookup_pte(pmap, va);
-      assert(ptep != NULL);
-      pte_t pte = *ptep;
-      pte |= set;
-      pte &= ~clr;
-      *ptep = pte;
-      tlb_invalidate(va, pmap->asid);
-    }
+    pte_t *ptep = pmap_lookup_pte(pmap, va);
+    assert(ptep != NULL);
+    pte_t pte = *ptep;
+    pte |= set;
+    pte &= ~clr;
+    /* Never make a read-only (e.g. copy-on-write) mapping writable. */
+    if (!(pte & ATTR_SW_WRITE))
+      pte |= ATTR_AP_RO;
+    *ptep = pte;
+    tlb_invalidate(va, pmap->asid);
   }
 }
 
@@ -517,7 +801,9 @@ int pmap_emulate_bits(pmap_t *pmap, vaddr_t va, vm_prot_t prot) {
     if (!pmap_extract_nolock(pmap, va, &pa))
       return EFAULT;
 
-    pte_t pte = *pmap_lookup_pte(pmap, va);
+    pte_t *ptep = pmap_lookup_pte(pmap, va);
+    /* Block mappings carry the same software bits as pages. */
+    pte_t pte = ptep ? *ptep : *pmap_lookup_l2(pmap, va);
 
     if ((prot & VM_PROT_READ) && !(pte & ATTR_SW_READ))
       return EACCES;
@@ -532,7 +818,7 @@ int pmap_emulate_bits(pmap_t *pmap, vaddr_t va, vm_prot_t prot) {
   vm_page_t *pg = vm_page_find(pa);
   assert(pg != NULL);
 
-  WITH_MTX_LOCK (&pv_list_lock) {
+  WITH_MTX_LOCK (&pv_table_of(pa)->lock) {
     /* Kernel non-pageable memory? */
     if (TAILQ_EMPTY(&pg->pv_list))
       return EINVAL;
@@ -550,13 +836,14 @@ int pmap_emulate_bits(pmap_t *pmap, vaddr_t va, vm_prot_t prot) {
  */
 
 static void pmap_setup(pmap_t *pmap) {
-  pmap->asid = alloc_asid();
   mtx_init(&pmap->mtx, 0);
   TAILQ_INIT(&pmap->pte_pages);
-  TAILQ_INIT(&pmap->pv_list);
 }
 
 void init_pmap(void) {
+  for (int i = 0; i < PV_LOCKS; i++)
+    mtx_init(&pv_table[i].lock, 0);
+
   pmap_setup(&kernel_pmap);
   kernel_pmap.pde = _kernel_pmap_pde;
 }
@@ -576,17 +863,8 @@ pmap_t *pmap_new(void) {
 void pmap_delete(pmap_t *pmap) {
   assert(pmap != pmap_kernel());
 
-  while (!TAILQ_EMPTY(&pmap->pv_list)) {
-    pv_entry_t *pv = TAILQ_FIRST(&pmap->pv_list);
-    vm_page_t *pg;
-    paddr_t pa;
-    pmap_extract_nolock(pmap, pv->va, &pa);
-    pg = vm_page_find(pa);
-    WITH_MTX_LOCK (&pv_list_lock)
-      TAILQ_REMOVE(&pg->pv_list, pv, page_link);
-    TAILQ_REMOVE(&pmap->pv_list, pv, pmap_link);
-    pool_free(P_PV, pv);
-  }
+  /* Removes all pv entries and frees page tables that became empty. */
+  pmap_remove(pmap, PMAP_USER_BEGIN, PMAP_USER_END);
 
   while (!TAILQ_EMPTY(&pmap->pte_pages)) {
     vm_page_t *pg = TAILQ_FIRST(&pmap->pte_pages);
@@ -594,7 +872,6 @@ void pmap_delete(pmap_t *pmap) {
     vm_page_free(pg);
   }
 
-  free_asid(pmap->asid);
   pool_free(P_PMAP, pmap);
 }
 
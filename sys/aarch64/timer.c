@@ -35,6 +35,15 @@ static int arm_timer_stop(timer_t *tm) {
   return 0;
 }
 
+static int arm_timer_program(timer_t *tm, const bintime_t when) {
+  /* Physical counter measures time since boot. */
+  uint64_t target = bintime_mul(when, tm->tm_frequency).sec;
+  WITH_INTR_DISABLED {
+    WRITE_SPECIALREG(cntp_cval_el0, target);
+  }
+  return 0;
+}
+
 static bintime_t arm_timer_gettime(timer_t *tm) {
   uint64_t count = READ_SPECIALREG(cntpct_el0);
   bintime_t res = bintime_mul(tm->tm_min_period, (uint32_t)count);
@@ -76,6 +85,7 @@ static int arm_timer_attach(device_t *dev) {
     .tm_quality = 0,
     .tm_start = arm_timer_start,
     .tm_stop = arm_timer_stop,
+    .tm_program = arm_timer_program,
     .tm_gettime = arm_timer_gettime,
     .tm_priv = dev,
     .tm_frequency = freq,
@@ -40,3 +40,10 @@ void tlb_invalidate_asid(asid_t asid) {
   __dsb("ish");
   __isb();
 }
+
+void tlb_invalidate_all(void) {
+  __dsb("ishst");
+  __asm__ volatile("TLBI vmalle1is");
+  __dsb("ish");
+  __isb();
+}
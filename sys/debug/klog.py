@@ -9,7 +9,8 @@ from .utils import TextTable, global_var, relpath
 class LogEntry(metaclass=GdbStructMeta):
     __ctype__ = 'struct klog_entry'
     __cast__ = {'kl_tid': int, 'kl_timestamp': BinTime, 'kl_file': cstr,
-                'kl_format': cstr, 'kl_line': int, 'kl_origin': enum}
+                'kl_format': cstr, 'kl_line': int, 'kl_origin': enum,
+                'kl_size': int, 'kl_nparams': int, 'kl_repeated': int}
 
     @property
     def source(self):
@@ -19,7 +20,9 @@ class LogEntry(metaclass=GdbStructMeta):
         msg = self.kl_format.replace('"', '\\"').replace('\n', '\\n')
         # If there is % escaped it is not parameter.
         nparams = msg.count('%') - 2 * msg.count('%%')
-        params = [str(self.kl_params[i]) for i in range(nparams)]
+        # Trailing zero parameters are not stored in the buffer.
+        params = [str(self.kl_params[i]) if i < self.kl_nparams else '0'
+                  for i in range(nparams)]
         printf = 'printf "%s", %s' % (msg, ', '.join(params))
         try:
             # Using gdb printf so we don't need to dereference addresses.
@@ -37,24 +40,35 @@ class LogEntry(metaclass=GdbStructMeta):
 
 
 class LogBuffer(metaclass=GdbStructMeta):
-    __ctype__ = 'struct klog'
-    __cast__ = {'first': int, 'last': int}
+    __ctype__ = 'struct klog_buf'
+    __cast__ = {'head': int, 'tail': int}
 
     @property
     def size(self):
-        return int(self.array.type.range()[1]) + 1
+        return int(self.data.type.range()[1]) + 1
+
+    def entry(self, offset):
+        addr = self.data[offset % self.size].address
+        return LogEntry(addr.cast(LogEntry.__ctype__ + ' *').dereference())
 
     def __iter__(self):
-        first, last = self.first, self.last
-        while first != last:
-            yield LogEntry(self.array[first])
-            first = (first + 1) % self.size
+        # Walk entries the same way klog.c does: the space at the end of
+        # the buffer that is too small for an entry header is skipped and
+        # padding entries (with no format) are ignored.
+        hdrsize = gdb.lookup_type(LogEntry.__ctype__).sizeof
+        offset, head = self.tail, self.head
+        while offset != head:
+            room = self.size - offset % self.size
+            if room < hdrsize:
+                offset += room
+                continue
+            entry = self.entry(offset)
+            if int(entry._obj['kl_format']):
+                yield entry
+            offset += entry.kl_size
 
     def __len__(self):
-        n = self.last - self.first
-        if n < 0:
-            n += self.size
-        return n
+        return sum(1 for _ in self)
 
 
 class Klog(SimpleCommand):
@@ -64,21 +78,31 @@ class Klog(SimpleCommand):
         super().__init__('klog')
 
     def __call__(self, args):
-        klog = LogBuffer(global_var('klog'))
+        bufs = global_var('klog_buf')
+        nbufs = int(bufs.type.range()[1]) + 1
+        klog = [LogBuffer(bufs[i]) for i in range(nbufs)]
         self.dump_info(klog)
         self.dump_messages(klog)
 
     def dump_info(self, klog):
-        table = TextTable(types='ti', align='rr')
-        table.header(['Mask', 'Messages'])
-        table.add_row([hex(klog.mask), len(klog)])
+        table = TextTable(types='tii', align='rrr')
+        table.header(['Mask', 'CPU', 'Messages'])
+        mask = hex(int(global_var('klog_mask')))
+        for cpu, buf in enumerate(klog):
+            table.add_row([mask, cpu, len(buf)])
         print(table)
 
     def dump_messages(self, klog):
-        table = TextTable(types='', align='rrlll')
-        table.header(['Time', 'Id', 'Source', 'System', 'Message'])
+        # Merge entries from all per-CPU buffers by their timestamps.
+        entries = [(entry.kl_timestamp.as_float(), cpu, entry)
+                   for cpu, buf in enumerate(klog) for entry in buf]
+        entries.sort(key=lambda e: (e[0], e[1]))
+        table = TextTable(types='', align='rrrllll')
+        table.header(['Time', 'CPU', 'Id', 'Source', 'System', 'Message',
+                      'Repeated'])
         table.set_precision(6)
-        for entry in klog:
-            table.add_row([entry.kl_timestamp.as_float(), entry.kl_tid,
-                           entry.source, entry.kl_origin, entry.format_msg()])
+        for time, cpu, entry in entries:
+            table.add_row([time, cpu, entry.kl_tid, entry.source,
+                           entry.kl_origin, entry.format_msg(),
+                           entry.kl_repeated])
         print(table)
@@ -147,11 +147,15 @@ class PoolStats(UserCommand):
 
     def __call__(self, args):
         pool_list = TailQueue(global_var('pool_list'), 'pp_link')
-        table = TextTable(types='tiiii', align='lrrrr')
+        table = TextTable(types='tiiiiii', align='lrrrrrr')
         table.header(['description', 'bytes', 'used items', 'max used items',
-                      'total items'])
+                      'total items', 'cache hits', 'cache misses'])
         for pool in sorted(pool_list, key=lambda x: x['pp_desc'].string()):
+            cache = pool['pp_cache']
+            ncpus = cache.type.range()[1] + 1
+            hits = sum(int(cache[i]['pc_nhits']) for i in range(ncpus))
+            misses = sum(int(cache[i]['pc_nmisses']) for i in range(ncpus))
             table.add_row([pool['pp_desc'].string(), int(pool['pp_npages']),
                            int(pool['pp_nused']), int(pool['pp_nmaxused']),
-                           int(pool['pp_ntotal'])])
+                           int(pool['pp_ntotal']), hits, misses])
         print(table)
@@ -8,6 +8,7 @@
 #include <sys/devfs.h>
 #include <sys/queue.h>
 #include <sys/mutex.h>
+#include <sys/event.h>
 #include <sys/devfs.h>
 #include <sys/vnode.h>
 #include <sys/malloc.h>
@@ -95,6 +96,7 @@ typedef struct evdev_client {
   mtx_t ec_lock;                /* serializes access to ring buffer data */
   evdev_clock_id_t ec_clock_id; /* (c) clock used to timestamp events */
   condvar_t ec_buffer_cv;       /* (c) wait here for state change to happen */
+  knlist_t ec_knlist;           /* (c) knotes waiting for events */
   size_t ec_buffer_size;        /* (c) ring buffer capacity */
   size_t ec_buffer_ready;       /* (c) read limit (see note above) */
   size_t ec_buffer_head;        /* (c) read end */
@@ -175,6 +177,7 @@ static void evdev_client_notify(evdev_client_t *client) {
   /* move `ready` pointer and notify readers */
   client->ec_buffer_ready = client->ec_buffer_tail;
   cv_broadcast(&client->ec_buffer_cv);
+  knote(&client->ec_knlist, 0);
 }
 
 /* Pop one event from the client's queue. Assumes the queue is nonempty! */
@@ -440,6 +443,46 @@ static int evdev_ioctl(file_t *f, u_long cmd, void *data) {
   return EINVAL;
 }
 
+static int filt_evdevread(knote_t *kn, long hint) {
+  evdev_client_t *client = kn->kn_obj;
+  size_t head = client->ec_buffer_head;
+  size_t ready = client->ec_buffer_ready;
+
+  if (ready < head)
+    ready += client->ec_buffer_size;
+  kn->kn_data = (ready - head) * sizeof(input_event_t);
+  return kn->kn_data > 0;
+}
+
+static int filt_evdevattach(knote_t *kn) {
+  evdev_client_t *client = kn->kn_obj;
+  knlist_add(&client->ec_knlist, kn);
+  return 0;
+}
+
+static void filt_evdevdetach(knote_t *kn) {
+  evdev_client_t *client = kn->kn_obj;
+  knlist_remove(&client->ec_knlist, kn);
+}
+
+static filterops_t evdev_filtops = {
+  .filt_attach = filt_evdevattach,
+  .filt_detach = filt_evdevdetach,
+  .filt_event = filt_evdevread,
+};
+
+static int evdev_kqfilter(file_t *f, knote_t *kn) {
+  evdev_client_t *client = f->f_data;
+
+  if (kn->kn_filter != EVFILT_READ)
+    return EINVAL;
+
+  kn->kn_filtops = &evdev_filtops;
+  kn->kn_obj = client;
+  kn->kn_objlock = &client->ec_lock;
+  return 0;
+}
+
 static fileops_t evdev_fileops = {
   .fo_read = evdev_read,
   .fo_write = nowrite,
@@ -447,6 +490,7 @@ static fileops_t evdev_fileops = {
   .fo_seek = noseek,
   .fo_stat = default_vnstat,
   .fo_ioctl = evdev_ioctl,
+  .fo_kqfilter = evdev_kqfilter,
 };
 
 static int evdev_open(vnode_t *v, int mode, file_t *fp) {
@@ -465,6 +509,7 @@ static int evdev_open(vnode_t *v, int mode, file_t *fp) {
   client->ec_evdev = evdev;
   mtx_init(&client->ec_lock, 0);
   cv_init(&client->ec_buffer_cv, "ec_buffer_cv");
+  knlist_init(&client->ec_knlist);
 
   WITH_MTX_LOCK (&evdev->ev_lock)
     LIST_INSERT_HEAD(&evdev->ev_clients, client, ec_link);
@@ -496,7 +541,8 @@ static int evdev_close(vnode_t *v, file_t *fp) {
   WITH_MTX_LOCK (&client->ec_evdev->ev_lock)
     evdev_dispose_client(client->ec_evdev, client);
 
-  mtx_destroy(&client->ec_mtx);
+  assert(knlist_empty(&client->ec_knlist));
+  mtx_destroy(&client->ec_lock);
   cv_destroy(&client->ec_buffer_cv);
   kfree(M_DEV, client);
   return 0;
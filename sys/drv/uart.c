@@ -8,7 +8,8 @@ void uart_init(device_t *dev, const char *name, size_t buf_size, void *state,
   uart_state_t *uart = dev->state;
   uart->u_state = state;
 
-  ringbuf_init(&uart->u_rx_buf, kmalloc(M_DEV, buf_size, M_ZERO), buf_size);
+  spsc_ringbuf_init(&uart->u_rx_buf, kmalloc(M_DEV, buf_size, M_ZERO),
+                    buf_size);
   ringbuf_init(&uart->u_tx_buf, kmalloc(M_DEV, buf_size, M_ZERO), buf_size);
 
   spin_init(&uart->u_lock, 0);
@@ -24,7 +25,7 @@ intr_filter_t uart_intr(void *data /* device_t* */) {
   WITH_SPIN_LOCK (&uart->u_lock) {
     /* data ready to be received? */
     if (uart_rx_ready(dev)) {
-      (void)ringbuf_putb(&uart->u_rx_buf, uart_getc(dev));
+      (void)spsc_ringbuf_putb(&uart->u_rx_buf, uart_getc(dev));
       ttd->ttd_flags |= TTY_THREAD_RXRDY;
       cv_signal(&ttd->ttd_cv);
       res = IF_FILTERED;
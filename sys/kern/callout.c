@@ -3,6 +3,7 @@
 #include <sys/libkern.h>
 #include <sys/mimiker.h>
 #include <sys/callout.h>
+#include <sys/pcpu.h>
 #include <sys/spinlock.h>
 #include <sys/sleepq.h>
 #include <sys/thread.h>
@@ -10,10 +11,6 @@
 #include <sys/interrupt.h>
 #include <sys/time.h>
 
-/* Note: If the difference in time between ticks is greater than the number of
-   buckets, some callouts may be called out-of-order! */
-#define CALLOUT_BUCKETS 64
-
 #define callout_is_active(c) ((c)->c_flags & CALLOUT_ACTIVE)
 #define callout_set_active(c) ((c)->c_flags |= CALLOUT_ACTIVE)
 #define callout_clear_active(c) ((c)->c_flags &= ~CALLOUT_ACTIVE)
@@ -27,39 +24,63 @@
 #define callout_clear_stopped(c) ((c)->c_flags &= ~CALLOUT_STOPPED)
 
 /*
-  Every event is inside one of CALLOUT_BUCKETS buckets.
-  The buckets is a cyclic list, but we implement it as an array,
-  allowing us to access random elements in constant time.
-*/
+ * Pending callouts are kept in a hierarchical timing wheel. Level 0 has a slot
+ * for each of the next WHEEL_SIZE ticks. Each slot of level `n` covers
+ * WHEEL_SIZE^n ticks, hence the wheel spans WHEEL_SIZE^WHEEL_LEVELS ticks.
+ * Callouts scheduled even further are put into the last slot they can reach.
+ *
+ * Ticks are processed one by one, so callouts are always run in order of their
+ * expiration time, even if clock interrupts were skipped. Whenever the level 0
+ * wheel turns around, callouts from the current slot of level 1 are cascaded,
+ * i.e. inserted again, so they land in level 0. Same goes for higher levels.
+ *
+ * Each CPU has its own wheel and callout thread. A callout is put into
+ * the wheel of the CPU it's been scheduled on.
+ */
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS 4
+#define WHEEL_SPAN (1U << (WHEEL_BITS * WHEEL_LEVELS))
 
 typedef TAILQ_HEAD(callout_list, callout) callout_list_t;
 
-static struct {
-  callout_list_t heads[CALLOUT_BUCKETS];
-  /* Stores the value of the argument callout_process was previously
-     called with. All callouts up to this timestamp have already been
-     processed. */
-  systime_t last;
+typedef struct callout_cpu {
   spin_t lock;
-} ci;
+  callout_list_t wheel[WHEEL_LEVELS][WHEEL_SIZE];
+  /* All ticks up to `last` have already been processed. */
+  systime_t last;
+  /* Number of callouts in the wheel. */
+  unsigned pending;
+  /* Expired callouts waiting to be executed by callout thread. */
+  callout_list_t delegated;
+  thread_t *thread;
+} callout_cpu_t;
+
+static callout_cpu_t callout_cpu[MAXCPU];
 
-static inline callout_list_t *ci_list(int i) {
-  return &ci.heads[i];
+static inline callout_list_t *cc_slot(callout_cpu_t *cc, unsigned index) {
+  return &cc->wheel[index / WHEEL_SIZE][index % WHEEL_SIZE];
 }
 
-static callout_list_t delegated;
+/* Index of slot of level `lvl` that corresponds to tick `tm`. */
+static inline unsigned wheel_index(systime_t tm, unsigned lvl) {
+  return (tm >> (lvl * WHEEL_BITS)) & WHEEL_MASK;
+}
 
 static void callout_thread(void *arg) {
+  callout_cpu_t *cc = arg;
+
   while (true) {
     callout_t *elem;
 
     WITH_INTR_DISABLED {
-      while (TAILQ_EMPTY(&delegated)) {
-        sleepq_wait(&delegated, NULL);
+      while (TAILQ_EMPTY(&cc->delegated)) {
+        sleepq_wait(&cc->delegated, NULL);
       }
 
-      elem = TAILQ_FIRST(&delegated);
-      TAILQ_REMOVE(&delegated, elem, c_link);
+      elem = TAILQ_FIRST(&cc->delegated);
+      TAILQ_REMOVE(&cc->delegated, elem, c_link);
     }
 
     assert(callout_is_active(elem));
@@ -68,7 +89,7 @@ static void callout_thread(void *arg) {
     /* Execute callout's function. */
     elem->c_func(elem->c_arg);
 
-    WITH_SPIN_LOCK (&ci.lock) {
+    WITH_SPIN_LOCK (&cc->lock) {
       callout_clear_active(elem);
       /* Only notify waiters if the callout isn't already pending
        * due to a reschedule. */
@@ -79,18 +100,23 @@ static void callout_thread(void *arg) {
 }
 
 void init_callout(void) {
-  bzero(&ci, sizeof(ci));
+  unsigned i;
+
+  CPU_FOREACH (i) {
+    callout_cpu_t *cc = &callout_cpu[i];
 
-  spin_init(&ci.lock, 0);
+    bzero(cc, sizeof(callout_cpu_t));
+    spin_init(&cc->lock, 0);
 
-  for (int i = 0; i < CALLOUT_BUCKETS; i++)
-    TAILQ_INIT(ci_list(i));
+    for (int lvl = 0; lvl < WHEEL_LEVELS; lvl++)
+      for (int j = 0; j < WHEEL_SIZE; j++)
+        TAILQ_INIT(&cc->wheel[lvl][j]);
 
-  TAILQ_INIT(&delegated);
+    TAILQ_INIT(&cc->delegated);
 
-  thread_t *td =
-    thread_create("callout", callout_thread, NULL, prio_kthread(0));
-  sched_add(td);
+    cc->thread = thread_create("callout", callout_thread, cc, prio_kthread(0));
+    sched_add(cc->thread);
+  }
 }
 
 void callout_setup(callout_t *co, timeout_t fn, void *arg) {
@@ -99,23 +125,57 @@ void callout_setup(callout_t *co, timeout_t fn, void *arg) {
   co->c_arg = arg;
 }
 
+/* Put a callout into the slot that will be processed (or cascaded) exactly at
+ * its expiration time. Callouts that have already expired will be run when
+ * the next tick is processed. */
+static void wheel_insert(callout_cpu_t *cc, callout_t *co) {
+  systime_t base = cc->last + 1;
+  systime_t delta = co->c_time - base;
+
+  /* Expiration time is in the past. */
+  if ((int32_t)delta < 0)
+    delta = 0;
+  /* Expiration time is too far, it'll be cascaded again. */
+  if (delta >= WHEEL_SPAN)
+    delta = WHEEL_SPAN - 1;
+
+  systime_t tm = base + delta;
+  unsigned lvl = 0;
+
+  while (delta >= WHEEL_SIZE) {
+    delta >>= WHEEL_BITS;
+    lvl++;
+  }
+
+  unsigned slot = wheel_index(tm, lvl);
+
+  co->c_index = lvl * WHEEL_SIZE + slot;
+  TAILQ_INSERT_TAIL(&cc->wheel[lvl][slot], co, c_link);
+}
+
 static void _callout_schedule(callout_t *co, systime_t tm) {
-  assert(spin_owned(&ci.lock));
+  callout_cpu_t *cc = &callout_cpu[co->c_cpu];
+
+  assert(spin_owned(&cc->lock));
   assert(!callout_is_pending(co));
 
   callout_set_pending(co);
 
-  int idx = tm % CALLOUT_BUCKETS;
-
   co->c_time = tm;
-  co->c_index = idx;
+  wheel_insert(cc, co);
+  cc->pending++;
 
   klog("Add callout {%p} with wakeup at %ld.", co, tm);
-  TAILQ_INSERT_TAIL(ci_list(idx), co, c_link);
+
+  /* The clock may not be ticking if the CPU is idle. */
+  clock_resume();
 }
 
 void callout_schedule_abs(callout_t *co, systime_t tm) {
-  SCOPED_SPIN_LOCK(&ci.lock);
+  /* Callouts go into the wheel of current CPU. */
+  co->c_cpu = PCPU_GET(cpuid);
+
+  SCOPED_SPIN_LOCK(&callout_cpu[co->c_cpu].lock);
   assert(!callout_is_active(co));
   callout_clear_stopped(co);
 
@@ -123,15 +183,11 @@ void callout_schedule_abs(callout_t *co, systime_t tm) {
 }
 
 void callout_schedule(callout_t *co, systime_t tm) {
-  SCOPED_SPIN_LOCK(&ci.lock);
-  assert(!callout_is_active(co));
-  callout_clear_stopped(co);
-
-  _callout_schedule(co, getsystime() + tm);
+  callout_schedule_abs(co, getsystime() + tm);
 }
 
 bool callout_reschedule(callout_t *c, systime_t tm) {
-  SCOPED_SPIN_LOCK(&ci.lock);
+  SCOPED_SPIN_LOCK(&callout_cpu[c->c_cpu].lock);
   assert(callout_is_active(c));
   if (callout_is_stopped(c))
     return false;
@@ -140,7 +196,9 @@ bool callout_reschedule(callout_t *c, systime_t tm) {
 }
 
 bool callout_stop(callout_t *handle) {
-  SCOPED_SPIN_LOCK(&ci.lock);
+  callout_cpu_t *cc = &callout_cpu[handle->c_cpu];
+
+  SCOPED_SPIN_LOCK(&cc->lock);
 
   klog("Remove callout {%p} at %ld.", handle, handle->c_time);
 
@@ -148,7 +206,8 @@ bool callout_stop(callout_t *handle) {
 
   if (callout_is_pending(handle)) {
     callout_clear_pending(handle);
-    TAILQ_REMOVE(ci_list(handle->c_index), handle, c_link);
+    TAILQ_REMOVE(cc_slot(cc, handle->c_index), handle, c_link);
+    cc->pending--;
     /* A callout may be observed to be both active and pending if it rescheduled
      * itself but hasn't finished executing yet.
      * If that's the case, we must make the caller wait for its completion in
@@ -158,52 +217,97 @@ bool callout_stop(callout_t *handle) {
   return !callout_is_active(handle);
 }
 
+/* Move callouts from given slot of higher level into lower levels. */
+static void wheel_cascade(callout_cpu_t *cc, unsigned lvl, unsigned slot) {
+  callout_list_t *head = &cc->wheel[lvl][slot];
+  callout_list_t list;
+  callout_t *elem;
+
+  TAILQ_INIT(&list);
+  TAILQ_CONCAT(&list, head, c_link);
+
+  while ((elem = TAILQ_FIRST(&list))) {
+    TAILQ_REMOVE(&list, elem, c_link);
+    wheel_insert(cc, elem);
+  }
+}
+
+/* Process single tick `tm`, i.e. cascade callouts if a wheel has turned around
+ * and delegate those which expire at `tm` to callout thread. */
+static void wheel_process(callout_cpu_t *cc, systime_t tm) {
+  cc->last = tm - 1;
+
+  /* Lower level wheel has just turned around. */
+  for (unsigned lvl = 1; lvl < WHEEL_LEVELS; lvl++) {
+    if (wheel_index(tm, lvl - 1))
+      break;
+    wheel_cascade(cc, lvl, wheel_index(tm, lvl));
+  }
+
+  callout_list_t *head = &cc->wheel[0][wheel_index(tm, 0)];
+  callout_t *elem;
+
+  while ((elem = TAILQ_FIRST(head))) {
+    assert((int32_t)(elem->c_time - tm) <= 0);
+    callout_set_active(elem);
+    callout_clear_pending(elem);
+    TAILQ_REMOVE(head, elem, c_link);
+    cc->pending--;
+    /* Attach elem to callout thread's queue. */
+    TAILQ_INSERT_TAIL(&cc->delegated, elem, c_link);
+  }
+
+  cc->last = tm;
+}
+
 /*
- * Process all timeouted callouts from queues between last position and
- * current position and delegate them to callout thread.
+ * Process all ticks between last processed tick and current time and delegate
+ * expired callouts to callout thread.
  */
 void callout_process(systime_t time) {
-  unsigned int last_bucket;
-  unsigned int current_bucket = ci.last % CALLOUT_BUCKETS;
-
-  if (time - ci.last > CALLOUT_BUCKETS) {
-    /* Process all buckets */
-    last_bucket = (ci.last - 1) % CALLOUT_BUCKETS;
-  } else {
-    /* Process only buckets in time range ci.last to time */
-    last_bucket = time % CALLOUT_BUCKETS;
-  }
+  callout_cpu_t *cc = &callout_cpu[PCPU_GET(cpuid)];
 
   /* We are in kernel's bottom half. */
   assert(intr_disabled());
 
-  while (true) {
-    callout_list_t *head = ci_list(current_bucket);
-    callout_t *elem, *next;
-
-    /* Detach triggered callouts from ci_list queue. */
-    TAILQ_FOREACH_SAFE (elem, head, c_link, next) {
-      if (elem->c_time <= time) {
-        callout_set_active(elem);
-        callout_clear_pending(elem);
-        TAILQ_REMOVE(head, elem, c_link);
-        /* Attach elem to callout thread's queue. */
-        TAILQ_INSERT_TAIL(&delegated, elem, c_link);
+  WITH_SPIN_LOCK (&cc->lock) {
+    while ((int32_t)(time - cc->last) > 0) {
+      /* Nothing to do in the wheel, so we can skip the ticks. */
+      if (cc->pending == 0) {
+        cc->last = time;
+        break;
       }
+      wheel_process(cc, cc->last + 1);
     }
+  }
 
-    if (current_bucket == last_bucket)
-      break;
-
-    current_bucket = (current_bucket + 1) % CALLOUT_BUCKETS;
+  /* Wake callout thread. */
+  if (!TAILQ_EMPTY(&cc->delegated)) {
+    sleepq_signal(&cc->delegated);
   }
+}
 
-  ci.last = time;
+systime_t callout_next(systime_t limit) {
+  callout_cpu_t *cc = &callout_cpu[PCPU_GET(cpuid)];
 
-  /* Wake callout thread. */
-  if (!TAILQ_EMPTY(&delegated)) {
-    sleepq_signal(&delegated);
+  SCOPED_SPIN_LOCK(&cc->lock);
+
+  if (cc->pending == 0)
+    return limit;
+
+  /* Look for the first tick that has anything to process. */
+  for (systime_t tm = cc->last + 1; (int32_t)(limit - tm) > 0; tm++) {
+    if (!TAILQ_EMPTY(&cc->wheel[0][wheel_index(tm, 0)]))
+      return tm;
+    for (unsigned lvl = 1; lvl < WHEEL_LEVELS; lvl++) {
+      if (wheel_index(tm, lvl - 1))
+        break;
+      if (!TAILQ_EMPTY(&cc->wheel[lvl][wheel_index(tm, lvl)]))
+        return tm;
+    }
   }
+
+  return limit;
 }
 
 bool callout_drain(callout_t *handle) {
@@ -3,28 +3,85 @@
 #include <sys/sched.h>
 #include <sys/mimiker.h>
 #include <sys/klog.h>
+#include <sys/interrupt.h>
 #include <sys/timer.h>
 #include <sys/kgprof.h>
+#include <sys/kprof.h>
+
+/* Maximum number of ticks the clock can skip while CPU is idle. */
+#define CLOCK_IDLE_MAX CLK_TCK
 
 static systime_t now = 0;
 static timer_t *clock = NULL;
 
+static bintime_t st2bt(systime_t st) {
+  return bintime_mul(HZ2BT(CLK_TCK), st);
+}
+
+/*
+ * Tickless idle: when idle thread runs and no callout is due soon, the clock
+ * timer is programmed to trigger when the earliest callout expires, instead of
+ * on every tick. Periodic ticks are resumed as soon as the timer triggers,
+ * a thread is about to run, or a new callout is scheduled.
+ */
+static bool clock_skipping = false;
+
 systime_t getsystime(void) {
+  /* `now` is not updated when ticks are skipped. */
+  if (clock_skipping) {
+    bintime_t bin = binuptime();
+    return bt2st(&bin);
+  }
   return now;
 }
 
 static void stat_clock(void) {
   kgprof_tick();
+  kprof_tick();
 }
 
 static void clock_cb(timer_t *tm, void *arg) {
   bintime_t bin = binuptime();
   now = bt2st(&bin);
+  /* Make sure the next event happens one tick from now, even if this one came
+   * earlier than programmed. */
+  if (clock_skipping) {
+    clock_skipping = false;
+    (void)tm_program(clock, st2bt(now + 1));
+  }
   stat_clock();
   callout_process(now);
   sched_clock();
 }
 
+void clock_idle(void) {
+  SCOPED_INTR_DISABLED();
+
+  if (clock == NULL || clock_skipping)
+    return;
+
+  systime_t next = callout_next(now + CLOCK_IDLE_MAX);
+  if ((int32_t)(next - now) <= 1)
+    return;
+
+  if (tm_program(clock, st2bt(next)))
+    return;
+
+  clock_skipping = true;
+}
+
+void clock_resume(void) {
+  SCOPED_INTR_DISABLED();
+
+  if (!clock_skipping)
+    return;
+
+  bintime_t bin = binuptime();
+  now = bt2st(&bin);
+  clock_skipping = false;
+  (void)tm_program(clock, st2bt(now + 1));
+}
+
 void init_clock(void) {
   clock = tm_reserve(NULL, TMF_PERIODIC);
   if (clock == NULL)
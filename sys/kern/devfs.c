@@ -123,6 +123,7 @@ static int devfs_add_entry(devfs_node_t *parent, const char *name, int mode,
   TAILQ_INSERT_TAIL(&parent->dn_children, dn, dn_link);
   if (mode & S_IFDIR)
     parent->dn_nlinks++;
+  vfs_cache_purge_name(parent->dn_vnode, &COMPONENTNAME(name));
   *dnp = dn;
 
   return 0;
@@ -526,6 +527,7 @@ int devfs_unlink(devfs_node_t *dn) {
   TAILQ_REMOVE(&parent->dn_children, dn, dn_link);
   if (dn->dn_device.mode & S_IFDIR)
     parent->dn_nlinks--;
+  vfs_cache_purge_name(parent->dn_vnode, &COMPONENTNAME(dn->dn_name));
   vnode_drop(dn->dn_vnode);
   return 0;
 }
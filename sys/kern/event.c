@@ -1,15 +1,529 @@
+#define KL_LOG KL_FILE
+#include <sys/klog.h>
+#include <sys/mimiker.h>
 #include <sys/event.h>
 #include <sys/errno.h>
+#include <sys/mutex.h>
+#include <sys/condvar.h>
+#include <sys/callout.h>
+#include <sys/malloc.h>
+#include <sys/pool.h>
+#include <sys/file.h>
+#include <sys/filedesc.h>
+#include <sys/fcntl.h>
+#include <sys/proc.h>
+#include <sys/time.h>
+
+/* Number of buckets in knote hash table. Must be a power of two. */
+#define KQ_NBUCKETS 64
+
+typedef SLIST_HEAD(, knote) knhash_t;
+typedef TAILQ_HEAD(, knote) knqueue_t;
+
+/*
+ * Field locking:
+ *
+ * (m) - kq_mtx
+ * (q) - kq_lock
+ */
+struct kqueue {
+  /* Serializes registration, removal and collection of events. It's held
+   * while calling filter operations, hence it's ordered before object locks. */
+  mtx_t kq_mtx;
+  /* Protects the queue of pending events. Taken by `knote` with object lock
+   * held, so it's the innermost lock. */
+  mtx_t kq_lock;
+  condvar_t kq_cv;                 /* (q) wait here for pending events */
+  knqueue_t kq_pending;            /* (q) activated knotes */
+  unsigned kq_count;               /* (m) number of registered knotes */
+  knhash_t kq_knhash[KQ_NBUCKETS]; /* (m) knotes by (ident, filter) */
+};
+
+static KMALLOC_DEFINE(M_KQUEUE, "kqueue");
+static POOL_DEFINE(P_KNOTE, "knote", sizeof(knote_t));
+
+static inline knhash_t *kq_bucket(kqueue_t *kq, uintptr_t ident,
+                                  uint32_t filter) {
+  return &kq->kq_knhash[(ident * EVFILT_SYSCOUNT + filter) &
+                        (KQ_NBUCKETS - 1)];
+}
+
+static knote_t *kqueue_find(kqueue_t *kq, uintptr_t ident, uint32_t filter) {
+  assert(mtx_owned(&kq->kq_mtx));
+
+  knote_t *kn;
+  SLIST_FOREACH(kn, kq_bucket(kq, ident, filter), kn_hashlink) {
+    if (kn->kn_id == ident && kn->kn_filter == filter)
+      return kn;
+  }
+  return NULL;
+}
+
+/* Put a knote on the queue of pending events and wake up the waiter.
+ * Must be called with the object lock held. */
+static void knote_activate(knote_t *kn) {
+  assert(mtx_owned(kn->kn_objlock));
+
+  kqueue_t *kq = kn->kn_kq;
+
+  WITH_MTX_LOCK (&kq->kq_lock) {
+    if (kn->kn_status & KN_QUEUED)
+      break;
+    kn->kn_status |= KN_QUEUED;
+    TAILQ_INSERT_TAIL(&kq->kq_pending, kn, kn_penlink);
+    cv_broadcast(&kq->kq_cv);
+  }
+}
+
+/* Detach a knote from the monitored object and release all its resources. */
+static void knote_drop(knote_t *kn) {
+  kqueue_t *kq = kn->kn_kq;
+
+  assert(mtx_owned(&kq->kq_mtx));
+
+  /* Once detached the object won't activate the knote anymore. */
+  kn->kn_filtops->filt_detach(kn);
+
+  WITH_MTX_LOCK (&kq->kq_lock) {
+    if (kn->kn_status & KN_QUEUED)
+      TAILQ_REMOVE(&kq->kq_pending, kn, kn_penlink);
+  }
+
+  SLIST_REMOVE(kq_bucket(kq, kn->kn_id, kn->kn_filter), kn, knote,
+               kn_hashlink);
+  kq->kq_count--;
+
+  if (kn->kn_file)
+    file_drop(kn->kn_file);
+  pool_free(P_KNOTE, kn);
+}
+
+void knlist_add(knlist_t *knlist, knote_t *kn) {
+  SCOPED_MTX_LOCK(kn->kn_objlock);
+  LIST_INSERT_HEAD(knlist, kn, kn_objlink);
+}
+
+void knlist_remove(knlist_t *knlist, knote_t *kn) {
+  SCOPED_MTX_LOCK(kn->kn_objlock);
+  LIST_REMOVE(kn, kn_objlink);
+}
+
+void knote(knlist_t *knlist, long hint) {
+  knote_t *kn;
+
+  LIST_FOREACH(kn, knlist, kn_objlink) {
+    if (kn->kn_filtops->filt_event(kn, hint))
+      knote_activate(kn);
+  }
+}
+
+/*
+ * EVFILT_TIMER: periodic timer driven by a callout.
+ * `kn_data` counts expirations since the event was last reported.
+ */
+
+typedef struct kntimer {
+  callout_t kt_callout;
+  mtx_t kt_lock;
+  systime_t kt_period; /* in ticks */
+} kntimer_t;
+
+static void filt_timerexpire(void *arg) {
+  knote_t *kn = arg;
+  kntimer_t *kt = kn->kn_hook;
+
+  WITH_MTX_LOCK (&kt->kt_lock) {
+    kn->kn_data++;
+    knote_activate(kn);
+  }
+
+  if (!(kn->kn_flags & EV_ONESHOT))
+    callout_reschedule(&kt->kt_callout,
+                       kt->kt_callout.c_time + kt->kt_period);
+}
+
+static int filt_timerattach(knote_t *kn) {
+  kntimer_t *kt = kn->kn_hook;
+  callout_schedule(&kt->kt_callout, kt->kt_period);
+  return 0;
+}
+
+static void filt_timerdetach(knote_t *kn) {
+  kntimer_t *kt = kn->kn_hook;
+
+  if (!callout_stop(&kt->kt_callout))
+    callout_drain(&kt->kt_callout);
+
+  mtx_destroy(&kt->kt_lock);
+  kfree(M_KQUEUE, kt);
+}
+
+static int filt_timer(knote_t *kn, long hint) {
+  return kn->kn_data > 0;
+}
+
+static filterops_t timer_filtops = {
+  .filt_attach = filt_timerattach,
+  .filt_detach = filt_timerdetach,
+  .filt_event = filt_timer,
+};
+
+static int kqueue_timer_setup(knote_t *kn) {
+  if (kn->kn_data <= 0)
+    return EINVAL;
+
+  /* One tick is one millisecond. */
+  systime_t period = kn->kn_data * CLK_TCK / 1000;
+
+  kntimer_t *kt = kmalloc(M_KQUEUE, sizeof(kntimer_t), M_WAITOK | M_ZERO);
+  mtx_init(&kt->kt_lock, 0);
+  callout_setup(&kt->kt_callout, filt_timerexpire, kn);
+  kt->kt_period = max(period, (systime_t)1);
+
+  /* Timer events are always edge-triggered. */
+  kn->kn_flags |= EV_CLEAR;
+  kn->kn_data = 0;
+  kn->kn_filtops = &timer_filtops;
+  kn->kn_obj = kt;
+  kn->kn_hook = kt;
+  kn->kn_objlock = &kt->kt_lock;
+  return 0;
+}
+
+/*
+ * Event registration.
+ */
+
+static int kqueue_add(kqueue_t *kq, kevent_t *kev, file_t *f) {
+  knote_t *kn = kqueue_find(kq, kev->ident, kev->filter);
+  int error;
+
+  if (kn != NULL) {
+    /* Modifying a registered event only updates user data. */
+    WITH_MTX_LOCK (kn->kn_objlock)
+      kn->kn_kevent.udata = kev->udata;
+  } else {
+    kn = pool_alloc(P_KNOTE, M_ZERO);
+    kn->kn_kq = kq;
+    kn->kn_kevent = *kev;
+    kn->kn_flags &= EV_ONESHOT | EV_CLEAR;
+
+    if (f == NULL) {
+      error = kqueue_timer_setup(kn);
+    } else if (f->f_ops->fo_kqfilter == NULL) {
+      error = EINVAL;
+    } else {
+      error = f->f_ops->fo_kqfilter(f, kn);
+    }
+
+    if (!error)
+      error = kn->kn_filtops->filt_attach(kn);
+
+    if (error) {
+      pool_free(P_KNOTE, kn);
+      return error;
+    }
+
+    if (f != NULL) {
+      file_hold(f);
+      kn->kn_file = f;
+    }
+
+    SLIST_INSERT_HEAD(kq_bucket(kq, kn->kn_id, kn->kn_filter), kn,
+                      kn_hashlink);
+    kq->kq_count++;
+  }
+
+  /* The event may have already happened. */
+  WITH_MTX_LOCK (kn->kn_objlock) {
+    if (kn->kn_filtops->filt_event(kn, 0))
+      knote_activate(kn);
+  }
+
+  return 0;
+}
+
+static int kqueue_register(proc_t *p, kqueue_t *kq, kevent_t *kev) {
+  file_t *f = NULL;
+  int error = 0;
+
+  if (kev->filter >= EVFILT_SYSCOUNT)
+    return EINVAL;
+
+  /* Descriptor lookup has to be done before acquiring `kq_mtx`, since closing
+   * a descriptor calls `kqueue_fdclose` with the descriptor table locked. */
+  if (kev->filter != EVFILT_TIMER) {
+    if ((error = fdtab_get_file(p->p_fdtable, kev->ident, 0, &f)))
+      return error;
+  }
+
+  WITH_MTX_LOCK (&kq->kq_mtx) {
+    if (kev->flags & EV_DELETE) {
+      knote_t *kn = kqueue_find(kq, kev->ident, kev->filter);
+      if (kn == NULL) {
+        error = ENOENT;
+      } else {
+        knote_drop(kn);
+      }
+    } else if (kev->flags & EV_ADD) {
+      error = kqueue_add(kq, kev, f);
+    } else {
+      error = EINVAL;
+    }
+  }
+
+  if (f)
+    file_drop(f);
+
+  return error;
+}
+
+void kqueue_fdclose(file_t *kqf, int fd) {
+  assert(kqf->f_type == FT_KQUEUE);
+
+  kqueue_t *kq = kqf->f_data;
+
+  SCOPED_MTX_LOCK(&kq->kq_mtx);
+
+  if (kq->kq_count == 0)
+    return;
+
+  for (uint32_t filter = 0; filter < EVFILT_SYSCOUNT; filter++) {
+    knote_t *kn = kqueue_find(kq, fd, filter);
+    if (kn != NULL && kn->kn_file != NULL)
+      knote_drop(kn);
+  }
+}
+
+/*
+ * Event collection.
+ */
+
+/* Move up to `nevents` pending events to `eventlist`. Level-triggered events
+ * that are still active are put back on the queue of pending events. */
+static int kqueue_collect(kqueue_t *kq, kevent_t *eventlist, size_t nevents) {
+  assert(mtx_owned(&kq->kq_mtx));
+
+  knote_t marker = {.kn_status = KN_MARKER};
+  size_t n = 0;
+
+  mtx_lock(&kq->kq_lock);
+
+  /* Knotes reactivated during the scan will land behind the marker. */
+  TAILQ_INSERT_TAIL(&kq->kq_pending, &marker, kn_penlink);
+
+  while (n < nevents) {
+    knote_t *kn = TAILQ_FIRST(&kq->kq_pending);
+    if (kn == &marker)
+      break;
+
+    TAILQ_REMOVE(&kq->kq_pending, kn, kn_penlink);
+    kn->kn_status &= ~KN_QUEUED;
+    mtx_unlock(&kq->kq_lock);
+
+    bool active, requeue = false;
+
+    WITH_MTX_LOCK (kn->kn_objlock) {
+      /* Check whether the event is still there. */
+      active = kn->kn_filtops->filt_event(kn, 0);
+      if (!active)
+        break;
+      eventlist[n++] = kn->kn_kevent;
+      if (kn->kn_flags & EV_CLEAR) {
+        kn->kn_data = 0;
+        kn->kn_fflags = 0;
+      } else {
+        requeue = !(kn->kn_flags & EV_ONESHOT);
+      }
+    }
+
+    if (active && (kn->kn_flags & EV_ONESHOT))
+      knote_drop(kn);
+
+    mtx_lock(&kq->kq_lock);
+
+    if (requeue && !(kn->kn_status & KN_QUEUED)) {
+      kn->kn_status |= KN_QUEUED;
+      TAILQ_INSERT_TAIL(&kq->kq_pending, kn, kn_penlink);
+    }
+  }
+
+  TAILQ_REMOVE(&kq->kq_pending, &marker, kn_penlink);
+  mtx_unlock(&kq->kq_lock);
+
+  return n;
+}
+
+static int kqueue_scan(kqueue_t *kq, kevent_t *eventlist, size_t nevents,
+                       timespec_t *timeout, int *retval) {
+  systime_t deadline = 0, now = 0;
+  int error = 0, n = 0;
+
+  if (nevents == 0)
+    goto done;
+
+  if (timeout != NULL) {
+    if (timeout->tv_sec < 0 || timeout->tv_nsec < 0 ||
+        timeout->tv_nsec >= 1000000000)
+      return EINVAL;
+    /* Zero timeout means we only poll for events. */
+    if (timespecisset(timeout)) {
+      systime_t timo = ts2hz(timeout);
+      now = getsystime();
+      deadline = (timo > UINT_MAX - now) ? UINT_MAX : now + timo;
+    }
+  }
+
+  while (true) {
+    WITH_MTX_LOCK (&kq->kq_mtx)
+      n = kqueue_collect(kq, eventlist, nevents);
+
+    if (n > 0)
+      break;
+
+    if (timeout != NULL) {
+      if (deadline == 0)
+        break;
+      if ((now = getsystime()) >= deadline)
+        break;
+    }
+
+    WITH_MTX_LOCK (&kq->kq_lock) {
+      if (!TAILQ_EMPTY(&kq->kq_pending))
+        break;
+      error = cv_wait_timed(&kq->kq_cv, &kq->kq_lock,
+                            timeout ? deadline - now : 0);
+    }
+
+    if (error == ETIMEDOUT) {
+      error = 0;
+      break;
+    }
+    if (error)
+      break;
+  }
+
+done:
+  *retval = n;
+  return error;
+}
+
+/*
+ * Kqueue file operations.
+ */
+
+static int kqueue_read(file_t *f, uio_t *uio) {
+  return EOPNOTSUPP;
+}
+
+static int kqueue_close(file_t *f) {
+  kqueue_t *kq = f->f_data;
+
+  WITH_MTX_LOCK (&kq->kq_mtx) {
+    for (int i = 0; i < KQ_NBUCKETS; i++) {
+      knote_t *kn;
+      while ((kn = SLIST_FIRST(&kq->kq_knhash[i])))
+        knote_drop(kn);
+    }
+  }
+
+  assert(kq->kq_count == 0);
+  assert(TAILQ_EMPTY(&kq->kq_pending));
+
+  mtx_destroy(&kq->kq_mtx);
+  mtx_destroy(&kq->kq_lock);
+  cv_destroy(&kq->kq_cv);
+  kfree(M_KQUEUE, kq);
+  return 0;
+}
+
+static int kqueue_stat(file_t *f, stat_t *sb) {
+  return EOPNOTSUPP;
+}
+
+static int kqueue_ioctl(file_t *f, u_long cmd, void *data) {
+  return EOPNOTSUPP;
+}
+
+static fileops_t kqueueops = {
+  .fo_read = kqueue_read,
+  .fo_write = nowrite,
+  .fo_close = kqueue_close,
+  .fo_seek = noseek,
+  .fo_stat = kqueue_stat,
+  .fo_ioctl = kqueue_ioctl,
+};
 
 int do_kqueue1(proc_t *p, int flags, int *fd) {
-  return ENOTSUP;
+  int error;
+
+  if (flags & ~O_CLOEXEC)
+    return EINVAL;
+
+  kqueue_t *kq = kmalloc(M_KQUEUE, sizeof(kqueue_t), M_WAITOK | M_ZERO);
+  mtx_init(&kq->kq_mtx, 0);
+  mtx_init(&kq->kq_lock, 0);
+  cv_init(&kq->kq_cv, "kqueue");
+  TAILQ_INIT(&kq->kq_pending);
+  for (int i = 0; i < KQ_NBUCKETS; i++)
+    SLIST_INIT(&kq->kq_knhash[i]);
+
+  file_t *f = file_alloc();
+  f->f_data = kq;
+  f->f_ops = &kqueueops;
+  f->f_type = FT_KQUEUE;
+  f->f_flags = FF_READ;
+
+  /* Dropping the file reference will free the kqueue on error. */
+  file_hold(f);
+
+  if (!(error = fdtab_install_file(p->p_fdtable, f, 0, fd))) {
+    if ((error = fd_set_cloexec(p->p_fdtable, *fd, flags & O_CLOEXEC)))
+      fdtab_close_fd(p->p_fdtable, *fd);
+  }
+
+  file_drop(f);
+  return error;
 }
 
-int do_kevent(proc_t *p, int kq, kevent_t *changelist, size_t nchanges,
+int do_kevent(proc_t *p, int fd, kevent_t *changelist, size_t nchanges,
               kevent_t *eventlist, size_t nevents, timespec_t *timeout,
               int *retval) {
-  return ENOTSUP;
-}
+  file_t *f;
+  int error;
+
+  if ((error = fdtab_get_file(p->p_fdtable, fd, 0, &f)))
+    return error;
+
+  if (f->f_type != FT_KQUEUE) {
+    error = EBADF;
+    goto end;
+  }
+
+  kqueue_t *kq = f->f_data;
+  size_t nerrors = 0;
+
+  for (size_t i = 0; i < nchanges; i++) {
+    kevent_t *kev = &changelist[i];
+    if (!(error = kqueue_register(p, kq, kev)))
+      continue;
+    /* Report the error in the event list if there's room for it. */
+    if (nerrors == nevents)
+      goto end;
+    kev->flags = EV_ERROR;
+    kev->data = error;
+    eventlist[nerrors++] = *kev;
+    error = 0;
+  }
+
+  if (nerrors > 0) {
+    *retval = nerrors;
+    goto end;
+  }
+
+  error = kqueue_scan(kq, eventlist, nevents, timeout, retval);
 
-void knote(knlist_t *list, long hint) {
+end:
+  file_drop(f);
+  return error;
 }
@@ -3,6 +3,7 @@
 #include <sys/sysent.h>
 #include <sys/siginfo.h>
 #include <sys/exception.h>
+#include <sys/kprof.h>
 #include <sys/thread.h>
 #include <sys/sched.h>
 #include <sys/proc.h>
@@ -60,6 +61,10 @@ void on_user_exc_leave(mcontext_t *ctx, syscall_result_t *result) {
   int sig = 0;
   ksiginfo_t ksi;
 
+  /* Profiler has sampled the thread and needs its user-space call stack. */
+  if (td->td_flags & TDF_NEEDPROF)
+    kprof_user_leave(ctx);
+
   /* XXX we need to know if there's a signal to be delivered in order to call
    * set_syscall_retval(), but we also need to call set_syscall_retval() before
    * sig_post(), as set_syscall_retval() assumes the context has not been
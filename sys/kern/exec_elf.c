@@ -5,6 +5,8 @@
 #include <sys/libkern.h>
 #include <sys/vm_map.h>
 #include <sys/vm_object.h>
+#include <sys/vm_physmem.h>
+#include <sys/pmap.h>
 #include <sys/malloc.h>
 #include <sys/errno.h>
 #include <sys/vnode.h>
@@ -83,6 +85,51 @@ int exec_elf_inspect(vnode_t *vn, Elf_Ehdr *eh) {
   return 0;
 }
 
+/*
+ * Create an object that shadows pages of the file containing the segment.
+ * Pages are shared with other processes running the same program until they
+ * get written to. If the segment ends in the middle of a page, which is
+ * followed by zero-initialized data, then the page gets a private copy with
+ * the remainder cleared.
+ */
+static int map_elf_segment(vnode_t *vn, Elf_Phdr *ph, vm_object_t **objp) {
+  vm_object_t *file_obj;
+  int error;
+
+  vnode_lock(vn);
+  error = VOP_MMAP(vn, &file_obj);
+  vnode_unlock(vn);
+  if (error) {
+    klog("Exec failed: Mapping ELF segment failed.");
+    return error;
+  }
+
+  size_t tail = ph->p_filesz % PAGESIZE;
+  bool partial = tail > 0 && ph->p_memsz > ph->p_filesz;
+  vm_offset_t end = ph->p_offset + ph->p_filesz - tail;
+  if (!partial)
+    end = roundup(ph->p_offset + ph->p_filesz, PAGESIZE);
+
+  vm_object_t *obj = vm_object_shadow(file_obj, end);
+  vm_object_drop(file_obj);
+
+  if (partial) {
+    vm_page_t *pg = vm_page_alloc(1);
+    pmap_zero_page(pg);
+    uio_t uio = UIO_SINGLE_KERNEL(UIO_READ, end, pmap_page_kva(pg), tail);
+    if ((error = VOP_READ(vn, &uio))) {
+      klog("Exec failed: Reading ELF segment failed.");
+      vm_page_free(pg);
+      vm_object_drop(obj);
+      return error;
+    }
+    vm_object_add_page(obj, end, pg);
+  }
+
+  *objp = obj;
+  return 0;
+}
+
 static int load_elf_segment(proc_t *p, vnode_t *vn, Elf_Phdr *ph) {
   int error;
 
@@ -103,22 +150,29 @@ static int load_elf_segment(proc_t *p, vnode_t *vn, Elf_Phdr *ph) {
   vaddr_t start = ph->p_vaddr;
   vaddr_t end = roundup(ph->p_vaddr + ph->p_memsz, PAGESIZE);
 
+  /* Segments that begin at page boundary in the file are paged in on demand.
+   * Other ones are copied into anonymous memory. */
+  bool paged = ph->p_filesz > 0 && page_aligned_p(ph->p_offset);
+  vm_object_t *obj = NULL;
+  off_t offset = 0;
+
+  if (paged && (error = map_elf_segment(vn, ph, &obj)))
+    return error;
+  if (paged)
+    offset = ph->p_offset;
+
   /* Temporarily permissive protection. */
-  vm_object_t *obj = vm_object_alloc(VM_ANONYMOUS);
-  vm_map_entry_t *ent = vm_map_entry_alloc(
-    obj, start, end, VM_PROT_READ | VM_PROT_WRITE | VM_PROT_EXEC,
-    VM_ENT_PRIVATE);
-  error = vm_map_insert(p->p_uspace, ent, VM_FIXED);
+  vm_map_entry_t *ent;
+  error = vm_map_alloc_entry(p->p_uspace, obj, offset, start, end - start,
+                             VM_PROT_READ | VM_PROT_WRITE | VM_PROT_EXEC,
+                             VM_PRIVATE | VM_FIXED, &ent);
+  if (obj)
+    vm_object_drop(obj);
   /* TODO: What if segments overlap? */
   assert(error == 0);
 
   /* Read data from file into the map entry */
-  if (ph->p_filesz > 0) {
-    /* TODO: This is a lot of copying! Ideally we would look up the
-     * vm_object associated with the elf vnode, create a shadow vm_object
-     * on top of it using correct size/offset, and we would use it to page
-     * the file contents on demand. But we don't have a vnode_pager yet.
-     */
+  if (ph->p_filesz > 0 && !paged) {
     uio_t uio =
       UIO_SINGLE_USER(UIO_READ, ph->p_offset, (char *)start, ph->p_filesz);
     if ((error = VOP_READ(vn, &uio))) {
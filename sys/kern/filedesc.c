@@ -1,5 +1,6 @@
 #include <sys/file.h>
 #include <sys/filedesc.h>
+#include <sys/event.h>
 #include <sys/malloc.h>
 #include <sys/libkern.h>
 #include <sys/errno.h>
@@ -27,6 +28,7 @@ struct fdtab {
   bitstr_t *fdt_map;    /* Bitmap of used fds */
   unsigned fdt_flags;
   int fdt_nfiles;     /* Number of files allocated */
+  int fdt_nkqueues;   /* Number of descriptors referring to kqueues */
   refcnt_t fdt_count; /* Reference count */
   mtx_t fdt_mtx;
 };
@@ -104,9 +106,32 @@ static int fd_alloc(fdtab_t *fdt, int minfd, int *fdp) {
   return 0;
 }
 
+static void fd_install(fdtab_t *fdt, int fd, file_t *f) {
+  fdent_t *fde = &fdt->fdt_entries[fd];
+  fde->fde_file = f;
+  fde->fde_cloexec = false;
+  if (f->f_type == FT_KQUEUE)
+    fdt->fdt_nkqueues++;
+}
+
+/* Remove events registered for `fd` from all kqueues in the table. */
+static void fd_knote_close(fdtab_t *fdt, int fd) {
+  for (int i = 0; i < fdt->fdt_nfiles; i++) {
+    if (!fd_is_used(fdt, i))
+      continue;
+    file_t *f = fdt->fdt_entries[i].fde_file;
+    if (f->f_type == FT_KQUEUE)
+      kqueue_fdclose(f, fd);
+  }
+}
+
 static void fd_free(fdtab_t *fdt, int fd) {
   fdent_t *fde = &fdt->fdt_entries[fd];
   assert(fde->fde_file != NULL);
+  if (fde->fde_file->f_type == FT_KQUEUE)
+    fdt->fdt_nkqueues--;
+  else if (fdt->fdt_nkqueues > 0)
+    fd_knote_close(fdt, fd);
   file_drop(fde->fde_file);
   fde->fde_file = NULL;
   fde->fde_cloexec = false;
@@ -138,16 +163,17 @@ fdtab_t *fdtab_copy(fdtab_t *fdt) {
   }
 
   for (int i = 0; i < fdt->fdt_nfiles; i++) {
-    if (fd_is_used(fdt, i)) {
-      fdent_t *f = &fdt->fdt_entries[i];
-      newfdt->fdt_entries[i] = *f;
-      file_hold(f->fde_file);
-    }
+    if (!fd_is_used(fdt, i))
+      continue;
+    fdent_t *f = &fdt->fdt_entries[i];
+    /* Kqueues are not inherited by the child. */
+    if (f->fde_file->f_type == FT_KQUEUE)
+      continue;
+    newfdt->fdt_entries[i] = *f;
+    fd_mark_used(newfdt, i);
+    file_hold(f->fde_file);
   }
 
-  memcpy(newfdt->fdt_map, fdt->fdt_map,
-         sizeof(bitstr_t) * bitstr_size(fdt->fdt_nfiles));
-
   return newfdt;
 }
 
@@ -177,8 +203,7 @@ int fdtab_install_file(fdtab_t *fdt, file_t *f, int minfd, int *fd) {
   int error;
   if ((error = fd_alloc(fdt, minfd, fd)))
     return error;
-  fdt->fdt_entries[*fd].fde_file = f;
-  fdt->fdt_entries[*fd].fde_cloexec = false;
+  fd_install(fdt, *fd, f);
   file_hold(f);
   return 0;
 }
@@ -198,8 +223,7 @@ int fdtab_install_file_at(fdtab_t *fdt, file_t *f, int fd) {
         break;
       fd_free(fdt, fd);
     }
-    fde->fde_file = f;
-    fde->fde_cloexec = false;
+    fd_install(fdt, fd, f);
     fd_mark_used(fdt, fd);
   }
 
@@ -51,6 +51,10 @@ int do_fork(void (*start)(void *), void *arg, pid_t *cldpidp) {
   newtd->td_waitpt = NULL;
 
   newtd->td_prio = td->td_prio;
+  /* Child inherits sleep and run history of its parent, hence it starts with
+   * the same interactivity score, which then follows child's behaviour. */
+  newtd->td_slphist = td->td_slphist;
+  newtd->td_runhist = td->td_runhist;
 
   newtd->td_sigmask = td->td_sigmask;
 
@@ -176,6 +176,9 @@ __no_profile void intr_root_handler(ctx_t *ctx) {
    * routines to accidentaly enable interrupts. */
   td->td_idnest++;
 
+  /* Remember interrupted kernel context, e.g. for the profiler. */
+  td->td_kframe = user_mode_p(ctx) ? NULL : ctx;
+
   /* Explicitely disallow switching out to another thread. */
   PCPU_SET(no_switch, true);
   if (ir_filter != NULL)
@@ -1,5 +1,10 @@
 #include <sys/mutex.h>
+#include <sys/devfs.h>
 #include <sys/kenv.h>
+#include <sys/linker_set.h>
+#include <sys/mimiker.h>
+#include <sys/pcpu.h>
+#include <sys/uio.h>
 #include <sys/time.h>
 #include <sys/libkern.h>
 #include <sys/thread.h>
@@ -7,7 +12,28 @@
 #include <sys/ktest.h>
 #include <sys/interrupt.h>
 
-#define KL_SIZE 1024
+/*
+ * Each CPU has its own ring buffer with variable-size log entries, so logging
+ * does not need any lock. Entry size depends on the number of parameters, as
+ * trailing zero parameters are not stored. Only the CPU owning a buffer puts
+ * entries into it, with interrupts disabled for the time of the copy.
+ *
+ * `head` and `tail` are free running offsets of the end of the newest and of
+ * the oldest entry respectively. A writer that runs out of space moves `tail`
+ * forward past the oldest entries *before* overwriting them. Readers never
+ * block writers: a reader copies an entry out and then checks whether `tail`
+ * has moved past it in the meantime, in which case the copy is discarded.
+ *
+ * An entry never wraps around the end of the buffer. If it doesn't fit,
+ * the rest of the buffer is skipped. The skipped space starts with a padding
+ * entry (one without format) unless it's too small to hold an entry header.
+ *
+ * Readers merge entries from all buffers ordered by their timestamps.
+ */
+
+#define KL_BUFSIZE 32768 /* per-CPU buffer size, must be a power of two */
+#define KL_ALIGN 8
+#define KL_MAXPARAMS 6
 
 typedef struct klog_entry {
   bintime_t kl_timestamp;
@@ -15,21 +41,28 @@ typedef struct klog_entry {
   unsigned kl_line;
   const char *kl_file;
   klog_origin_t kl_origin;
-  const char *kl_format;
-  uintptr_t kl_params[6];
+  const char *kl_format; /* NULL for padding entries */
+  uint16_t kl_size;      /* size of the entry including parameters */
+  uint8_t kl_nparams;    /* number of parameters stored */
+  unsigned kl_repeated;  /* how many times the message was repeated */
+  uintptr_t kl_params[];
 } klog_entry_t;
 
-typedef struct klog {
-  klog_entry_t array[KL_SIZE];
-  atomic_uint mask;
-  volatile unsigned first;
-  volatile unsigned last;
-  bool repeated;
-  int prev;
-} klog_t;
+/* Entry with space for all parameters. */
+typedef struct klog_entry_max {
+  klog_entry_t entry;
+  uintptr_t params[KL_MAXPARAMS];
+} klog_entry_max_t;
+
+typedef struct klog_buf {
+  atomic_uint head; /* end of the newest entry */
+  atomic_uint tail; /* beginning of the oldest entry */
+  unsigned prev;    /* beginning of the newest entry */
+  uint8_t data[KL_BUFSIZE] __aligned(KL_ALIGN);
+} klog_buf_t;
 
-static klog_t klog;
-static SPIN_DEFINE(klog_lock, LK_RECURSIVE);
+static klog_buf_t klog_buf[MAXCPU];
+static atomic_uint klog_mask;
 
 static const char *subsystems[] = {
   [KL_SLEEPQ] = "sleepq",   [KL_CALLOUT] = "callout", [KL_INIT] = "init",
@@ -44,107 +77,277 @@ static const char *subsystems[] = {
 
 void init_klog(void) {
   const char *mask = kenv_get("klog-mask");
-  klog.mask = mask ? (unsigned)strtol(mask, NULL, 16) : KL_DEFAULT_MASK;
-  klog.first = 0;
-  klog.last = 0;
-  klog.repeated = 0;
-  klog.prev = -1;
+  klog_mask = mask ? (unsigned)strtol(mask, NULL, 16) : KL_DEFAULT_MASK;
+  klog_clear();
 }
 
-static inline unsigned next(unsigned i) {
-  return (i + 1) % KL_SIZE;
+static inline klog_entry_t *klog_entry_at(klog_buf_t *kb, unsigned off) {
+  return (klog_entry_t *)&kb->data[off % KL_BUFSIZE];
 }
 
-static void klog_entry_dump(klog_entry_t *entry) {
-  if (entry->kl_origin == KL_UNDEF)
-    kprintf("[%s:%d] ", entry->kl_file, entry->kl_line);
-  else
-    kprintf("[%s] ", subsystems[entry->kl_origin]);
-  kprintf(entry->kl_format, entry->kl_params[0], entry->kl_params[1],
-          entry->kl_params[2], entry->kl_params[3], entry->kl_params[4],
-          entry->kl_params[5]);
-  kprintf("\n");
+/* Returns offset of the entry following the one at `off`. Skipped space at the
+ * end of the buffer is treated as an entry. */
+static unsigned klog_next(klog_buf_t *kb, unsigned off) {
+  unsigned room = KL_BUFSIZE - off % KL_BUFSIZE;
+  if (room < sizeof(klog_entry_t))
+    return off + room;
+  /* Size may be bogus if a reader races with a writer. */
+  return off + max(klog_entry_at(kb, off)->kl_size, sizeof(klog_entry_t));
+}
+
+static inline bool klog_is_padding(klog_buf_t *kb, unsigned off) {
+  unsigned room = KL_BUFSIZE - off % KL_BUFSIZE;
+  return room < sizeof(klog_entry_t) ||
+         klog_entry_at(kb, off)->kl_format == NULL;
+}
+
+/* Moves tail forward until there's `size` bytes of free space at head. */
+static void klog_make_room(klog_buf_t *kb, unsigned head, unsigned size) {
+  unsigned tail = atomic_load(&kb->tail);
+  while (head + size - tail > KL_BUFSIZE) {
+    if (atomic_compare_exchange_weak(&kb->tail, &tail, klog_next(kb, tail)))
+      tail = atomic_load(&kb->tail);
+  }
+  /* Readers must notice the new tail before the data is overwritten. */
+  atomic_thread_fence(memory_order_seq_cst);
+}
+
+static bool klog_repeats(klog_buf_t *kb, unsigned head, klog_entry_t *new) {
+  unsigned tail = atomic_load(&kb->tail);
+  if (head == tail || (int)(kb->prev - tail) < 0)
+    return false;
+  klog_entry_t *prev = klog_entry_at(kb, kb->prev);
+  return prev->kl_format == new->kl_format && prev->kl_file == new->kl_file &&
+         prev->kl_line == new->kl_line && prev->kl_tid == new->kl_tid &&
+         prev->kl_origin == new->kl_origin &&
+         prev->kl_nparams == new->kl_nparams &&
+         !memcmp(prev->kl_params, new->kl_params,
+                 new->kl_nparams * sizeof(uintptr_t));
 }
 
 void klog_append(klog_origin_t origin, const char *file, unsigned line,
                  const char *format, uintptr_t arg1, uintptr_t arg2,
                  uintptr_t arg3, uintptr_t arg4, uintptr_t arg5,
                  uintptr_t arg6) {
-  if (!(KL_MASK(origin) & atomic_load(&klog.mask)))
+  if (!(KL_MASK(origin) & atomic_load(&klog_mask)))
     return;
 
-  tid_t tid = thread_self()->td_tid;
+  klog_entry_max_t em = {
+    .entry = {.kl_tid = thread_self()->td_tid,
+              .kl_line = line,
+              .kl_file = file,
+              .kl_origin = origin,
+              .kl_format = format},
+    .params = {arg1, arg2, arg3, arg4, arg5, arg6}};
+  klog_entry_t *new = &em.entry;
 
-  WITH_SPIN_LOCK (&klog_lock) {
-    bintime_t now = binuptime();
+  /* Trailing zero parameters are not stored. */
+  unsigned n = KL_MAXPARAMS;
+  while (n > 0 && em.params[n - 1] == 0)
+    n--;
+  new->kl_nparams = n;
+  new->kl_size =
+    roundup(sizeof(klog_entry_t) + n * sizeof(uintptr_t), KL_ALIGN);
 
-    klog_entry_t *prev = (klog.prev >= 0) ? &klog.array[klog.prev] : NULL;
+  WITH_INTR_DISABLED {
+    klog_buf_t *kb = &klog_buf[PCPU_GET(cpuid)];
+    unsigned head = atomic_load(&kb->head);
 
-    /* Do not store repeating log messages, just count them. */
-    if (prev) {
-      bool repeats =
-        (prev->kl_params[0] == arg1) && (prev->kl_params[1] == arg2) &&
-        (prev->kl_params[2] == arg3) && (prev->kl_params[3] == arg4) &&
-        (prev->kl_params[4] == arg5) && (prev->kl_params[5] == arg6) &&
-        (prev->kl_origin == origin) && (prev->kl_file == file) &&
-        (prev->kl_line == line) && (prev->kl_tid = tid);
-
-      if (repeats) {
-        if (!klog.repeated) {
-          int old_prev = klog.prev;
-          klog.prev = -1;
-          klog_append(prev->kl_origin, prev->kl_file, prev->kl_line,
-                      "Last message repeated %d times.", 0, 0, 0, 0, 0, 0);
-          klog.prev = old_prev;
-          klog.repeated = true;
-        }
-
-        prev = &klog.array[next(klog.prev)];
-        prev->kl_timestamp = now;
-        prev->kl_params[0]++;
-        return;
-      }
+    new->kl_timestamp = binuptime();
 
-      klog.repeated = false;
+    /* Do not store repeating log messages, just count them. */
+    if (klog_repeats(kb, head, new)) {
+      klog_entry_at(kb, kb->prev)->kl_repeated++;
+      break;
     }
 
-    klog_entry_t *entry = &klog.array[klog.last];
-    *entry = (klog_entry_t){.kl_timestamp = now,
-                            .kl_tid = tid,
-                            .kl_line = line,
-                            .kl_file = file,
-                            .kl_origin = origin,
-                            .kl_format = format,
-                            .kl_params = {arg1, arg2, arg3, arg4, arg5, arg6}};
-
-    klog.prev = klog.last;
-    klog.last = next(klog.last);
-    if (klog.first == klog.last)
-      klog.first = next(klog.first);
+    unsigned room = KL_BUFSIZE - head % KL_BUFSIZE;
+    unsigned skip = (room < new->kl_size) ? room : 0;
+
+    klog_make_room(kb, head, skip + new->kl_size);
+
+    if (skip >= sizeof(klog_entry_t))
+      *klog_entry_at(kb, head) = (klog_entry_t){.kl_size = skip};
+
+    memcpy(klog_entry_at(kb, head + skip), new, new->kl_size);
+    kb->prev = head + skip;
+    atomic_store(&kb->head, head + skip + new->kl_size);
   }
 }
 
 unsigned klog_setmask(unsigned newmask) {
-  return atomic_exchange(&klog.mask, newmask);
+  return atomic_exchange(&klog_mask, newmask);
 }
 
-void klog_dump(void) {
-  klog_entry_t entry;
+/* Copies out the oldest entry from the buffer. Returns false if the buffer is
+ * empty. Otherwise `tailp` and `nextp` are set to the value of tail at the time
+ * of copying and to the offset just past the entry. */
+static bool klog_peek(klog_buf_t *kb, klog_entry_max_t *em, unsigned *tailp,
+                      unsigned *nextp) {
+  while (true) {
+    unsigned tail = atomic_load(&kb->tail);
+    unsigned head = atomic_load(&kb->head);
+    unsigned off = tail;
 
-  while (klog.first != klog.last) {
-    WITH_SPIN_LOCK (&klog_lock) {
-      entry = klog.array[klog.first];
-      klog.first = next(klog.first);
+    while ((int)(head - off) > 0 && klog_is_padding(kb, off))
+      off = klog_next(kb, off);
+
+    if ((int)(head - off) > 0) {
+      klog_entry_t *entry = klog_entry_at(kb, off);
+      memcpy(em, entry, min(entry->kl_size, sizeof(klog_entry_max_t)));
     }
-    klog_entry_dump(&entry);
+
+    /* Check if the entries haven't been overwritten while we were reading
+     * them. If they were, what we've read may be garbage. */
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load(&kb->tail) != tail)
+      continue;
+
+    if ((int)(head - off) <= 0)
+      return false;
+
+    *tailp = tail;
+    *nextp = off + em->entry.kl_size;
+    return true;
   }
 }
 
+/* Removes the oldest entry among all buffers and stores it in `em`. */
+static bool klog_read(klog_entry_max_t *em) {
+  while (true) {
+    klog_buf_t *oldest = NULL;
+    unsigned oldest_tail = 0, oldest_next = 0;
+    unsigned i;
+
+    CPU_FOREACH (i) {
+      klog_buf_t *kb = &klog_buf[i];
+      klog_entry_max_t cur;
+      unsigned tail, next;
+
+      if (!klog_peek(kb, &cur, &tail, &next))
+        continue;
+
+      if (oldest == NULL || bintime_cmp(&cur.entry.kl_timestamp,
+                                        &em->entry.kl_timestamp, <)) {
+        oldest = kb;
+        oldest_tail = tail;
+        oldest_next = next;
+        memcpy(em, &cur, sizeof(klog_entry_max_t));
+      }
+    }
+
+    if (oldest == NULL)
+      return false;
+
+    /* Retry if a writer or another reader has moved the tail. */
+    if (atomic_compare_exchange_strong(&oldest->tail, &oldest_tail,
+                                       oldest_next))
+      return true;
+  }
+}
+
+static int klog_entry_format(klog_entry_t *entry, char *buf, size_t size) {
+  uintptr_t *p = entry->kl_params;
+  uintptr_t params[KL_MAXPARAMS] = {0};
+  memcpy(params, p, entry->kl_nparams * sizeof(uintptr_t));
+
+  timeval_t tv;
+  bt2tv(&entry->kl_timestamp, &tv);
+
+  size_t n = snprintf_append(buf, size, 0, "%u.%06u %u ", (unsigned)tv.tv_sec,
+                             (unsigned)tv.tv_usec, entry->kl_tid);
+  if (entry->kl_origin == KL_UNDEF)
+    n = snprintf_append(buf, size, n, "[%s:%d] ", entry->kl_file,
+                        entry->kl_line);
+  else
+    n = snprintf_append(buf, size, n, "[%s] ", subsystems[entry->kl_origin]);
+  n = snprintf_append(buf, size, n, entry->kl_format, params[0], params[1],
+                      params[2], params[3], params[4], params[5]);
+  if (entry->kl_repeated)
+    n = snprintf_append(buf, size, n, " (repeated %u times)",
+                        entry->kl_repeated);
+  n = snprintf_append(buf, size, n, "\n");
+  return n;
+}
+
+static void klog_entry_dump(klog_entry_t *entry) {
+  uintptr_t params[KL_MAXPARAMS] = {0};
+  memcpy(params, entry->kl_params, entry->kl_nparams * sizeof(uintptr_t));
+
+  if (entry->kl_origin == KL_UNDEF)
+    kprintf("[%s:%d] ", entry->kl_file, entry->kl_line);
+  else
+    kprintf("[%s] ", subsystems[entry->kl_origin]);
+  kprintf(entry->kl_format, params[0], params[1], params[2], params[3],
+          params[4], params[5]);
+  if (entry->kl_repeated)
+    kprintf(" (repeated %u times)", entry->kl_repeated);
+  kprintf("\n");
+}
+
+void klog_dump(void) {
+  klog_entry_max_t em;
+
+  while (klog_read(&em))
+    klog_entry_dump(&em.entry);
+}
+
 void klog_clear(void) {
-  klog.first = 0;
-  klog.last = 0;
+  unsigned i;
+
+  CPU_FOREACH (i) {
+    klog_buf_t *kb = &klog_buf[i];
+    atomic_store(&kb->tail, atomic_load(&kb->head));
+  }
+}
+
+/*
+ * /dev/klog drains log entries formatted as text lines. Entries that have been
+ * read are removed from the buffers.
+ */
+
+#define KL_LINESIZE 256
+
+static MTX_DEFINE(klog_dev_lock, 0);
+static char klog_dev_line[KL_LINESIZE];
+static size_t klog_dev_len;
+static size_t klog_dev_off;
+
+static int klog_dev_read(devnode_t *dev, uio_t *uio) {
+  klog_entry_max_t em;
+  int error = 0;
+
+  SCOPED_MTX_LOCK(&klog_dev_lock);
+
+  while (uio->uio_resid > 0) {
+    /* Fetch next line if the previous one has been read entirely. */
+    if (klog_dev_off == klog_dev_len) {
+      if (!klog_read(&em))
+        break;
+      klog_dev_len =
+        klog_entry_format(&em.entry, klog_dev_line, sizeof(klog_dev_line));
+      klog_dev_off = 0;
+    }
+    size_t len = min(uio->uio_resid, klog_dev_len - klog_dev_off);
+    if ((error = uiomove(klog_dev_line + klog_dev_off, len, uio)))
+      break;
+    klog_dev_off += len;
+  }
+
+  return error;
 }
 
+static devops_t klog_devops = {
+  .d_type = DT_OTHER,
+  .d_read = klog_dev_read,
+};
+
+static void init_dev_klog(void) {
+  devfs_makedev_new(NULL, "klog", &klog_devops, NULL, NULL);
+}
+
+SET_ENTRY(devfs_init, init_dev_klog);
+
 /*
  * @brief Permanently lock the kernel.
  *
@@ -10,6 +10,7 @@
 #include <sys/vm_physmem.h>
 #include <sys/kasan.h>
 #include <sys/mutex.h>
+#include <sys/pool.h>
 
 static vmem_t *kvspace; /* Kernel virtual address space allocator. */
 
@@ -24,7 +25,9 @@ static void kick_swapper(void) {
   panic("Cannot allocate more kernel memory: swapper not implemented!");
 }
 
-vaddr_t kva_alloc(size_t size) {
+/* Allocates `size` bytes of kernel virtual addresses aligned to `alignment`.
+ * Never fails, since kernel virtual address space grows on demand. */
+static vaddr_t kva_xalloc(size_t size, size_t alignment) {
   assert(page_aligned_p(size));
   vmem_addr_t start;
   vaddr_t old = atomic_load(&vm_kernel_end);
@@ -38,7 +41,7 @@ vaddr_t kva_alloc(size_t size) {
    * vmem_alloc fails so we need to repeat pmap_growkernel and restart
    * vmem_alloc. We do that until success because kva_alloc should never failed.
    */
-  while (vmem_alloc(kvspace, size, &start, M_NOGROW)) {
+  while (vmem_xalloc(kvspace, size, alignment, &start, M_NOGROW)) {
     mtx_lock(&vm_kernel_end_lock);
     /* Check if other thread called pmap_growkernel between vmem_alloc and
      * mtx_lock. */
@@ -48,7 +51,7 @@ vaddr_t kva_alloc(size_t size) {
       continue;
     }
 
-    pmap_growkernel(old + size);
+    pmap_growkernel(old + size + alignment);
     klog("%s: increase kernel end %08lx -> %08lx", __func__, old,
          vm_kernel_end);
 
@@ -61,6 +64,10 @@ vaddr_t kva_alloc(size_t size) {
   return start;
 }
 
+vaddr_t kva_alloc(size_t size) {
+  return kva_xalloc(size, 0);
+}
+
 void kva_free(vaddr_t ptr, size_t size) {
   assert(page_aligned_p(ptr) && page_aligned_p(size));
   vmem_free(kvspace, ptr, size);
@@ -81,8 +88,12 @@ void kva_map(vaddr_t ptr, size_t size, kmem_flags_t flags) {
 
   vm_pagelist_t pglist;
   int error = vm_pagelist_alloc(npages, &pglist);
-  if (error)
-    kick_swapper();
+  if (error) {
+    /* Try to get back memory cached by pool allocators. */
+    pool_reclaim();
+    if (vm_pagelist_alloc(npages, &pglist))
+      kick_swapper();
+  }
 
   vaddr_t va = ptr;
   vm_page_t *pg;
@@ -155,7 +166,13 @@ void kmem_free(void *ptr, size_t size) {
 vaddr_t kmem_map_contig(paddr_t pa, size_t size, unsigned flags) {
   assert(page_aligned_p(pa) && page_aligned_p(size));
 
-  vaddr_t va = kva_alloc(size);
+  /* Place superpage-aligned memory at superpage-aligned addresses as well,
+   * so that pmap can use large pages to map it. */
+  size_t alignment = 0;
+  if (size >= SUPERPAGESIZE && is_aligned(pa, SUPERPAGESIZE))
+    alignment = SUPERPAGESIZE;
+
+  vaddr_t va = kva_xalloc(size, alignment);
 
   /* Mark the entire block as valid */
   kasan_mark_valid((void *)va, size);
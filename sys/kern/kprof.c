@@ -0,0 +1,333 @@
+#include <sys/context.h>
+#include <sys/devfs.h>
+#include <sys/errno.h>
+#include <sys/kmem.h>
+#include <sys/kprof.h>
+#include <sys/libkern.h>
+#include <sys/linker_set.h>
+#include <sys/mimiker.h>
+#include <sys/mutex.h>
+#include <sys/pcpu.h>
+#include <sys/spinlock.h>
+#include <sys/thread.h>
+#include <sys/uio.h>
+
+/*
+ * Statistical sampling profiler.
+ *
+ * When enabled, on every clock tick it records the call stack of the thread
+ * running on the CPU. Unlike kgprof it doesn't need the kernel to be built
+ * with instrumentation, thus it can be switched on at any moment.
+ *
+ * The kernel part of the call stack is unwound right away in the interrupt
+ * handler. The user-space part cannot be read with interrupts disabled, as
+ * the access may fault. Hence the sample is marked as pending, and it's
+ * completed just before the thread returns to user space.
+ *
+ * Samples are kept in per-CPU ring buffers and are drained through
+ * /dev/kprof in the folded stacks format, i.e. one line per distinct stack:
+ *
+ *   name-tid;outermost;...;innermost count
+ *
+ * with user-space frames followed by kernel frames. Program counters are
+ * printed as hexadecimal numbers. Writing "1" or "0" to /dev/kprof
+ * respectively enables or disables sampling.
+ */
+
+#define KPROF_DEPTH 16      /* max. number of frames of kernel and user stack */
+#define KPROF_NSAMPLES 1024 /* per-CPU number of samples */
+#define KPROF_NAMELEN 16    /* length of recorded thread name */
+#define KPROF_LINESIZE (KPROF_NAMELEN + 32 + 2 * KPROF_DEPTH * 20)
+
+typedef struct kprof_sample {
+  tid_t tid;
+  char name[KPROF_NAMELEN];
+  uint8_t nkern; /* number of kernel frames */
+  uint8_t nuser; /* number of user frames */
+  bool pending;  /* waiting for user-space call stack */
+  uintptr_t kern[KPROF_DEPTH];
+  uintptr_t user[KPROF_DEPTH];
+} kprof_sample_t;
+
+typedef struct kprof_cpu {
+  spin_t lock;
+  unsigned head;    /* index of next sample to be written (free running) */
+  unsigned tail;    /* index of the oldest sample (free running) */
+  unsigned pending; /* number of samples waiting for user-space call stack */
+  kprof_sample_t *samples;
+} kprof_cpu_t;
+
+static kprof_cpu_t kprof_cpu[MAXCPU];
+static atomic_bool kprof_enabled;
+
+static inline kprof_sample_t *kprof_sample(kprof_cpu_t *kc, unsigned i) {
+  return &kc->samples[i % KPROF_NSAMPLES];
+}
+
+/* Only current thread's kernel stack and kernel text are read. */
+static bool kprof_kread(vaddr_t addr, register_t *valp) {
+  kstack_t *stk = &thread_self()->td_kstack;
+  vaddr_t end = addr + sizeof(register_t);
+
+  if (!is_aligned(addr, sizeof(register_t)))
+    return false;
+  if (!(addr >= (vaddr_t)stk->stk_base &&
+        end <= (vaddr_t)stk->stk_base + stk->stk_size) &&
+      !(addr >= (vaddr_t)__text && end <= (vaddr_t)__etext))
+    return false;
+  *valp = *(register_t *)addr;
+  return true;
+}
+
+static bool kprof_uread(vaddr_t addr, register_t *valp) {
+  if (!is_aligned(addr, sizeof(register_t)))
+    return false;
+  return copyin((void *)addr, valp, sizeof(register_t)) == 0;
+}
+
+void kprof_tick(void) {
+  assert(intr_disabled());
+
+  if (!atomic_load(&kprof_enabled))
+    return;
+
+  thread_t *td = thread_self();
+  if (td == PCPU_GET(idle_thread))
+    return;
+
+  kprof_cpu_t *kc = &kprof_cpu[PCPU_GET(cpuid)];
+
+  SCOPED_SPIN_LOCK(&kc->lock);
+
+  /* Make room for new sample by dropping the oldest one. */
+  if (kc->head - kc->tail == KPROF_NSAMPLES) {
+    if (kprof_sample(kc, kc->tail)->pending)
+      kc->pending--;
+    kc->tail++;
+  }
+
+  kprof_sample_t *s = kprof_sample(kc, kc->head++);
+  bzero(s, sizeof(kprof_sample_t));
+  s->tid = td->td_tid;
+  strlcpy(s->name, td->td_name, KPROF_NAMELEN);
+
+  /* td_kframe is NULL if the thread was interrupted in user mode. */
+  if (td->td_kframe)
+    s->nkern = ctx_unwind(td->td_kframe, kprof_kread, s->kern, KPROF_DEPTH);
+
+  if (td->td_proc) {
+    s->pending = true;
+    kc->pending++;
+    WITH_SPIN_LOCK (td->td_lock)
+      td->td_flags |= TDF_NEEDPROF;
+  }
+}
+
+void kprof_user_leave(mcontext_t *ctx) {
+  thread_t *td = thread_self();
+  uintptr_t pcs[KPROF_DEPTH];
+  unsigned i;
+
+  WITH_SPIN_LOCK (td->td_lock)
+    td->td_flags &= ~TDF_NEEDPROF;
+
+  unsigned n = ctx_unwind((ctx_t *)ctx, kprof_uread, pcs, KPROF_DEPTH);
+
+  /* The thread might have been sampled several times since it entered
+   * the kernel. All these samples share the user-space call stack. */
+  CPU_FOREACH (i) {
+    kprof_cpu_t *kc = &kprof_cpu[i];
+
+    SCOPED_SPIN_LOCK(&kc->lock);
+
+    for (unsigned j = kc->head; kc->pending > 0 && j != kc->tail; j--) {
+      kprof_sample_t *s = kprof_sample(kc, j - 1);
+      if (!s->pending || s->tid != td->td_tid)
+        continue;
+      memcpy(s->user, pcs, n * sizeof(uintptr_t));
+      s->nuser = n;
+      s->pending = false;
+      kc->pending--;
+    }
+  }
+}
+
+/*
+ * /dev/kprof
+ *
+ * First read takes all samples out of per-CPU buffers. Samples with the same
+ * thread and call stack are merged and the result is returned line by line.
+ * When all lines have been read, next read returns 0, and the one after it
+ * takes a new snapshot.
+ */
+
+static MTX_DEFINE(kprof_dev_lock, 0);
+static kprof_sample_t *kprof_snap;
+static size_t kprof_snap_size; /* size of `kprof_snap` allocation */
+static unsigned kprof_snap_cnt;
+static unsigned kprof_snap_cur;
+static char kprof_line[KPROF_LINESIZE];
+static size_t kprof_line_len;
+static size_t kprof_line_off;
+
+static void kprof_enable(void) {
+  unsigned i;
+
+  assert(mtx_owned(&kprof_dev_lock));
+
+  CPU_FOREACH (i) {
+    kprof_cpu_t *kc = &kprof_cpu[i];
+    if (kc->samples != NULL)
+      continue;
+    void *samples =
+      kmem_alloc(KPROF_NSAMPLES * sizeof(kprof_sample_t), M_ZERO);
+    WITH_SPIN_LOCK (&kc->lock)
+      kc->samples = samples;
+  }
+
+  atomic_store(&kprof_enabled, true);
+}
+
+static int kprof_sample_cmp(const void *a, const void *b) {
+  return memcmp(a, b, sizeof(kprof_sample_t));
+}
+
+static void kprof_snapshot(void) {
+  unsigned i, cnt = 0;
+
+  assert(mtx_owned(&kprof_dev_lock));
+
+  CPU_FOREACH (i) {
+    if (kprof_cpu[i].samples)
+      cnt += KPROF_NSAMPLES;
+  }
+
+  kprof_snap_cnt = 0;
+  kprof_snap_cur = 0;
+  kprof_line_len = 0;
+  kprof_line_off = 0;
+
+  if (cnt == 0)
+    return;
+
+  kprof_snap_size = roundup(cnt * sizeof(kprof_sample_t), PAGESIZE);
+  kprof_snap = kmem_alloc(kprof_snap_size, 0);
+
+  CPU_FOREACH (i) {
+    kprof_cpu_t *kc = &kprof_cpu[i];
+
+    SCOPED_SPIN_LOCK(&kc->lock);
+
+    for (; kc->tail != kc->head; kc->tail++) {
+      kprof_sample_t *s = &kprof_snap[kprof_snap_cnt++];
+      memcpy(s, kprof_sample(kc, kc->tail), sizeof(kprof_sample_t));
+      /* User-space part of the call stack will not be recorded. */
+      s->pending = false;
+    }
+    kc->pending = 0;
+  }
+
+  /* Identical samples become adjacent. */
+  qsort(kprof_snap, kprof_snap_cnt, sizeof(kprof_sample_t), kprof_sample_cmp);
+}
+
+/* Formats a line for samples starting at `kprof_snap_cur`. */
+static void kprof_format(void) {
+  kprof_sample_t *s = &kprof_snap[kprof_snap_cur];
+  unsigned count = 0;
+  size_t n;
+
+  while (kprof_snap_cur < kprof_snap_cnt &&
+         !kprof_sample_cmp(s, &kprof_snap[kprof_snap_cur])) {
+    kprof_snap_cur++;
+    count++;
+  }
+
+  n = snprintf_append(kprof_line, KPROF_LINESIZE, 0, "%s-%u", s->name, s->tid);
+  for (int i = s->nuser - 1; i >= 0; i--)
+    n = snprintf_append(kprof_line, KPROF_LINESIZE, n, ";0x%lx",
+                        (u_long)s->user[i]);
+  for (int i = s->nkern - 1; i >= 0; i--)
+    n = snprintf_append(kprof_line, KPROF_LINESIZE, n, ";0x%lx",
+                        (u_long)s->kern[i]);
+  n = snprintf_append(kprof_line, KPROF_LINESIZE, n, " %u\n", count);
+
+  kprof_line_len = n;
+  kprof_line_off = 0;
+}
+
+static bool kprof_snap_done(void) {
+  return kprof_snap_cur == kprof_snap_cnt && kprof_line_off == kprof_line_len;
+}
+
+static int kprof_dev_read(devnode_t *dev, uio_t *uio) {
+  int error = 0;
+
+  SCOPED_MTX_LOCK(&kprof_dev_lock);
+
+  /* Report end of file once the whole snapshot has been read. */
+  if (kprof_snap && kprof_snap_done()) {
+    kmem_free(kprof_snap, kprof_snap_size);
+    kprof_snap = NULL;
+    return 0;
+  }
+
+  if (kprof_snap == NULL) {
+    kprof_snapshot();
+    if (kprof_snap == NULL)
+      return 0;
+  }
+
+  while (uio->uio_resid > 0) {
+    if (kprof_line_off == kprof_line_len) {
+      if (kprof_snap_cur == kprof_snap_cnt)
+        break;
+      kprof_format();
+    }
+    size_t len = min(uio->uio_resid, kprof_line_len - kprof_line_off);
+    if ((error = uiomove(kprof_line + kprof_line_off, len, uio)))
+      break;
+    kprof_line_off += len;
+  }
+
+  return error;
+}
+
+static int kprof_dev_write(devnode_t *dev, uio_t *uio) {
+  char c;
+  int error;
+
+  if (uio->uio_resid == 0)
+    return 0;
+
+  if ((error = uiomove(&c, 1, uio)))
+    return error;
+
+  SCOPED_MTX_LOCK(&kprof_dev_lock);
+
+  if (c == '1')
+    kprof_enable();
+  else if (c == '0')
+    atomic_store(&kprof_enabled, false);
+  else
+    return EINVAL;
+
+  return 0;
+}
+
+static devops_t kprof_devops = {
+  .d_type = DT_OTHER,
+  .d_read = kprof_dev_read,
+  .d_write = kprof_dev_write,
+};
+
+static void init_kprof(void) {
+  unsigned i;
+
+  CPU_FOREACH (i)
+    spin_init(&kprof_cpu[i].lock, 0);
+
+  devfs_makedev_new(NULL, "kprof", &kprof_devops, NULL, NULL);
+}
+
+SET_ENTRY(devfs_init, init_kprof);
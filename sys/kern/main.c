@@ -80,6 +80,7 @@ __noreturn void kernel_init(void) {
   init_pool();
   init_vmem();
   init_kmem();
+  init_kmalloc_classes();
   init_vm_map();
 
   init_cons();
@@ -93,6 +94,7 @@ __noreturn void kernel_init(void) {
 
   /* With scheduler ready we can create necessary threads. */
   init_callout();
+  init_vm_pagezero();
   preempt_enable();
 
   /* [FIRST_PASS] Initialize first timer and console devices. */
@@ -4,6 +4,7 @@
 #include <sys/libkern.h>
 #include <sys/mutex.h>
 #include <sys/malloc.h>
+#include <sys/pool.h>
 #include <sys/kmem.h>
 #include <sys/kasan.h>
 #include <sys/queue.h>
@@ -47,6 +48,7 @@ typedef enum {
   USED = 1,     /* this block is used */
   PREVFREE = 2, /* previous block is free */
   ISLAST = 4,   /* last block in an arena */
+  INPOOL = 8,   /* block is an item of a size class pool (see below) */
 } bt_flags;
 
 /* Stored in payload of free blocks. */
@@ -330,6 +332,95 @@ static void *realloc(void *old_ptr, size_t size) {
   return new_ptr;
 }
 
+/* --=[ size classes ]=----------------------------------------------------- */
+
+/*
+ * Small blocks are served by pool allocators, one for each size class, which
+ * avoids searching free lists and coalescing blocks in the arenas. Size classes
+ * are powers of two and their 3/4, so internal fragmentation is below 25%.
+ * Only blocks larger than the biggest size class are carved from arenas.
+ *
+ * Pool item begins with a header, which is padded to ALIGNMENT, so that user
+ * payload is aligned just as in case of arena blocks. The last word of the
+ * header is a tag (just before the payload, i.e. in place of boundary tag),
+ * which encodes size class index and INPOOL flag.
+ */
+#define POOLHDR_SZ ALIGNMENT
+#define NCLASSES 12
+
+static const size_t class_size[NCLASSES] = {
+  16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024,
+};
+
+static const char *class_desc[NCLASSES] = {
+  "kmalloc-16",  "kmalloc-32",  "kmalloc-48",  "kmalloc-64",
+  "kmalloc-96",  "kmalloc-128", "kmalloc-192", "kmalloc-256",
+  "kmalloc-384", "kmalloc-512", "kmalloc-768", "kmalloc-1024",
+};
+
+static pool_t *class_pool[NCLASSES];
+
+static inline word_t class_tag(int i) {
+  return (i << 4) | INPOOL | USED;
+}
+
+static inline int tag_class(word_t *bt) {
+  return *bt >> 4;
+}
+
+static inline int bt_inpool(word_t *bt) {
+  return *bt & INPOOL;
+}
+
+/* Returns size class index suitable for a block of `size` bytes or -1. */
+static int size_class(size_t size) {
+  if (size > class_size[NCLASSES - 1])
+    return -1;
+  for (int i = 0;; i++)
+    if (size <= class_size[i])
+      return i;
+}
+
+static void *class_alloc(int i, unsigned flags) {
+  pool_t *pool = class_pool[i];
+  if (pool == NULL)
+    return NULL;
+
+  void *item = pool_alloc(pool, flags & ~M_ZERO);
+  if (item == NULL)
+    return NULL;
+
+  word_t *bt = item + POOLHDR_SZ - sizeof(word_t);
+  *bt = class_tag(i);
+  return bt_payload(bt);
+}
+
+static void class_free(word_t *bt) {
+  int i = tag_class(bt);
+  /* Clear the tag, so that double free is detected. */
+  *bt = 0;
+  pool_free(class_pool[i], (void *)(bt + 1) - POOLHDR_SZ);
+}
+
+static void mp_account(kmalloc_pool_t *mp, size_t size) {
+  size_t used = atomic_fetch_add(&mp->used, size) + size;
+  if (used > mp->maxused)
+    mp->maxused = used;
+  atomic_fetch_add(&mp->active, 1);
+  atomic_fetch_add(&mp->nrequests, 1);
+}
+
+static void mp_unaccount(kmalloc_pool_t *mp, size_t size) {
+  atomic_fetch_sub(&mp->used, size);
+  atomic_fetch_sub(&mp->active, 1);
+}
+
+void init_kmalloc_classes(void) {
+  for (int i = 0; i < NCLASSES; i++)
+    class_pool[i] = pool_create(class_desc[i], POOLHDR_SZ + class_size[i],
+                                ALIGNMENT);
+}
+
 /* --=[ kernel API ]=------------------------------------------------------- */
 
 static void arena_init(arena_t *ar) {
@@ -356,20 +447,37 @@ static void arena_add(void) {
   arena_init(ar);
 }
 
+/* Returns number of bytes needed to hold `size` bytes of user data. */
+static size_t payload_size(size_t size) {
+#if KASAN
+  return size + KASAN_KMALLOC_REDZONE_SIZE;
+#else /* !KASAN */
+  return size;
+#endif
+}
+
 void *kmalloc(kmalloc_pool_t *mp, size_t size, unsigned flags) {
   if (size == 0)
     return NULL;
 
-#if KASAN
-  size_t req_size = blk_size(size + KASAN_KMALLOC_REDZONE_SIZE);
-#else /* !KASAN */
-  size_t req_size = blk_size(size);
-#endif
+  size_t req_size = blk_size(payload_size(size));
 
   void *ptr = NULL;
 
   assert(req_size <= BLOCK_MAXSIZE);
 
+  /* Pool items have no canary, so the class depends only on the payload. */
+  int i = size_class(payload_size(size));
+  if (i >= 0 && (ptr = class_alloc(i, flags))) {
+    req_size = POOLHDR_SZ + class_size[i];
+    mp_account(mp, req_size);
+    /* Create redzone after the buffer. */
+    kasan_mark(ptr, size, class_size[i], KASAN_CODE_KMALLOC_OVERFLOW);
+    if (flags & M_ZERO)
+      bzero(ptr, size);
+    return ptr;
+  }
+
   WITH_MTX_LOCK (&arena_lock) {
     while (!(ptr = malloc(req_size))) {
       /* Couldn't find any continuous memory with the requested size. */
@@ -378,10 +486,7 @@ void *kmalloc(kmalloc_pool_t *mp, size_t size, unsigned flags) {
       arena_add();
     }
 
-    mp->used += req_size;
-    mp->maxused = max(mp->used, mp->maxused);
-    mp->active++;
-    mp->nrequests++;
+    mp_account(mp, req_size);
   }
 
   /* Create redzone after the buffer. */
@@ -394,8 +499,7 @@ void *kmalloc(kmalloc_pool_t *mp, size_t size, unsigned flags) {
 static void kfree_nokasan(kmalloc_pool_t *mp, void *ptr) {
   assert(mtx_owned(&arena_lock));
   word_t *bt = bt_fromptr(ptr);
-  mp->used -= bt_size(bt);
-  mp->active--;
+  mp_unaccount(mp, bt_size(bt));
   free(ptr);
 }
 
@@ -403,6 +507,15 @@ void kfree(kmalloc_pool_t *mp, void *ptr) {
   if (ptr == NULL)
     return;
 
+  word_t *bt = bt_fromptr(ptr);
+  if (bt_inpool(bt)) {
+    /* Pool allocator takes care of KASAN quarantine on its own. */
+    assert(bt_used(bt));
+    mp_unaccount(mp, POOLHDR_SZ + class_size[tag_class(bt)]);
+    class_free(bt);
+    return;
+  }
+
   WITH_MTX_LOCK (&arena_lock) {
 #if KASAN
     word_t *bt = bt_fromptr(ptr);
@@ -425,15 +538,31 @@ void *krealloc(kmalloc_pool_t *mp, void *old_ptr, size_t size, unsigned flags) {
   if (old_ptr == NULL)
     return kmalloc(mp, size, flags);
 
-  WITH_MTX_LOCK (&arena_lock) {
-    if ((new_ptr = realloc(old_ptr, size)))
-      return new_ptr;
+  word_t *bt = bt_fromptr(old_ptr);
+  size_t old_size;
+
+  if (bt_inpool(bt)) {
+    old_size = class_size[tag_class(bt)];
+    /* Block is big enough, though it may be too big after shrinking. */
+    if (size <= old_size && size_class(payload_size(size)) == tag_class(bt)) {
+      /* Move redzone to the new end of the buffer. */
+      kasan_mark(old_ptr, size, old_size, KASAN_CODE_KMALLOC_OVERFLOW);
+      return old_ptr;
+    }
+  } else {
+    WITH_MTX_LOCK (&arena_lock) {
+      if ((new_ptr = realloc(old_ptr, payload_size(size)))) {
+        kasan_mark(new_ptr, size, bt_size(bt) - USEDBLK_SZ,
+                   KASAN_CODE_KMALLOC_OVERFLOW);
+        return new_ptr;
+      }
+    }
+    old_size = bt_size(bt) - sizeof(word_t);
   }
 
   /* Run out of options - need to move block physically. */
   if ((new_ptr = kmalloc(mp, size, flags))) {
-    word_t *bt = bt_fromptr(old_ptr);
-    memcpy(new_ptr, old_ptr, bt_size(bt) - sizeof(word_t));
+    memcpy(new_ptr, old_ptr, min(old_size, size));
     kfree(mp, old_ptr);
     return new_ptr;
   }
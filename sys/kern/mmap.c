@@ -8,6 +8,9 @@
 #include <sys/vm_object.h>
 #include <sys/mutex.h>
 #include <sys/proc.h>
+#include <sys/file.h>
+#include <sys/filedesc.h>
+#include <sys/vnode.h>
 
 /* Ensure kernel vm_prot_t & vm_flags_t map directly to user-space constants. */
 static_assert(VM_PROT_NONE == PROT_NONE, "VM_PROT_NONE != PROT_NONE");
@@ -22,7 +25,42 @@ static_assert(VM_PRIVATE == MAP_PRIVATE, "VM_PRIVATE != MAP_PRIVATE");
 static_assert(VM_FIXED == MAP_FIXED, "VM_FIXED != MAP_FIXED");
 static_assert(VM_STACK == MAP_STACK, "VM_STACK != MAP_STACK");
 
-int do_mmap(vaddr_t *addr_p, size_t length, int u_prot, int u_flags) {
+/* Get memory object with contents of the file referred to by `fd`. */
+static int mmap_file_object(proc_t *p, int fd, vm_prot_t prot,
+                            vm_flags_t flags, vm_object_t **objp) {
+  file_t *f;
+  int error;
+
+  if ((error = fdtab_get_file(p->p_fdtable, fd, 0, &f)))
+    return error;
+
+  if (f->f_type != FT_VNODE) {
+    error = ENODEV;
+  } else if (!(f->f_flags & FF_READ)) {
+    error = EACCES;
+  } else if ((flags & VM_SHARED) && (prot & VM_PROT_WRITE) &&
+             !(f->f_flags & FF_WRITE)) {
+    error = EACCES;
+  } else {
+    vnode_t *v = f->f_vnode;
+    vnode_lock(v);
+    error = VOP_MMAP(v, objp);
+    vnode_unlock(v);
+  }
+
+  /* Vnode pager never writes modified pages back to the file. */
+  if (!error && (*objp)->vo_pager->pgr_type == VM_VNODE &&
+      (flags & VM_SHARED) && (prot & VM_PROT_WRITE)) {
+    vm_object_drop(*objp);
+    error = ENOTSUP;
+  }
+
+  file_drop(f);
+  return error;
+}
+
+int do_mmap(vaddr_t *addr_p, size_t length, int u_prot, int u_flags, int fd,
+            off_t pos) {
   thread_t *td = thread_self();
   assert(td->td_proc != NULL);
   vm_map_t *vmap = td->td_proc->p_uspace;
@@ -42,8 +80,30 @@ int do_mmap(vaddr_t *addr_p, size_t length, int u_prot, int u_flags) {
     return EINVAL;
 
   int error;
+  vm_object_t *obj = NULL;
+
+  if (!(flags & VM_ANON)) {
+    if (pos < 0 || !page_aligned_p(pos))
+      return EINVAL;
+
+    if ((error = mmap_file_object(td->td_proc, fd, prot, flags, &obj)))
+      return error;
+
+    /* Private mapping sees pages of the file until it writes to them. */
+    if (flags & VM_PRIVATE) {
+      vm_object_t *shadow = vm_object_shadow(obj, pos + length);
+      vm_object_drop(obj);
+      obj = shadow;
+    }
+  } else {
+    pos = 0;
+  }
+
   vm_map_entry_t *ent;
-  if ((error = vm_map_alloc_entry(vmap, addr, length, prot, flags, &ent)))
+  error = vm_map_alloc_entry(vmap, obj, pos, addr, length, prot, flags, &ent);
+  if (obj)
+    vm_object_drop(obj);
+  if (error)
     return error;
 
   vaddr_t start = vm_map_entry_start(ent);
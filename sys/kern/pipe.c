@@ -5,6 +5,7 @@
 #include <sys/kmem.h>
 #include <sys/pool.h>
 #include <sys/errno.h>
+#include <sys/event.h>
 #include <sys/pipe.h>
 #include <sys/libkern.h>
 #include <sys/stat.h>
@@ -13,10 +14,24 @@
 #include <sys/proc.h>
 #include <sys/ringbuf.h>
 #include <sys/uio.h>
+#include <sys/pmap.h>
+#include <sys/vm_map.h>
+#include <sys/vm_physmem.h>
 
 /* Our pipes are unidrectional, since almost all software depends on POSIX
  * semantics. Please note that BSD systems implement bidirectional pipes,
- * even if they don't tell you that in pipe(2) manual. */
+ * even if they don't tell you that in pipe(2) manual.
+ *
+ * Small writes are copied into the pipe buffer. The buffer starts with
+ * `PIPE_SIZE` bytes and is doubled (up to `PIPE_MAX_SIZE`) each time a writer
+ * finds it full, so that streams of data need fewer context switches.
+ *
+ * Writes of at least `PIPE_DIRECT_MIN` bytes from user space bypass the buffer.
+ * The writer waits for the buffer to drain, loans the physical pages holding
+ * its data to the pipe and sleeps until the reader copies them out directly
+ * into its own address space. Loaned pages are held until the transfer ends,
+ * so that they aren't freed if other processes remove them from a shared
+ * object, e.g. by truncating a mapped file. */
 
 typedef struct pipe pipe_t;
 
@@ -28,27 +43,200 @@ struct pipe {
   condvar_t nonempty; /*!< used to wait data to appear in the buffer */
   condvar_t nonfull;  /*!< used to wait for free space in the buffer */
   ringbuf_t buf;      /*!< buffer with pipe data */
+  knlist_t knlist;    /*!< knotes monitoring both ends of the pipe */
+  /* Direct transfer state, valid only if `direct` is set. */
+  bool direct;   /*!< writer's pages are loaned to the pipe */
+  size_t d_pos;  /*!< offset of the next byte to read in loaned pages */
+  size_t d_end;  /*!< offset just after the last byte in loaned pages */
+  vm_page_t *d_pages[PIPE_DIRECT_PAGES]; /*!< pages loaned by the writer */
 };
 
-static POOL_DEFINE(P_PIPE, "pipe", sizeof(pipe_t));
+static size_t pipe_direct_count(pipe_t *pipe) {
+  return pipe->direct ? pipe->d_end - pipe->d_pos : 0;
+}
 
-static pipe_t *pipe_alloc(void) {
-  pipe_t *pipe = pool_alloc(P_PIPE, M_ZERO);
+/* Pipe buffer is kept while the pipe structure is cached in the pool. */
+static void pipe_ctor(void *ptr) {
+  pipe_t *pipe = ptr;
   mtx_init(&pipe->mtx, 0);
-  pipe->writer_closed = false;
-  pipe->reader_closed = false;
   cv_init(&pipe->nonempty, "pipe_nonempty");
   cv_init(&pipe->nonfull, "pipe_nonfull");
-  pipe->buf.data = kmem_alloc(PIPE_SIZE, M_ZERO);
-  pipe->buf.size = PIPE_SIZE;
+  knlist_init(&pipe->knlist);
+  ringbuf_init(&pipe->buf, kmem_alloc(PIPE_SIZE, 0), PIPE_SIZE);
+}
+
+static void pipe_dtor(void *ptr) {
+  pipe_t *pipe = ptr;
+  kmem_free(pipe->buf.data, pipe->buf.size);
+}
+
+static POOL_DEFINE(P_PIPE, "pipe", sizeof(pipe_t), .ctor = pipe_ctor,
+                   .dtor = pipe_dtor);
+
+static pipe_t *pipe_alloc(void) {
+  pipe_t *pipe = pool_alloc(P_PIPE, 0);
+  pipe->writer_closed = false;
+  pipe->reader_closed = false;
+  pipe->direct = false;
+  ringbuf_reset(&pipe->buf);
   return pipe;
 }
 
 static void pipe_free(pipe_t *pipe) {
-  kmem_free(pipe->buf.data, PIPE_SIZE);
+  assert(knlist_empty(&pipe->knlist));
+  /* Don't keep grown buffers in cached pipe structures. */
+  if (pipe->buf.size > PIPE_SIZE) {
+    kmem_free(pipe->buf.data, pipe->buf.size);
+    ringbuf_init(&pipe->buf, kmem_alloc(PIPE_SIZE, 0), PIPE_SIZE);
+  }
   pool_free(P_PIPE, pipe);
 }
 
+/* Replaces pipe buffer with one twice as large. Since memory allocation may
+ * sleep the pipe lock is released for that time. */
+static void pipe_grow(pipe_t *pipe) {
+  size_t size = pipe->buf.size * 2;
+
+  mtx_unlock(&pipe->mtx);
+  uint8_t *data = kmem_alloc(size, 0);
+  mtx_lock(&pipe->mtx);
+
+  ringbuf_t *rb = &pipe->buf;
+
+  /* Someone else could have resized the buffer in the meantime. */
+  if (rb->size >= size) {
+    mtx_unlock(&pipe->mtx);
+    kmem_free(data, size);
+    mtx_lock(&pipe->mtx);
+    return;
+  }
+
+  /* Used space is either [tail, head) or [tail, size) and [0, head). */
+  size_t count = rb->count;
+  size_t first = min(count, rb->size - rb->tail);
+  memcpy(data, rb->data + rb->tail, first);
+  memcpy(data + first, rb->data, count - first);
+
+  uint8_t *old_data = rb->data;
+  size_t old_size = rb->size;
+
+  ringbuf_init(rb, data, size);
+  rb->head = count;
+  rb->count = count;
+
+  mtx_unlock(&pipe->mtx);
+  kmem_free(old_data, old_size);
+  mtx_lock(&pipe->mtx);
+}
+
+/* Copies data from pages loaned by the writer to the reader. */
+static int pipe_direct_read(pipe_t *pipe, uio_t *uio) {
+  assert(mtx_owned(&pipe->mtx));
+  assert(pipe->direct);
+
+  while (uio->uio_resid > 0 && pipe->d_pos < pipe->d_end) {
+    vm_page_t *pg = pipe->d_pages[pipe->d_pos / PAGESIZE];
+    size_t off = pipe->d_pos % PAGESIZE;
+    size_t size = min(PAGESIZE - off, pipe->d_end - pipe->d_pos);
+    size_t resid = uio->uio_resid;
+    int error = uiomove((char *)pmap_page_kva(pg) + off, size, uio);
+    pipe->d_pos += resid - uio->uio_resid;
+    if (error)
+      return error;
+  }
+
+  return 0;
+}
+
+/* Looks up the page backing user virtual address `va`, faulting it in
+ * if necessary, and holds it. */
+static int pipe_loan_page(vaddr_t va, vm_page_t **pgp) {
+  paddr_t pa;
+
+  if (!pmap_extract(pmap_user(), va, &pa)) {
+    int error = vm_page_fault(vm_map_user(), va, VM_PROT_READ);
+    if (error)
+      return error;
+    if (!pmap_extract(pmap_user(), va, &pa))
+      return EFAULT;
+  }
+
+  *pgp = vm_page_find(pa);
+  assert(*pgp != NULL);
+  vm_page_hold(*pgp);
+  return 0;
+}
+
+static void pipe_unloan_pages(pipe_t *pipe, size_t npages) {
+  for (size_t i = 0; i < npages; i++)
+    vm_page_unhold(pipe->d_pages[i]);
+}
+
+/* Loans pages backing (a part of) the current segment of `uio` to the pipe
+ * and waits until the reader consumes them. */
+static int pipe_direct_write(pipe_t *pipe, uio_t *uio) {
+  assert(mtx_owned(&pipe->mtx));
+  assert(!pipe->direct && ringbuf_empty(&pipe->buf));
+
+  /* Skip empty segments the same way `uiomove` does. */
+  while (uio->uio_iov->iov_len == uio->uio_iovoff) {
+    uio->uio_iov++;
+    uio->uio_iovcnt--;
+    uio->uio_iovoff = 0;
+  }
+
+  iovec_t *iov = uio->uio_iov;
+  vaddr_t base = (vaddr_t)iov->iov_base + uio->uio_iovoff;
+  size_t off = base % PAGESIZE;
+  size_t len = min(iov->iov_len - uio->uio_iovoff, uio->uio_resid);
+  len = min(len, PIPE_DIRECT_PAGES * PAGESIZE - off);
+
+  size_t npages = howmany(off + len, PAGESIZE);
+
+  for (size_t i = 0; i < npages; i++) {
+    vaddr_t va = base - off + i * PAGESIZE;
+    int error = pipe_loan_page(va, &pipe->d_pages[i]);
+    if (error) {
+      pipe_unloan_pages(pipe, i);
+      return error;
+    }
+  }
+
+  pipe->direct = true;
+  pipe->d_pos = off;
+  pipe->d_end = off + len;
+
+  /* notify reader that new data is available */
+  cv_broadcast(&pipe->nonempty);
+  knote(&pipe->knlist, 0);
+
+  int error = 0;
+
+  while (pipe->d_pos < pipe->d_end) {
+    if (pipe->reader_closed) {
+      error = EPIPE;
+      break;
+    }
+    if (cv_wait_intr(&pipe->nonfull, &pipe->mtx)) {
+      error = ERESTARTSYS;
+      break;
+    }
+  }
+
+  /* Take back the pages and account for the data consumed by the reader. */
+  size_t done = pipe->d_pos - off;
+  uio->uio_iovoff += done;
+  uio->uio_resid -= done;
+  uio->uio_offset += done;
+  pipe->direct = false;
+  pipe_unloan_pages(pipe, npages);
+
+  /* wake up writers waiting for the transfer to finish */
+  cv_broadcast(&pipe->nonfull);
+  knote(&pipe->knlist, 0);
+  return error;
+}
+
 static int pipe_read(file_t *f, uio_t *uio) {
   pipe_t *pipe = f->f_data;
   int error;
@@ -61,7 +249,7 @@ static int pipe_read(file_t *f, uio_t *uio) {
 
   /* no read atomicity for now! */
   WITH_MTX_LOCK (&pipe->mtx) {
-    while (ringbuf_empty(&pipe->buf)) {
+    while (ringbuf_empty(&pipe->buf) && !pipe->direct) {
       /* pipe empty & no writers => return end-of-file */
       if (pipe->writer_closed)
         return 0;
@@ -70,10 +258,15 @@ static int pipe_read(file_t *f, uio_t *uio) {
         return ERESTARTSYS;
     }
 
-    if ((error = ringbuf_read(&pipe->buf, uio)))
+    if (pipe->direct)
+      error = pipe_direct_read(pipe, uio);
+    else
+      error = ringbuf_read(&pipe->buf, uio);
+    if (error)
       return error;
     /* notify writer that free space is available */
     cv_broadcast(&pipe->nonfull);
+    knote(&pipe->knlist, 0);
   }
 
   return 0;
@@ -97,13 +290,33 @@ static int pipe_write(file_t *f, uio_t *uio) {
         error = EPIPE;
         break;
       }
-      if ((error = ringbuf_write(&pipe->buf, uio)))
-        break;
-      /* notify reader that new data is available */
-      cv_broadcast(&pipe->nonempty);
-      /* nothing left to write? */
-      if (uio->uio_resid == 0)
-        return 0;
+      if (pipe->direct) {
+        /* another writer has loaned its pages, wait until they're consumed */
+      } else if (uio->uio_resid >= PIPE_DIRECT_MIN &&
+                 uio->uio_vmspace == vm_map_user()) {
+        /* direct transfer must not overtake data in the buffer */
+        if (ringbuf_empty(&pipe->buf)) {
+          if ((error = pipe_direct_write(pipe, uio)))
+            break;
+          if (uio->uio_resid == 0)
+            return 0;
+          continue;
+        }
+      } else {
+        if ((error = ringbuf_write(&pipe->buf, uio)))
+          break;
+        /* notify reader that new data is available */
+        cv_broadcast(&pipe->nonempty);
+        knote(&pipe->knlist, 0);
+        /* nothing left to write? */
+        if (uio->uio_resid == 0)
+          return 0;
+        /* the reader can't keep up, so give it more room */
+        if (pipe->buf.size < PIPE_MAX_SIZE) {
+          pipe_grow(pipe);
+          continue;
+        }
+      }
       /* buffer is full so wait for some data to be consumed */
       if (cv_wait_intr(&pipe->nonfull, &pipe->mtx)) {
         error = ERESTARTSYS;
@@ -136,6 +349,8 @@ static int pipe_close(file_t *f) {
       /* Wake up readers so that they exit. */
       cv_broadcast(&pipe->nonempty);
     }
+    /* Knotes on the other end must report EOF. */
+    knote(&pipe->knlist, 0);
     closed = pipe->reader_closed && pipe->writer_closed;
   }
 
@@ -158,6 +373,74 @@ static int pipe_seek(file_t *f, off_t offset, int whence, off_t *newoffp) {
   return EOPNOTSUPP;
 }
 
+static int filt_piperead(knote_t *kn, long hint) {
+  pipe_t *pipe = kn->kn_obj;
+
+  kn->kn_data = pipe->buf.count + pipe_direct_count(pipe);
+  if (pipe->writer_closed) {
+    kn->kn_flags |= EV_EOF;
+    return 1;
+  }
+  return kn->kn_data > 0;
+}
+
+static int filt_pipewrite(knote_t *kn, long hint) {
+  pipe_t *pipe = kn->kn_obj;
+
+  kn->kn_data = pipe->direct ? 0 : pipe->buf.size - pipe->buf.count;
+  if (pipe->reader_closed) {
+    kn->kn_flags |= EV_EOF;
+    return 1;
+  }
+  return kn->kn_data > 0;
+}
+
+static int filt_pipeattach(knote_t *kn) {
+  pipe_t *pipe = kn->kn_obj;
+  knlist_add(&pipe->knlist, kn);
+  return 0;
+}
+
+static void filt_pipedetach(knote_t *kn) {
+  pipe_t *pipe = kn->kn_obj;
+  knlist_remove(&pipe->knlist, kn);
+}
+
+static filterops_t pipe_readfiltops = {
+  .filt_attach = filt_pipeattach,
+  .filt_detach = filt_pipedetach,
+  .filt_event = filt_piperead,
+};
+
+static filterops_t pipe_writefiltops = {
+  .filt_attach = filt_pipeattach,
+  .filt_detach = filt_pipedetach,
+  .filt_event = filt_pipewrite,
+};
+
+static int pipe_kqfilter(file_t *f, knote_t *kn) {
+  pipe_t *pipe = f->f_data;
+
+  switch (kn->kn_filter) {
+    case EVFILT_READ:
+      if (!(f->f_flags & FF_READ))
+        return EINVAL;
+      kn->kn_filtops = &pipe_readfiltops;
+      break;
+    case EVFILT_WRITE:
+      if (!(f->f_flags & FF_WRITE))
+        return EINVAL;
+      kn->kn_filtops = &pipe_writefiltops;
+      break;
+    default:
+      return EINVAL;
+  }
+
+  kn->kn_obj = pipe;
+  kn->kn_objlock = &pipe->mtx;
+  return 0;
+}
+
 static fileops_t pipeops = {
   .fo_read = pipe_read,
   .fo_write = pipe_write,
@@ -165,6 +448,7 @@ static fileops_t pipeops = {
   .fo_seek = pipe_seek,
   .fo_stat = pipe_stat,
   .fo_ioctl = pipe_ioctl,
+  .fo_kqfilter = pipe_kqfilter,
 };
 
 static file_t *make_pipe_file(pipe_t *pipe, unsigned flags) {
@@ -4,6 +4,8 @@
 #include <sys/mimiker.h>
 #include <sys/klog.h>
 #include <sys/mutex.h>
+#include <sys/spinlock.h>
+#include <sys/pcpu.h>
 #include <sys/linker_set.h>
 #include <sys/sched.h>
 #include <sys/malloc.h>
@@ -26,10 +28,58 @@
 
 typedef LIST_HEAD(, slab) slab_list_t;
 
+/* Number of objects (rounds) that a magazine can hold. */
+#define MAG_SIZE 15
+/* Maximum number of magazines owned by a pool (in the depot and CPU caches). */
+#define POOL_MAXMAGS 16
+
+/*
+ * Magazine layer is based on Bonwick & Adams "Magazines and Vmem: Extending
+ * the Slab Allocator to Many CPUs and Arbitrary Resources".
+ *
+ * Each CPU caches two magazines: loaded and previous. Objects are taken from
+ * and returned to the loaded one. When it becomes empty (or full) it's swapped
+ * with the previous one if that is full (or empty). Otherwise a full (or empty)
+ * magazine is exchanged with the depot. Only when the depot cannot satisfy
+ * the request we fall back to the slab layer, protected by `pp_mtx`.
+ *
+ * Invariant: previous magazine is either NULL, empty or full.
+ *
+ * A pool owns at most POOL_MAXMAGS magazines. They're taken from P_MAGAZINE
+ * pool when objects are freed, and returned there only when the pool is
+ * destroyed. Thus reclaiming memory (which may happen while P_MAGAZINE is
+ * being grown) never frees magazines.
+ */
+typedef struct magazine {
+  SLIST_ENTRY(magazine) mag_link; /* depot magazine list */
+  unsigned mag_rounds;            /* # of objects in the magazine */
+  void *mag_objs[MAG_SIZE];
+} magazine_t;
+
+typedef SLIST_HEAD(, magazine) mag_list_t;
+
+typedef struct pool_cache {
+  spin_t pc_lock;
+  magazine_t *pc_loaded;   /* magazine we allocate from and free to */
+  magazine_t *pc_previous; /* full or empty magazine */
+  /* statistics */
+  size_t pc_nhits;   /* number of requests satisfied by magazine layer */
+  size_t pc_nmisses; /* number of requests that went to slab layer */
+} pool_cache_t;
+
 typedef struct pool {
   TAILQ_ENTRY(pool) pp_link;
   mtx_t pp_mtx;
   const char *pp_desc;
+  bool pp_cached;           /* is magazine layer enabled? */
+  pool_ctor_t pp_ctor;      /* object constructor */
+  pool_dtor_t pp_dtor;      /* object destructor */
+  spin_t pp_depot_lock;     /* protects magazine lists below */
+  mag_list_t pp_full_mags;  /* depot of full magazines */
+  mag_list_t pp_empty_mags; /* depot of empty magazines */
+  size_t pp_nfullmags;      /* number of full magazines in the depot */
+  size_t pp_nmags;          /* number of magazines owned by the pool */
+  pool_cache_t pp_cache[MAXCPU];
   slab_list_t pp_empty_slabs;
   slab_list_t pp_full_slabs;
   slab_list_t pp_part_slabs; /* partially allocated slabs */
@@ -49,11 +99,16 @@ typedef struct pool {
 static TAILQ_HEAD(, pool) pool_list = TAILQ_HEAD_INITIALIZER(pool_list);
 static MTX_DEFINE(pool_list_lock, 0);
 static KMALLOC_DEFINE(M_POOL, "pool allocators");
+static pool_t *P_MAGAZINE;
+/* Pools may release objects before kmem is ready, so the first magazines must
+ * come from static memory. */
+static alignas(PAGESIZE) uint8_t P_MAGAZINE_BOOTPAGE[PAGESIZE];
 
 typedef struct slab {
   LIST_ENTRY(slab) ph_link; /* pool slab list */
   uint16_t ph_nused;        /* # of items in use */
   uint16_t ph_ntotal;       /* total number of items */
+  bool ph_kmem;             /* was the slab allocated with kmem_alloc? */
   size_t ph_size;           /* size of memory allocated for the slab */
   size_t ph_itemsize;       /* total size of item (with header and redzone) */
   void *ph_items;           /* ptr to array of items after bitmap */
@@ -64,7 +119,8 @@ static void *slab_item_at(slab_t *slab, unsigned i) {
   return slab->ph_items + i * slab->ph_itemsize;
 }
 
-static void add_slab(pool_t *pool, slab_t *slab, size_t slabsize) {
+static void add_slab(pool_t *pool, slab_t *slab, size_t slabsize,
+                     bool kmem) {
   assert(mtx_owned(&pool->pp_mtx));
   assert(is_aligned(slab, PAGESIZE));
   assert(is_aligned(slabsize, PAGESIZE));
@@ -72,6 +128,7 @@ static void add_slab(pool_t *pool, slab_t *slab, size_t slabsize) {
   klog("add slab at %p to '%s' pool", slab, pool->pp_desc);
 
   slab->ph_size = slabsize;
+  slab->ph_kmem = kmem;
   slab->ph_itemsize = pool->pp_itemsize;
 #if KASAN
   slab->ph_itemsize += pool->pp_redzone;
@@ -101,6 +158,11 @@ static void add_slab(pool_t *pool, slab_t *slab, size_t slabsize) {
 
   bzero(slab->ph_bitmap, bitstr_size(slab->ph_ntotal));
 
+  if (pool->pp_ctor) {
+    for (unsigned i = 0; i < slab->ph_ntotal; i++)
+      pool->pp_ctor(slab_item_at(slab, i));
+  }
+
   LIST_INSERT_HEAD(&pool->pp_empty_slabs, slab, ph_link);
 
   pool->pp_ntotal += slab->ph_ntotal;
@@ -113,44 +175,185 @@ static void add_slab(pool_t *pool, slab_t *slab, size_t slabsize) {
   }
 }
 
-void *pool_alloc(pool_t *pool, kmem_flags_t flags) {
-  void *ptr;
+static pool_cache_t *pool_cache(pool_t *pool) {
+  return &pool->pp_cache[PCPU_GET(cpuid)];
+}
 
-  debug("pool_alloc: pool=%p", pool);
+/* Takes a full magazine from the depot in exchange for an empty one. */
+static magazine_t *depot_get_full(pool_t *pool, magazine_t *empty) {
+  SCOPED_SPIN_LOCK(&pool->pp_depot_lock);
 
-  WITH_MTX_LOCK (&pool->pp_mtx) {
-    slab_t *slab;
+  magazine_t *mag = SLIST_FIRST(&pool->pp_full_mags);
+  if (mag == NULL)
+    return NULL;
 
-    if (!(slab = LIST_FIRST(&pool->pp_part_slabs))) {
-      if (!(slab = LIST_FIRST(&pool->pp_empty_slabs))) {
-        slab = kmem_alloc(PAGESIZE, flags);
-        assert(slab != NULL);
-        add_slab(pool, slab, PAGESIZE);
-      }
-      /* We're going to allocate from empty slab
-       * -> move it to the list of non-empty slabs. */
-      assert(slab->ph_nused == 0);
-      LIST_REMOVE(slab, ph_link);
-      LIST_INSERT_HEAD(&pool->pp_part_slabs, slab, ph_link);
+  SLIST_REMOVE_HEAD(&pool->pp_full_mags, mag_link);
+  pool->pp_nfullmags--;
+  if (empty)
+    SLIST_INSERT_HEAD(&pool->pp_empty_mags, empty, mag_link);
+  return mag;
+}
+
+/* Takes an empty magazine from the depot in exchange for a full one. */
+static magazine_t *depot_get_empty(pool_t *pool, magazine_t *full) {
+  SCOPED_SPIN_LOCK(&pool->pp_depot_lock);
+
+  magazine_t *mag = SLIST_FIRST(&pool->pp_empty_mags);
+  if (mag == NULL)
+    return NULL;
+
+  SLIST_REMOVE_HEAD(&pool->pp_empty_mags, mag_link);
+  if (full) {
+    SLIST_INSERT_HEAD(&pool->pp_full_mags, full, mag_link);
+    pool->pp_nfullmags++;
+  }
+  return mag;
+}
+
+/* Tries to take an object from the magazine layer. */
+static void *pool_cache_alloc(pool_t *pool) {
+  pool_cache_t *pc = pool_cache(pool);
+  SCOPED_SPIN_LOCK(&pc->pc_lock);
+
+  for (;;) {
+    magazine_t *mag = pc->pc_loaded;
+
+    if (mag && mag->mag_rounds > 0) {
+      pc->pc_nhits++;
+      return mag->mag_objs[--mag->mag_rounds];
+    }
+
+    if (pc->pc_previous && pc->pc_previous->mag_rounds > 0) {
+      swap(pc->pc_loaded, pc->pc_previous);
+      continue;
+    }
+
+    magazine_t *full = depot_get_full(pool, pc->pc_previous);
+    if (full == NULL) {
+      pc->pc_nmisses++;
+      return NULL;
     }
 
-    assert(slab->ph_nused < slab->ph_ntotal);
-    int i = 0;
-    bit_ffc(slab->ph_bitmap, slab->ph_ntotal, &i);
-    bit_set(slab->ph_bitmap, i);
-    ptr = slab_item_at(slab, i);
-    debug("slab_alloc: allocated item %p at slab %p, index %d", ptr, slab, i);
-
-    if (++slab->ph_nused == slab->ph_ntotal) {
-      /* We've allocated last item from non-empty slab
-       * -> move it to the list of full slabs. */
-      LIST_REMOVE(slab, ph_link);
-      LIST_INSERT_HEAD(&pool->pp_full_slabs, slab, ph_link);
+    pc->pc_previous = pc->pc_loaded;
+    pc->pc_loaded = full;
+  }
+}
+
+/* Tries to return an object to the magazine layer. */
+static bool pool_cache_free(pool_t *pool, void *ptr) {
+  pool_cache_t *pc = pool_cache(pool);
+  SCOPED_SPIN_LOCK(&pc->pc_lock);
+
+  for (;;) {
+    magazine_t *mag = pc->pc_loaded;
+
+    if (mag && mag->mag_rounds < MAG_SIZE) {
+      pc->pc_nhits++;
+      mag->mag_objs[mag->mag_rounds++] = ptr;
+      return true;
+    }
+
+    if (pc->pc_previous && pc->pc_previous->mag_rounds == 0) {
+      swap(pc->pc_loaded, pc->pc_previous);
+      continue;
+    }
+
+    magazine_t *empty = depot_get_empty(pool, pc->pc_previous);
+    if (empty == NULL) {
+      pc->pc_nmisses++;
+      return false;
     }
 
-    pool->pp_nused++;
-    pool->pp_nmaxused = max(pool->pp_nmaxused, pool->pp_nused);
+    pc->pc_previous = pc->pc_loaded;
+    pc->pc_loaded = empty;
   }
+}
+
+/* Supplies the depot with an empty magazine, so that subsequent frees can be
+ * handled by magazine layer. */
+static void depot_grow(pool_t *pool) {
+  if (P_MAGAZINE == NULL)
+    return;
+
+  WITH_SPIN_LOCK (&pool->pp_depot_lock) {
+    if (pool->pp_nmags >= POOL_MAXMAGS)
+      return;
+    pool->pp_nmags++;
+  }
+
+  magazine_t *mag = pool_alloc(P_MAGAZINE, M_NOWAIT);
+
+  WITH_SPIN_LOCK (&pool->pp_depot_lock) {
+    if (mag == NULL) {
+      pool->pp_nmags--;
+    } else {
+      mag->mag_rounds = 0;
+      SLIST_INSERT_HEAD(&pool->pp_empty_mags, mag, mag_link);
+    }
+  }
+}
+
+static void *_pool_alloc(pool_t *pool, kmem_flags_t flags) {
+  void *ptr;
+
+  mtx_lock(&pool->pp_mtx);
+
+  while (LIST_EMPTY(&pool->pp_part_slabs) &&
+         LIST_EMPTY(&pool->pp_empty_slabs)) {
+    /* kmem may reclaim memory from pools (including this one), so the lock
+     * must not be held while a new slab is allocated. */
+    mtx_unlock(&pool->pp_mtx);
+    slab_t *slab = kmem_alloc(PAGESIZE, flags);
+    assert(slab != NULL);
+    mtx_lock(&pool->pp_mtx);
+    add_slab(pool, slab, PAGESIZE, true);
+  }
+
+  slab_t *slab;
+
+  if (!(slab = LIST_FIRST(&pool->pp_part_slabs))) {
+    slab = LIST_FIRST(&pool->pp_empty_slabs);
+    /* We're going to allocate from empty slab
+     * -> move it to the list of non-empty slabs. */
+    assert(slab->ph_nused == 0);
+    LIST_REMOVE(slab, ph_link);
+    LIST_INSERT_HEAD(&pool->pp_part_slabs, slab, ph_link);
+  }
+
+  assert(slab->ph_nused < slab->ph_ntotal);
+  int i = 0;
+  bit_ffc(slab->ph_bitmap, slab->ph_ntotal, &i);
+  bit_set(slab->ph_bitmap, i);
+  ptr = slab_item_at(slab, i);
+  debug("slab_alloc: allocated item %p at slab %p, index %d", ptr, slab, i);
+
+  if (++slab->ph_nused == slab->ph_ntotal) {
+    /* We've allocated last item from non-empty slab
+     * -> move it to the list of full slabs. */
+    LIST_REMOVE(slab, ph_link);
+    LIST_INSERT_HEAD(&pool->pp_full_slabs, slab, ph_link);
+  }
+
+  pool->pp_nused++;
+  pool->pp_nmaxused = max(pool->pp_nmaxused, pool->pp_nused);
+
+  mtx_unlock(&pool->pp_mtx);
+
+  return ptr;
+}
+
+void *pool_alloc(pool_t *pool, kmem_flags_t flags) {
+  void *ptr = NULL;
+
+  debug("pool_alloc: pool=%p", pool);
+
+  /* Zeroing would destroy the constructed state of an object. */
+  assert(!(pool->pp_ctor && (flags & M_ZERO)));
+
+  if (pool->pp_cached)
+    ptr = pool_cache_alloc(pool);
+  if (ptr == NULL)
+    ptr = _pool_alloc(pool, flags);
 
   /* Create redzone after the item. */
   kasan_mark(ptr, pool->pp_itemsize, pool->pp_itemsize + pool->pp_redzone,
@@ -196,6 +399,12 @@ static void _pool_free(pool_t *pool, void *ptr) {
 }
 
 void pool_free(pool_t *pool, void *ptr) {
+  if (pool->pp_cached) {
+    if (pool_cache_free(pool, ptr))
+      return;
+    depot_grow(pool);
+  }
+
   SCOPED_MTX_LOCK(&pool->pp_mtx);
 
   kasan_mark_invalid(ptr, pool->pp_itemsize + pool->pp_redzone,
@@ -212,14 +421,74 @@ static void pool_ctor(pool_t *pool) {
   LIST_INIT(&pool->pp_full_slabs);
   LIST_INIT(&pool->pp_part_slabs);
   mtx_init(&pool->pp_mtx, 0);
+  SLIST_INIT(&pool->pp_full_mags);
+  SLIST_INIT(&pool->pp_empty_mags);
+  spin_init(&pool->pp_depot_lock, 0);
+  for (int i = 0; i < MAXCPU; i++)
+    spin_init(&pool->pp_cache[i].pc_lock, 0);
+}
+
+/* Moves all objects cached in magazine layer back to slabs. Emptied magazines
+ * are left in the depot. */
+static void pool_drain(pool_t *pool) {
+  mag_list_t mags = SLIST_HEAD_INITIALIZER(mags);
+  magazine_t *mag;
+
+  for (int i = 0; i < MAXCPU; i++) {
+    pool_cache_t *pc = &pool->pp_cache[i];
+    WITH_SPIN_LOCK (&pc->pc_lock) {
+      if (pc->pc_loaded)
+        SLIST_INSERT_HEAD(&mags, pc->pc_loaded, mag_link);
+      if (pc->pc_previous)
+        SLIST_INSERT_HEAD(&mags, pc->pc_previous, mag_link);
+      pc->pc_loaded = NULL;
+      pc->pc_previous = NULL;
+    }
+  }
+
+  WITH_SPIN_LOCK (&pool->pp_depot_lock) {
+    while ((mag = SLIST_FIRST(&pool->pp_full_mags))) {
+      SLIST_REMOVE_HEAD(&pool->pp_full_mags, mag_link);
+      SLIST_INSERT_HEAD(&mags, mag, mag_link);
+    }
+    pool->pp_nfullmags = 0;
+  }
+
+  WITH_MTX_LOCK (&pool->pp_mtx) {
+    SLIST_FOREACH(mag, &mags, mag_link) {
+      for (unsigned i = 0; i < mag->mag_rounds; i++)
+        _pool_free(pool, mag->mag_objs[i]);
+      mag->mag_rounds = 0;
+    }
+  }
+
+  WITH_SPIN_LOCK (&pool->pp_depot_lock) {
+    while ((mag = SLIST_FIRST(&mags))) {
+      SLIST_REMOVE_HEAD(&mags, mag_link);
+      SLIST_INSERT_HEAD(&pool->pp_empty_mags, mag, mag_link);
+    }
+  }
 }
 
 static void destroy_slabs(pool_t *pool, slab_list_t *slabs) {
   slab_t *slab, *next;
 
   LIST_FOREACH_SAFE (slab, slabs, ph_link, next) {
+    /* Slabs supplied by pool_add_page don't belong to kmem. */
+    if (!slab->ph_kmem)
+      continue;
+
     klog("destroy_slab: pool = %p, slab = %p", pool, slab);
 
+    if (pool->pp_dtor) {
+      for (unsigned i = 0; i < slab->ph_ntotal; i++) {
+        void *item = slab_item_at(slab, i);
+        /* Free items are poisoned, but destructor needs to access them. */
+        kasan_mark_valid(item, pool->pp_itemsize);
+        pool->pp_dtor(item);
+      }
+    }
+
     pool->pp_ntotal -= slab->ph_ntotal;
     pool->pp_npages -= slab->ph_size;
 
@@ -254,6 +523,10 @@ static void pool_init(pool_t *pool, pool_init_t *args) {
   pool_ctor(pool);
   pool->pp_desc = desc;
   pool->pp_alignment = alignment;
+  pool->pp_ctor = args->ctor;
+  pool->pp_dtor = args->dtor;
+  /* Magazines would hide freed objects from KASAN quarantine. */
+  pool->pp_cached = !KASAN && !(args->flags & PF_NOCACHE);
 #if KASAN
   /* the alignment is within the redzone */
   pool->pp_itemsize = size;
@@ -270,12 +543,37 @@ static void pool_init(pool_t *pool, pool_init_t *args) {
 }
 
 void init_pool(void) {
+  P_MAGAZINE =
+    pool_create("magazines", sizeof(magazine_t), .flags = PF_NOCACHE);
+  pool_add_page(P_MAGAZINE, P_MAGAZINE_BOOTPAGE, sizeof(P_MAGAZINE_BOOTPAGE));
   INVOKE_CTORS(pool_ctor_table);
 }
 
 void pool_add_page(pool_t *pool, void *page, size_t size) {
   SCOPED_MTX_LOCK(&pool->pp_mtx);
-  add_slab(pool, page, size);
+  add_slab(pool, page, size, false);
+}
+
+void pool_reclaim(void) {
+  SCOPED_MTX_LOCK(&pool_list_lock);
+
+  pool_t *pool;
+  TAILQ_FOREACH (pool, &pool_list, pp_link) {
+    /* Object constructors run with the pool lock held and may allocate
+     * memory, so we can be called with the lock held by us. Rather than
+     * risking a deadlock skip busy pools. */
+    if (mtx_owner(&pool->pp_mtx))
+      continue;
+    if (pool->pp_cached)
+      pool_drain(pool);
+    WITH_MTX_LOCK (&pool->pp_mtx) {
+      size_t npages = pool->pp_npages;
+      destroy_slabs(pool, &pool->pp_empty_slabs);
+      if (npages > pool->pp_npages)
+        klog("reclaimed %d bytes from '%s' pool", npages - pool->pp_npages,
+             pool->pp_desc);
+    }
+  }
 }
 
 pool_t *_pool_create(pool_init_t *args) {
@@ -287,6 +585,15 @@ pool_t *_pool_create(pool_init_t *args) {
 void pool_destroy(pool_t *pool) {
   WITH_MTX_LOCK (&pool_list_lock)
     TAILQ_REMOVE(&pool_list, pool, pp_link);
+  if (pool->pp_cached) {
+    pool_drain(pool);
+    magazine_t *mag;
+    while ((mag = SLIST_FIRST(&pool->pp_empty_mags))) {
+      SLIST_REMOVE_HEAD(&pool->pp_empty_mags, mag_link);
+      pool_free(P_MAGAZINE, mag);
+    }
+    pool->pp_nmags = 0;
+  }
   WITH_MTX_LOCK (&pool->pp_mtx)
     /* Lock needed as the quarantine may call _pool_free! */
     kasan_quar_releaseall(&pool->pp_quarantine);
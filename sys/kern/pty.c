@@ -10,6 +10,7 @@
 #include <sys/proc.h>
 #include <sys/fcntl.h>
 #include <sys/errno.h>
+#include <sys/event.h>
 #include <sys/stat.h>
 #include <sys/devfs.h>
 #include <sys/linker_set.h>
@@ -27,6 +28,7 @@ typedef struct {
   atomic_int pt_number; /* PTY number, if allocated. -1 means free. */
   condvar_t pt_incv;    /* CV for readers */
   condvar_t pt_outcv;   /* CV for writers */
+  knlist_t pt_knlist;   /* Knotes monitoring the master device */
 } pty_t;
 
 static pty_t pty_array[MAX_PTYS];
@@ -43,6 +45,7 @@ static pty_t *pty_alloc(void) {
 
 static void pty_free(pty_t *pty) {
   assert(pty->pt_number >= 0);
+  assert(knlist_empty(&pty->pt_knlist));
   pty->pt_number = -1;
 }
 
@@ -188,6 +191,74 @@ static int pty_ioctl(file_t *f, u_long cmd, void *data) {
   return tty_ioctl(f, cmd, data);
 }
 
+/* Master side is readable if there are characters in the slave's output queue
+ * and writable if the slave's input queue is not full. */
+static int filt_ptyread(knote_t *kn, long hint) {
+  tty_t *tty = kn->kn_obj;
+
+  kn->kn_data = tty->t_outq.count;
+  if (!tty_opened(tty)) {
+    kn->kn_flags |= EV_EOF;
+    return 1;
+  }
+  return kn->kn_data > 0;
+}
+
+static int filt_ptywrite(knote_t *kn, long hint) {
+  tty_t *tty = kn->kn_obj;
+
+  kn->kn_data = tty->t_inq.size - tty->t_inq.count;
+  if (!tty_opened(tty)) {
+    kn->kn_flags |= EV_EOF;
+    return 1;
+  }
+  return !(tty->t_flags & TF_IN_HIWAT);
+}
+
+static int filt_ptyattach(knote_t *kn) {
+  tty_t *tty = kn->kn_obj;
+  pty_t *pty = tty->t_data;
+  knlist_add(&pty->pt_knlist, kn);
+  return 0;
+}
+
+static void filt_ptydetach(knote_t *kn) {
+  tty_t *tty = kn->kn_obj;
+  pty_t *pty = tty->t_data;
+  knlist_remove(&pty->pt_knlist, kn);
+}
+
+static filterops_t pty_readfiltops = {
+  .filt_attach = filt_ptyattach,
+  .filt_detach = filt_ptydetach,
+  .filt_event = filt_ptyread,
+};
+
+static filterops_t pty_writefiltops = {
+  .filt_attach = filt_ptyattach,
+  .filt_detach = filt_ptydetach,
+  .filt_event = filt_ptywrite,
+};
+
+static int pty_kqfilter(file_t *f, knote_t *kn) {
+  tty_t *tty = f->f_data;
+
+  switch (kn->kn_filter) {
+    case EVFILT_READ:
+      kn->kn_filtops = &pty_readfiltops;
+      break;
+    case EVFILT_WRITE:
+      kn->kn_filtops = &pty_writefiltops;
+      break;
+    default:
+      return EINVAL;
+  }
+
+  kn->kn_obj = tty;
+  kn->kn_objlock = &tty->t_lock;
+  return 0;
+}
+
 static fileops_t pty_fileops = {
   .fo_read = pty_read,
   .fo_write = pty_write,
@@ -195,18 +266,21 @@ static fileops_t pty_fileops = {
   .fo_seek = noseek,
   .fo_stat = pty_stat,
   .fo_ioctl = pty_ioctl,
+  .fo_kqfilter = pty_kqfilter,
 };
 
 static void pty_notify_out(tty_t *tty) {
   pty_t *pty = tty->t_data;
   /* Notify PTY readers: input is available. */
   cv_broadcast(&pty->pt_incv);
+  knote(&pty->pt_knlist, 0);
 }
 
 static void pty_notify_in(tty_t *tty) {
   pty_t *pty = tty->t_data;
   /* Notify PTY writers: there is space in the slave TTY's input buffer. */
   cv_broadcast(&pty->pt_outcv);
+  knote(&pty->pt_knlist, 0);
 }
 
 static void pty_notify_inactive(tty_t *tty) {
@@ -214,6 +288,7 @@ static void pty_notify_inactive(tty_t *tty) {
   /* Notify PTY readers and writers so that they abort. */
   cv_broadcast(&pty->pt_incv);
   cv_broadcast(&pty->pt_outcv);
+  knote(&pty->pt_knlist, 0);
 }
 
 static ttyops_t pty_ttyops = {.t_notify_out = pty_notify_out,
@@ -278,6 +353,7 @@ static void init_pty(void) {
     pty->pt_number = -1;
     cv_init(&pty->pt_incv, "pt_incv");
     cv_init(&pty->pt_outcv, "pt_outcv");
+    knlist_init(&pty->pt_knlist);
   }
 }
 
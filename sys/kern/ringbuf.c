@@ -1,7 +1,28 @@
 #include <sys/klog.h>
+#include <sys/mimiker.h>
+#include <sys/libkern.h>
+#include <sys/param.h>
 #include <sys/ringbuf.h>
 #include <sys/uio.h>
 
+/* Copy `n` bytes from `src` into circular buffer `ring` of `size` bytes
+ * starting at position `pos`. Wrap-around is handled with a second copy. */
+static void copy_to_ring(uint8_t *ring, size_t size, size_t pos,
+                         const uint8_t *src, size_t n) {
+  size_t first = min(n, size - pos);
+  memcpy(ring + pos, src, first);
+  memcpy(ring, src + first, n - first);
+}
+
+/* Copy `n` bytes from circular buffer `ring` of `size` bytes starting
+ * at position `pos` into `dst`. */
+static void copy_from_ring(const uint8_t *ring, size_t size, size_t pos,
+                           uint8_t *dst, size_t n) {
+  size_t first = min(n, size - pos);
+  memcpy(dst, ring + pos, first);
+  memcpy(dst + first, ring, n - first);
+}
+
 void ringbuf_init(ringbuf_t *rb, void *buf, size_t size) {
   rb->head = 0;
   rb->tail = 0;
@@ -10,22 +31,20 @@ void ringbuf_init(ringbuf_t *rb, void *buf, size_t size) {
   rb->data = buf;
 }
 
-static void produce(ringbuf_t *buf, unsigned bytes) {
+static void produce(ringbuf_t *buf, size_t bytes) {
   assert(buf->count + bytes <= buf->size);
-  assert(buf->head + bytes <= buf->size);
   buf->count += bytes;
   buf->head += bytes;
-  if (buf->head == buf->size)
-    buf->head = 0;
+  if (buf->head >= buf->size)
+    buf->head -= buf->size;
 }
 
-static void consume(ringbuf_t *buf, unsigned bytes) {
+static void consume(ringbuf_t *buf, size_t bytes) {
   assert(buf->count >= bytes);
-  assert(buf->tail + bytes <= buf->size);
   buf->count -= bytes;
   buf->tail += bytes;
-  if (buf->tail == buf->size)
-    buf->tail = 0;
+  if (buf->tail >= buf->size)
+    buf->tail -= buf->size;
 }
 
 bool ringbuf_putb(ringbuf_t *buf, uint8_t byte) {
@@ -39,8 +58,8 @@ bool ringbuf_putb(ringbuf_t *buf, uint8_t byte) {
 bool ringbuf_putnb(ringbuf_t *buf, uint8_t *data, size_t n) {
   if (buf->count + n > buf->size)
     return false;
-  for (size_t i = 0; i < n; i++)
-    ringbuf_putb(buf, data[i]);
+  copy_to_ring(buf->data, buf->size, buf->head, data, n);
+  produce(buf, n);
   return true;
 }
 
@@ -55,8 +74,8 @@ bool ringbuf_getb(ringbuf_t *buf, uint8_t *byte_p) {
 bool ringbuf_getnb(ringbuf_t *buf, uint8_t *data, size_t n) {
   if (buf->count < n)
     return false;
-  for (size_t i = 0; i < n; i++)
-    ringbuf_getb(buf, &data[i]);
+  copy_from_ring(buf->data, buf->size, buf->tail, data, n);
+  consume(buf, n);
   return true;
 }
 
@@ -72,8 +91,14 @@ bool ringbuf_moveb(ringbuf_t *src, ringbuf_t *dst) {
 bool ringbuf_movenb(ringbuf_t *src, ringbuf_t *dst, size_t n) {
   if (src->count < n || dst->count + n > dst->size)
     return false;
-  for (size_t i = 0; i < n; i++)
-    ringbuf_moveb(src, dst);
+  /* used space of `src` is split into at most two parts */
+  while (n > 0) {
+    size_t size = min(n, src->size - src->tail);
+    copy_to_ring(dst->data, dst->size, dst->head, src->data + src->tail, size);
+    produce(dst, size);
+    consume(src, size);
+    n -= size;
+  }
   return true;
 }
 
@@ -114,3 +139,58 @@ int ringbuf_write(ringbuf_t *buf, uio_t *uio) {
 void ringbuf_reset(ringbuf_t *buf) {
   ringbuf_init(buf, buf->data, buf->size);
 }
+
+/*
+ * Single-producer single-consumer ring buffer.
+ *
+ * Head and tail are free running counters, i.e. they're never wrapped, so the
+ * number of stored bytes is simply `head - tail`. Buffer size must be a power
+ * of two, so that positions stay consistent when counters overflow.
+ *
+ * Producer writes data first and then publishes it by moving head forward with
+ * release semantics. Consumer observes head with acquire semantics, so it sees
+ * the data written before head was updated. Same goes for tail in the other
+ * direction, hence free space is never overwritten before it's consumed.
+ */
+
+void spsc_ringbuf_init(spsc_ringbuf_t *rb, void *buf, size_t size) {
+  assert(powerof2(size));
+  atomic_store_explicit(&rb->head, 0, memory_order_relaxed);
+  atomic_store_explicit(&rb->tail, 0, memory_order_relaxed);
+  rb->size = size;
+  rb->data = buf;
+}
+
+bool spsc_ringbuf_putb(spsc_ringbuf_t *rb, uint8_t byte) {
+  return spsc_ringbuf_putnb(rb, &byte, 1);
+}
+
+bool spsc_ringbuf_putnb(spsc_ringbuf_t *rb, const uint8_t *data, size_t n) {
+  size_t head = atomic_load_explicit(&rb->head, memory_order_relaxed);
+  size_t tail = atomic_load_explicit(&rb->tail, memory_order_acquire);
+  if (head - tail + n > rb->size)
+    return false;
+  copy_to_ring(rb->data, rb->size, head & (rb->size - 1), data, n);
+  atomic_store_explicit(&rb->head, head + n, memory_order_release);
+  return true;
+}
+
+bool spsc_ringbuf_getb(spsc_ringbuf_t *rb, uint8_t *byte_p) {
+  return spsc_ringbuf_getnb(rb, byte_p, 1);
+}
+
+bool spsc_ringbuf_getnb(spsc_ringbuf_t *rb, uint8_t *data, size_t n) {
+  size_t tail = atomic_load_explicit(&rb->tail, memory_order_relaxed);
+  size_t head = atomic_load_explicit(&rb->head, memory_order_acquire);
+  if (head - tail < n)
+    return false;
+  copy_from_ring(rb->data, rb->size, tail & (rb->size - 1), data, n);
+  atomic_store_explicit(&rb->tail, tail + n, memory_order_release);
+  return true;
+}
+
+size_t spsc_ringbuf_count(spsc_ringbuf_t *rb) {
+  size_t tail = atomic_load_explicit(&rb->tail, memory_order_acquire);
+  size_t head = atomic_load_explicit(&rb->head, memory_order_acquire);
+  return head - tail;
+}
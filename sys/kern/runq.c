@@ -2,6 +2,10 @@
 #include <sys/mimiker.h>
 #include <sys/thread.h>
 #include <sys/runq.h>
+#include <sys/bitops.h>
+
+#define RQ_WORD(i) ((i) / RQ_BPW)
+#define RQ_BIT(i) (1U << ((i) % RQ_BPW))
 
 void runq_init(runq_t *rq) {
   memset(rq, 0, sizeof(*rq));
@@ -13,15 +17,18 @@ void runq_init(runq_t *rq) {
 void runq_add(runq_t *rq, thread_t *td) {
   unsigned prio = td->td_prio / RQ_PPQ;
   TAILQ_INSERT_TAIL(&rq->rq_queues[prio], td, td_runq);
+  rq->rq_status[RQ_WORD(prio)] |= RQ_BIT(prio);
+  rq->rq_count++;
 }
 
 thread_t *runq_choose(runq_t *rq) {
-  for (int i = 0; i < RQ_NQS; i++) {
-    struct rq_head *head = &rq->rq_queues[i];
-    thread_t *td = TAILQ_FIRST(head);
+  for (int i = 0; i < RQ_NSW; i++) {
+    uint32_t status = rq->rq_status[i];
 
-    if (td)
-      return td;
+    if (status) {
+      unsigned prio = i * RQ_BPW + ffs32(status) - 1;
+      return TAILQ_FIRST(&rq->rq_queues[prio]);
+    }
   }
 
   return NULL;
@@ -29,5 +36,9 @@ thread_t *runq_choose(runq_t *rq) {
 
 void runq_remove(runq_t *rq, thread_t *td) {
   unsigned prio = td->td_prio / RQ_PPQ;
-  TAILQ_REMOVE(&rq->rq_queues[prio], td, td_runq);
+  struct rq_head *head = &rq->rq_queues[prio];
+  TAILQ_REMOVE(head, td, td_runq);
+  if (TAILQ_EMPTY(head))
+    rq->rq_status[RQ_WORD(prio)] &= ~RQ_BIT(prio);
+  rq->rq_count--;
 }
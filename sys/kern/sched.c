@@ -12,21 +12,194 @@
 #include <sys/turnstile.h>
 
 static SPIN_DEFINE(sched_lock, 0);
-static runq_t runq;
+static runq_t runq[MAXCPU];
 static bool sched_active = false;
 
 #define SLICE 10
+#define SLICE_MIN 5  /* Time slice of the most interactive user thread. */
+#define SLICE_MAX 20 /* Time slice of the least interactive user thread. */
+#define BALANCE_TICKS 100 /* Number of ticks between load balancing passes. */
+
+/* Interactivity score ranges from 0 (only sleeps) to 100 (only runs). */
+#define INTERACT_MAX 100
+#define INTERACT_HALF (INTERACT_MAX / 2)
+/* Sleep and run time history is scaled down when it exceeds 5 seconds. */
+#define HIST_MAX 5000000
+/* How much can priority of a user thread change due to its interactivity. */
+#define PRIO_BOOST (PRIO_UTHRD_QTY / 2)
 
 void init_sched(void) {
+  unsigned i;
+
   thread0.td_lock = &sched_lock;
-  runq_init(&runq);
+
+  CPU_FOREACH (i) {
+    runq_init(&runq[i]);
+    _pcpu_data[i].runq = &runq[i];
+    _pcpu_data[i].cpuid = i;
+  }
+}
+
+/* Insert thread into given run queue and remember the choice in \a td. */
+static void sched_runq_add(runq_t *rq, thread_t *td) {
+  runq_add(rq, td);
+  td->td_runqueue = rq;
+}
+
+static void sched_runq_remove(thread_t *td) {
+  runq_remove(td->td_runqueue, td);
+}
+
+/* Returns the most loaded run queue other than \a rq or NULL if all other run
+ * queues are empty. */
+static runq_t *sched_busiest(runq_t *rq) {
+  runq_t *busiest = NULL;
+  unsigned i;
+
+  CPU_FOREACH (i) {
+    runq_t *other = &runq[i];
+    if (other == rq || other->rq_count == 0)
+      continue;
+    if (busiest == NULL || other->rq_count > busiest->rq_count)
+      busiest = other;
+  }
+
+  return busiest;
+}
+
+/* Returns the least loaded run queue. */
+static runq_t *sched_idlest(void) {
+  runq_t *idlest = &runq[0];
+  unsigned i;
+
+  CPU_FOREACH (i) {
+    if (runq[i].rq_count < idlest->rq_count)
+      idlest = &runq[i];
+  }
+
+  return idlest;
+}
+
+/*! \brief Takes the highest priority thread from a run queue of another CPU.
+ *
+ * Called when \a rq (i.e. run queue of current CPU) is empty and the CPU would
+ * run its idle thread otherwise.
+ *
+ * \returns NULL if there's nothing to steal
+ */
+static thread_t *sched_steal(runq_t *rq) {
+  runq_t *victim = sched_busiest(rq);
+  if (victim == NULL)
+    return NULL;
+
+  thread_t *td = runq_choose(victim);
+  assert(td != NULL);
+  runq_remove(victim, td);
+  td->td_runqueue = rq;
+  klog("Thread %ld {%p} stolen by CPU %u", td->td_tid, td, PCPU_GET(cpuid));
+  return td;
+}
+
+/*! \brief Moves threads from the busiest to the idlest run queue until load
+ * of all run queues differs by at most one thread. */
+static void sched_balance(void) {
+  for (;;) {
+    runq_t *idlest = sched_idlest();
+    runq_t *busiest = sched_busiest(idlest);
+
+    if (busiest == NULL || busiest->rq_count <= idlest->rq_count + 1)
+      return;
+
+    thread_t *td = runq_choose(busiest);
+    runq_remove(busiest, td);
+    sched_runq_add(idlest, td);
+  }
+}
+
+/* Threads with base priority from user range are subject to time-sharing,
+ * i.e. their priority and time slice depend on interactivity score. Idle
+ * threads mostly sleep, but must not get ahead of user threads. */
+static inline bool td_is_timeshare(thread_t *td) {
+  return prio_le(td->td_base_prio, prio_uthread(0)) &&
+         !(td->td_flags & TDF_IDLE);
+}
+
+static uint32_t bt2us(bintime_t *bt) {
+  timeval_t tv;
+  bt2tv(bt, &tv);
+  if (tv.tv_sec >= HIST_MAX / 1000000)
+    return HIST_MAX;
+  return tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/* Keeps only recent behaviour of a thread in its sleep and run history, so
+ * that a thread can change from being interactive to batch and back. */
+static void sched_hist_update(thread_t *td, uint32_t *hist, bintime_t *bt) {
+  *hist += bt2us(bt);
+
+  uint64_t sum = td->td_slphist + td->td_runhist;
+  if (sum <= HIST_MAX)
+    return;
+
+  /* Scale both values to 80% of the limit, preserving their ratio. */
+  td->td_slphist = td->td_slphist * (uint64_t)HIST_MAX * 4 / 5 / sum;
+  td->td_runhist = td->td_runhist * (uint64_t)HIST_MAX * 4 / 5 / sum;
+}
+
+/*! \brief Computes interactivity score of a thread.
+ *
+ * Threads that mostly sleep get a score below \a INTERACT_HALF, proportional
+ * to run to sleep time ratio. Threads that mostly run get a score above
+ * \a INTERACT_HALF, proportional to sleep to run time ratio.
+ */
+static unsigned sched_interact_score(thread_t *td) {
+  uint32_t slp = td->td_slphist;
+  uint32_t run = td->td_runhist;
+
+  if (run > slp)
+    return INTERACT_MAX - (uint64_t)slp * INTERACT_HALF / run;
+  if (slp > run)
+    return (uint64_t)run * INTERACT_HALF / slp;
+  return INTERACT_HALF;
+}
+
+/* Returns active priority of a thread which does not borrow priority. */
+static prio_t sched_prio(thread_t *td) {
+  if (!td_is_timeshare(td))
+    return td->td_base_prio;
+
+  int score = sched_interact_score(td);
+  int boost = (INTERACT_HALF - score) * PRIO_BOOST / INTERACT_HALF;
+  int prio = td->td_base_prio - boost;
+  return min(max(prio, (int)prio_uthread(0)), (int)prio_uthread(PRIO_QTY - 1));
+}
+
+/* Interactive threads get shorter time slices but thanks to higher priority
+ * they preempt batch threads, which get longer slices to do more work. */
+static int sched_slice(thread_t *td) {
+  if (!td_is_timeshare(td) || prio_gt(td->td_prio, prio_uthread(0)))
+    return SLICE;
+
+  unsigned level = td->td_prio - prio_uthread(0);
+  return SLICE_MIN + level * (SLICE_MAX - SLICE_MIN) / (PRIO_UTHRD_QTY - 1);
+}
+
+/* Recalculates priority & time slice of a thread that is not on a run queue. */
+static void sched_update(thread_t *td) {
+  if (!td_is_borrowing(td))
+    td->td_prio = sched_prio(td);
+  td->td_slice = sched_slice(td);
 }
 
 void sched_add(thread_t *td) {
   klog("Add thread %ld {%p} to scheduler", td->td_tid, td);
 
-  WITH_SPIN_LOCK (td->td_lock)
+  WITH_SPIN_LOCK (td->td_lock) {
+    /* New thread hasn't slept yet, so time since its creation (or since boot
+     * for the first one) mustn't be accounted as sleep. */
+    td->td_last_slptime = binuptime();
     sched_wakeup(td, 0);
+  }
 }
 
 void sched_wakeup(thread_t *td, long reason) {
@@ -38,17 +211,23 @@ void sched_wakeup(thread_t *td, long reason) {
   bintime_t now = binuptime();
   bintime_sub(&now, &td->td_last_slptime);
   bintime_add(&td->td_slptime, &now);
+  sched_hist_update(td, &td->td_slphist, &now);
 
   td->td_state = TDS_READY;
-  td->td_slice = SLICE;
+  sched_update(td);
 
   ctx_set_retval(td->td_kctx, reason);
 
-  runq_add(&runq, td);
+  /* Prefer the CPU the thread was running on recently, since its caches may
+   * still hold thread's working set. Load balancer will fix the imbalance. */
+  runq_t *rq = td->td_runqueue ? td->td_runqueue : PCPU_GET(runq);
+  sched_runq_add(rq, td);
 
-  /* Check if we need to reschedule threads. */
+  /* Check if we need to reschedule threads. Other CPUs cannot be notified,
+   * since there are no inter-processor interrupts. A thread put on a remote
+   * run queue waits until that CPU enters the scheduler by itself. */
   thread_t *oldtd = thread_self();
-  if (prio_gt(td->td_prio, oldtd->td_prio))
+  if (rq == PCPU_GET(runq) && prio_gt(td->td_prio, oldtd->td_prio))
     oldtd->td_flags |= TDF_NEEDSWITCH;
 }
 
@@ -64,9 +243,9 @@ static void sched_set_active_prio(thread_t *td, prio_t prio) {
 
   if (td_is_ready(td)) {
     /* Thread is on a run queue. */
-    runq_remove(&runq, td);
+    sched_runq_remove(td);
     td->td_prio = prio;
-    runq_add(&runq, td);
+    sched_runq_add(td->td_runqueue, td);
   } else {
     td->td_prio = prio;
   }
@@ -76,6 +255,7 @@ void sched_set_prio(thread_t *td, prio_t prio) {
   assert(spin_owned(td->td_lock));
 
   td->td_base_prio = prio;
+  prio = sched_prio(td);
 
   /* If thread is borrowing priority, don't lower its active priority. */
   if (td_is_borrowing(td) && prio_gt(td->td_prio, prio))
@@ -101,9 +281,11 @@ void sched_lend_prio(thread_t *td, prio_t prio) {
 void sched_unlend_prio(thread_t *td, prio_t prio) {
   assert(spin_owned(td->td_lock));
 
-  if (prio_le(prio, td->td_base_prio)) {
+  prio_t own_prio = sched_prio(td);
+
+  if (prio_le(prio, own_prio)) {
     td->td_flags &= ~TDF_BORROWING;
-    sched_set_active_prio(td, td->td_base_prio);
+    sched_set_active_prio(td, own_prio);
   } else
     sched_lend_prio(td, prio);
 }
@@ -113,10 +295,12 @@ void sched_unlend_prio(thread_t *td, prio_t prio) {
  * \note Returned thread is marked as running!
  */
 static thread_t *sched_choose(void) {
-  thread_t *td = runq_choose(&runq);
-  if (td == NULL)
+  runq_t *rq = PCPU_GET(runq);
+  thread_t *td = runq_choose(rq);
+  if (td != NULL)
+    sched_runq_remove(td);
+  else if ((td = sched_steal(rq)) == NULL)
     return PCPU_GET(idle_thread);
-  runq_remove(&runq, td);
   td->td_state = TDS_RUNNING;
   td->td_last_rtime = binuptime();
   return td;
@@ -131,17 +315,24 @@ long sched_switch(void) {
   assert(spin_owned(td->td_lock));
   assert(!td_is_running(td));
 
+  bool sliceend = td->td_flags & TDF_SLICEEND;
   td->td_flags &= ~(TDF_SLICEEND | TDF_NEEDSWITCH);
 
   /* Update running time, */
   bintime_t now = binuptime();
   bintime_sub(&now, &td->td_last_rtime);
   bintime_add(&td->td_rtime, &now);
+  sched_hist_update(td, &td->td_runhist, &now);
 
   if (td_is_ready(td)) {
     /* Idle threads need not to be inserted into the run queue. */
-    if (td != PCPU_GET(idle_thread))
-      runq_add(&runq, td);
+    if (td != PCPU_GET(idle_thread)) {
+      /* Thread used up its time slice, so it may have become less
+       * interactive. Its new slice depends on updated priority. */
+      if (sliceend)
+        sched_update(td);
+      sched_runq_add(PCPU_GET(runq), td);
+    }
   } else if (td_is_sleeping(td)) {
     /* Record when the thread fell asleep. */
     td->td_last_slptime = now;
@@ -154,6 +345,11 @@ long sched_switch(void) {
   if (td == newtd)
     goto noswitch;
 
+  /* Clock may have been stopped while idle, but other threads need ticks to
+   * account for their time slices. */
+  if (td == PCPU_GET(idle_thread))
+    clock_resume();
+
   /* If we got here then a context switch is required. */
   td->td_nctxsw++;
 
@@ -172,8 +368,16 @@ noswitch:
 }
 
 void sched_clock(void) {
+  static unsigned balance_ticks = BALANCE_TICKS;
+
   assert(intr_disabled());
 
+  /* Only the first CPU performs periodic load balancing. */
+  if (PCPU_GET(cpuid) == 0 && --balance_ticks == 0) {
+    balance_ticks = BALANCE_TICKS;
+    sched_balance();
+  }
+
   thread_t *td = thread_self();
 
   if (td != PCPU_GET(idle_thread)) {
@@ -198,6 +402,8 @@ __noreturn void sched_run(void) {
   sched_active = true;
 
   while (true) {
+    /* Don't let the clock interrupt us until there's something to do. */
+    clock_idle();
     WITH_SPIN_LOCK (td->td_lock)
       td->td_flags |= TDF_NEEDSWITCH;
   }
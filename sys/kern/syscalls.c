@@ -169,11 +169,14 @@ static int sys_mmap(proc_t *p, mmap_args_t *args, register_t *res) {
   size_t length = SCARG(args, len);
   vm_prot_t prot = SCARG(args, prot);
   int flags = SCARG(args, flags);
+  int fd = SCARG(args, fd);
+  off_t pos = SCARG(args, pos);
 
-  klog("mmap(%p, %u, %d, %d)", (void *)va, length, prot, flags);
+  klog("mmap(%p, %u, %d, %d, %d, %d)", (void *)va, length, prot, flags, fd,
+       (int)pos);
 
   int error;
-  if ((error = do_mmap(&va, length, prot, flags)))
+  if ((error = do_mmap(&va, length, prot, flags, fd, pos)))
     return error;
 
   *res = va;
@@ -162,6 +162,15 @@ int tm_stop(timer_t *tm) {
   return retval;
 }
 
+int tm_program(timer_t *tm, const bintime_t when) {
+  assert(is_active(tm));
+
+  if (tm->tm_program == NULL)
+    return ENOTSUP;
+
+  return tm->tm_program(tm, when);
+}
+
 void tm_trigger(timer_t *tm) {
   assert(is_initialized(tm));
   assert(intr_disabled());
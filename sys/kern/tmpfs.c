@@ -10,8 +10,10 @@
 #include <sys/vfs.h>
 #include <sys/kmem.h>
 #include <sys/pmap.h>
+#include <sys/vm_object.h>
 #include <sys/malloc.h>
 #include <sys/cred.h>
+#include <sys/hash.h>
 #include <bitstring.h>
 
 /*
@@ -33,17 +35,32 @@
  * 256+------------+
  *   END OF THE ARENA
  *
- * Dirctory entries uses the same memory blocks as regular files. Every
+ * Contents of regular files are not stored in arenas. Instead every file has
+ * its own memory object, with pages allocated on first access and released
+ * when the file is truncated. Read and write copy data directly to and from
+ * these pages, and mmap maps them into address space of a process.
+ *
+ * Dirctory entries uses the same memory blocks as symbolic links. Every
  * directory has two lists containing free and used direntries. If a new
  * direntry is needed, but there aren't any free direntries then the new data
  * block is allocated and subsequently partitioned into free direntries.
  *
  * When a direntry is freed, then it is returned back to the pool of free
  * direntries. For simplicity, we never return back whole data blocks.
+ *
+ * Used direntries are kept on a list in order of their creation, which is the
+ * order readdir returns them in. To make lookups fast each directory also has
+ * a hash table of its direntries keyed by name. The table is allocated when
+ * the first entry is added and doubles its size whenever the average length
+ * of a hash chain exceeds TMPFS_DIRHASH_LOAD.
  */
 
 #define TMPFS_NAME_MAX 64
 
+#define TMPFS_DIRHASH_MIN 16   /* initial number of hash buckets */
+#define TMPFS_DIRHASH_MAX 8192 /* maximum number of hash buckets */
+#define TMPFS_DIRHASH_LOAD 2   /* maximum average length of hash chain */
+
 #define BLOCK_SIZE PAGESIZE
 #define BLOCK_MASK (BLOCK_SIZE - 1)
 #define BLKNO(x) ((x) / BLOCK_SIZE)
@@ -74,12 +91,14 @@ typedef struct _blk *blkptr_t;
 
 typedef struct tmpfs_dirent {
   TAILQ_ENTRY(tmpfs_dirent) tfd_entries; /* node on dirent list */
+  LIST_ENTRY(tmpfs_dirent) tfd_hash;     /* node on hash bucket */
   struct tmpfs_node *tfd_node;           /* pointer to the file's node */
   size_t tfd_namelen;            /* number of bytes occupied in array below */
   char tfd_name[TMPFS_NAME_MAX]; /* name of file */
 } tmpfs_dirent_t;
 
 typedef TAILQ_HEAD(, tmpfs_dirent) tmpfs_dirent_list_t;
+typedef LIST_HEAD(, tmpfs_dirent) tmpfs_dirent_hash_t;
 
 typedef struct tmpfs_node {
   vnode_t *tfn_vnode;   /* corresponding v-node */
@@ -108,10 +127,16 @@ typedef struct tmpfs_node {
       struct tmpfs_node *parent;    /* Parent directory. */
       tmpfs_dirent_list_t dirents;  /* List of directory entries. */
       tmpfs_dirent_list_t fdirents; /* List of free directory entries. */
+      tmpfs_dirent_hash_t *hash;    /* Hash table of directory entries. */
+      size_t hashsize;              /* Number of hash buckets. */
+      size_t nentries;              /* Number of directory entries. */
     } tfn_dir;
     struct {
       char *link;
     } tfn_lnk;
+    struct {
+      vm_object_t *obj; /* Memory object with file contents. */
+    } tfn_reg;
   };
 } tmpfs_node_t;
 
@@ -130,6 +155,8 @@ typedef struct tmpfs_mount {
   mem_arena_list_t tfm_arenas;
 } tmpfs_mount_t;
 
+static KMALLOC_DEFINE(M_TMPFS, "tmpfs");
+
 typedef struct mem_arena {
   STAILQ_ENTRY(mem_arena) tma_link; /* link on list of all arenas */
   size_t tma_ninodes;               /* number of free inodes */
@@ -306,6 +333,7 @@ static int tmpfs_alloc_dirent(tmpfs_node_t *tfn, const char *name,
 static tmpfs_dirent_t *tmpfs_dir_lookup(tmpfs_node_t *tfn,
                                         const componentname_t *cn);
 static void tmpfs_dir_detach(tmpfs_node_t *dv, tmpfs_dirent_t *de);
+static void tmpfs_dir_free_hash(tmpfs_node_t *tfn);
 
 static blkptr_t *tmpfs_get_blk(tmpfs_node_t *v, size_t blkno);
 static int tmpfs_resize(tmpfs_mount_t *tfm, tmpfs_node_t *v, size_t newsize);
@@ -390,12 +418,24 @@ static int tmpfs_vop_close(vnode_t *v, file_t *fp) {
   return 0;
 }
 
+/*
+ * tmpfs_get_page: return page of regular file that contains given offset.
+ * Missing pages are filled with zeros, so holes in files read as expected.
+ */
+static vm_page_t *tmpfs_get_page(tmpfs_node_t *node, off_t offset) {
+  vm_object_t *obj = node->tfn_reg.obj;
+  vm_offset_t pgoff = rounddown(offset, PAGESIZE);
+  vm_page_t *pg = vm_object_find_page(obj, pgoff);
+  if (pg == NULL)
+    pg = obj->vo_pager->pgr_fault(obj, pgoff);
+  return pg;
+}
+
 static int tmpfs_uiomove(tmpfs_node_t *node, uio_t *uio, size_t n) {
-  size_t blkoff = BLKOFF(uio->uio_offset);
-  size_t len = min(BLOCK_SIZE - blkoff, n);
-  size_t blkno = BLKNO(uio->uio_offset);
-  void *blk = *tmpfs_get_blk(node, blkno);
-  return uiomove(blk + blkoff, len, uio);
+  size_t pgoff = uio->uio_offset % PAGESIZE;
+  size_t len = min(PAGESIZE - pgoff, n);
+  vm_page_t *pg = tmpfs_get_page(node, uio->uio_offset);
+  return uiomove(pmap_page_kva(pg) + pgoff, len, uio);
 }
 
 static int tmpfs_vop_read(vnode_t *v, uio_t *uio) {
@@ -546,7 +586,7 @@ static int tmpfs_vop_rmdir(vnode_t *dv, vnode_t *v, componentname_t *cn) {
 
   tmpfs_node_t *node = de->tfd_node;
 
-  if (!TAILQ_EMPTY(&node->tfn_dir.dirents))
+  if (node->tfn_dir.nentries > 0)
     return ENOTEMPTY;
 
   /* Decrement link count for the '.' entry. */
@@ -555,6 +595,17 @@ static int tmpfs_vop_rmdir(vnode_t *dv, vnode_t *v, componentname_t *cn) {
   return 0;
 }
 
+static int tmpfs_vop_mmap(vnode_t *v, vm_object_t **objp) {
+  tmpfs_node_t *node = TMPFS_NODE_OF(v);
+
+  if (node->tfn_type != V_REG)
+    return ENODEV;
+
+  vm_object_hold(node->tfn_reg.obj);
+  *objp = node->tfn_reg.obj;
+  return 0;
+}
+
 static int tmpfs_vop_reclaim(vnode_t *v) {
   tmpfs_mount_t *tfm = TMPFS_ROOT_OF(v->v_mount);
   tmpfs_node_t *node = TMPFS_NODE_OF(v);
@@ -631,7 +682,8 @@ static vnodeops_t tmpfs_vnodeops = {.v_lookup = tmpfs_vop_lookup,
                                     .v_reclaim = tmpfs_vop_reclaim,
                                     .v_readlink = tmpfs_vop_readlink,
                                     .v_symlink = tmpfs_vop_symlink,
-                                    .v_link = tmpfs_vop_link};
+                                    .v_link = tmpfs_vop_link,
+                                    .v_mmap = tmpfs_vop_mmap};
 
 /* tmpfs internal routines */
 
@@ -676,10 +728,14 @@ static tmpfs_node_t *tmpfs_new_node(tmpfs_mount_t *tfm, vattr_t *va,
     case V_DIR:
       TAILQ_INIT(&node->tfn_dir.dirents);
       TAILQ_INIT(&node->tfn_dir.fdirents);
+      node->tfn_dir.hash = NULL;
+      node->tfn_dir.hashsize = 0;
+      node->tfn_dir.nentries = 0;
       /* Extra link count for the '.' entry. */
       node->tfn_links++;
       break;
     case V_REG:
+      node->tfn_reg.obj = vm_object_alloc(VM_ANONYMOUS);
       break;
     case V_LNK:
       node->tfn_lnk.link = NULL;
@@ -696,7 +752,13 @@ static tmpfs_node_t *tmpfs_new_node(tmpfs_mount_t *tfm, vattr_t *va,
  * destroy the inode structures.
  */
 static void tmpfs_free_node(tmpfs_mount_t *tfm, tmpfs_node_t *tfn) {
-  tmpfs_resize(tfm, tfn, 0);
+  if (tfn->tfn_type == V_DIR)
+    tmpfs_dir_free_hash(tfn);
+  /* Contents of the file stay around as long as it is memory mapped. */
+  if (tfn->tfn_type == V_REG)
+    vm_object_drop(tfn->tfn_reg.obj);
+  else
+    tmpfs_resize(tfm, tfn, 0);
   tmpfs_free_inode(tfm, tfn);
 }
 
@@ -723,6 +785,63 @@ static int tmpfs_create_file(vnode_t *dv, vnode_t **vp, vattr_t *va,
   return 0;
 }
 
+static inline tmpfs_dirent_hash_t *tmpfs_dir_bucket(tmpfs_node_t *dnode,
+                                                    const char *name,
+                                                    size_t namelen) {
+  uint32_t hash = hash32_buf(name, namelen, HASH32_BUF_INIT);
+  return &dnode->tfn_dir.hash[hash & (dnode->tfn_dir.hashsize - 1)];
+}
+
+/*
+ * tmpfs_dir_rehash: move all entries of the directory to a new hash table
+ * with given number of buckets.
+ */
+static void tmpfs_dir_rehash(tmpfs_node_t *dnode, size_t hashsize) {
+  tmpfs_dirent_hash_t *hash =
+    kmalloc(M_TMPFS, sizeof(tmpfs_dirent_hash_t) * hashsize, M_ZERO);
+
+  if (dnode->tfn_dir.hash)
+    kfree(M_TMPFS, dnode->tfn_dir.hash);
+  dnode->tfn_dir.hash = hash;
+  dnode->tfn_dir.hashsize = hashsize;
+
+  tmpfs_dirent_t *de;
+  TAILQ_FOREACH (de, &dnode->tfn_dir.dirents, tfd_entries) {
+    tmpfs_dirent_hash_t *head =
+      tmpfs_dir_bucket(dnode, de->tfd_name, de->tfd_namelen);
+    LIST_INSERT_HEAD(head, de, tfd_hash);
+  }
+}
+
+/*
+ * tmpfs_dir_hash_insert: add directory entry, that's already on the list of
+ * used entries, to the hash table and grow the table if it's too crowded.
+ */
+static void tmpfs_dir_hash_insert(tmpfs_node_t *dnode, tmpfs_dirent_t *de) {
+  size_t hashsize = dnode->tfn_dir.hashsize;
+
+  dnode->tfn_dir.nentries++;
+
+  /* Rehashing puts the entry into the table as well. */
+  if (hashsize == 0) {
+    tmpfs_dir_rehash(dnode, TMPFS_DIRHASH_MIN);
+  } else if (hashsize < TMPFS_DIRHASH_MAX &&
+             dnode->tfn_dir.nentries > hashsize * TMPFS_DIRHASH_LOAD) {
+    tmpfs_dir_rehash(dnode, hashsize * 2);
+  } else {
+    LIST_INSERT_HEAD(tmpfs_dir_bucket(dnode, de->tfd_name, de->tfd_namelen),
+                     de, tfd_hash);
+  }
+}
+
+static void tmpfs_dir_free_hash(tmpfs_node_t *tfn) {
+  assert(tfn->tfn_dir.nentries == 0);
+  if (tfn->tfn_dir.hash)
+    kfree(M_TMPFS, tfn->tfn_dir.hash);
+  tfn->tfn_dir.hash = NULL;
+  tfn->tfn_dir.hashsize = 0;
+}
+
 /*
  * tmpfs_dir_attach: associate directory entry with a specified inode, and
  * attach the entry into the directory, specified by dnode.
@@ -732,6 +851,7 @@ static void tmpfs_dir_attach(tmpfs_node_t *dnode, tmpfs_dirent_t *de,
   node->tfn_links++;
   de->tfd_node = node;
   TAILQ_INSERT_TAIL(&dnode->tfn_dir.dirents, de, tfd_entries);
+  tmpfs_dir_hash_insert(dnode, de);
 
   /* If directory set parent and increase the link count of parent. */
   if (node->tfn_type == V_DIR) {
@@ -805,8 +925,13 @@ static int tmpfs_alloc_dirent(tmpfs_node_t *tfn, const char *name,
 
 static tmpfs_dirent_t *tmpfs_dir_lookup(tmpfs_node_t *tfn,
                                         const componentname_t *cn) {
+  if (tfn->tfn_dir.hashsize == 0)
+    return NULL;
+
+  tmpfs_dirent_hash_t *head =
+    tmpfs_dir_bucket(tfn, cn->cn_nameptr, cn->cn_namelen);
   tmpfs_dirent_t *de;
-  TAILQ_FOREACH (de, &tfn->tfn_dir.dirents, tfd_entries) {
+  LIST_FOREACH (de, head, tfd_hash) {
     if (componentname_equal(cn, de->tfd_name))
       return de;
   }
@@ -829,6 +954,8 @@ static void tmpfs_dir_detach(tmpfs_node_t *dv, tmpfs_dirent_t *de) {
   }
   de->tfd_node = NULL;
   TAILQ_REMOVE(&dv->tfn_dir.dirents, de, tfd_entries);
+  LIST_REMOVE(de, tfd_hash);
+  dv->tfn_dir.nentries--;
   TAILQ_INSERT_TAIL(&dv->tfn_dir.fdirents, de, tfd_entries);
 
   tmpfs_update_time(dv, TMPFS_UPDATE_MTIME | TMPFS_UPDATE_CTIME);
@@ -957,7 +1084,28 @@ static void tmpfs_free_blk_range(tmpfs_mount_t *tfm, tmpfs_node_t *v,
 }
 
 /*
- * tmpfs_resize: resize regular file and possibly allocate new blocks.
+ * tmpfs_resize_pages: resize regular file. Pages are allocated on first access,
+ * hence only the data past the new end of file needs to be thrown away.
+ */
+static void tmpfs_resize_pages(tmpfs_node_t *v, size_t newsize) {
+  vm_object_t *obj = v->tfn_reg.obj;
+
+  /* Pages past the end of file may have been written to through mmap. Clear
+   * them even when the file grows, so that its new part reads as zeros. */
+  size_t size = min(v->tfn_size, newsize);
+  size_t pgoff = size % PAGESIZE;
+  if (pgoff) {
+    vm_page_t *pg = vm_object_find_page(obj, size - pgoff);
+    if (pg)
+      bzero(pmap_page_kva(pg) + pgoff, PAGESIZE - pgoff);
+  }
+
+  vm_offset_t end = roundup(size, PAGESIZE);
+  vm_object_remove_pages(obj, end, (vm_offset_t)(-PAGESIZE) - end);
+}
+
+/*
+ * tmpfs_resize: resize file and possibly allocate new blocks.
  */
 static int tmpfs_resize(tmpfs_mount_t *tfm, tmpfs_node_t *v, size_t newsize) {
   size_t oldsize = v->tfn_size;
@@ -965,7 +1113,10 @@ static int tmpfs_resize(tmpfs_mount_t *tfm, tmpfs_node_t *v, size_t newsize) {
   size_t newblks = NBLOCKS(newsize);
   int error;
 
-  if (newblks > oldblks) {
+  if (v->tfn_type == V_REG) {
+    if (newsize != oldsize)
+      tmpfs_resize_pages(v, newsize);
+  } else if (newblks > oldblks) {
     if ((error = tmpfs_expand_meta(tfm, v, newblks))) {
       tmpfs_shrink_meta(tfm, v, oldblks);
       return error;
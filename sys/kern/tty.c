@@ -169,6 +169,7 @@ tty_t *tty_alloc(void) {
                TTY_QUEUE_SIZE);
   cv_init(&tty->t_outcv, "t_outcv");
   cv_init(&tty->t_serialize_cv, "t_serialize_cv");
+  knlist_init(&tty->t_knlist);
   tty->t_line.ln_buf = kmalloc(M_DEV, LINEBUF_SIZE, M_WAITOK);
   tty->t_line.ln_size = LINEBUF_SIZE;
   tty_init_termios(&tty->t_termios);
@@ -179,6 +180,7 @@ void tty_free(tty_t *tty) {
   assert(!tty_opened(tty));
   assert(tty_detached(tty));
   assert(!mtx_owned(&tty->t_lock));
+  assert(knlist_empty(&tty->t_knlist));
   mtx_destroy(&tty->t_lock);
   cv_destroy(&tty->t_incv);
   cv_destroy(&tty->t_outcv);
@@ -408,6 +410,7 @@ static void tty_erase(tty_t *tty, uint8_t c) {
 /* Wake up readers waiting for input. */
 static void tty_wakeup(tty_t *tty) {
   cv_broadcast(&tty->t_incv);
+  knote(&tty->t_knlist, 0);
 }
 
 /*
@@ -671,6 +674,7 @@ static void tty_discard_output(tty_t *tty) {
   assert(mtx_owned(&tty->t_lock));
   ringbuf_reset(&tty->t_outq);
   cv_broadcast(&tty->t_outcv);
+  knote(&tty->t_knlist, 0);
 }
 
 /*
@@ -839,6 +843,8 @@ void tty_getc_done(tty_t *tty) {
 
   if (tty->t_flags != oldf)
     cv_broadcast(&tty->t_outcv);
+  if (cnt < TTY_OUT_LOW_WATER)
+    knote(&tty->t_knlist, 0);
 }
 
 static int tty_drain_out(tty_t *tty) {
@@ -1070,6 +1076,7 @@ void tty_detach_driver(tty_t *tty) {
   cv_broadcast(&tty->t_incv);
   cv_broadcast(&tty->t_outcv);
   cv_broadcast(&tty->t_serialize_cv);
+  knote(&tty->t_knlist, 0);
 
   /* We can't free the tty structure yet, as there may still be existing
    * references to the vnode. We free it in tty_vn_reclaim, once all
@@ -1083,6 +1090,70 @@ void tty_detach_driver(tty_t *tty) {
   vnode_drop(v);
 }
 
+static int filt_ttyread(knote_t *kn, long hint) {
+  tty_t *tty = kn->kn_obj;
+
+  kn->kn_data = tty->t_inq.count;
+  if (tty_detached(tty)) {
+    kn->kn_flags |= EV_EOF;
+    return 1;
+  }
+  return kn->kn_data > 0;
+}
+
+static int filt_ttywrite(knote_t *kn, long hint) {
+  tty_t *tty = kn->kn_obj;
+
+  kn->kn_data = tty->t_outq.size - tty->t_outq.count;
+  if (tty_detached(tty)) {
+    kn->kn_flags |= EV_EOF;
+    return 1;
+  }
+  return tty->t_outq.count < TTY_OUT_LOW_WATER;
+}
+
+static int filt_ttyattach(knote_t *kn) {
+  tty_t *tty = kn->kn_obj;
+  knlist_add(&tty->t_knlist, kn);
+  return 0;
+}
+
+static void filt_ttydetach(knote_t *kn) {
+  tty_t *tty = kn->kn_obj;
+  knlist_remove(&tty->t_knlist, kn);
+}
+
+static filterops_t tty_readfiltops = {
+  .filt_attach = filt_ttyattach,
+  .filt_detach = filt_ttydetach,
+  .filt_event = filt_ttyread,
+};
+
+static filterops_t tty_writefiltops = {
+  .filt_attach = filt_ttyattach,
+  .filt_detach = filt_ttydetach,
+  .filt_event = filt_ttywrite,
+};
+
+static int tty_kqfilter(file_t *f, knote_t *kn) {
+  tty_t *tty = f->f_data;
+
+  switch (kn->kn_filter) {
+    case EVFILT_READ:
+      kn->kn_filtops = &tty_readfiltops;
+      break;
+    case EVFILT_WRITE:
+      kn->kn_filtops = &tty_writefiltops;
+      break;
+    default:
+      return EINVAL;
+  }
+
+  kn->kn_obj = tty;
+  kn->kn_objlock = &tty->t_lock;
+  return 0;
+}
+
 /* We implement I/O operations as fileops in order to bypass
  * the vnode layer's locking. */
 static fileops_t tty_fileops = {
@@ -1092,6 +1163,7 @@ static fileops_t tty_fileops = {
   .fo_seek = default_vnseek,
   .fo_stat = default_vnstat,
   .fo_ioctl = tty_ioctl,
+  .fo_kqfilter = tty_kqfilter,
 };
 
 bool maybe_assoc_ctty(proc_t *p, tty_t *tty) {
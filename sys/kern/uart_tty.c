@@ -10,11 +10,6 @@ static void tty_set_outq_nonempty_flag(tty_thread_t *ttd) {
     ttd->ttd_flags |= TTY_THREAD_OUTQ_NONEMPTY;
 }
 
-static bool uart_getb_lock(uart_state_t *uart, uint8_t *byte_p) {
-  SCOPED_SPIN_LOCK(&uart->u_lock);
-  return ringbuf_getb(&uart->u_rx_buf, byte_p);
-}
-
 /*
  * If tx_buf is empty, we can try to write characters directly from tty->t_outq.
  * This routine attempts to do just that.
@@ -88,8 +83,9 @@ static void uart_tty_thread(void *arg) {
     }
     WITH_MTX_LOCK (&tty->t_lock) {
       if (work & TTY_THREAD_RXRDY) {
-        /* Move characters from rx_buf into the tty's input queue. */
-        while (uart_getb_lock(uart, &byte))
+        /* Move characters from rx_buf into the tty's input queue.
+         * We're the only consumer of rx_buf, so u_lock is not needed. */
+        while (spsc_ringbuf_getb(&uart->u_rx_buf, &byte))
           if (!tty_input(tty, byte))
             klog("dropped character %hhx", byte);
       }
@@ -0,0 +1,180 @@
+#define KL_LOG KL_VFS
+#include <sys/klog.h>
+#include <sys/hash.h>
+#include <sys/libkern.h>
+#include <sys/mutex.h>
+#include <sys/pool.h>
+#include <sys/vfs.h>
+#include <sys/vnode.h>
+
+/*
+ * Name cache maps (directory vnode, component name) pairs to vnodes found by
+ * VOP_LOOKUP. Failed lookups are remembered as negative entries, i.e. ones
+ * without target vnode.
+ *
+ * Entries do not hold references to vnodes. Instead each vnode keeps lists of
+ * entries it's a part of, and they're purged just before the vnode is
+ * reclaimed. Thus a vnode found in the cache is only returned if its use
+ * counter has not dropped to zero yet.
+ *
+ * Every change to a directory must be followed by a call to
+ * `vfs_cache_purge_name`, which bumps cache generation number. Lookups that
+ * were in progress during the change will not enter stale results.
+ */
+
+#define NCHNAMLEN 31   /* longer names are not cached */
+#define NCHASHSIZE 256 /* number of hash buckets, must be a power of two */
+#define NCACHEMAX 1024 /* maximum number of entries */
+
+typedef struct namecache {
+  TAILQ_ENTRY(namecache) nc_lru;  /* link on LRU list */
+  LIST_ENTRY(namecache) nc_hash;  /* link on hash bucket */
+  LIST_ENTRY(namecache) nc_dlink; /* link on directory's v_ncdir list */
+  LIST_ENTRY(namecache) nc_vlink; /* link on target's v_nclist list */
+  vnode_t *nc_dvp;                /* directory vnode */
+  vnode_t *nc_vp;                 /* target vnode or NULL if negative */
+  uint8_t nc_namelen;             /* length of the name */
+  char nc_name[NCHNAMLEN];        /* component name (not null-terminated) */
+} namecache_t;
+
+typedef LIST_HEAD(, namecache) nchashhead_t;
+
+static POOL_DEFINE(P_NAMECACHE, "namecache", sizeof(namecache_t));
+
+static MTX_DEFINE(nc_lock, 0);
+static nchashhead_t nc_hashtbl[NCHASHSIZE];
+static TAILQ_HEAD(, namecache) nc_lru = TAILQ_HEAD_INITIALIZER(nc_lru);
+static unsigned nc_count;
+static unsigned nc_gen;
+
+static nchashhead_t *nc_hashhead(vnode_t *dvp, const char *name, size_t len) {
+  uint32_t hash = hash32_buf(&dvp, sizeof(dvp), HASH32_BUF_INIT);
+  hash = hash32_buf(name, len, hash);
+  return &nc_hashtbl[hash & (NCHASHSIZE - 1)];
+}
+
+static bool nc_cacheable(componentname_t *cn) {
+  if (cn->cn_namelen > NCHNAMLEN)
+    return false;
+  /* Dot and dot-dot are resolved by the filesystem. */
+  return !componentname_equal(cn, ".") && !componentname_equal(cn, "..");
+}
+
+static namecache_t *nc_find(vnode_t *dvp, componentname_t *cn) {
+  assert(mtx_owned(&nc_lock));
+
+  nchashhead_t *head = nc_hashhead(dvp, cn->cn_nameptr, cn->cn_namelen);
+  namecache_t *nc;
+
+  LIST_FOREACH(nc, head, nc_hash) {
+    if (nc->nc_dvp == dvp && nc->nc_namelen == cn->cn_namelen &&
+        memcmp(nc->nc_name, cn->cn_nameptr, cn->cn_namelen) == 0)
+      return nc;
+  }
+  return NULL;
+}
+
+static void nc_remove(namecache_t *nc) {
+  assert(mtx_owned(&nc_lock));
+
+  TAILQ_REMOVE(&nc_lru, nc, nc_lru);
+  LIST_REMOVE(nc, nc_hash);
+  LIST_REMOVE(nc, nc_dlink);
+  if (nc->nc_vp)
+    LIST_REMOVE(nc, nc_vlink);
+  nc_count--;
+  pool_free(P_NAMECACHE, nc);
+}
+
+/* Take a reference to a vnode unless it's about to be reclaimed. */
+static bool nc_vnode_hold(vnode_t *v) {
+  unsigned cnt = atomic_load(&v->v_usecnt);
+  do {
+    if (cnt == 0)
+      return false;
+  } while (!atomic_compare_exchange_weak(&v->v_usecnt, &cnt, cnt + 1));
+  return true;
+}
+
+bool vfs_cache_lookup(vnode_t *dvp, componentname_t *cn, vnode_t **vp) {
+  if (!nc_cacheable(cn))
+    return false;
+
+  SCOPED_MTX_LOCK(&nc_lock);
+
+  namecache_t *nc = nc_find(dvp, cn);
+  if (nc == NULL)
+    return false;
+
+  if (nc->nc_vp != NULL && !nc_vnode_hold(nc->nc_vp))
+    return false;
+
+  /* Move the entry to the tail of LRU list. */
+  TAILQ_REMOVE(&nc_lru, nc, nc_lru);
+  TAILQ_INSERT_TAIL(&nc_lru, nc, nc_lru);
+
+  *vp = nc->nc_vp;
+  return true;
+}
+
+unsigned vfs_cache_generation(void) {
+  SCOPED_MTX_LOCK(&nc_lock);
+  return nc_gen;
+}
+
+void vfs_cache_enter(vnode_t *dvp, componentname_t *cn, vnode_t *vp,
+                     unsigned gen) {
+  if (!nc_cacheable(cn))
+    return;
+
+  namecache_t *new = pool_alloc(P_NAMECACHE, 0);
+
+  new->nc_dvp = dvp;
+  new->nc_vp = vp;
+  new->nc_namelen = cn->cn_namelen;
+  memcpy(new->nc_name, cn->cn_nameptr, cn->cn_namelen);
+
+  SCOPED_MTX_LOCK(&nc_lock);
+
+  /* Directory was modified while lookup was in progress or another thread
+   * has already entered the name. */
+  if (gen != nc_gen || nc_find(dvp, cn)) {
+    pool_free(P_NAMECACHE, new);
+    return;
+  }
+
+  if (nc_count == NCACHEMAX)
+    nc_remove(TAILQ_FIRST(&nc_lru));
+
+  LIST_INSERT_HEAD(nc_hashhead(dvp, cn->cn_nameptr, cn->cn_namelen), new,
+                   nc_hash);
+  LIST_INSERT_HEAD(&dvp->v_ncdir, new, nc_dlink);
+  if (vp)
+    LIST_INSERT_HEAD(&vp->v_nclist, new, nc_vlink);
+  TAILQ_INSERT_TAIL(&nc_lru, new, nc_lru);
+  nc_count++;
+}
+
+void vfs_cache_purge_name(vnode_t *dvp, componentname_t *cn) {
+  SCOPED_MTX_LOCK(&nc_lock);
+
+  nc_gen++;
+
+  if (!nc_cacheable(cn))
+    return;
+
+  namecache_t *nc = nc_find(dvp, cn);
+  if (nc != NULL)
+    nc_remove(nc);
+}
+
+void vfs_cache_purge(vnode_t *v) {
+  namecache_t *nc;
+
+  SCOPED_MTX_LOCK(&nc_lock);
+
+  while ((nc = LIST_FIRST(&v->v_ncdir)))
+    nc_remove(nc);
+  while ((nc = LIST_FIRST(&v->v_nclist)))
+    nc_remove(nc);
+}
@@ -108,7 +108,34 @@ static int can_lookup(vnode_t *vn, cred_t *cred) {
   return VOP_ACCESS(vn, VEXEC, cred);
 }
 
-/* Call VOP_LOOKUP for a single lookup.
+/* Consult the name cache and call VOP_LOOKUP only on a cache miss.
+ * The result of VOP_LOOKUP is entered into the cache. */
+static int vnr_cached_lookup(vnode_t *searchdir, componentname_t *cn,
+                             vnode_t **foundvn_p) {
+  vnode_t *foundvn;
+  int error;
+
+  if (vfs_cache_lookup(searchdir, cn, &foundvn)) {
+    if (foundvn == NULL)
+      return ENOENT;
+    *foundvn_p = foundvn;
+    return 0;
+  }
+
+  unsigned gen = vfs_cache_generation();
+
+  if ((error = VOP_LOOKUP(searchdir, cn, &foundvn))) {
+    if (error == ENOENT)
+      vfs_cache_enter(searchdir, cn, NULL, gen);
+    return error;
+  }
+
+  vfs_cache_enter(searchdir, cn, foundvn, gen);
+  *foundvn_p = foundvn;
+  return 0;
+}
+
+/* Look up a single path component.
  * searchdir vnode is locked on entry and remains locked on return. */
 static int vnr_lookup_once(vnrstate_t *vs, vnode_t **searchdir_p,
                            vnode_t **foundvn_p) {
@@ -124,7 +151,7 @@ static int vnr_lookup_once(vnrstate_t *vs, vnode_t **searchdir_p,
   if ((error = can_lookup(searchdir, cred)))
     return error;
 
-  if ((error = VOP_LOOKUP(searchdir, cn, &foundvn))) {
+  if ((error = vnr_cached_lookup(searchdir, cn, &foundvn))) {
     /*
      * The entry was not found in the directory. This is valid if we are
      * creating an entry and are working on the last component of the path name.
@@ -137,7 +164,7 @@ static int vnr_lookup_once(vnrstate_t *vs, vnode_t **searchdir_p,
     return error;
   }
 
-  /* No need to ref foundvn vnode, VOP_LOOKUP already did it for us. */
+  /* No need to ref foundvn vnode, lookup already did it for us. */
   if (searchdir != foundvn)
     vnode_lock(foundvn);
 
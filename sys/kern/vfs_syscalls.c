@@ -80,6 +80,8 @@ static int vfs_create(proc_t *p, int fdat, char *pathname, int *flags, int mode,
     va.va_uid = p->p_cred.cr_euid;
     va.va_gid = dva.va_mode & S_ISGID ? dva.va_gid : p->p_cred.cr_egid;
     error = VOP_CREATE(vs.vs_dvp, &vs.vs_lastcn, &va, &vs.vs_vp);
+    if (!error)
+      vfs_cache_purge_name(vs.vs_dvp, &vs.vs_lastcn);
     vnode_put(vs.vs_dvp);
   } else {
     if (vs.vs_vp == vs.vs_dvp)
@@ -273,6 +275,9 @@ int do_unlinkat(proc_t *p, int fd, char *path, int flag) {
       error = EPERM;
     else if (!(error = vfs_check_remove(vs.vs_dvp, vs.vs_vp, &p->p_cred)))
       error = VOP_RMDIR(vs.vs_dvp, vs.vs_vp, &vs.vs_lastcn);
+    /* Drop negative entries of the removed directory. */
+    if (!error)
+      vfs_cache_purge(vs.vs_vp);
   } else {
     if (flag & AT_REMOVEDIR)
       error = ENOTDIR;
@@ -280,6 +285,9 @@ int do_unlinkat(proc_t *p, int fd, char *path, int flag) {
       error = VOP_REMOVE(vs.vs_dvp, vs.vs_vp, &vs.vs_lastcn);
   }
 
+  if (!error)
+    vfs_cache_purge_name(vs.vs_dvp, &vs.vs_lastcn);
+
   vnode_put_both(vs.vs_vp, vs.vs_dvp);
 
 fail:
@@ -329,8 +337,10 @@ int do_mkdirat(proc_t *p, int fd, char *path, mode_t mode) {
   }
 
   error = VOP_MKDIR(vs.vs_dvp, &vs.vs_lastcn, &va, &vs.vs_vp);
-  if (!error)
+  if (!error) {
+    vfs_cache_purge_name(vs.vs_dvp, &vs.vs_lastcn);
     vnode_drop(vs.vs_vp);
+  }
 
   vnode_put(vs.vs_dvp);
 
@@ -533,8 +543,10 @@ int do_symlinkat(proc_t *p, char *target, int newdirfd, char *linkpath) {
   va.va_gid = p->p_cred.cr_rgid;
 
   error = VOP_SYMLINK(vs.vs_dvp, &vs.vs_lastcn, &va, target, &vs.vs_vp);
-  if (!error)
+  if (!error) {
+    vfs_cache_purge_name(vs.vs_dvp, &vs.vs_lastcn);
     vnode_drop(vs.vs_vp);
+  }
   vnode_put(vs.vs_dvp);
 
 fail:
@@ -577,8 +589,8 @@ int do_linkat(proc_t *p, int fd, char *path, int linkfd, char *linkpath,
 
   if (vs.vs_dvp->v_mount != target_vn->v_mount)
     error = EXDEV;
-  else
-    error = VOP_LINK(vs.vs_dvp, target_vn, &vs.vs_lastcn);
+  else if (!(error = VOP_LINK(vs.vs_dvp, target_vn, &vs.vs_lastcn)))
+    vfs_cache_purge_name(vs.vs_dvp, &vs.vs_lastcn);
 
   vnode_put(vs.vs_dvp);
 
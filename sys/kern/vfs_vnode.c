@@ -12,23 +12,34 @@
 #include <sys/spinlock.h>
 #include <sys/condvar.h>
 #include <sys/cred.h>
-
-static POOL_DEFINE(P_VNODE, "vnode", sizeof(vnode_t));
+#include <sys/vm_pager.h>
 
 static void vnlock_init(vnlock_t *vl);
 
+static void vnode_ctor(void *ptr) {
+  vnode_t *v = ptr;
+  vnlock_init(&v->v_lock);
+}
+
+static POOL_DEFINE(P_VNODE, "vnode", sizeof(vnode_t), .ctor = vnode_ctor);
+
 /* Actually, vnode management should be much more complex than this, because
    this stub does not recycle vnodes, does not store them on a free list,
    etc. So at some point we may need a more sophisticated memory management here
    - but this will do for now. */
 
 vnode_t *vnode_new(vnodetype_t type, vnodeops_t *ops, void *data) {
-  vnode_t *v = pool_alloc(P_VNODE, M_ZERO);
+  vnode_t *v = pool_alloc(P_VNODE, 0);
   v->v_type = type;
   v->v_data = data;
   v->v_ops = ops;
+  v->v_mount = NULL;
+  v->v_mountedhere = NULL;
   v->v_usecnt = 1;
-  vnlock_init(&v->v_lock);
+  LIST_INIT(&v->v_nclist);
+  LIST_INIT(&v->v_ncdir);
+  v->v_object = NULL;
+  assert(!v->v_lock.vl_locked);
   return v;
 }
 
@@ -65,6 +76,8 @@ void vnode_hold(vnode_t *v) {
 
 void vnode_drop(vnode_t *v) {
   if (refcnt_release(&v->v_usecnt)) {
+    vfs_cache_purge(v);
+    vnode_pager_release(v);
     VOP_RECLAIM(v);
     pool_free(P_VNODE, v);
   }
@@ -117,6 +130,7 @@ static int vnode_nop(vnode_t *v, ...) {
 #define vnode_reclaim_nop vnode_nop
 #define vnode_readlink_nop vnode_nop
 #define vnode_symlink_nop vnode_nop
+#define vnode_mmap_nop vnode_mmap_generic
 
 /* XXX when no v_access function don't return error */
 static int vnode_access_nop(vnode_t *v, mode_t m, cred_t *cred) {
@@ -152,6 +166,7 @@ void vnodeops_init(vnodeops_t *vops) {
   NOP_IF_NULL(vops, reclaim);
   NOP_IF_NULL(vops, readlink);
   NOP_IF_NULL(vops, symlink);
+  NOP_IF_NULL(vops, mmap);
 }
 
 void vattr_convert(vattr_t *va, stat_t *sb) {
@@ -299,6 +314,15 @@ static fileops_t default_vnode_fileops = {
   .fo_ioctl = default_vnioctl,
 };
 
+int vnode_mmap_generic(vnode_t *v, vm_object_t **objp) {
+  /* mmap(2) reports ENODEV for files that cannot be mapped. */
+  if (v->v_type != V_REG)
+    return ENODEV;
+
+  *objp = vnode_pager_object(v);
+  return 0;
+}
+
 int vnode_open_generic(vnode_t *v, int mode, file_t *fp) {
   vnode_hold(v);
   fp->f_ops = &default_vnode_fileops;
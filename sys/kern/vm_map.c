@@ -6,6 +6,7 @@
 #include <sys/pmap.h>
 #include <sys/vm_pager.h>
 #include <sys/vm_object.h>
+#include <sys/vm_physmem.h>
 #include <sys/vm_map.h>
 #include <sys/errno.h>
 #include <sys/proc.h>
@@ -15,21 +16,53 @@
 
 struct vm_map_entry {
   TAILQ_ENTRY(vm_map_entry) link;
+  RB_ENTRY(vm_map_entry) tree;
   vm_object_t *object;
   vaddr_t offset; /* offset in object */
   vm_prot_t prot;
   vm_entry_flags_t flags;
   vaddr_t start;
   vaddr_t end;
+  vaddr_t next_fault;   /* expected address of next sequential fault */
+  unsigned fault_ahead; /* number of pages mapped ahead of faulting one */
+  size_t gap;           /* free space between this entry and the next one */
+  size_t max_gap;       /* largest gap in the subtree rooted at this entry */
 };
 
 struct vm_map {
   TAILQ_HEAD(vm_map_list, vm_map_entry) entries;
+  RB_HEAD(vm_map_tree, vm_map_entry) tree; /* entries sorted by address */
+  vm_map_entry_t *hint;                    /* entry found by last lookup */
   size_t nentries;
   pmap_t *pmap;
   mtx_t mtx; /* Mutex guarding vm_map structure and all its entries. */
 };
 
+static inline int vm_map_entry_cmp(vm_map_entry_t *a, vm_map_entry_t *b) {
+  if (a->start < b->start)
+    return -1;
+  return a->start > b->start;
+}
+
+/* Recalculate the largest gap in the subtree rooted at `ent`. Called by tree
+ * operations whenever children of `ent` change. */
+static inline void vm_map_entry_augment(vm_map_entry_t *ent) {
+  vm_map_entry_t *left = RB_LEFT(ent, tree);
+  vm_map_entry_t *right = RB_RIGHT(ent, tree);
+  size_t max_gap = ent->gap;
+  if (left && left->max_gap > max_gap)
+    max_gap = left->max_gap;
+  if (right && right->max_gap > max_gap)
+    max_gap = right->max_gap;
+  ent->max_gap = max_gap;
+}
+
+#undef RB_AUGMENT
+#define RB_AUGMENT(x) vm_map_entry_augment(x)
+
+RB_PROTOTYPE_STATIC(vm_map_tree, vm_map_entry, tree, vm_map_entry_cmp);
+RB_GENERATE_STATIC(vm_map_tree, vm_map_entry, tree, vm_map_entry_cmp);
+
 static POOL_DEFINE(P_VM_MAP, "vm_map", sizeof(vm_map_t));
 static POOL_DEFINE(P_VM_MAPENT, "vm_map_entry", sizeof(vm_map_entry_t));
 
@@ -102,6 +135,8 @@ vm_map_t *vm_map_lookup(vaddr_t addr) {
 
 static void vm_map_setup(vm_map_t *map) {
   TAILQ_INIT(&map->entries);
+  RB_INIT(&map->tree);
+  map->hint = NULL;
   mtx_init(&map->mtx, 0);
 }
 
@@ -141,28 +176,77 @@ static void vm_map_entry_free(vm_map_entry_t *ent) {
 vm_map_entry_t *vm_map_find_entry(vm_map_t *map, vaddr_t vaddr) {
   assert(mtx_owned(&map->mtx));
 
-  vm_map_entry_t *it;
-  TAILQ_FOREACH (it, &map->entries, link)
-    if (it->start <= vaddr && vaddr < it->end)
+  /* Consecutive faults often hit the same entry. */
+  vm_map_entry_t *it = map->hint;
+  if (it && it->start <= vaddr && vaddr < it->end)
+    return it;
+
+  it = RB_ROOT(&map->tree);
+  while (it) {
+    if (vaddr < it->start) {
+      it = RB_LEFT(it, tree);
+    } else if (vaddr >= it->end) {
+      it = RB_RIGHT(it, tree);
+    } else {
+      map->hint = it;
       return it;
+    }
+  }
   return NULL;
 }
 
-static void vm_map_insert_after(vm_map_t *map, vm_map_entry_t *after,
-                                vm_map_entry_t *ent) {
-  assert(mtx_owned(&map->mtx));
+/* Update augmented data on the path from `ent` to the root of the tree. */
+static void vm_map_augment_path(vm_map_entry_t *ent) {
+  for (; ent; ent = RB_PARENT(ent, tree))
+    vm_map_entry_augment(ent);
+}
+
+/* Recalculate the gap after `ent`, i.e. when `ent` or its successor moved. */
+static void vm_map_entry_update_gap(vm_map_t *map, vm_map_entry_t *ent) {
+  vm_map_entry_t *next = vm_map_entry_next(ent);
+  ent->gap = (next ? next->start : vm_map_end(map)) - ent->end;
+  vm_map_augment_path(ent);
+}
+
+static void vm_map_link(vm_map_t *map, vm_map_entry_t *after,
+                        vm_map_entry_t *ent) {
   if (after)
     TAILQ_INSERT_AFTER(&map->entries, after, ent, link);
   else
     TAILQ_INSERT_HEAD(&map->entries, ent, link);
+  vm_map_entry_t *dup __unused = RB_INSERT(vm_map_tree, &map->tree, ent);
+  assert(dup == NULL);
   map->nentries++;
+
+  vm_map_entry_update_gap(map, ent);
+  if (after)
+    vm_map_entry_update_gap(map, after);
+}
+
+static void vm_map_insert_after(vm_map_t *map, vm_map_entry_t *after,
+                                vm_map_entry_t *ent) {
+  assert(mtx_owned(&map->mtx));
+  vm_map_link(map, after, ent);
 }
 
 void vm_map_entry_destroy(vm_map_t *map, vm_map_entry_t *ent) {
   assert(mtx_owned(&map->mtx));
 
+  vm_map_entry_t *prev = TAILQ_PREV(ent, vm_map_list, link);
+  vm_map_entry_t *parent = RB_PARENT(ent, tree);
+
   TAILQ_REMOVE(&map->entries, ent, link);
+  RB_REMOVE(vm_map_tree, &map->tree, ent);
   map->nentries--;
+
+  /* Removal may have left stale gaps on the path to the root. */
+  vm_map_augment_path(parent);
+  if (prev)
+    vm_map_entry_update_gap(map, prev);
+
+  if (map->hint == ent)
+    map->hint = NULL;
+
   vm_map_entry_free(ent);
 }
 
@@ -230,6 +314,41 @@ void vm_map_delete(vm_map_t *map) {
 void vm_map_protect(vm_map_t *map, vaddr_t start, vaddr_t end, vm_prot_t prot) {
 }
 
+/* Find the first entry following `ent` with a gap of at least `length` bytes
+ * after it. Subtrees that have no gap large enough are skipped. */
+static vm_map_entry_t *vm_map_entry_next_fit(vm_map_entry_t *ent,
+                                             size_t length) {
+  vm_map_entry_t *it = RB_RIGHT(ent, tree);
+
+  if (it == NULL || it->max_gap < length) {
+    /* Climb up until there's an entry or a right subtree that fits. */
+    for (;;) {
+      vm_map_entry_t *parent = RB_PARENT(ent, tree);
+      if (parent == NULL)
+        return NULL;
+      if (RB_LEFT(parent, tree) == ent) {
+        if (parent->gap >= length)
+          return parent;
+        it = RB_RIGHT(parent, tree);
+        if (it && it->max_gap >= length)
+          break;
+      }
+      ent = parent;
+    }
+  }
+
+  /* Descend to the leftmost entry in `it` subtree that fits. */
+  for (;;) {
+    vm_map_entry_t *left = RB_LEFT(it, tree);
+    if (left && left->max_gap >= length)
+      it = left;
+    else if (it->gap >= length)
+      return it;
+    else
+      it = RB_RIGHT(it, tree);
+  }
+}
+
 static int vm_map_findspace_nolock(vm_map_t *map, vaddr_t /*inout*/ *start_p,
                                    size_t length, vm_map_entry_t **after_p) {
   vaddr_t start = *start_p;
@@ -253,27 +372,34 @@ static int vm_map_findspace_nolock(vm_map_t *map, vaddr_t /*inout*/ *start_p,
   if (start + length <= first->start)
     goto found;
 
-  /* Browse available gaps. */
-  vm_map_entry_t *it;
-  TAILQ_FOREACH (it, &map->entries, link) {
-    vm_map_entry_t *next = vm_map_entry_next(it);
-    vaddr_t gap_start = it->end;
-    vaddr_t gap_end = next ? next->start : vm_map_end(map);
-
-    /* Move start address forward if it points inside allocated space. */
-    if (start < gap_start)
-      start = gap_start;
-
-    /* Will we fit inside this gap? */
-    if (start + length <= gap_end) {
-      if (after_p)
-        *after_p = it;
-      goto found;
+  /* Find the last entry that begins at or below start address. */
+  vm_map_entry_t *it = first;
+  for (vm_map_entry_t *node = RB_ROOT(&map->tree); node;) {
+    if (node->start <= start) {
+      it = node;
+      node = RB_RIGHT(node, tree);
+    } else {
+      node = RB_LEFT(node, tree);
     }
   }
 
-  /* Failed to find free space. */
-  return ENOMEM;
+  /* Will we fit inside the gap after it? Start address may be in the gap. */
+  vaddr_t gap_start = max(start, it->end);
+  vaddr_t gap_end = it->end + it->gap;
+  if (gap_start <= gap_end && gap_end - gap_start >= length) {
+    start = gap_start;
+    goto found_after;
+  }
+
+  /* Otherwise take the first following gap that is large enough. */
+  it = vm_map_entry_next_fit(it, length);
+  if (it == NULL)
+    return ENOMEM;
+  start = it->end;
+
+found_after:
+  if (after_p)
+    *after_p = it;
 
 found:
   *start_p = start;
@@ -310,15 +436,10 @@ int vm_map_insert(vm_map_t *map, vm_map_entry_t *ent, vm_flags_t flags) {
   return 0;
 }
 
-int vm_map_alloc_entry(vm_map_t *map, vaddr_t addr, size_t length,
-                       vm_prot_t prot, vm_flags_t flags,
-                       vm_map_entry_t **ent_p) {
-  if (!(flags & VM_ANON)) {
-    klog("Only anonymous memory mappings are supported!");
-    return ENOTSUP;
-  }
-
-  if (!page_aligned_p(addr))
+int vm_map_alloc_entry(vm_map_t *map, vm_object_t *obj, vm_offset_t offset,
+                       vaddr_t addr, size_t length, vm_prot_t prot,
+                       vm_flags_t flags, vm_map_entry_t **ent_p) {
+  if (!page_aligned_p(addr) || !page_aligned_p(offset))
     return EINVAL;
 
   if (length == 0)
@@ -328,9 +449,14 @@ int vm_map_alloc_entry(vm_map_t *map, vaddr_t addr, size_t length,
     return EINVAL;
 
   /* Create object with a pager that supplies cleared pages on page fault. */
-  vm_object_t *obj = vm_object_alloc(VM_ANONYMOUS);
+  if (obj == NULL)
+    obj = vm_object_alloc(VM_ANONYMOUS);
+  else
+    vm_object_hold(obj);
+
   vm_map_entry_t *ent =
     vm_map_entry_alloc(obj, addr, addr + length, prot, VM_ENT_SHARED);
+  ent->offset = offset;
 
   /* Given the hint try to insert the entry at given position or after it. */
   if (vm_map_insert(map, ent, flags)) {
@@ -355,7 +481,7 @@ int vm_map_entry_resize(vm_map_t *map, vm_map_entry_t *ent, vaddr_t new_end) {
       return ENOMEM;
   } else {
     /* Shrinking entry */
-    off_t offset = new_end - ent->start;
+    off_t offset = ent->offset + (new_end - ent->start);
     size_t length = ent->end - new_end;
     pmap_remove(map->pmap, new_end, ent->end);
     vm_object_remove_pages(ent->object, offset, length);
@@ -366,6 +492,8 @@ int vm_map_entry_resize(vm_map_t *map, vm_map_entry_t *ent, vaddr_t new_end) {
 
   if (ent->start == ent->end)
     vm_map_entry_destroy(map, ent);
+  else
+    vm_map_entry_update_gap(map, ent);
 
   return 0;
 }
@@ -402,20 +530,78 @@ vm_map_t *vm_map_clone(vm_map_t *map) {
         vm_object_hold(it->object);
         obj = it->object;
       } else {
-        /* vm_object_clone will clone the data from the vm_object_t
-         * and will return the new object with ref_counter equal to one */
-        obj = vm_object_clone(it->object);
+        /* Both maps get a shadow of the original object, so its pages are
+         * shared until either side writes to them. Then the faulting map
+         * gets a private copy of the page (see vm_page_fault). */
+        vm_object_t *orig = it->object;
+        vaddr_t end = it->offset + (it->end - it->start);
+        vm_object_collapse(orig);
+        obj = vm_object_shadow(orig, end);
+        it->object = vm_object_shadow(orig, end);
+        vm_object_drop(orig);
+        /* Make sure parent will fault on write to any page it maps now. */
+        if (it->prot & VM_PROT_WRITE)
+          pmap_protect(map->pmap, it->start, it->end,
+                       it->prot & ~VM_PROT_WRITE);
       }
       ent = vm_map_entry_alloc(obj, it->start, it->end, it->prot, it->flags);
       ent->offset = it->offset;
-      TAILQ_INSERT_TAIL(&new_map->entries, ent, link);
-      new_map->nentries++;
+      vm_map_link(new_map, TAILQ_LAST(&new_map->entries, vm_map_list), ent);
     }
   }
 
   return new_map;
 }
 
+/* Number of pages following the faulting one that get mapped along with it.
+ * The window doubles with each sequential fault within an entry. */
+#define FAULT_AHEAD_MIN 4U
+#define FAULT_AHEAD_MAX 32U
+
+/* Map pages that follow `fault_page` and are resident in the entry's object
+ * (or its backing objects), so that subsequent accesses do not trap. Pages of
+ * files backing the object are read in as well. If the entry is being accessed
+ * sequentially, then also fill the object itself in advance. */
+static void vm_fault_ahead(vm_map_t *map, vm_map_entry_t *ent,
+                           vaddr_t fault_page) {
+  vm_object_t *obj = ent->object;
+  bool sequential = (fault_page == ent->next_fault);
+
+  if (sequential)
+    ent->fault_ahead =
+      min(max(ent->fault_ahead * 2, FAULT_AHEAD_MIN), FAULT_AHEAD_MAX);
+  else
+    ent->fault_ahead = FAULT_AHEAD_MIN;
+
+  vaddr_t va = fault_page + PAGESIZE;
+  size_t npages = min(ent->fault_ahead, (ent->end - va) / PAGESIZE);
+
+  for (; npages > 0; npages--, va += PAGESIZE) {
+    paddr_t pa;
+    if (pmap_extract(map->pmap, va, &pa))
+      continue;
+
+    vaddr_t offset = ent->offset + (va - ent->start);
+    vm_prot_t prot = ent->prot;
+    vm_page_t *pg = vm_object_find_page(obj, offset);
+
+    if (pg == NULL && (pg = vm_object_find_backing_page(obj, offset)))
+      prot &= ~VM_PROT_WRITE;
+
+    if (pg == NULL && sequential && obj->vo_pager->pgr_type != VM_DUMMY)
+      pg = obj->vo_pager->pgr_fault(obj, offset);
+
+    if (pg == NULL)
+      break;
+
+    /* Pages mapped during sequential scan are going to be accessed soon,
+     * hence mark them as referenced to avoid another trap. */
+    pmap_enter(map->pmap, va, pg, prot, sequential ? VM_PROT_READ : 0);
+  }
+
+  ent->next_fault = va;
+}
+
 int vm_page_fault(vm_map_t *map, vaddr_t fault_addr, vm_prot_t fault_type) {
   SCOPED_VM_MAP_LOCK(map);
 
@@ -449,15 +635,39 @@ int vm_page_fault(vm_map_t *map, vaddr_t fault_addr, vm_prot_t fault_type) {
 
   vaddr_t fault_page = fault_addr & -PAGESIZE;
   vaddr_t offset = ent->offset + (fault_page - ent->start);
-  vm_page_t *frame = vm_object_find_page(ent->object, offset);
-
-  if (frame == NULL)
-    frame = obj->vo_pager->pgr_fault(obj, offset);
+  vm_prot_t prot = ent->prot;
+
+  /* Backing objects that are not shared anymore can be merged into this one,
+   * so that the page gets moved instead of being copied below. */
+  if ((fault_type & VM_PROT_WRITE) && obj->vo_backing)
+    vm_object_collapse(obj);
+
+  vm_page_t *frame = vm_object_find_page(obj, offset);
+
+  if (frame == NULL) {
+    vm_page_t *shared = vm_object_find_backing_page(obj, offset);
+    if (shared == NULL) {
+      frame = obj->vo_pager->pgr_fault(obj, offset);
+    } else if (fault_type & VM_PROT_WRITE) {
+      /* Copy-on-write: give this object its private copy of the page. */
+      frame = vm_page_alloc(1);
+      pmap_copy_page(shared, frame);
+      vm_object_add_page(obj, offset, frame);
+    } else {
+      /* Map the page read-only, so that the first write faults again. */
+      frame = shared;
+      prot &= ~VM_PROT_WRITE;
+    }
+  }
 
   if (frame == NULL)
     return EFAULT;
 
-  pmap_enter(map->pmap, fault_page, frame, ent->prot, 0);
+  /* The page is going to be accessed right away, so let pmap know about it
+   * to avoid taking another trap for referenced & modified bits emulation. */
+  pmap_enter(map->pmap, fault_page, frame, prot, fault_type);
+
+  vm_fault_ahead(map, ent, fault_page);
 
   return 0;
 }
@@ -5,28 +5,44 @@
 #include <sys/pmap.h>
 #include <sys/vm_object.h>
 #include <sys/vm_physmem.h>
+#include <sys/vnode.h>
 
-static POOL_DEFINE(P_VMOBJ, "vm_object", sizeof(vm_object_t));
+static inline int vm_page_cmp(vm_page_t *a, vm_page_t *b) {
+  if (a->offset < b->offset)
+    return -1;
+  return a->offset > b->offset;
+}
 
-vm_object_t *vm_object_alloc(vm_pgr_type_t type) {
-  vm_object_t *obj = pool_alloc(P_VMOBJ, M_ZERO);
-  TAILQ_INIT(&obj->vo_pages);
+RB_PROTOTYPE_STATIC(vm_pagetree, vm_page, objpages, vm_page_cmp);
+RB_GENERATE_STATIC(vm_pagetree, vm_page, objpages, vm_page_cmp);
+
+static void vm_object_ctor(void *ptr) {
+  vm_object_t *obj = ptr;
+  RB_INIT(&obj->vo_pages);
+  obj->vo_npages = 0;
   mtx_init(&obj->vo_lock, 0);
+  mtx_init(&obj->vo_pagein_lock, 0);
+}
+
+static POOL_DEFINE(P_VMOBJ, "vm_object", sizeof(vm_object_t),
+                   .ctor = vm_object_ctor);
+
+vm_object_t *vm_object_alloc(vm_pgr_type_t type) {
+  vm_object_t *obj = pool_alloc(P_VMOBJ, 0);
+  assert(obj->vo_npages == 0);
   obj->vo_pager = &pagers[type];
   obj->vo_refs = 1;
+  obj->vo_backing = NULL;
+  obj->vo_backing_end = 0;
+  obj->vo_vnode = NULL;
   return obj;
 }
 
 vm_page_t *vm_object_find_page(vm_object_t *obj, vm_offset_t offset) {
   SCOPED_MTX_LOCK(&obj->vo_lock);
 
-  vm_page_t *pg;
-  TAILQ_FOREACH (pg, &obj->vo_pages, objpages) {
-    if (pg->offset == offset)
-      return pg;
-  }
-
-  return NULL;
+  vm_page_t find = {.offset = offset};
+  return RB_FIND(vm_pagetree, &obj->vo_pages, &find);
 }
 
 void vm_object_add_page(vm_object_t *obj, vm_offset_t offset, vm_page_t *pg) {
@@ -38,19 +54,9 @@ void vm_object_add_page(vm_object_t *obj, vm_offset_t offset, vm_page_t *pg) {
   pg->offset = offset;
 
   WITH_MTX_LOCK (&obj->vo_lock) {
-    vm_page_t *it;
-    TAILQ_FOREACH (it, &obj->vo_pages, objpages) {
-      if (it->offset > pg->offset) {
-        TAILQ_INSERT_BEFORE(it, pg, objpages);
-        obj->vo_npages++;
-        return;
-      }
-      /* there must be no page at the offset! */
-      assert(it->offset != pg->offset);
-    }
-
-    /* offset of page is greater than the offset of any other page */
-    TAILQ_INSERT_TAIL(&obj->vo_pages, pg, objpages);
+    /* there must be no page at the offset! */
+    vm_page_t *old __unused = RB_INSERT(vm_pagetree, &obj->vo_pages, pg);
+    assert(old == NULL);
     obj->vo_npages++;
   }
 }
@@ -60,24 +66,31 @@ static void vm_object_remove_pages_nolock(vm_object_t *obj, vm_offset_t offset,
   assert(mtx_owned(&obj->vo_lock));
   assert(page_aligned_p(offset) && page_aligned_p(length));
 
-  vm_page_t *pg, *next;
-  TAILQ_FOREACH_SAFE (pg, &obj->vo_pages, objpages, next) {
-    if (pg->offset >= offset + length)
-      break;
-    if (pg->offset < offset)
-      continue;
+  /* Find the first page at or above `offset`, then walk forward in order. */
+  vm_page_t find = {.offset = offset};
+  vm_page_t *pg = RB_NFIND(vm_pagetree, &obj->vo_pages, &find);
 
+  while (pg && pg->offset < offset + length) {
+    vm_page_t *next = RB_NEXT(vm_pagetree, &obj->vo_pages, pg);
+    RB_REMOVE(vm_pagetree, &obj->vo_pages, pg);
+    /* Pages of objects backing files may be mapped anywhere. */
+    pmap_page_remove(pg);
     pg->offset = 0;
     pg->object = NULL;
-    TAILQ_REMOVE(&obj->vo_pages, pg, objpages);
     vm_page_free(pg);
     obj->vo_npages--;
+    pg = next;
   }
 }
 
 void vm_object_remove_pages(vm_object_t *obj, vm_offset_t off, size_t len) {
   SCOPED_MTX_LOCK(&obj->vo_lock);
   vm_object_remove_pages_nolock(obj, off, len);
+
+  /* Backing pages are shared with other objects, so they cannot be freed.
+   * If the tail of the object is being removed, then hide them instead. */
+  if (obj->vo_backing && off + len >= obj->vo_backing_end)
+    obj->vo_backing_end = min(obj->vo_backing_end, off);
 }
 
 #define vm_object_remove_all_pages(obj)                                        \
@@ -88,37 +101,108 @@ void vm_object_hold(vm_object_t *obj) {
 }
 
 void vm_object_drop(vm_object_t *obj) {
-  WITH_MTX_LOCK (&obj->vo_lock) {
-    if (!refcnt_release(&obj->vo_refs))
+  /* Releasing the last reference to a shadow object drops the reference it
+   * holds to its backing object, so walk down the chain iteratively. */
+  while (obj) {
+    vm_object_t *backing;
+    vnode_t *vp;
+
+    WITH_MTX_LOCK (&obj->vo_lock) {
+      if (!refcnt_release(&obj->vo_refs))
+        return;
+
+      /* Pages of a file stay cached until its vnode is reclaimed, so only
+       * release the vnode that was held on behalf of the object's users. */
+      if ((vp = obj->vo_vnode))
+        break;
+
+      vm_object_remove_all_pages(obj);
+      backing = obj->vo_backing;
+      obj->vo_backing = NULL;
+    }
+
+    if (vp) {
+      vnode_drop(vp);
       return;
+    }
 
-    vm_object_remove_all_pages(obj);
+    pool_free(P_VMOBJ, obj);
+    obj = backing;
   }
-  pool_free(P_VMOBJ, obj);
 }
 
-vm_object_t *vm_object_clone(vm_object_t *obj) {
-  /* XXX: this function will not be used in UVM */
-  vm_object_t *new_obj = vm_object_alloc(VM_DUMMY);
-  new_obj->vo_pager = obj->vo_pager;
+vm_object_t *vm_object_shadow(vm_object_t *obj, vm_offset_t end) {
+  vm_object_t *shadow = vm_object_alloc(VM_ANONYMOUS);
+  vm_object_hold(obj);
+  shadow->vo_backing = obj;
+  shadow->vo_backing_end = end;
+  return shadow;
+}
 
-  WITH_MTX_LOCK (&obj->vo_lock) {
-    vm_page_t *pg;
-    TAILQ_FOREACH (pg, &obj->vo_pages, objpages) {
-      vm_page_t *new_pg = vm_page_alloc(1);
-      pmap_copy_page(pg, new_pg);
-      vm_object_add_page(new_obj, pg->offset, new_pg);
+vm_page_t *vm_object_find_backing_page(vm_object_t *obj, vm_offset_t off) {
+  vm_object_t *backing;
+
+  for (; obj; obj = backing) {
+    WITH_MTX_LOCK (&obj->vo_lock) {
+      backing = obj->vo_backing;
+      if (off >= obj->vo_backing_end)
+        return NULL;
     }
+    if (backing == NULL)
+      return NULL;
+    vm_page_t *pg = vm_object_find_page(backing, off);
+    if (pg)
+      return pg;
+    /* Missing pages of a file are not holes, so they must be read in. */
+    if (backing->vo_pager->pgr_type == VM_VNODE)
+      return backing->vo_pager->pgr_fault(backing, off);
   }
 
-  return new_obj;
+  return NULL;
+}
+
+void vm_object_collapse(vm_object_t *obj) {
+  SCOPED_MTX_LOCK(&obj->vo_lock);
+
+  vm_object_t *backing;
+  while ((backing = obj->vo_backing) && backing->vo_refs == 1 &&
+         backing->vo_pager->pgr_type == VM_ANONYMOUS) {
+    /* Only `obj` refers to `backing`, hence pages of the latter that are not
+     * hidden by `obj` can be moved rather than copied on write fault. */
+    WITH_MTX_LOCK (&backing->vo_lock) {
+      vm_page_t *pg, *next;
+      RB_FOREACH_SAFE (pg, vm_pagetree, &backing->vo_pages, next) {
+        RB_REMOVE(vm_pagetree, &backing->vo_pages, pg);
+        backing->vo_npages--;
+
+        if (pg->offset < obj->vo_backing_end &&
+            !RB_FIND(vm_pagetree, &obj->vo_pages, pg)) {
+          pg->object = obj;
+          RB_INSERT(vm_pagetree, &obj->vo_pages, pg);
+          obj->vo_npages++;
+        } else {
+          pmap_page_remove(pg);
+          pg->offset = 0;
+          pg->object = NULL;
+          vm_page_free(pg);
+        }
+      }
+
+      obj->vo_backing = backing->vo_backing;
+      obj->vo_backing_end = min(obj->vo_backing_end, backing->vo_backing_end);
+      backing->vo_backing = NULL;
+    }
+
+    klog("(vm-obj) collapsed %p into %p", backing, obj);
+    pool_free(P_VMOBJ, backing);
+  }
 }
 
 void vm_object_dump(vm_object_t *obj) {
   SCOPED_MTX_LOCK(&obj->vo_lock);
 
   vm_page_t *pg;
-  TAILQ_FOREACH (pg, &obj->vo_pages, objpages) {
+  RB_FOREACH (pg, vm_pagetree, &obj->vo_pages) {
     klog("(vm-obj) offset: 0x%08lx, size: %ld", pg->offset, pg->size);
   }
 }
@@ -1,5 +1,8 @@
 #include <sys/mimiker.h>
 #include <sys/pmap.h>
+#include <sys/uio.h>
+#include <sys/vnode.h>
+#include <sys/vm_map.h>
 #include <sys/vm_object.h>
 #include <sys/vm_pager.h>
 #include <sys/vm_physmem.h>
@@ -11,13 +14,90 @@ static vm_page_t *dummy_pager_fault(vm_object_t *obj, off_t offset) {
 static vm_page_t *anon_pager_fault(vm_object_t *obj, off_t offset) {
   assert(obj != NULL);
 
-  vm_page_t *new_pg = vm_page_alloc(1);
-  pmap_zero_page(new_pg);
+  vm_page_t *new_pg = vm_page_alloc_zero();
   vm_object_add_page(obj, offset, new_pg);
   return new_pg;
 }
 
+/*
+ * Vnode pager reads pages of a file on first access and keeps them in an
+ * object that is shared by all mappings of the file. The object refers to the
+ * vnode without holding a reference, unless it's used by someone else.
+ */
+static vm_page_t *vnode_pager_fault(vm_object_t *obj, off_t offset) {
+  vnode_t *v = obj->vo_vnode;
+  vm_page_t *pg;
+  vattr_t va;
+
+  assert(v != NULL);
+
+  /* Page-ins are serialized, so a page cannot be read twice. Vnode lock must
+   * not be used for that, since it's held by read(2) and write(2) while data
+   * is copied from or to user memory, which may fault on a mapped file. */
+  mtx_lock(&obj->vo_pagein_lock);
+
+  if ((pg = vm_object_find_page(obj, offset)))
+    goto end;
+
+  /* Accessing pages past the end of file is an error. */
+  if (VOP_GETATTR(v, &va) || offset >= (off_t)va.va_size)
+    goto end;
+
+  pg = vm_page_alloc(1);
+  pmap_zero_page(pg);
+
+  uio_t uio = UIO_SINGLE_KERNEL(UIO_READ, offset, pmap_page_kva(pg), PAGESIZE);
+  if (VOP_READ(v, &uio)) {
+    vm_page_free(pg);
+    pg = NULL;
+    goto end;
+  }
+
+  vm_object_add_page(obj, offset, pg);
+
+end:
+  mtx_unlock(&obj->vo_pagein_lock);
+  return pg;
+}
+
+vm_object_t *vnode_pager_object(vnode_t *v) {
+  vm_object_t *obj = v->v_object;
+
+  if (obj == NULL) {
+    obj = vm_object_alloc(VM_VNODE);
+    obj->vo_vnode = v;
+    obj->vo_refs = 0;
+    v->v_object = obj;
+  }
+
+  WITH_MTX_LOCK (&obj->vo_lock) {
+    if (obj->vo_refs++ == 0)
+      vnode_hold(v);
+  }
+
+  return obj;
+}
+
+void vnode_pager_release(vnode_t *v) {
+  vm_object_t *obj = v->v_object;
+
+  if (obj == NULL)
+    return;
+
+  v->v_object = NULL;
+
+  /* The vnode could not be reclaimed if the object had any users. */
+  WITH_MTX_LOCK (&obj->vo_lock) {
+    assert(obj->vo_refs == 0);
+    obj->vo_vnode = NULL;
+    obj->vo_refs = 1;
+  }
+
+  vm_object_drop(obj);
+}
+
 vm_pager_t pagers[] = {
-  [VM_DUMMY] = {.pgr_fault = dummy_pager_fault},
-  [VM_ANONYMOUS] = {.pgr_fault = anon_pager_fault},
+  [VM_DUMMY] = {.pgr_type = VM_DUMMY, .pgr_fault = dummy_pager_fault},
+  [VM_ANONYMOUS] = {.pgr_type = VM_ANONYMOUS, .pgr_fault = anon_pager_fault},
+  [VM_VNODE] = {.pgr_type = VM_VNODE, .pgr_fault = vnode_pager_fault},
 };
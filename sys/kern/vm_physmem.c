@@ -4,7 +4,14 @@
 #include <sys/libkern.h>
 #include <sys/errno.h>
 #include <sys/mutex.h>
+#include <sys/condvar.h>
+#include <sys/devfs.h>
+#include <sys/linker_set.h>
+#include <sys/pcpu.h>
 #include <sys/pmap.h>
+#include <sys/sched.h>
+#include <sys/thread.h>
+#include <sys/uio.h>
 #include <sys/vm_physmem.h>
 #include <sys/kasan.h>
 
@@ -31,6 +38,46 @@ static vm_pagelist_t freelist[PM_NQUEUES];
 static size_t pagecount[PM_NQUEUES];
 static MTX_DEFINE(physmem_lock, LK_RECURSIVE);
 
+/*
+ * Single pages are requested far more often than bigger ones (page tables,
+ * page faults, pools), so each CPU keeps a cache of order-0 pages. The cache
+ * is refilled from and drained to the buddy system in batches, hence
+ * `physmem_lock` is taken once per PM_CACHE_BATCH operations. Pages in the
+ * caches are regarded by the buddy system as allocated, but have PG_ALLOCATED
+ * cleared, so that freeing a cached page for the second time is detected.
+ *
+ * Lock order: pm_cache_t::lock, then `physmem_lock`.
+ */
+#define PM_CACHE_BATCH 16 /* number of pages moved to or from buddy system */
+#define PM_CACHE_MAX 64   /* cache is drained when it gets more pages */
+
+typedef struct pm_cache {
+  mtx_t lock;
+  vm_pagelist_t pages; /* free pages, most recently freed first */
+  unsigned count;      /* number of pages on `pages` */
+  unsigned long hits;
+  unsigned long refills;
+  unsigned long drains;
+} pm_cache_t;
+
+static pm_cache_t pm_cache[MAXCPU];
+
+/*
+ * Pool of pre-zeroed pages. Zeroing a page on the fault path is costly, so
+ * it's done in advance by a thread of the lowest priority, i.e. one that runs
+ * when the CPU would be idle otherwise. Consumers wake it up when the pool
+ * runs low.
+ */
+#define PM_ZERO_MAX 64 /* pool is filled up to this number of pages */
+#define PM_ZERO_LOW 16 /* zeroing thread is woken below this number */
+
+static MTX_DEFINE(pm_zero_lock, 0);
+static condvar_t pm_zero_cv;
+static vm_pagelist_t pm_zero_pages = TAILQ_HEAD_INITIALIZER(pm_zero_pages);
+static unsigned pm_zero_count;
+static unsigned long pm_zero_hits;
+static unsigned long pm_zero_misses;
+
 void _vm_physseg_plug(paddr_t start, paddr_t end, bool used) {
   assert(page_aligned_p(start) && page_aligned_p(end) && start < end);
 
@@ -104,6 +151,13 @@ void init_vm_page(void) {
   for (unsigned i = 0; i < PM_NQUEUES; i++)
     TAILQ_INIT(&freelist[i]);
 
+  for (unsigned i = 0; i < MAXCPU; i++) {
+    mtx_init(&pm_cache[i].lock, 0);
+    TAILQ_INIT(&pm_cache[i].pages);
+  }
+
+  cv_init(&pm_zero_cv, "pagezero");
+
   /* Allocate contiguous array of vm_page_t to cover all physical memory. */
   size_t npages = 0;
   TAILQ_FOREACH (seg, &seglist, seglink)
@@ -218,10 +272,8 @@ static vm_page_t *pm_take_page(size_t fl) {
   return page;
 }
 
-vm_page_t *vm_page_alloc(size_t npages) {
-  assert((npages > 0) && powerof2(npages));
-
-  SCOPED_MTX_LOCK(&physmem_lock);
+static vm_page_t *pm_alloc(size_t npages) {
+  assert(mtx_owned(&physmem_lock));
 
   size_t n = log2(npages);
   size_t fl = n;
@@ -239,7 +291,7 @@ vm_page_t *vm_page_alloc(size_t npages) {
   return pm_take_page(fl);
 }
 
-int vm_pagelist_alloc(size_t n, vm_pagelist_t *pglist) {
+static int pm_pagelist_alloc(size_t n, vm_pagelist_t *pglist) {
   TAILQ_INIT(pglist);
 
   SCOPED_MTX_LOCK(&physmem_lock);
@@ -324,11 +376,171 @@ static void vm_page_free_nolock(vm_page_t *pg) {
   panic("page out of range: %p", (void *)pg->paddr);
 }
 
-void vm_page_free(vm_page_t *page) {
+static void pm_cache_refill(pm_cache_t *pc) {
+  assert(mtx_owned(&pc->lock));
+
+  SCOPED_MTX_LOCK(&physmem_lock);
+
+  pc->refills++;
+  for (int i = 0; i < PM_CACHE_BATCH; i++) {
+    vm_page_t *pg = pm_alloc(1);
+    if (pg == NULL)
+      break;
+    pg->flags &= ~PG_ALLOCATED;
+    TAILQ_INSERT_TAIL(&pc->pages, pg, freeq);
+    pc->count++;
+  }
+}
+
+/* Return `n` least recently freed pages to the buddy system. */
+static void pm_cache_drain(pm_cache_t *pc, unsigned n) {
+  assert(mtx_owned(&pc->lock));
+
+  SCOPED_MTX_LOCK(&physmem_lock);
+
+  pc->drains++;
+  for (; n > 0 && pc->count > 0; n--) {
+    vm_page_t *pg = TAILQ_LAST(&pc->pages, vm_pagelist);
+    TAILQ_REMOVE(&pc->pages, pg, freeq);
+    pc->count--;
+    pg->flags |= PG_ALLOCATED;
+    vm_page_free_nolock(pg);
+  }
+}
+
+/* A thread may migrate to another CPU after picking a cache, but since caches
+ * are protected by locks, it only means it uses a cache of another CPU. */
+static pm_cache_t *pm_cache_self(void) {
+  return &pm_cache[PCPU_GET(cpuid)];
+}
+
+static vm_page_t *pm_cache_alloc(void) {
+  pm_cache_t *pc = pm_cache_self();
+
+  SCOPED_MTX_LOCK(&pc->lock);
+
+  if (pc->count > 0)
+    pc->hits++;
+  else
+    pm_cache_refill(pc);
+
+  vm_page_t *pg = TAILQ_FIRST(&pc->pages);
+  if (pg != NULL) {
+    TAILQ_REMOVE(&pc->pages, pg, freeq);
+    pc->count--;
+    pg->flags |= PG_ALLOCATED;
+  }
+  return pg;
+}
+
+static void pm_cache_free(vm_page_t *pg) {
+  pm_cache_t *pc = pm_cache_self();
+
+  SCOPED_MTX_LOCK(&pc->lock);
+
+  if (!(pg->flags & PG_ALLOCATED))
+    panic("page is already free: %p", (void *)pg->paddr);
+  assert(TAILQ_EMPTY(&pg->pv_list));
+  pg->flags &= ~(PG_ALLOCATED | PG_REFERENCED | PG_MODIFIED);
+
+  TAILQ_INSERT_HEAD(&pc->pages, pg, freeq);
+  pc->count++;
+
+  if (pc->count > PM_CACHE_MAX)
+    pm_cache_drain(pc, PM_CACHE_BATCH);
+}
+
+/* Give back all pages held in caches and zeroed pages pool to the buddy
+ * system, so that a failed allocation can be retried. */
+static void pm_reclaim(void) {
+  for (unsigned i = 0; i < MAXCPU; i++) {
+    pm_cache_t *pc = &pm_cache[i];
+    WITH_MTX_LOCK (&pc->lock)
+      pm_cache_drain(pc, pc->count);
+  }
+
+  vm_pagelist_t pglist;
+  TAILQ_INIT(&pglist);
+
+  WITH_MTX_LOCK (&pm_zero_lock) {
+    TAILQ_CONCAT(&pglist, &pm_zero_pages, pageq);
+    pm_zero_count = 0;
+  }
+
+  vm_pagelist_free(&pglist);
+}
+
+vm_page_t *vm_page_alloc(size_t npages) {
+  assert((npages > 0) && powerof2(npages));
+
+  vm_page_t *pg;
+
+  if (npages == 1 && (pg = pm_cache_alloc()))
+    return pg;
+
+  WITH_MTX_LOCK (&physmem_lock)
+    pg = pm_alloc(npages);
+
+  if (pg == NULL) {
+    klog("%s: out of memory, reclaiming cached pages", __func__);
+    pm_reclaim();
+    WITH_MTX_LOCK (&physmem_lock)
+      pg = pm_alloc(npages);
+  }
+
+  return pg;
+}
+
+int vm_pagelist_alloc(size_t n, vm_pagelist_t *pglist) {
+  int error = pm_pagelist_alloc(n, pglist);
+  if (error == ENOMEM) {
+    pm_reclaim();
+    error = pm_pagelist_alloc(n, pglist);
+  }
+  return error;
+}
+
+static void pm_page_free(vm_page_t *page) {
+  if (page->size == 1) {
+    pm_cache_free(page);
+    return;
+  }
+
   SCOPED_MTX_LOCK(&physmem_lock);
   vm_page_free_nolock(page);
 }
 
+void vm_page_free(vm_page_t *page) {
+  /* Holds are rare, so don't take the lock unless the page seems held. */
+  if (page->holdcnt > 0) {
+    WITH_MTX_LOCK (&physmem_lock) {
+      if (page->holdcnt > 0) {
+        page->flags |= PG_RELEASED;
+        return;
+      }
+    }
+  }
+
+  pm_page_free(page);
+}
+
+void vm_page_hold(vm_page_t *page) {
+  SCOPED_MTX_LOCK(&physmem_lock);
+  assert(page->flags & PG_ALLOCATED);
+  page->holdcnt++;
+}
+
+void vm_page_unhold(vm_page_t *page) {
+  WITH_MTX_LOCK (&physmem_lock) {
+    assert(page->holdcnt > 0);
+    if (--page->holdcnt > 0 || !(page->flags & PG_RELEASED))
+      return;
+    page->flags &= ~PG_RELEASED;
+  }
+
+  pm_page_free(page);
+}
+
 void vm_pagelist_free(vm_pagelist_t *pglist) {
   SCOPED_MTX_LOCK(&physmem_lock);
 
@@ -352,3 +564,116 @@ vm_page_t *vm_page_find(paddr_t pa) {
 
   return NULL;
 }
+
+vm_page_t *vm_page_alloc_zero(void) {
+  vm_page_t *pg = NULL;
+
+  WITH_MTX_LOCK (&pm_zero_lock) {
+    if ((pg = TAILQ_FIRST(&pm_zero_pages))) {
+      TAILQ_REMOVE(&pm_zero_pages, pg, pageq);
+      pm_zero_count--;
+      pm_zero_hits++;
+    } else {
+      pm_zero_misses++;
+    }
+    if (pm_zero_count < PM_ZERO_LOW)
+      cv_signal(&pm_zero_cv);
+  }
+
+  if (pg == NULL && (pg = vm_page_alloc(1)))
+    pmap_zero_page(pg);
+
+  return pg;
+}
+
+static void pm_zero_thread(void *arg) {
+  while (true) {
+    WITH_MTX_LOCK (&pm_zero_lock) {
+      while (pm_zero_count >= PM_ZERO_MAX)
+        cv_wait(&pm_zero_cv, &pm_zero_lock);
+    }
+
+    /* Don't reclaim cached pages just to have them zeroed. */
+    vm_page_t *pg;
+    WITH_MTX_LOCK (&physmem_lock)
+      pg = pm_alloc(1);
+
+    if (pg != NULL)
+      pmap_zero_page(pg);
+
+    WITH_MTX_LOCK (&pm_zero_lock) {
+      if (pg != NULL) {
+        TAILQ_INSERT_TAIL(&pm_zero_pages, pg, pageq);
+        pm_zero_count++;
+      } else {
+        /* Out of memory - wait until someone takes a zeroed page. */
+        cv_wait(&pm_zero_cv, &pm_zero_lock);
+      }
+    }
+  }
+}
+
+void init_vm_pagezero(void) {
+  thread_t *td = thread_create("pagezero", pm_zero_thread, NULL,
+                               prio_uthread(PRIO_QTY - 1));
+  td->td_flags |= TDF_IDLE;
+  sched_add(td);
+}
+
+/*
+ * /dev/physmem reports physical memory allocator statistics, one
+ * `name value` pair per line.
+ */
+
+#define PM_STATSIZE 1024
+
+static MTX_DEFINE(pm_stat_lock, 0);
+static char pm_stat_buf[PM_STATSIZE];
+
+static int pm_stat_read(devnode_t *dev, uio_t *uio) {
+  char *buf = pm_stat_buf;
+  unsigned long hits = 0, refills = 0, drains = 0, cached = 0;
+  size_t nfree[PM_NQUEUES];
+  int n = 0;
+
+  SCOPED_MTX_LOCK(&pm_stat_lock);
+
+  for (unsigned i = 0; i < MAXCPU; i++) {
+    pm_cache_t *pc = &pm_cache[i];
+    SCOPED_MTX_LOCK(&pc->lock);
+    hits += pc->hits;
+    refills += pc->refills;
+    drains += pc->drains;
+    cached += pc->count;
+  }
+
+  WITH_MTX_LOCK (&physmem_lock)
+    memcpy(nfree, pagecount, sizeof(nfree));
+
+  for (unsigned i = 0; i < PM_NQUEUES; i++)
+    n += snprintf(buf + n, PM_STATSIZE - n, "free_order%u %lu\n", i,
+                  (u_long)nfree[i]);
+
+  n += snprintf(buf + n, PM_STATSIZE - n,
+                "cache_pages %lu\ncache_hits %lu\ncache_refills %lu\n"
+                "cache_drains %lu\n",
+                cached, hits, refills, drains);
+
+  WITH_MTX_LOCK (&pm_zero_lock)
+    n += snprintf(buf + n, PM_STATSIZE - n,
+                  "zero_pages %u\nzero_hits %lu\nzero_misses %lu\n",
+                  pm_zero_count, pm_zero_hits, pm_zero_misses);
+
+  return uiomove_frombuf(buf, min(n, PM_STATSIZE - 1), uio);
+}
+
+static devops_t pm_stat_devops = {
+  .d_type = DT_OTHER,
+  .d_read = pm_stat_read,
+};
+
+static void init_dev_physmem(void) {
+  devfs_makedev_new(NULL, "physmem", &pm_stat_devops, NULL, NULL);
+}
+
+SET_ENTRY(devfs_init, init_dev_physmem);
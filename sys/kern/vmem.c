@@ -159,7 +159,10 @@ static bt_t *bt_lookupbusy(vmem_t *vm, vmem_addr_t addr) {
   return NULL;
 }
 
-static bt_t *bt_find_freeseg(vmem_t *vm, vmem_size_t size) {
+/* Returns a free segment that has `size` bytes starting at an address
+ * aligned to `alignment`. */
+static bt_t *bt_find_freeseg(vmem_t *vm, vmem_size_t size,
+                            vmem_size_t alignment) {
   assert(mtx_owned(&vm->vm_lock));
 
   vmem_freelist_t *first = bt_freehead(vm, size);
@@ -168,7 +171,8 @@ static bt_t *bt_find_freeseg(vmem_t *vm, vmem_size_t size) {
   for (vmem_freelist_t *list = first; list < end; list++) {
     bt_t *bt;
     LIST_FOREACH (bt, list, bt_freelink) {
-      if (bt->bt_size >= size)
+      vmem_size_t skip = align(bt->bt_start, alignment) - bt->bt_start;
+      if (bt->bt_size >= size && bt->bt_size - size >= skip)
         return bt;
     }
   }
@@ -259,22 +263,39 @@ int vmem_add(vmem_t *vm, vmem_addr_t addr, vmem_size_t size) {
 
 int vmem_alloc(vmem_t *vm, vmem_size_t size, vmem_addr_t *addrp,
                kmem_flags_t flags) {
+  return vmem_xalloc(vm, size, 0, addrp, flags);
+}
+
+int vmem_xalloc(vmem_t *vm, vmem_size_t size, vmem_size_t alignment,
+                vmem_addr_t *addrp, kmem_flags_t flags) {
   size = align(size, vm->vm_quantum);
-  assert(size > 0);
+  alignment = max(alignment, vm->vm_quantum);
+  assert(size > 0 && powerof2(alignment));
 
-  /* Allocate new boundary tag before acquiring the vmem lock */
-  bt_t *bt, *btnew;
+  /* Allocate new boundary tags before acquiring the vmem lock. The second one
+   * is needed if the segment has to be split in front of an aligned address. */
+  bt_t *bt, *btnew, *btaligned;
 
   if (!(btnew = pool_alloc(P_BT, flags | M_ZERO)))
     return ENOMEM;
 
+  btaligned = NULL;
+  if (alignment > vm->vm_quantum) {
+    if (!(btaligned = pool_alloc(P_BT, flags | M_ZERO))) {
+      pool_free(P_BT, btnew);
+      return ENOMEM;
+    }
+  }
+
   WITH_MTX_LOCK (&vm->vm_lock) {
     vmem_check_sanity(vm);
 
-    bt = bt_find_freeseg(vm, size);
+    bt = bt_find_freeseg(vm, size, alignment);
 
     if (bt == NULL) {
       pool_free(P_BT, btnew);
+      if (btaligned != NULL)
+        pool_free(P_BT, btaligned);
       klog("%s: block of %lu bytes not found in '%s'", __func__, size,
            vm->vm_name);
       return ENOMEM;
@@ -283,6 +304,19 @@ int vmem_alloc(vmem_t *vm, vmem_size_t size, vmem_addr_t *addrp,
     bt_remfree(vm, bt);
     vmem_check_sanity(vm);
 
+    vmem_addr_t start = align(bt->bt_start, alignment);
+    if (start > bt->bt_start) {
+      /* Split [bt] into [bt | btaligned] and allocate from the latter */
+      btaligned->bt_type = BT_TYPE_FREE;
+      btaligned->bt_start = start;
+      btaligned->bt_size = bt->bt_size - (start - bt->bt_start);
+      bt->bt_size = start - bt->bt_start;
+      bt_insfree(vm, bt);
+      bt_insseg_after(vm, btaligned, bt);
+      bt = btaligned;
+      btaligned = NULL;
+    }
+
     if (bt->bt_size > size && bt->bt_size - size >= vm->vm_quantum) {
       /* Split [bt] into [bt | btnew] */
       btnew->bt_type = BT_TYPE_FREE;
@@ -306,8 +340,10 @@ int vmem_alloc(vmem_t *vm, vmem_size_t size, vmem_addr_t *addrp,
 
   if (btnew != NULL)
     pool_free(P_BT, btnew);
+  if (btaligned != NULL)
+    pool_free(P_BT, btaligned);
 
-  assert(bt->bt_size >= size);
+  assert(bt->bt_size >= size && is_aligned(bt->bt_start, alignment));
   assert(bt->bt_type == BT_TYPE_BUSY);
 
   if (addrp != NULL)
@@ -112,6 +112,20 @@ vsnprintf(char *buf, size_t size, const char *cfmt, va_list ap)
 	return (retval);
 }
 
+size_t
+snprintf_append(char *buf, size_t size, size_t n, const char *cfmt, ...)
+{
+	va_list ap;
+	int len;
+
+	va_start(ap, cfmt);
+	len = vsnprintf(buf + n, size - n, cfmt, ap);
+	va_end(ap);
+
+	n += imax(len, 0);
+	return (n < size ? n : size - 1);
+}
+
 static void
 kprint_func(int ch, void *arg)
 {
@@ -32,6 +32,78 @@ register_t ctx_get_pc(ctx_t *ctx) {
   return _REG(ctx, EPC);
 }
 
+#define INSN_IMM(insn) ((int16_t)((insn)&0xffff))
+#define INSN_ADDIU_SP 0x27bd0000 /* addiu sp, sp, imm */
+#define INSN_SW_RA 0xafbf0000    /* sw ra, imm(sp) */
+#define INSN_JR_RA 0x03e00008    /* jr ra */
+#define UNWIND_MAXSCAN 4096      /* how far to look for function prologue */
+
+static inline bool is_addiu_sp(uint32_t insn) {
+  return (insn & 0xffff0000) == INSN_ADDIU_SP;
+}
+
+/*
+ * The ABI does not maintain a chain of frame pointers, so we have to analyse
+ * function prologues. Starting from the program counter we search backwards
+ * for the instruction that allocates the stack frame. Then we look forward
+ * for the instruction that saves the return address. If the function has
+ * no stack frame (or the context was saved before it was allocated),
+ * the return address is still in the register, which is valid only for
+ * the innermost frame.
+ */
+unsigned ctx_unwind(ctx_t *ctx, unwind_read_t read, uintptr_t *pcs,
+                    unsigned n) {
+  vaddr_t pc = _REG(ctx, EPC);
+  vaddr_t sp = _REG(ctx, SP);
+  register_t ra = _REG(ctx, RA);
+  register_t insn, val;
+  unsigned i = 0;
+
+  while (i < n && pc != 0) {
+    pcs[i++] = pc;
+
+    vaddr_t start = 0;
+    int framesize = 0;
+
+    for (vaddr_t addr = pc - 4; pc - addr <= UNWIND_MAXSCAN; addr -= 4) {
+      if (!read(addr, &insn))
+        return i;
+      if (is_addiu_sp(insn) && INSN_IMM(insn) < 0) {
+        start = addr;
+        framesize = -INSN_IMM(insn);
+        break;
+      }
+      /* Returning from previous function, unless it's an early return from
+       * this one, which frees the stack frame in the delay slot. */
+      if ((uint32_t)insn == INSN_JR_RA) {
+        if (!read(addr + 4, &val))
+          return i;
+        if (!is_addiu_sp(val) || INSN_IMM(val) < 0)
+          break;
+      }
+    }
+
+    if (framesize > 0) {
+      for (vaddr_t addr = start + 4; addr < pc; addr += 4) {
+        if (!read(addr, &insn))
+          return i;
+        if ((insn & 0xffff0000) == INSN_SW_RA) {
+          if (!read(sp + INSN_IMM(insn), &ra))
+            return i;
+          break;
+        }
+      }
+      sp += framesize;
+    }
+
+    /* Return address may come from the register only once. */
+    pc = ra;
+    ra = 0;
+  }
+
+  return i;
+}
+
 void mcontext_copy(mcontext_t *to, mcontext_t *from) {
   memcpy(to, from, sizeof(mcontext_t));
 }
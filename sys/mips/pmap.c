@@ -1,5 +1,6 @@
 #define KL_LOG KL_PMAP
 #include <sys/klog.h>
+#include <sys/hash.h>
 #include <sys/mimiker.h>
 #include <sys/libkern.h>
 #include <sys/pool.h>
@@ -11,21 +12,20 @@
 #include <sys/mutex.h>
 #include <sys/sched.h>
 #include <sys/vm_physmem.h>
-#include <bitstring.h>
 #include <errno.h>
 #include <sys/kasan.h>
 
 typedef struct pmap {
-  mtx_t mtx;                      /* protects all fields in this structure */
-  asid_t asid;                    /* address space identifier */
-  pde_t *pde;                     /* directory page table (kseg0) */
-  vm_pagelist_t pte_pages;        /* pages we allocate in page table */
-  TAILQ_HEAD(, pv_entry) pv_list; /* all pages mapped by this physical map */
+  mtx_t mtx;               /* protects all fields in this structure */
+  asid_t asid;             /* address space identifier */
+  uint32_t asid_gen;       /* generation `asid` is valid in */
+  pde_t *pde;              /* directory page table (kseg0) */
+  vm_pagelist_t pte_pages; /* pages we allocate in page table */
 } pmap_t;
 
 typedef struct pv_entry {
-  TAILQ_ENTRY(pv_entry) pmap_link; /* link on pmap::pv_list */
   TAILQ_ENTRY(pv_entry) page_link; /* link on vm_page::pv_list */
+  LIST_ENTRY(pv_entry) hash_link;  /* link on pv hash bucket */
   pmap_t *pmap;                    /* page is mapped in this pmap */
   vaddr_t va;                      /* under this address */
 } pv_entry_t;
@@ -48,18 +48,43 @@ static const pte_t vm_prot_map[] = {
 
 static pmap_t kernel_pmap;
 pde_t *_kernel_pmap_pde;
-static bitstr_t asid_used[bitstr_size(MAX_ASID)] = {0};
 static SPIN_DEFINE(asid_lock, 0);
+static uint32_t asid_gen = 1;  /* current ASID generation */
+static unsigned asid_next = 1; /* next ASID to hand out in this generation */
 
-/* this lock is used to protect the vm_page::pv_list field */
-/* the order of acquiring locks is as follows: firstly pv_list_lock and then
- * pmap_t::mtx */
-static MTX_DEFINE(pv_list_lock, 0);
+/*
+ * Physical-to-virtual entries of a page are kept on vm_page::pv_list. To find
+ * an entry for given pmap and virtual address without walking the list of
+ * a page that is mapped in many address spaces, entries are also put into
+ * a hash table.
+ *
+ * There's no single lock for all pv entries. A page is assigned one of
+ * PV_LOCKS locks based on its physical address. The lock protects pv list of
+ * the page, a part of the hash table and page table entries that map the page.
+ * Thus flags of all mappings of a page can be changed without taking locks of
+ * pmaps involved. Creating or destroying a mapping requires holding both
+ * pmap_t::mtx and the pv lock of the page, in that order.
+ */
+#define PV_LOCKS 64    /* number of pv locks, must be a power of two */
+#define PV_HASHSIZE 64 /* hash buckets per lock, must be a power of two */
+
+typedef LIST_HEAD(, pv_entry) pv_hashhead_t;
+
+typedef struct pv_table {
+  mtx_t lock;
+  pv_hashhead_t hash[PV_HASHSIZE];
+} pv_table_t;
+
+static pv_table_t pv_table[PV_LOCKS];
 
 #define PDE_OF(pmap, vaddr) ((pmap)->pde[PDE_INDEX(vaddr)])
 #define PT_BASE(pde) ((pte_t *)(((pde) >> PTE_PFN_SHIFT) << PTE_INDEX_SHIFT))
 #define PTE_OF(pde, vaddr) (PT_BASE(pde)[PTE_INDEX(vaddr)])
 
+#define PDE_SPACE_SIZE (PAGESIZE * PAGESIZE / sizeof(pte_t))
+#define PDE_SPACE_END(vaddr)                                                   \
+  (rounddown((vaddr), PDE_SPACE_SIZE) + PDE_SPACE_SIZE)
+
 #define PTE_FRAME_ADDR(pte) (PTE_PFN_OF(pte) * PAGESIZE)
 #define PAGE_OFFSET(x) ((x) & (PAGESIZE - 1))
 #define PG_KSEG0_ADDR(pg) (void *)(MIPS_PHYS_TO_KSEG0((pg)->paddr))
@@ -85,11 +110,11 @@ static bool kern_addr_p(vaddr_t addr) {
 }
 
 inline vaddr_t pmap_start(pmap_t *pmap) {
-  return pmap->asid ? PMAP_USER_BEGIN : PMAP_KERNEL_BEGIN;
+  return pmap != pmap_kernel() ? PMAP_USER_BEGIN : PMAP_KERNEL_BEGIN;
 }
 
 inline vaddr_t pmap_end(pmap_t *pmap) {
-  return pmap->asid ? PMAP_USER_END : PMAP_KERNEL_END;
+  return pmap != pmap_kernel() ? PMAP_USER_END : PMAP_KERNEL_END;
 }
 
 inline bool pmap_address_p(pmap_t *pmap, vaddr_t va) {
@@ -118,57 +143,132 @@ pmap_t *pmap_lookup(vaddr_t addr) {
 
 /*
  * Address space identifiers management.
+ *
+ * ASID 0 belongs to the kernel, the rest is handed out to user pmaps in order
+ * of activation. When all ASIDs are used up, we start a new generation and
+ * flush all non-global TLB entries, so every user pmap will get a fresh ASID
+ * next time it's activated. Thus ASIDs are never released, and a pmap from
+ * an older generation has no TLB entries tagged with its (stale) ASID.
  */
 
-static asid_t alloc_asid(void) {
-  int free = 0;
-  WITH_SPIN_LOCK (&asid_lock) {
-    bit_ffc(asid_used, MAX_ASID, &free);
-    if (free < 0)
-      panic("Out of asids!");
-    bit_set(asid_used, free);
+static void pmap_asid_check(pmap_t *pmap) {
+  SCOPED_SPIN_LOCK(&asid_lock);
+
+  if (pmap->asid_gen == asid_gen)
+    return;
+
+  if (asid_next > MAX_ASID) {
+    /* Generation number 0 marks pmaps that have never been activated. */
+    if (++asid_gen == 0)
+      asid_gen = 1;
+    asid_next = 1;
+    tlb_invalidate_user();
+    klog("ASID generation %u started", asid_gen);
   }
-  klog("alloc_asid() = %d", free);
-  return free;
+
+  pmap->asid = asid_next++;
+  pmap->asid_gen = asid_gen;
+  klog("pmap %p got ASID %d", pmap, pmap->asid);
 }
 
-static void free_asid(asid_t asid) {
-  klog("free_asid(%d)", asid);
-  SCOPED_SPIN_LOCK(&asid_lock);
-  bit_clear(asid_used, (unsigned)asid);
-  tlb_invalidate_asid(asid);
+/*
+ * TLB invalidation for operations on ranges of addresses.
+ *
+ * Instead of probing the TLB after each PTE update, addresses of modified
+ * PTEs are gathered in a batch and invalidated when the operation is done.
+ * A single TLB entry maps a pair of adjacent pages, so it's probed only once.
+ * If there are too many entries to probe, we scan the whole TLB instead.
+ */
+
+#define TLB_BATCH_MAX 16
+
+typedef struct tlb_batch {
+  pmap_t *pmap;
+  vaddr_t start, end;        /* range of addresses in the batch */
+  unsigned count;            /* number of TLB entries to invalidate */
+  tlbhi_t hi[TLB_BATCH_MAX]; /* valid only if `count` is within limit */
+} tlb_batch_t;
+
+static void tlb_batch_init(tlb_batch_t *batch, pmap_t *pmap) {
+  batch->pmap = pmap;
+  batch->start = batch->end = 0;
+  batch->count = 0;
+}
+
+static void tlb_batch_add(tlb_batch_t *batch, vaddr_t va) {
+  tlbhi_t hi = PTE_VPN2(va) | PTE_ASID(batch->pmap->asid);
+
+  if (batch->count == 0)
+    batch->start = va;
+  batch->end = va + PAGESIZE;
+
+  /* Range operations visit pages in order, so it's enough to check whether
+   * the other page of the pair has just been added. */
+  if (batch->count > 0 && batch->count <= TLB_BATCH_MAX &&
+      batch->hi[batch->count - 1] == hi)
+    return;
+
+  if (batch->count < TLB_BATCH_MAX)
+    batch->hi[batch->count] = hi;
+  batch->count++;
+}
+
+static void tlb_batch_flush(tlb_batch_t *batch) {
+  if (batch->count > TLB_BATCH_MAX) {
+    tlb_invalidate_range(batch->pmap->asid, batch->start, batch->end);
+  } else {
+    for (unsigned i = 0; i < batch->count; i++)
+      tlb_invalidate(batch->hi[i]);
+  }
+  batch->count = 0;
 }
 
 /*
  * Physical-to-virtual entries are managed for all pageable mappings.
  */
 
+static inline pv_table_t *pv_table_of(paddr_t pa) {
+  return &pv_table[(pa / PAGESIZE) & (PV_LOCKS - 1)];
+}
+
+static pv_hashhead_t *pv_hashhead(pv_table_t *pt, pmap_t *pmap, vaddr_t va) {
+  uint32_t hash = hash32_buf(&pmap, sizeof(pmap), HASH32_BUF_INIT);
+  hash = hash32_buf(&va, sizeof(va), hash);
+  return &pt->hash[hash & (PV_HASHSIZE - 1)];
+}
+
 static void pv_add(pmap_t *pmap, vaddr_t va, vm_page_t *pg) {
-  assert(mtx_owned(&pv_list_lock));
+  pv_table_t *pt = pv_table_of(pg->paddr);
+  assert(mtx_owned(&pt->lock));
   pv_entry_t *pv = pool_alloc(P_PV, M_ZERO);
   pv->pmap = pmap;
   pv->va = va;
   TAILQ_INSERT_TAIL(&pg->pv_list, pv, page_link);
-  TAILQ_INSERT_TAIL(&pmap->pv_list, pv, pmap_link);
+  LIST_INSERT_HEAD(pv_hashhead(pt, pmap, va), pv, hash_link);
 }
 
 static pv_entry_t *pv_find(pmap_t *pmap, vaddr_t va, vm_page_t *pg) {
-  assert(mtx_owned(&pv_list_lock));
+  pv_table_t *pt = pv_table_of(pg->paddr);
+  assert(mtx_owned(&pt->lock));
   pv_entry_t *pv;
-  TAILQ_FOREACH (pv, &pg->pv_list, page_link) {
+  LIST_FOREACH (pv, pv_hashhead(pt, pmap, va), hash_link) {
     if (pv->pmap == pmap && pv->va == va)
       return pv;
   }
   return NULL;
 }
 
+static void pv_free(pv_entry_t *pv, vm_page_t *pg) {
+  assert(mtx_owned(&pv_table_of(pg->paddr)->lock));
+  TAILQ_REMOVE(&pg->pv_list, pv, page_link);
+  LIST_REMOVE(pv, hash_link);
+  pool_free(P_PV, pv);
+}
+
 static void pv_remove(pmap_t *pmap, vaddr_t va, vm_page_t *pg) {
-  assert(mtx_owned(&pv_list_lock));
   pv_entry_t *pv = pv_find(pmap, va, pg);
   assert(pv != NULL);
-  TAILQ_REMOVE(&pg->pv_list, pv, page_link);
-  TAILQ_REMOVE(&pmap->pv_list, pv, pmap_link);
-  pool_free(P_PV, pv);
+  pv_free(pv, pg);
 }
 
 /*
@@ -176,9 +276,7 @@ static void pv_remove(pmap_t *pmap, vaddr_t va, vm_page_t *pg) {
  */
 
 static vm_page_t *pmap_pagealloc(void) {
-  vm_page_t *pg = vm_page_alloc(1);
-  pmap_zero_page(pg);
-  return pg;
+  return vm_page_alloc_zero();
 }
 
 /* Add PT to PD so kernel can handle access to @vaddr. */
@@ -202,6 +300,24 @@ static pde_t pmap_add_pde(pmap_t *pmap, vaddr_t vaddr) {
   return pde;
 }
 
+/* Free PT that covers @vaddr if none of its entries maps a page. */
+static void pmap_remove_pde(pmap_t *pmap, vaddr_t vaddr) {
+  pde_t pde = PDE_OF(pmap, vaddr);
+  assert(is_valid_pde(pde));
+
+  pte_t *pte = PT_BASE(pde);
+  for (int i = 0; i < PT_ENTRIES; i++)
+    if (PTE_FRAME_ADDR(pte[i]) != 0)
+      return;
+
+  PDE_OF(pmap, vaddr) = 0;
+
+  vm_page_t *pg = vm_page_find(MIPS_KSEG0_TO_PHYS(pte));
+  TAILQ_REMOVE(&pmap->pte_pages, pg, pageq);
+  vm_page_free(pg);
+  klog("Page table for %08lx freed", vaddr & PDE_INDEX_MASK);
+}
+
 /*! \brief Reads the PTE mapping virtual address \a vaddr. */
 static pte_t pmap_pte_read(pmap_t *pmap, vaddr_t vaddr) {
   pde_t pde = PDE_OF(pmap, vaddr);
@@ -210,9 +326,11 @@ static pte_t pmap_pte_read(pmap_t *pmap, vaddr_t vaddr) {
   return PTE_OF(pde, vaddr);
 }
 
-/*! \brief Writes \a pte as the new PTE mapping virtual address \a vaddr. */
-static void pmap_pte_write(pmap_t *pmap, vaddr_t vaddr, pte_t pte,
-                           unsigned flags) {
+/*! \brief Writes \a pte as the new PTE mapping virtual address \a vaddr.
+ *
+ * TLB entry is not invalidated, the caller is responsible for that. */
+static void pmap_pte_update(pmap_t *pmap, vaddr_t vaddr, pte_t pte,
+                            unsigned flags) {
   unsigned cacheflags = flags & PMAP_CACHE_MASK;
 
   if (cacheflags == PMAP_NOCACHE)
@@ -226,6 +344,12 @@ static void pmap_pte_write(pmap_t *pmap, vaddr_t vaddr, pte_t pte,
   if (!is_valid_pde(pde))
     pde = pmap_add_pde(pmap, vaddr);
   PTE_OF(pde, vaddr) = pte;
+}
+
+/*! \brief Writes \a pte as the new PTE mapping virtual address \a vaddr. */
+static void pmap_pte_write(pmap_t *pmap, vaddr_t vaddr, pte_t pte,
+                           unsigned flags) {
+  pmap_pte_update(pmap, vaddr, pte, flags);
   tlb_invalidate(PTE_VPN2(vaddr) | PTE_ASID(pmap->asid));
 }
 
@@ -251,6 +375,9 @@ static void update_wired_pde(pmap_t *umap) {
 void pmap_activate(pmap_t *umap) {
   SCOPED_NO_PREEMPTION();
 
+  if (umap)
+    pmap_asid_check(umap);
+
   PCPU_SET(curpmap, umap);
   update_wired_pde(umap);
 
@@ -286,9 +413,15 @@ void pmap_kremove(vaddr_t va, size_t size) {
   klog("%s: remove unmanaged mapping for %p - %p range", __func__, va,
        va + size - 1);
 
+  tlb_batch_t batch;
+  tlb_batch_init(&batch, pmap);
+
   WITH_MTX_LOCK (&pmap->mtx) {
-    for (size_t off = 0; off < size; off += PAGESIZE)
-      pmap_pte_write(pmap, va + off, PTE_GLOBAL, 0);
+    for (size_t off = 0; off < size; off += PAGESIZE) {
+      pmap_pte_update(pmap, va + off, PTE_GLOBAL, 0);
+      tlb_batch_add(&batch, va + off);
+    }
+    tlb_batch_flush(&batch);
   }
 }
 
@@ -313,6 +446,25 @@ static bool pmap_extract_nolock(pmap_t *pmap, vaddr_t va, paddr_t *pap) {
   return true;
 }
 
+/*! \brief Removes mapping of page frame \a pa under \a va.
+ *
+ * The mapping could have been removed by pmap_page_remove in the meantime,
+ * so it's checked again with pv lock held. TLB entry is not invalidated.
+ *
+ * \returns true if the mapping has been removed */
+static bool pmap_remove_mapping(pmap_t *pmap, vaddr_t va, paddr_t pa) {
+  assert(mtx_owned(&pmap->mtx));
+
+  SCOPED_MTX_LOCK(&pv_table_of(pa)->lock);
+
+  if (PTE_FRAME_ADDR(pmap_pte_read(pmap, va)) != pa)
+    return false;
+
+  pv_remove(pmap, va, vm_page_find(pa));
+  pmap_pte_update(pmap, va, empty_pte(pmap), 0);
+  return true;
+}
+
 void pmap_enter(pmap_t *pmap, vaddr_t va, vm_page_t *pg, vm_prot_t prot,
                 unsigned flags) {
   paddr_t pa = pg->paddr;
@@ -324,20 +476,35 @@ void pmap_enter(pmap_t *pmap, vaddr_t va, vm_page_t *pg, vm_prot_t prot,
 
   bool kern_mapping = (pmap == pmap_kernel());
 
-  /* Mark user pages as non-referenced & non-modified. */
+  /* Mark user pages as non-referenced & non-modified, unless the caller told
+   * us which kind of access is going to happen right after the mapping. */
   pte_t mask =
     kern_mapping ? (PTE_VALID | PTE_DIRTY | PTE_SW_FLAGS) : PTE_SW_FLAGS;
+  pg_flags_t pgflags = kern_mapping ? (PG_MODIFIED | PG_REFERENCED) : 0;
+  if (flags & PMAP_PROT_MASK) {
+    mask |= PTE_VALID;
+    pgflags |= PG_REFERENCED;
+  }
+  if (flags & VM_PROT_WRITE) {
+    mask |= PTE_DIRTY;
+    pgflags |= PG_MODIFIED;
+  }
   pte_t pte = (vm_prot_map[prot] & mask) | empty_pte(pmap);
 
-  WITH_MTX_LOCK (&pv_list_lock) {
-    WITH_MTX_LOCK (&pmap->mtx) {
+  WITH_MTX_LOCK (&pmap->mtx) {
+    paddr_t old_pa;
+    /* Replacing mapping of another page (i.e. after copy-on-write)? */
+    if (pmap_extract_nolock(pmap, va, &old_pa) && old_pa != pa)
+      pmap_remove_mapping(pmap, va, old_pa);
+    /* Don't allocate page table with pv lock held. */
+    if (!is_valid_pde(PDE_OF(pmap, va)))
+      pmap_add_pde(pmap, va);
+    WITH_MTX_LOCK (&pv_table_of(pa)->lock) {
       pv_entry_t *pv = pv_find(pmap, va, pg);
       if (pv == NULL)
         pv_add(pmap, va, pg);
-      if (kern_mapping)
-        pg->flags |= PG_MODIFIED | PG_REFERENCED;
-      else
-        pg->flags &= ~(PG_MODIFIED | PG_REFERENCED);
+      pg->flags &= ~(PG_MODIFIED | PG_REFERENCED);
+      pg->flags |= pgflags;
       pmap_pte_write(pmap, va, PTE_PFN(pa) | pte, flags);
     }
   }
@@ -349,20 +516,32 @@ void pmap_remove(pmap_t *pmap, vaddr_t start, vaddr_t end) {
 
   klog("Remove page mapping for address range %p-%p", start, end);
 
-  WITH_MTX_LOCK (&pv_list_lock) {
-    WITH_MTX_LOCK (&pmap->mtx) {
-      for (vaddr_t va = start; va < end; va += PAGESIZE) {
-        paddr_t pa;
-        if (pmap_extract_nolock(pmap, va, &pa)) {
-          vm_page_t *pg = vm_page_find(pa);
-          pv_remove(pmap, va, pg);
-          pmap_pte_write(pmap, va, empty_pte(pmap), 0);
-        }
-      }
+  tlb_batch_t batch;
+  tlb_batch_init(&batch, pmap);
+
+  /* Page tables of kernel pmap are shared by all address spaces. */
+  bool reclaim = (pmap != pmap_kernel());
 
-      /* TODO: Deallocate empty page table fragment by calling pmap_remove_pde.
-       */
+  WITH_MTX_LOCK (&pmap->mtx) {
+    for (vaddr_t va = start; va < end; va += PAGESIZE) {
+      /* Skip over address ranges without page table. */
+      if (!is_valid_pde(PDE_OF(pmap, va))) {
+        vaddr_t next = PDE_SPACE_END(va);
+        if (next == 0 || next >= end)
+          break;
+        va = next - PAGESIZE;
+        continue;
+      }
+      paddr_t pa;
+      if (pmap_extract_nolock(pmap, va, &pa) &&
+          pmap_remove_mapping(pmap, va, pa))
+        tlb_batch_add(&batch, va);
+      /* Done with the part of the range covered by this page table? */
+      if (reclaim && (va + PAGESIZE == end ||
+                      is_aligned(va + PAGESIZE, PDE_SPACE_SIZE)))
+        pmap_remove_pde(pmap, va);
     }
+    tlb_batch_flush(&batch);
   }
 }
 
@@ -373,13 +552,33 @@ void pmap_protect(pmap_t *pmap, vaddr_t start, vaddr_t end, vm_prot_t prot) {
   klog("Change protection bits to %x for address range %p-%p", prot, start,
        end);
 
+  tlb_batch_t batch;
+  tlb_batch_init(&batch, pmap);
+
   WITH_MTX_LOCK (&pmap->mtx) {
     for (vaddr_t va = start; va < end; va += PAGESIZE) {
-      pte_t pte = pmap_pte_read(pmap, va);
-      if (pte == 0)
+      /* Skip over address ranges without page table. */
+      if (!is_valid_pde(PDE_OF(pmap, va))) {
+        vaddr_t next = PDE_SPACE_END(va);
+        if (next == 0 || next >= end)
+          break;
+        va = next - PAGESIZE;
+        continue;
+      }
+      paddr_t pa = PTE_FRAME_ADDR(pmap_pte_read(pmap, va));
+      if (pa == 0)
         continue;
-      pmap_pte_write(pmap, va, (pte & ~PTE_PROT_MASK) | vm_prot_map[prot], 0);
+      WITH_MTX_LOCK (&pv_table_of(pa)->lock) {
+        /* Check if the page hasn't been unmapped in the meantime. */
+        pte_t pte = pmap_pte_read(pmap, va);
+        if (PTE_FRAME_ADDR(pte) == pa) {
+          pte = (pte & ~PTE_PROT_MASK) | vm_prot_map[prot];
+          pmap_pte_update(pmap, va, pte, 0);
+        }
+      }
+      tlb_batch_add(&batch, va);
     }
+    tlb_batch_flush(&batch);
   }
 }
 
@@ -389,17 +588,13 @@ bool pmap_extract(pmap_t *pmap, vaddr_t va, paddr_t *pap) {
 }
 
 void pmap_page_remove(vm_page_t *pg) {
-  SCOPED_MTX_LOCK(&pv_list_lock);
-  while (!TAILQ_EMPTY(&pg->pv_list)) {
-    pv_entry_t *pv = TAILQ_FIRST(&pg->pv_list);
+  SCOPED_MTX_LOCK(&pv_table_of(pg->paddr)->lock);
+  pv_entry_t *pv;
+  while ((pv = TAILQ_FIRST(&pg->pv_list))) {
     pmap_t *pmap = pv->pmap;
-    WITH_MTX_LOCK (&pmap->mtx) {
-      vaddr_t va = pv->va;
-      TAILQ_REMOVE(&pg->pv_list, pv, page_link);
-      TAILQ_REMOVE(&pmap->pv_list, pv, pmap_link);
-      pmap_pte_write(pmap, va, empty_pte(pmap), 0);
-    }
-    pool_free(P_PV, pv);
+    vaddr_t va = pv->va;
+    pv_free(pv, pg);
+    pmap_pte_write(pmap, va, empty_pte(pmap), 0);
   }
 }
 
@@ -411,21 +606,26 @@ void pmap_copy_page(vm_page_t *src, vm_page_t *dst) {
   memcpy(PG_KSEG0_ADDR(dst), PG_KSEG0_ADDR(src), PAGESIZE);
 }
 
+void *pmap_page_kva(vm_page_t *pg) {
+  return PG_KSEG0_ADDR(pg);
+}
+
 static void pmap_modify_flags(vm_page_t *pg, pte_t set, pte_t clr) {
-  SCOPED_MTX_LOCK(&pv_list_lock);
+  SCOPED_MTX_LOCK(&pv_table_of(pg->paddr)->lock);
   pv_entry_t *pv;
   TAILQ_FOREACH (pv, &pg->pv_list, page_link) {
     pmap_t *pmap = pv->pmap;
     vaddr_t va = pv->va;
-    WITH_MTX_LOCK (&pmap->mtx) {
-      pde_t pde = PDE_OF(pmap, va);
-      assert(is_valid_pde(pde));
-      pte_t pte = PTE_OF(pde, va);
-      pte |= set;
-      pte &= ~clr;
-      PTE_OF(pde, va) = pte;
-      tlb_invalidate(PTE_VPN2(va) | PTE_ASID(pmap->asid));
-    }
+    pde_t pde = PDE_OF(pmap, va);
+    assert(is_valid_pde(pde));
+    pte_t pte = PTE_OF(pde, va);
+    pte |= set;
+    pte &= ~clr;
+    /* Never make a read-only (e.g. copy-on-write) mapping writable. */
+    if (!(pte & PTE_SW_WRITE))
+      pte &= ~PTE_DIRTY;
+    PTE_OF(pde, va) = pte;
+    tlb_invalidate(PTE_VPN2(va) | PTE_ASID(pmap->asid));
   }
 }
 
@@ -483,7 +683,7 @@ int pmap_emulate_bits(pmap_t *pmap, vaddr_t va, vm_prot_t prot) {
   vm_page_t *pg = vm_page_find(pa);
   assert(pg != NULL);
 
-  WITH_MTX_LOCK (&pv_list_lock) {
+  WITH_MTX_LOCK (&pv_table_of(pa)->lock) {
     /* Kernel non-pageable memory? */
     if (TAILQ_EMPTY(&pg->pv_list))
       return EINVAL;
@@ -501,13 +701,14 @@ int pmap_emulate_bits(pmap_t *pmap, vaddr_t va, vm_prot_t prot) {
  */
 
 static void pmap_setup(pmap_t *pmap) {
-  pmap->asid = alloc_asid();
   mtx_init(&pmap->mtx, 0);
   TAILQ_INIT(&pmap->pte_pages);
-  TAILQ_INIT(&pmap->pv_list);
 }
 
 void init_pmap(void) {
+  for (int i = 0; i < PV_LOCKS; i++)
+    mtx_init(&pv_table[i].lock, 0);
+
   pmap_setup(&kernel_pmap);
   kernel_pmap.pde = _kernel_pmap_pde;
 }
@@ -525,17 +726,9 @@ pmap_t *pmap_new(void) {
 
 void pmap_delete(pmap_t *pmap) {
   assert(pmap != pmap_kernel());
-  while (!TAILQ_EMPTY(&pmap->pv_list)) {
-    pv_entry_t *pv = TAILQ_FIRST(&pmap->pv_list);
-    vm_page_t *pg;
-    paddr_t pa;
-    pmap_extract_nolock(pmap, pv->va, &pa);
-    pg = vm_page_find(pa);
-    WITH_MTX_LOCK (&pv_list_lock)
-      TAILQ_REMOVE(&pg->pv_list, pv, page_link);
-    TAILQ_REMOVE(&pmap->pv_list, pv, pmap_link);
-    pool_free(P_PV, pv);
-  }
+
+  /* Removes all pv entries and frees page tables that became empty. */
+  pmap_remove(pmap, PMAP_USER_BEGIN, PMAP_USER_END);
 
   while (!TAILQ_EMPTY(&pmap->pte_pages)) {
     vm_page_t *pg = TAILQ_FIRST(&pmap->pte_pages);
@@ -545,12 +738,9 @@ void pmap_delete(pmap_t *pmap) {
 
   vm_page_t *pg = vm_page_find(MIPS_KSEG0_TO_PHYS(pmap->pde));
   vm_page_free(pg);
-  free_asid(pmap->asid);
   pool_free(P_PMAP, pmap);
 }
 
-#define L1_SPACE_SIZE (PAGESIZE * PAGESIZE / sizeof(pte_t))
-
 /*
  * Increase usable kernel virtual address space to at least maxkvaddr.
  * Allocate page table (level 1) if needed.
@@ -562,10 +752,10 @@ void pmap_growkernel(vaddr_t maxkvaddr) {
   pmap_t *pmap = pmap_kernel();
   vaddr_t va;
 
-  maxkvaddr = roundup2(maxkvaddr, L1_SPACE_SIZE);
+  maxkvaddr = roundup2(maxkvaddr, PDE_SPACE_SIZE);
 
   WITH_MTX_LOCK (&pmap->mtx) {
-    for (va = vm_kernel_end; va < maxkvaddr; va += L1_SPACE_SIZE) {
+    for (va = vm_kernel_end; va < maxkvaddr; va += PDE_SPACE_SIZE) {
       if (!is_valid_pde(PDE_OF(pmap, va)))
         pmap_add_pde(pmap, va);
     }
@@ -23,6 +23,7 @@ static intr_filter_t mips_timer_intr(void *data);
 static int mips_timer_start(timer_t *tm, unsigned flags, const bintime_t start,
                             const bintime_t period);
 static int mips_timer_stop(timer_t *tm);
+static int mips_timer_program(timer_t *tm, const bintime_t when);
 static bintime_t mips_timer_gettime(timer_t *tm);
 
 static uint64_t read_count(mips_timer_state_t *state) {
@@ -97,6 +98,19 @@ static int mips_timer_stop(timer_t *tm) {
   return 0;
 }
 
+static int mips_timer_program(timer_t *tm, const bintime_t when) {
+  device_t *dev = tm->tm_priv;
+  mips_timer_state_t *state = dev->state;
+  /* Counter was reset when the timer was started, so it measures uptime. */
+  uint64_t target = bintime_mul(when, tm->tm_frequency).sec;
+  SCOPED_INTR_DISABLED();
+  /* If the target is in the past, next period after current time is used.
+   * Compare register has only 32 bits, so far targets may trigger early. */
+  state->compare.val = target - state->period_cntr;
+  set_next_tick(state);
+  return 0;
+}
+
 static bintime_t mips_timer_gettime(timer_t *tm) {
   device_t *dev = tm->tm_priv;
   mips_timer_state_t *state = dev->state;
@@ -130,6 +144,7 @@ static int mips_timer_attach(device_t *dev) {
     .tm_max_period = BINTIME(((1LL << 32) - 1) / (double)CPU_FREQ),
     .tm_start = mips_timer_start,
     .tm_stop = mips_timer_stop,
+    .tm_program = mips_timer_program,
     .tm_gettime = mips_timer_gettime,
     .tm_priv = dev,
   };
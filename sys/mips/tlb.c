@@ -1,5 +1,6 @@
 #include <mips/m32c0.h>
 #include <mips/tlb.h>
+#include <mips/vm_param.h>
 #include <sys/interrupt.h>
 
 #define mips32_getasid() (mips32_getentryhi() & PTE_ASID_MASK)
@@ -105,6 +106,38 @@ void tlb_invalidate_asid(tlbhi_t asid) {
   mips32_setasid(saved);
 }
 
+void tlb_invalidate_user(void) {
+  SCOPED_INTR_DISABLED();
+  tlbhi_t saved = mips32_getasid();
+  for (unsigned i = mips32_getwired(); i < _tlb_size; i++) {
+    tlbentry_t e;
+    _tlb_read(i, &e);
+    if ((e.lo0 & PTE_GLOBAL) && (e.lo1 & PTE_GLOBAL))
+      continue;
+    _tlb_invalidate(i);
+  }
+  mips32_setasid(saved);
+}
+
+void tlb_invalidate_range(tlbhi_t asid, vaddr_t start, vaddr_t end) {
+  SCOPED_INTR_DISABLED();
+  tlbhi_t saved = mips32_getasid();
+  for (unsigned i = mips32_getwired(); i < _tlb_size; i++) {
+    tlbentry_t e;
+    _tlb_read(i, &e);
+    vaddr_t va = PTE_VPN2(e.hi);
+    /* Entry maps a pair of pages, check if any of them is within range. */
+    if (va + 2 * PAGESIZE <= start || va >= end)
+      continue;
+    /* Ignore mappings with different ASID, unless they're global. */
+    if (!((e.lo0 & PTE_GLOBAL) && (e.lo1 & PTE_GLOBAL)) &&
+        (e.hi & PTE_ASID_MASK) != asid)
+      continue;
+    _tlb_invalidate(i);
+  }
+  mips32_setasid(saved);
+}
+
 void tlb_write(unsigned i, tlbentry_t *e) {
   SCOPED_INTR_DISABLED();
   tlbhi_t saved = mips32_getasid();
@@ -143,7 +143,9 @@ static void tlb_exception_handler(ctx_t *ctx) {
   if (error == 0)
     return;
 
-  if (error == EACCES || error == EINVAL)
+  /* Insufficient permissions are checked against the memory map entry,
+   * since the page may be write-protected because of copy-on-write. */
+  if (error == EINVAL)
     goto fault;
 
   vm_map_t *vmap = vm_map_lookup(vaddr);
@@ -103,7 +103,66 @@ static int test_callout_drain(void) {
   return KTEST_SUCCESS;
 }
 
+/* This test checks ordering of callouts placed in different levels of timing
+ * wheel and of callouts expiring at the same tick. */
+
+#define LEVELS_N 8
+static int levels_delay[LEVELS_N] = {1, 63, 64, 64, 65, 130, 200, 300};
+static systime_t levels_time[LEVELS_N];
+
+static void callout_leveled(void *arg) {
+  int ord = (intptr_t)arg;
+  assert(current == ord);
+  /* Callout must not run before its time. */
+  assert((int32_t)(getsystime() - levels_time[ord]) >= 0);
+  current++;
+}
+
+static int test_callout_levels(void) {
+  callout_t callouts[LEVELS_N];
+  current = 0;
+
+  systime_t now = getsystime();
+  for (int i = 0; i < LEVELS_N; i++) {
+    callout_setup(&callouts[i], callout_leveled, (void *)(intptr_t)i);
+    levels_time[i] = now + levels_delay[i];
+  }
+
+  /* Schedule in reverse order, so that callouts are not already sorted. */
+  for (int i = LEVELS_N - 1; i >= 0; i--) {
+    /* Callouts expiring at the same tick must run in order of scheduling. */
+    if (i > 0 && levels_delay[i] == levels_delay[i - 1]) {
+      callout_schedule_abs(&callouts[i - 1], levels_time[i - 1]);
+      callout_schedule_abs(&callouts[i], levels_time[i]);
+      i--;
+      continue;
+    }
+    callout_schedule_abs(&callouts[i], levels_time[i]);
+  }
+
+  for (int i = 0; i < LEVELS_N; i++)
+    callout_drain(&callouts[i]);
+
+  assert(current == LEVELS_N);
+
+  return KTEST_SUCCESS;
+}
+
+/* Callouts beyond the span of timing wheel can be removed as well. */
+static int test_callout_far(void) {
+  callout_t callout;
+  callout_setup(&callout, callout_bad, NULL);
+
+  callout_schedule(&callout, 1 << 30);
+  assert(callout_stop(&callout));
+  assert(!callout_drain(&callout));
+
+  return KTEST_SUCCESS;
+}
+
 KTEST_ADD(callout_simple, test_callout_simple, 0);
 KTEST_ADD(callout_order, test_callout_order, 0);
 KTEST_ADD(callout_stop, test_callout_stop, 0);
 KTEST_ADD(callout_drain, test_callout_drain, 0);
+KTEST_ADD(callout_levels, test_callout_levels, 0);
+KTEST_ADD(callout_far, test_callout_far, 0);
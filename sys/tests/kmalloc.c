@@ -0,0 +1,77 @@
+#include <sys/klog.h>
+#include <sys/ktest.h>
+#include <sys/malloc.h>
+#include <sys/kasan.h>
+
+#define NBLOCKS 512
+
+/* Header of a pool item and maximum overhead of an arena block. */
+#define POOLHDR_SZ (4 * sizeof(long))
+#define ARENA_OVERHEAD 64
+
+static KMALLOC_DEFINE(M_BENCH, "kmalloc benchmark");
+
+/* Expected size classes: powers of two and their 3/4 up to 1 KiB. */
+static const size_t class_size[] = {
+  16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024,
+};
+
+/* Returns how many bytes are taken from a pool by a block of `size` bytes,
+ * or 0 if the block is too big to be served by a pool. */
+static size_t class_used(size_t size) {
+#if KASAN
+  size += KASAN_KMALLOC_REDZONE_SIZE;
+#endif
+  for (size_t i = 0; i < __arraycount(class_size); i++)
+    if (size <= class_size[i])
+      return POOLHDR_SZ + class_size[i];
+  return 0;
+}
+
+/* Allocates blocks of pseudo-random sizes from [minsz, maxsz] range, then
+ * frees them in different order than they were allocated. Blocks that fit
+ * in a size class must be served by pools, hence they must take exactly the
+ * size of the class and the header, while bigger ones may not waste more
+ * than a boundary tag and alignment padding. */
+static int kmalloc_bench(size_t minsz, size_t maxsz) {
+  void **blk = kmalloc(M_TEST, sizeof(void *) * NBLOCKS, 0);
+  size_t requested = 0, expected = 0;
+  bool pooled = true;
+
+  for (int i = 0; i < NBLOCKS; i++) {
+    size_t size = minsz + (i * 7919) % (maxsz - minsz + 1);
+    blk[i] = kmalloc(M_BENCH, size, 0);
+    requested += size;
+    expected += class_used(size);
+    pooled &= class_used(size) > 0;
+  }
+
+  size_t used = M_BENCH->used;
+
+  for (int i = 1; i < NBLOCKS; i += 2)
+    kfree(M_BENCH, blk[i]);
+  for (int i = 0; i < NBLOCKS; i += 2)
+    kfree(M_BENCH, blk[i]);
+
+  kfree(M_TEST, blk);
+
+  klog("sizes %u-%u: requested %u bytes, used %u bytes, overhead %u%%", minsz,
+       maxsz, requested, used, (used - requested) * 100 / requested);
+
+  /* Pool items are returned at once, while arena blocks may be quarantined. */
+  if (pooled)
+    return (used == expected && M_BENCH->used == 0) ? KTEST_SUCCESS
+                                                    : KTEST_FAILURE;
+  if (used < requested || used - requested > NBLOCKS * ARENA_OVERHEAD)
+    return KTEST_FAILURE;
+  return KTEST_SUCCESS;
+}
+
+static int test_kmalloc_bench(void) {
+  if (kmalloc_bench(8, 64) || kmalloc_bench(64, 1000) ||
+      kmalloc_bench(1100, 8192))
+    return KTEST_FAILURE;
+  return KTEST_SUCCESS;
+}
+
+KTEST_ADD(kmalloc_bench, test_kmalloc_bench, 0);
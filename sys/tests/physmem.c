@@ -1,5 +1,6 @@
 #include <sys/mimiker.h>
 #include <sys/libkern.h>
+#include <sys/pmap.h>
 #include <sys/vm_physmem.h>
 #include <sys/ktest.h>
 
@@ -16,4 +17,47 @@ static int test_physmem(void) {
   return KTEST_SUCCESS;
 }
 
+/* More than fits in per-CPU cache, so it has to be refilled and drained. */
+#define NSINGLE 200
+
+static bool page_zeroed_p(vm_page_t *pg) {
+  uint64_t *data = pmap_page_kva(pg);
+  for (size_t i = 0; i < PAGESIZE / sizeof(uint64_t); i++)
+    if (data[i] != 0)
+      return false;
+  return true;
+}
+
+static int test_physmem_single(void) {
+  static vm_page_t *pgs[NSINGLE];
+
+  for (int i = 0; i < NSINGLE; i++) {
+    pgs[i] = vm_page_alloc_zero();
+    if (pgs[i] == NULL || pgs[i]->size != 1 || !page_zeroed_p(pgs[i]))
+      return KTEST_FAILURE;
+    for (int j = 0; j < i; j++)
+      if (pgs[i] == pgs[j])
+        return KTEST_FAILURE;
+    /* Dirty the page, it will be freed to the per-CPU cache below. */
+    uint64_t *data = pmap_page_kva(pgs[i]);
+    data[0] = 0xDEADC0DE;
+  }
+
+  for (int i = 0; i < NSINGLE; i++)
+    vm_page_free(pgs[i]);
+
+  /* Dirty pages must not be handed out as zeroed ones. */
+  for (int i = 0; i < NSINGLE; i++) {
+    pgs[i] = vm_page_alloc_zero();
+    if (pgs[i] == NULL || !page_zeroed_p(pgs[i]))
+      return KTEST_FAILURE;
+  }
+
+  for (int i = 0; i < NSINGLE; i++)
+    vm_page_free(pgs[i]);
+
+  return KTEST_SUCCESS;
+}
+
 KTEST_ADD(physmem, test_physmem, 0);
+KTEST_ADD(physmem_single, test_physmem_single, 0);
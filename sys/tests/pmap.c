@@ -5,6 +5,9 @@
 #include <sys/ktest.h>
 #include <sys/sched.h>
 #include <sys/kmem.h>
+#include <sys/mman.h>
+#include <sys/proc.h>
+#include <sys/vm_map.h>
 
 static vm_page_t *x_vm_page_alloc(size_t npages) {
   vm_page_t *pg = vm_page_alloc(npages);
@@ -115,7 +118,50 @@ static int test_pmap_page_copy(void) {
   return KTEST_SUCCESS;
 }
 
+/* Big enough to be mapped with a single block on architectures that have them.
+ * Physical pages are aligned to their size by the buddy allocator. */
+#define BLOCK_SIZE (2 * 1024 * 1024)
+#define BLOCK_PAGES (BLOCK_SIZE / PAGESIZE)
+
+static int test_pmap_kenter_block(void) {
+  vm_page_t *pg = x_vm_page_alloc(BLOCK_PAGES);
+  vaddr_t kva = x_kva_alloc(2 * BLOCK_SIZE);
+  vaddr_t va = roundup2(kva, BLOCK_SIZE);
+  paddr_t pa;
+
+  assert(is_aligned(pg->paddr, BLOCK_SIZE));
+
+  for (size_t i = 0; i < BLOCK_PAGES; i++)
+    pmap_kenter(va + i * PAGESIZE, pg->paddr + i * PAGESIZE,
+                VM_PROT_READ | VM_PROT_WRITE, 0);
+
+  for (size_t i = 0; i < BLOCK_PAGES; i++) {
+    *(volatile unsigned *)(va + i * PAGESIZE) = i;
+    assert(pmap_kextract(va + i * PAGESIZE + 4, &pa));
+    assert(pa == pg->paddr + i * PAGESIZE + 4);
+  }
+
+  /* Changing a single page must not affect the rest of the range. */
+  pmap_kenter(va, pg->paddr, VM_PROT_READ, 0);
+  assert(!try_store_word((unsigned *)va, 0xDEADC0DE));
+  pmap_kremove(va + PAGESIZE, PAGESIZE);
+  assert(!pmap_kextract(va + PAGESIZE, &pa));
+
+  for (size_t i = 2; i < BLOCK_PAGES; i++)
+    assert(*(volatile unsigned *)(va + i * PAGESIZE) == i);
+
+  pmap_kremove(va, BLOCK_SIZE);
+  for (size_t i = 0; i < BLOCK_PAGES; i++)
+    assert(!pmap_kextract(va + i * PAGESIZE, &pa));
+
+  kva_free(kva, 2 * BLOCK_SIZE);
+  vm_page_free(pg);
+
+  return KTEST_SUCCESS;
+}
+
 KTEST_ADD(pmap_kenter, test_pmap_kenter, 0);
+KTEST_ADD(pmap_kenter_block, test_pmap_kenter_block, 0);
 KTEST_ADD(pmap_kextract, test_pmap_kextract, 0);
 KTEST_ADD(pmap_page_copy, test_pmap_page_copy, 0);
 
@@ -204,5 +250,156 @@ static int test_rmbits(void) {
   return KTEST_SUCCESS;
 }
 
+/* More pmaps than there are ASIDs, so they will have to be reassigned. */
+#define NPMAPS 300
+
+static int test_pmap_asid(void) {
+  /* This test mustn't be preempted since PCPU's user-space vm_map
+   * (and its pmap) will not be restored while switching back. */
+  SCOPED_NO_PREEMPTION();
+
+  pmap_t *orig = pmap_user();
+  static pmap_t *pmaps[NPMAPS];
+  vm_page_t *pg[2] = {x_vm_page_alloc(1), x_vm_page_alloc(1)};
+  volatile int *ptr = (int *)0x1001000;
+
+  /* Same address is mapped to one of two pages in each pmap. */
+  for (int i = 0; i < NPMAPS; i++) {
+    pmaps[i] = pmap_new();
+    pmap_enter(pmaps[i], (vaddr_t)ptr, pg[i % 2], VM_PROT_READ | VM_PROT_WRITE,
+               0);
+    pmap_activate(pmaps[i]);
+    *ptr = i % 2;
+  }
+
+  /* Stale TLB entries would make us see contents of the other page. */
+  for (int n = 0; n < 2; n++) {
+    for (int i = 0; i < NPMAPS; i++) {
+      pmap_activate(pmaps[i]);
+      assert(*ptr == i % 2);
+    }
+  }
+
+  /* Restore original user pmap */
+  pmap_activate(orig);
+
+  for (int i = 0; i < NPMAPS; i++)
+    pmap_delete(pmaps[i]);
+  vm_page_free(pg[0]);
+  vm_page_free(pg[1]);
+
+  return KTEST_SUCCESS;
+}
+
+#define NSHARED 64
+
+static int test_pmap_page_remove(void) {
+  /* This test mustn't be preempted since PCPU's user-space vm_map
+   * (and its pmap) will not be restored while switching back. */
+  SCOPED_NO_PREEMPTION();
+
+  pmap_t *orig = pmap_user();
+  pmap_t *pmaps[NSHARED];
+  vm_page_t *pg = x_vm_page_alloc(1);
+  vaddr_t start = 0x1001000;
+  paddr_t pa;
+
+  /* Same page is mapped in many pmaps under different addresses. */
+  for (int i = 0; i < NSHARED; i++) {
+    pmaps[i] = pmap_new();
+    pmap_enter(pmaps[i], start + i * PAGESIZE, pg, VM_PROT_READ, 0);
+  }
+
+  for (int i = 0; i < NSHARED; i++) {
+    assert(pmap_extract(pmaps[i], start + i * PAGESIZE, &pa));
+    assert(pa == pg->paddr);
+  }
+
+  /* Removing a mapping leaves the other ones intact. */
+  pmap_remove(pmaps[0], start, start + PAGESIZE);
+  assert(!pmap_extract(pmaps[0], start, &pa));
+  assert(pmap_extract(pmaps[1], start + PAGESIZE, &pa));
+
+  pmap_page_remove(pg);
+  for (int i = 0; i < NSHARED; i++)
+    assert(!pmap_extract(pmaps[i], start + i * PAGESIZE, &pa));
+
+  /* Page table of first pmap has been freed, so it must be allocated again. */
+  pmap_enter(pmaps[0], start, pg, VM_PROT_READ | VM_PROT_WRITE, 0);
+  pmap_activate(pmaps[0]);
+  *(volatile int *)start = 42;
+  assert(*(int *)pmap_page_kva(pg) == 42);
+
+  /* Restore original user pmap */
+  pmap_activate(orig);
+
+  for (int i = 0; i < NSHARED; i++)
+    pmap_delete(pmaps[i]);
+
+  /* Page must not be referenced by any pv entry. */
+  vm_page_free(pg);
+
+  return KTEST_SUCCESS;
+}
+
 KTEST_ADD(pmap_user, test_user_pmap, 0);
 KTEST_ADD(pmap_rmbits, test_rmbits, 0);
+KTEST_ADD(pmap_asid, test_pmap_asid, 0);
+KTEST_ADD(pmap_page_remove, test_pmap_page_remove, 0);
+
+/*
+ * Unmap a range of pages that have been touched, i.e. are mapped in the pmap
+ * and probably cached in the TLB, and check that no mapping is left behind.
+ * Accessing the pages must fault, so stale TLB entries must be gone as well.
+ */
+
+static void munmap_touched(size_t npages) {
+  pmap_t *pmap = pmap_user();
+  size_t length = npages * PAGESIZE;
+  vaddr_t va = 0;
+  paddr_t pa;
+  int error;
+
+  error = do_mmap(&va, length, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE,
+                  -1, 0);
+  assert(error == 0);
+
+  for (size_t off = 0; off < length; off += PAGESIZE)
+    *(volatile int *)(va + off) = 0;
+
+  error = do_munmap(va, length);
+  assert(error == 0);
+
+  for (size_t off = 0; off < length; off += PAGESIZE) {
+    unsigned val;
+    assert(!pmap_extract(pmap, va + off, &pa));
+    assert(!try_load_word((unsigned *)(va + off), &val));
+  }
+}
+
+static int test_pmap_munmap(void) {
+  /* This test mustn't be preempted since PCPU's user-space vm_map
+   * (and its pmap) will not be restored while switching back. */
+  SCOPED_NO_PREEMPTION();
+
+  proc_t *p = proc_self();
+  vm_map_t *orig = p->p_uspace;
+
+  p->p_uspace = vm_map_new();
+  vm_map_activate(p->p_uspace);
+
+  static const size_t npages[] = {1, 64, 1024};
+
+  for (size_t i = 0; i < __arraycount(npages); i++)
+    munmap_touched(npages[i]);
+
+  vm_map_delete(p->p_uspace);
+
+  /* Restore original vm_map */
+  p->p_uspace = orig;
+  vm_map_activate(orig);
+
+  return KTEST_SUCCESS;
+}
+
+KTEST_ADD(pmap_munmap, test_pmap_munmap, 0);
@@ -51,6 +51,31 @@ static int test_pool_alloc_doublefree(void) {
   return test_pool_alloc(PALLOC_TEST_DOUBLEFREE);
 }
 
+static int test_pool_reclaim(void) {
+  const int N = 100;
+
+  pool_t *test = pool_create("test", 64);
+  void **item = kmalloc(M_TEST, sizeof(void *) * N, 0);
+
+  for (int i = 0; i < N; i++)
+    item[i] = pool_alloc(test, M_ZERO);
+  for (int i = 0; i < N; i++)
+    pool_free(test, item[i]);
+
+  /* Recently freed objects are cached, so we should get them back. */
+  void *ptr = pool_alloc(test, 0);
+  bool cached = false;
+  for (int i = 0; i < N; i++)
+    cached |= (ptr == item[i]);
+  pool_free(test, ptr);
+
+  pool_reclaim();
+  kfree(M_TEST, item);
+  pool_destroy(test);
+  return cached ? KTEST_SUCCESS : KTEST_FAILURE;
+}
+
 KTEST_ADD(pool_alloc_regular, test_pool_alloc_regular, 0);
 KTEST_ADD(pool_alloc_corruption, test_pool_alloc_corruption, KTEST_FLAG_BROKEN);
 KTEST_ADD(pool_alloc_doublefree, test_pool_alloc_doublefree, KTEST_FLAG_BROKEN);
+KTEST_ADD(pool_reclaim, test_pool_reclaim, 0);
@@ -1,6 +1,10 @@
 #include <sys/klog.h>
+#include <sys/libkern.h>
+#include <sys/malloc.h>
 #include <sys/ringbuf.h>
 #include <sys/ktest.h>
+#include <sys/sched.h>
+#include <sys/thread.h>
 #include <sys/uio.h>
 #include <sys/vm_map.h>
 
@@ -222,6 +226,187 @@ static int test_uio_ringbuf_cyclic_transfers(void) {
   return KTEST_SUCCESS;
 }
 
+static int test_ringbuf_bulk_wrap(void) {
+  ringbuf_t rbt;
+  uint8_t buf[5];
+  ringbuf_init(&rbt, buf, 5);
+
+  uint8_t src[] = "abcdefg";
+  uint8_t dst[] = "       ";
+
+  assert(ringbuf_putnb(&rbt, src, 3));
+  assert(ringbuf_getnb(&rbt, dst, 2));
+  assert(!ringbuf_putnb(&rbt, src, 5));
+  /* data is split into [3, 5) and [0, 2) */
+  assert(ringbuf_putnb(&rbt, src + 3, 4));
+  assert(ringbuf_full(&rbt));
+  assert(!ringbuf_getnb(&rbt, dst + 2, 6));
+  assert(ringbuf_getnb(&rbt, dst + 2, 5));
+  assert(ringbuf_empty(&rbt));
+  assert(memcmp(dst, src, 7) == 0);
+
+  /* moving data between wrapped buffers */
+  ringbuf_t src_rb, dst_rb;
+  uint8_t buf0[5], buf1[5];
+  ringbuf_init(&src_rb, buf0, 5);
+  ringbuf_init(&dst_rb, buf1, 5);
+
+  assert(ringbuf_putnb(&src_rb, src, 4));
+  assert(ringbuf_getnb(&src_rb, dst, 3));
+  assert(ringbuf_putnb(&src_rb, src + 4, 3));
+  assert(ringbuf_putnb(&dst_rb, src, 2));
+  assert(ringbuf_getnb(&dst_rb, dst, 2));
+  assert(!ringbuf_movenb(&src_rb, &dst_rb, 5));
+  assert(ringbuf_movenb(&src_rb, &dst_rb, 4));
+  assert(ringbuf_empty(&src_rb));
+  assert(ringbuf_getnb(&dst_rb, dst, 4));
+  assert(memcmp(dst, src + 3, 4) == 0);
+
+  return KTEST_SUCCESS;
+}
+
+static int test_spsc_ringbuf(void) {
+  spsc_ringbuf_t rbt;
+  uint8_t buf[4];
+  spsc_ringbuf_init(&rbt, buf, 4);
+
+  uint8_t src[] = "abcdef";
+  uint8_t dst[] = "      ";
+  uint8_t c;
+
+  assert(spsc_ringbuf_empty(&rbt));
+  assert(!spsc_ringbuf_getb(&rbt, &c));
+  assert(spsc_ringbuf_putnb(&rbt, src, 3));
+  assert(!spsc_ringbuf_putnb(&rbt, src, 2));
+  assert(spsc_ringbuf_getb(&rbt, &c) && c == 'a');
+  assert(spsc_ringbuf_putnb(&rbt, src + 3, 2));
+  assert(spsc_ringbuf_count(&rbt) == 4);
+  assert(!spsc_ringbuf_putb(&rbt, 'x'));
+  assert(spsc_ringbuf_getnb(&rbt, dst, 4));
+  assert(memcmp(dst, src + 1, 4) == 0);
+  assert(spsc_ringbuf_empty(&rbt));
+
+  /* counters are allowed to overflow */
+  atomic_store(&rbt.head, (size_t)-2);
+  atomic_store(&rbt.tail, (size_t)-2);
+  assert(spsc_ringbuf_putnb(&rbt, src, 4));
+  assert(spsc_ringbuf_count(&rbt) == 4);
+  assert(spsc_ringbuf_getnb(&rbt, dst, 4));
+  assert(memcmp(dst, src, 4) == 0);
+  assert(spsc_ringbuf_empty(&rbt));
+
+  return KTEST_SUCCESS;
+}
+
+#define RB_STREAM_BYTES (1024 * 1024)
+#define RB_STREAM_SIZE 4096
+
+/* Fills `buf` with bytes that are expected at position `pos` of the stream. */
+static void rb_stream_fill(uint8_t *buf, size_t len, size_t pos) {
+  for (size_t i = 0; i < len; i++)
+    buf[i] = (pos + i) % 251;
+}
+
+static bool rb_stream_check(uint8_t *buf, size_t len, size_t pos) {
+  for (size_t i = 0; i < len; i++)
+    if (buf[i] != (pos + i) % 251)
+      return false;
+  return true;
+}
+
+/* Pass `RB_STREAM_BYTES` through a ring buffer in `chunk` sized pieces and
+ * check that they come out in order. */
+static void ringbuf_stream(size_t chunk) {
+  uint8_t *data = kmalloc(M_TEST, RB_STREAM_SIZE, 0);
+  uint8_t *src = kmalloc(M_TEST, chunk, 0);
+  uint8_t *dst = kmalloc(M_TEST, chunk, 0);
+  size_t keep = chunk / 2 + 1;
+  ringbuf_t rb;
+  spsc_ringbuf_t srb;
+
+  /* Keep some data in the buffer, so that transfers wrap around. */
+  ringbuf_init(&rb, data, RB_STREAM_SIZE);
+  rb_stream_fill(src, keep, 0);
+  assert(ringbuf_putnb(&rb, src, keep));
+  for (size_t n = 0; n < RB_STREAM_BYTES; n += chunk) {
+    rb_stream_fill(src, chunk, keep + n);
+    assert(ringbuf_putnb(&rb, src, chunk));
+    assert(ringbuf_getnb(&rb, dst, chunk));
+    assert(rb_stream_check(dst, chunk, n));
+  }
+
+  spsc_ringbuf_init(&srb, data, RB_STREAM_SIZE);
+  rb_stream_fill(src, keep, 0);
+  assert(spsc_ringbuf_putnb(&srb, src, keep));
+  for (size_t n = 0; n < RB_STREAM_BYTES; n += chunk) {
+    rb_stream_fill(src, chunk, keep + n);
+    assert(spsc_ringbuf_putnb(&srb, src, chunk));
+    assert(spsc_ringbuf_getnb(&srb, dst, chunk));
+    assert(rb_stream_check(dst, chunk, n));
+  }
+
+  kfree(M_TEST, dst);
+  kfree(M_TEST, src);
+  kfree(M_TEST, data);
+}
+
+static int test_ringbuf_stream(void) {
+  ringbuf_stream(1);
+  ringbuf_stream(64);
+  ringbuf_stream(1024);
+  return KTEST_SUCCESS;
+}
+
+#define SPSC_BYTES (256 * 1024)
+#define SPSC_SIZE 64
+
+static spsc_ringbuf_t spsc_rb;
+
+static void spsc_producer(void *arg) {
+  for (size_t n = 0; n < SPSC_BYTES;) {
+    uint8_t chunk[7];
+    size_t len = min(sizeof(chunk), SPSC_BYTES - n);
+    for (size_t i = 0; i < len; i++)
+      chunk[i] = (n + i) % 251;
+    if (spsc_ringbuf_putnb(&spsc_rb, chunk, len))
+      n += len;
+    else
+      thread_yield();
+  }
+}
+
+static void spsc_consumer(void *arg) {
+  for (size_t n = 0; n < SPSC_BYTES;) {
+    uint8_t byte;
+    if (spsc_ringbuf_getb(&spsc_rb, &byte)) {
+      assert(byte == n % 251);
+      n++;
+    } else {
+      thread_yield();
+    }
+  }
+}
+
+/* Producer and consumer run concurrently without any locks. */
+static int test_spsc_ringbuf_threads(void) {
+  uint8_t *data = kmalloc(M_TEST, SPSC_SIZE, 0);
+  spsc_ringbuf_init(&spsc_rb, data, SPSC_SIZE);
+
+  thread_t *producer =
+    thread_create("test-spsc-producer", spsc_producer, NULL, prio_kthread(0));
+  thread_t *consumer =
+    thread_create("test-spsc-consumer", spsc_consumer, NULL, prio_kthread(0));
+
+  sched_add(producer);
+  sched_add(consumer);
+  thread_join(producer);
+  thread_join(consumer);
+
+  assert(spsc_ringbuf_empty(&spsc_rb));
+  kfree(M_TEST, data);
+  return KTEST_SUCCESS;
+}
+
 KTEST_ADD(ringbuf_trivial, test_ringbuf_trivial, 0);
 KTEST_ADD(ringbuf_nontrivial, test_ringbuf_nontrivial, 0);
 KTEST_ADD(ringbuf_move, test_ringbuf_move, 0);
@@ -229,3 +414,7 @@ KTEST_ADD(uio_ringbuf_trivial, test_uio_ringbuf_trivial, 0);
 KTEST_ADD(uio_ringbuf_one_transfer, test_uio_ringbuf_one_transfer, 0);
 KTEST_ADD(uio_ringbuf_two_transfers, test_uio_ringbuf_two_transfers, 0);
 KTEST_ADD(uio_ringbuf_cyclic_transfers, test_uio_ringbuf_cyclic_transfers, 0);
+KTEST_ADD(ringbuf_bulk_wrap, test_ringbuf_bulk_wrap, 0);
+KTEST_ADD(spsc_ringbuf, test_spsc_ringbuf, 0);
+KTEST_ADD(ringbuf_stream, test_ringbuf_stream, 0);
+KTEST_ADD(spsc_ringbuf_threads, test_spsc_ringbuf_threads, 0);
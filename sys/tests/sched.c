@@ -95,3 +95,55 @@ static int test_sched(void) {
 
 KTEST_ADD(sched, test_sched, KTEST_FLAG_NORETURN);
 #endif
+
+/* Number of times each thread gives up the processor. */
+#define CTXSW_YIELDS 100
+
+static volatile atomic_int ctxsw_yields;
+static volatile atomic_int ctxsw_switches;
+
+static void ctxsw_yielder(void *arg) {
+  for (int i = 0; i < CTXSW_YIELDS; i++) {
+    thread_yield();
+    atomic_fetch_add(&ctxsw_yields, 1);
+  }
+  atomic_fetch_add(&ctxsw_switches, thread_self()->td_nctxsw);
+}
+
+/* Switches between \a n ready threads. Each yield must hand the processor
+ * over to another ready thread, unless there's none. Preemptions can only add
+ * context switches. */
+static int ctxsw_check(int n) {
+  thread_t **threads = kmalloc(M_TEST, sizeof(thread_t *) * n, 0);
+
+  ctxsw_yields = 0;
+  ctxsw_switches = 0;
+
+  for (int i = 0; i < n; i++)
+    threads[i] = thread_create("test-sched-yielder", ctxsw_yielder, NULL,
+                               prio_kthread(0));
+
+  /* All threads must be ready before the first one gets to run. */
+  WITH_NO_PREEMPTION {
+    for (int i = 0; i < n; i++)
+      sched_add(threads[i]);
+  }
+  for (int i = 0; i < n; i++)
+    thread_join(threads[i]);
+
+  kfree(M_TEST, threads);
+
+  if (ctxsw_yields != n * CTXSW_YIELDS)
+    return KTEST_FAILURE;
+  if (n > 1 && ctxsw_switches < n * CTXSW_YIELDS)
+    return KTEST_FAILURE;
+  return KTEST_SUCCESS;
+}
+
+static int test_sched_ctxsw(void) {
+  if (ctxsw_check(1) || ctxsw_check(10) || ctxsw_check(100))
+    return KTEST_FAILURE;
+  return KTEST_SUCCESS;
+}
+
+KTEST_ADD(sched_ctxsw, test_sched_ctxsw, 0);
@@ -65,6 +65,8 @@ UTEST_ADD_SIMPLE(munmap);
 UTEST_ADD_SIGNAL(munmap_sigsegv, SIGSEGV);
 UTEST_ADD_SIMPLE(mmap_prot_none);
 UTEST_ADD_SIMPLE(mmap_prot_read);
+UTEST_ADD_SIMPLE(mmap_file);
+UTEST_ADD_SIMPLE(mmap_vnode);
 UTEST_ADD_SIMPLE(sbrk);
 UTEST_ADD_SIGNAL(sbrk_sigsegv, SIGSEGV);
 UTEST_ADD_SIMPLE(misbehave);
@@ -97,6 +99,8 @@ UTEST_ADD_SIMPLE(signal_handler_mask);
 UTEST_ADD_SIMPLE(fork_wait);
 UTEST_ADD_SIMPLE(fork_signal);
 UTEST_ADD_SIMPLE(fork_sigchld_ignored);
+UTEST_ADD_SIMPLE(fork_cow);
+UTEST_ADD_SIMPLE(fork_cow_pages);
 
 UTEST_ADD_SIMPLE(lseek_basic);
 UTEST_ADD_SIMPLE(lseek_errors);
@@ -121,6 +125,7 @@ UTEST_ADD_SIMPLE(vfs_trunc);
 UTEST_ADD_SIMPLE(vfs_symlink);
 UTEST_ADD_SIMPLE(vfs_link);
 UTEST_ADD_SIMPLE(vfs_chmod);
+UTEST_ADD_SIMPLE(vfs_bigdir);
 
 UTEST_ADD_SIMPLE(wait_basic);
 UTEST_ADD_SIMPLE(wait_nohang);
@@ -182,6 +187,13 @@ UTEST_ADD_SIMPLE(tty_echo);
 UTEST_ADD_SIMPLE(tty_signals);
 
 UTEST_ADD_SIMPLE(procstat);
+UTEST_ADD_SIMPLE(physmem_stats);
+UTEST_ADD_SIMPLE(klog_dev);
+UTEST_ADD_SIMPLE(kprof);
 
 UTEST_ADD_SIMPLE(pipe_parent_signaled);
 UTEST_ADD_SIMPLE(pipe_child_signaled);
+UTEST_ADD_SIMPLE(pipe_transfer);
+
+UTEST_ADD_SIMPLE(kevent_pipe);
+UTEST_ADD_SIMPLE(kevent_timer);
@@ -7,6 +7,7 @@
 #include <sys/ktest.h>
 #include <sys/proc.h>
 #include <sys/cred.h>
+#include <sys/devfs.h>
 
 static bool fsname_of(vnode_t *v, const char *fsname) {
   return strncmp(v->v_mount->mnt_vfc->vfc_name, fsname, strlen(fsname)) == 0;
@@ -87,3 +88,91 @@ static int test_vfs(void) {
 }
 
 KTEST_ADD(vfs, test_vfs, 0);
+
+#define NC_DEPTH 8
+#define NC_ROUNDS 100
+
+static int nc_stat(const char *path, cred_t *cred) {
+  vnode_t *v;
+  vattr_t va;
+  int error;
+
+  if ((error = vfs_namelookup(path, &v, cred)))
+    return error;
+  error = VOP_GETATTR(v, &va);
+  vnode_drop(v);
+  return error;
+}
+
+/* Looks up `name` in directory `dirpath` using only the name cache. */
+static bool nc_cached(const char *dirpath, const char *name, cred_t *cred,
+                      bool *negative) {
+  vnode_t *dvp, *vp = NULL;
+  bool hit;
+
+  if (vfs_namelookup(dirpath, &dvp, cred))
+    return false;
+  hit = vfs_cache_lookup(dvp, &COMPONENTNAME(name), &vp);
+  if (hit && vp != NULL)
+    vnode_drop(vp);
+  vnode_drop(dvp);
+  *negative = (vp == NULL);
+  return hit;
+}
+
+/* Stat a deep path and a missing entry at the end of it in a loop, then check
+ * that every component of both lookups is held by the name cache. */
+static int test_vfs_namecache(void) {
+  cred_t *cred = cred_self();
+  devfs_node_t *dirs[NC_DEPTH];
+  devfs_node_t *parent = NULL;
+  char path[64] = "/dev";
+  char missing[80];
+  int error;
+
+  for (int i = 0; i < NC_DEPTH; i++) {
+    char name[8];
+    snprintf(name, sizeof(name), "nc%d", i);
+    strlcat(path, "/", sizeof(path));
+    strlcat(path, name, sizeof(path));
+    error = devfs_makedir(parent, name, &dirs[i]);
+    assert(error == 0);
+    parent = dirs[i];
+  }
+  snprintf(missing, sizeof(missing), "%s/missing", path);
+
+  for (int i = 0; i < NC_ROUNDS; i++) {
+    assert(nc_stat(path, cred) == 0);
+    assert(nc_stat(missing, cred) == ENOENT);
+  }
+
+  bool negative;
+  char dirpath[64] = "/dev";
+  for (int i = 0; i < NC_DEPTH; i++) {
+    char name[8];
+    snprintf(name, sizeof(name), "nc%d", i);
+    assert(nc_cached(dirpath, name, cred, &negative) && !negative);
+    strlcat(dirpath, "/", sizeof(dirpath));
+    strlcat(dirpath, name, sizeof(dirpath));
+  }
+  assert(nc_cached(path, "missing", cred, &negative) && negative);
+
+  /* Negative entry must go away once the name is created. */
+  devfs_node_t *leaf;
+  error = devfs_makedir(dirs[NC_DEPTH - 1], "missing", &leaf);
+  assert(error == 0);
+  assert(nc_stat(missing, cred) == 0);
+  error = devfs_unlink(leaf);
+  assert(error == 0);
+  assert(nc_stat(missing, cred) == ENOENT);
+
+  for (int i = NC_DEPTH - 1; i >= 0; i--) {
+    error = devfs_unlink(dirs[i]);
+    assert(error == 0);
+  }
+  assert(nc_stat(path, cred) == ENOENT);
+
+  return KTEST_SUCCESS;
+}
+
+KTEST_ADD(vfs_namecache, test_vfs_namecache, 0);
@@ -166,5 +166,77 @@ static int findspace_demo(void) {
   return KTEST_SUCCESS;
 }
 
+#define NENTRIES 10000
+
+/* Entries are laid out in groups of four, each spanning 10 pages. Entry `i`
+ * occupies a single page and is followed by `i % 4` free pages. */
+static vaddr_t entry_start(unsigned i) {
+  static const unsigned offset[4] = {0, 1, 3, 6};
+  return 0x00400000 + ((i / 4) * 10 + offset[i % 4]) * PAGESIZE;
+}
+
+static int vm_map_many_entries(void) {
+  vm_map_t *umap = vm_map_new();
+  vm_map_entry_t *ent;
+  vaddr_t t;
+  int n;
+
+  for (unsigned i = 0; i < NENTRIES; i++) {
+    vaddr_t addr = entry_start(i);
+    ent = vm_map_entry_alloc(NULL, addr, addr + PAGESIZE, VM_PROT_NONE,
+                             VM_ENT_PRIVATE);
+    n = vm_map_insert(umap, ent, VM_FIXED);
+    assert(n == 0);
+  }
+
+  WITH_VM_MAP_LOCK (umap) {
+    for (unsigned i = 0; i < NENTRIES; i++) {
+      /* Stride over the entries to defeat the lookup hint. */
+      unsigned j = (i * 7919) % NENTRIES;
+      vaddr_t addr = entry_start(j);
+      ent = vm_map_find_entry(umap, addr);
+      assert(ent != NULL && vm_map_entry_start(ent) == addr);
+      /* There's no entry within the gap following an entry. */
+      if (j % 4)
+        assert(vm_map_find_entry(umap, addr + PAGESIZE) == NULL);
+    }
+  }
+
+  for (unsigned i = 0; i < NENTRIES; i += 4) {
+    /* Smallest gap that fits is after entry with index 4k + 3. */
+    t = entry_start(i);
+    n = vm_map_findspace(umap, &t, 3 * PAGESIZE);
+    assert(n == 0 && t == entry_start(i + 3) + PAGESIZE);
+  }
+
+  /* Nothing bigger than 3 pages is available before the last entry. */
+  t = entry_start(0);
+  n = vm_map_findspace(umap, &t, 4 * PAGESIZE);
+  assert(n == 0 && t == entry_start(NENTRIES - 1) + PAGESIZE);
+
+  /* Remove every other group of entries, then look for bigger gaps. Each
+   * removed group leaves 13 free pages starting 3 pages below its address. */
+  WITH_VM_MAP_LOCK (umap) {
+    for (unsigned i = 0; i < NENTRIES; i += 8) {
+      for (unsigned j = i; j < i + 4; j++) {
+        ent = vm_map_find_entry(umap, entry_start(j));
+        assert(ent != NULL);
+        vm_map_entry_destroy(umap, ent);
+      }
+    }
+  }
+
+  for (unsigned i = 0; i < NENTRIES; i += 8) {
+    t = entry_start(i);
+    n = vm_map_findspace(umap, &t, 10 * PAGESIZE);
+    assert(n == 0 && t == entry_start(i));
+  }
+
+  vm_map_delete(umap);
+
+  return KTEST_SUCCESS;
+}
+
 KTEST_ADD(vm, paging_on_demand_and_memory_protection_demo, 0);
 KTEST_ADD(findspace, findspace_demo, 0);
+KTEST_ADD(vm_map_many_entries, vm_map_many_entries, 0);
@@ -67,7 +67,22 @@ static int test_vmem(void) {
   assert(rc == 0);
   assert_addr_is_in_span(addr10, size, &span2);
 
+  /* alloc 4 quantums aligned to 8 quantums, should return addr from span #2
+   * that lies in the middle of free segment */
+  size = 4 * quantum;
+  vmem_addr_t addr4;
+  rc = vmem_xalloc(vm, size, 8 * quantum, &addr4, 0);
+  assert(rc == 0);
+  assert(addr4 % (8 * quantum) == 0);
+  assert_addr_is_in_span(addr4, size, &span2);
+
+  /* alloc 1 quantum aligned to 8 quantums, should fail */
+  vmem_addr_t addr;
+  rc = vmem_xalloc(vm, quantum, 8 * quantum, &addr, 0);
+  assert(rc == ENOMEM);
+
   /* free all segments */
+  vmem_free(vm, addr4, 4 * quantum);
   vmem_free(vm, addr1, 1 * quantum);
   vmem_free(vm, addr8, 8 * quantum);
   vmem_free(vm, addr10, 10 * quantum);